@@ -29,6 +29,20 @@
 #define EVENT_QUEUE_TIMEOUT_MS 10
 #define EVENT_QUEUE_TIMEOUT_SYSTICK pdMS_TO_TICKS(EVENT_QUEUE_TIMEOUT_MS)
 
+#if BLE_EXTENDED_ADVERTISING
+#if !defined(CONFIG_BT_BLE_50_FEATURES_SUPPORTED) || !CONFIG_BT_BLE_50_FEATURES_SUPPORTED
+#error "BLE_EXTENDED_ADVERTISING requires CONFIG_BT_BLE_50_FEATURES_SUPPORTED"
+#endif
+
+// Single advertising set, non connectable and non scannable so the whole PDU goes into adv data
+#define EXT_ADV_INSTANCE 0
+#define EXT_ADV_SID 0
+#define EXT_ADV_TX_POWER_NO_PREFERENCE 127
+// Adv data travels in AUX_ADV_IND on the secondary channel, 2M PHY halves the airtime of long PDUs
+#define EXT_ADV_SECONDARY_PHY ESP_BLE_GAP_PHY_2M
+#define EXT_SCAN_DURATION_UNITS_PER_S 100
+#endif
+
 static const char* BROADCAST_LOG_GROUP = "BROADCAST TASK";
 
 #define BLE_ADV_DATA_RAW_SET_COMPLETE_EVT (1 << 0)
@@ -49,6 +63,15 @@ typedef struct {
     scan_complete scan_complete_cb[MAX_SCAN_COMPLETE_CB];
     int scan_complete_cb_observers;
     SemaphoreHandle_t xMutex;
+#if BLE_EXTENDED_ADVERTISING
+    uint32_t ext_scan_duration;
+    // Adv data longer than one HCI report arrives in fragments, reassembled here in the GAP callback context
+    uint8_t ext_report_data[MAX_EXT_GAP_DATA_LEN];
+    size_t ext_report_len;
+    int64_t ext_report_timestamp_us;
+    esp_bd_addr_t ext_report_addr;
+    uint8_t ext_report_sid;
+#endif
 } broadcast_control_structure;
 
 
@@ -65,12 +88,74 @@ static broadcast_control_structure bc =
 void set_broadcast_state(BroadcastState state);
 void set_scanner_state(ScannerState state);
 
+static void notify_scan_complete(int64_t timestamp_us, uint8_t *data, size_t data_size, esp_bd_addr_t mac_address)
+{
+    for (int j = 0; j < bc.scan_complete_cb_observers; j++)
+    {
+        bc.scan_complete_cb[j](timestamp_us, data, data_size, mac_address);
+    }
+}
+
+#if BLE_EXTENDED_ADVERTISING
+static void handle_ext_adv_report(esp_ble_gap_ext_adv_reprot_t *report)
+{
+    // Fragmenty jednego rozgłoszenia przychodzą kolejno z tym samym adresem i SID
+    const bool is_continuation = bc.ext_report_len > 0 && report->sid == bc.ext_report_sid &&
+                                 memcmp(report->addr, bc.ext_report_addr, sizeof(esp_bd_addr_t)) == 0;
+    if (is_continuation == false)
+    {
+        bc.ext_report_len = 0;
+        bc.ext_report_timestamp_us = esp_timer_get_time();
+        bc.ext_report_sid = report->sid;
+        memcpy(bc.ext_report_addr, report->addr, sizeof(esp_bd_addr_t));
+    }
+
+    if (report->data_status == ESP_BLE_GAP_EXT_ADV_DATA_TRUNCATED ||
+        bc.ext_report_len + report->adv_data_len > MAX_BEACON_PDU_LEN)
+    {
+        ESP_LOGW(BROADCAST_LOG_GROUP, "Ext adv data truncated or too large: %d bytes", (int) (bc.ext_report_len + report->adv_data_len));
+        bc.ext_report_len = 0;
+        return;
+    }
+
+    memcpy(&bc.ext_report_data[bc.ext_report_len], report->adv_data, report->adv_data_len);
+    bc.ext_report_len += report->adv_data_len;
+
+    if (report->data_status == ESP_BLE_GAP_EXT_ADV_DATA_COMPLETE)
+    {
+        // Czas odbioru pierwszego fragmentu - tak jak dla rozgłoszeń legacy
+        notify_scan_complete(bc.ext_report_timestamp_us, bc.ext_report_data, bc.ext_report_len, bc.ext_report_addr);
+        bc.ext_report_len = 0;
+    }
+}
+
+static void get_ext_adv_params(const esp_ble_adv_params_t *params, esp_ble_gap_ext_adv_params_t *ext_params)
+{
+    memset(ext_params, 0, sizeof(esp_ble_gap_ext_adv_params_t));
+    ext_params->type = ESP_BLE_GAP_SET_EXT_ADV_PROP_NONCONN_NONSCANNABLE_UNDIRECTED;
+    ext_params->interval_min = params->adv_int_min;
+    ext_params->interval_max = params->adv_int_max;
+    ext_params->channel_map = params->channel_map;
+    ext_params->own_addr_type = params->own_addr_type;
+    ext_params->peer_addr_type = params->peer_addr_type;
+    memcpy(ext_params->peer_addr, params->peer_addr, sizeof(esp_bd_addr_t));
+    ext_params->filter_policy = params->adv_filter_policy;
+    ext_params->tx_power = EXT_ADV_TX_POWER_NO_PREFERENCE;
+    ext_params->primary_phy = ESP_BLE_GAP_PRI_PHY_1M;
+    ext_params->max_skip = 0;
+    ext_params->secondary_phy = EXT_ADV_SECONDARY_PHY;
+    ext_params->sid = EXT_ADV_SID;
+    ext_params->scan_req_notif = false;
+}
+#endif
+
 
 static void esp_gap_cb(esp_gap_ble_cb_event_t event, esp_ble_gap_cb_param_t *param) {    
-    int64_t timestamp;
     // // Handle specific event types
     switch (event)
     {
+#if !BLE_EXTENDED_ADVERTISING
+        // Zdarzenia legacy nie istnieją w stosie bez BLE 4.2 features
         case ESP_GAP_BLE_ADV_DATA_RAW_SET_COMPLETE_EVT:
         {
             xEventGroupSetBits(bc.eventGroup, BLE_ADV_DATA_RAW_SET_COMPLETE_EVT);
@@ -110,22 +195,91 @@ static void esp_gap_cb(esp_gap_ble_cb_event_t event, esp_ble_gap_cb_param_t *par
             }
             esp_ble_gap_cb_param_t *scan_result = (esp_ble_gap_cb_param_t *)param;
             if (scan_result->scan_rst.search_evt == ESP_GAP_SEARCH_INQ_RES_EVT) {
-                timestamp = esp_timer_get_time();
+                int64_t timestamp = esp_timer_get_time();
                 // Safely handle payload size
                 if (scan_result->scan_rst.adv_data_len <= MAX_GAP_DATA_LEN) {
-                    if (bc.scan_complete_cb_observers > 0)
-                    {
-                        for (int j = 0; j < bc.scan_complete_cb_observers; j++)
-                        {
-                            bc.scan_complete_cb[j](timestamp, scan_result->scan_rst.ble_adv, scan_result->scan_rst.adv_data_len, scan_result->scan_rst.bda);
-                        }
-                    }
+                    notify_scan_complete(timestamp, scan_result->scan_rst.ble_adv, scan_result->scan_rst.adv_data_len, scan_result->scan_rst.bda);
                 } else {
                     ESP_LOGW(BROADCAST_LOG_GROUP, "Adv data too large: %d bytes", scan_result->scan_rst.adv_data_len);
                 }
             }
         }
         break;
+#endif
+
+#if BLE_EXTENDED_ADVERTISING
+        // Zdarzenia rozgłaszania i skanowania rozszerzonego mapowane na te same flagi co legacy
+        case ESP_GAP_BLE_EXT_ADV_SET_PARAMS_COMPLETE_EVT:
+        {
+            if (param->ext_adv_set_params.status == ESP_BT_STATUS_SUCCESS)
+            {
+                esp_ble_gap_ext_adv_t ext_adv = {
+                    .instance = EXT_ADV_INSTANCE,
+                    .duration = 0,
+                    .max_events = 0
+                };
+                esp_ble_gap_ext_adv_start(1, &ext_adv);
+            }
+            else
+            {
+                ESP_LOGE(BROADCAST_LOG_GROUP, "Ext adv params not set: %d", param->ext_adv_set_params.status);
+            }
+        }
+        break;
+
+        case ESP_GAP_BLE_EXT_ADV_DATA_SET_COMPLETE_EVT:
+        {
+            xEventGroupSetBits(bc.eventGroup, BLE_ADV_DATA_RAW_SET_COMPLETE_EVT);
+        }
+        break;
+
+        case ESP_GAP_BLE_EXT_ADV_START_COMPLETE_EVT:
+        {
+            xEventGroupSetBits(bc.eventGroup, BLE_ADV_START_COMPLETE_EVT);
+        }
+        break;
+
+        case ESP_GAP_BLE_EXT_ADV_STOP_COMPLETE_EVT:
+        {
+            xEventGroupSetBits(bc.eventGroup, BLE_ADV_STOP_COMPLETE_EVT);
+        }
+        break;
+
+        case ESP_GAP_BLE_SET_EXT_SCAN_PARAMS_COMPLETE_EVT:
+        {
+            if (param->set_ext_scan_params.status == ESP_BT_STATUS_SUCCESS)
+            {
+                esp_ble_gap_start_ext_scan(bc.ext_scan_duration, 0);
+            }
+            else
+            {
+                ESP_LOGE(BROADCAST_LOG_GROUP, "Ext scan params not set: %d", param->set_ext_scan_params.status);
+            }
+        }
+        break;
+
+        case ESP_GAP_BLE_EXT_SCAN_START_COMPLETE_EVT:
+        {
+            xEventGroupSetBits(bc.eventGroup, BLE_SCAN_START_COMPLETE_EVT);
+        }
+        break;
+
+        case ESP_GAP_BLE_EXT_SCAN_STOP_COMPLETE_EVT:
+        {
+            xEventGroupSetBits(bc.eventGroup, BLE_SCAN_STOP_COMPLETE_EVT);
+        }
+        break;
+
+        case ESP_GAP_BLE_EXT_ADV_REPORT_EVT:
+        {
+            if (param == NULL) {
+                ESP_LOGE(BROADCAST_LOG_GROUP, "Callback parameter is NULL");
+                return;
+            }
+            handle_ext_adv_report(&(param->ext_adv_report.params));
+        }
+        break;
+#endif
 
         default:
             break;
@@ -326,11 +480,15 @@ void register_scan_complete_callback(scan_complete cb)
 void set_broadcasting_payload(uint8_t *payload, size_t payload_size)
 {
     // Sprawdz bufor danych i stan transmisji
-    if (payload_size <= MAX_GAP_DATA_LEN && payload != NULL &&
+    if (payload_size <= MAX_BEACON_PDU_LEN && payload != NULL &&
         get_broadcast_state() == BROADCAST_CONTROLLER_BROADCASTING_RUNNING)
     {
         // Zgłoś żądanie nowych danych do stosu BLE
+#if BLE_EXTENDED_ADVERTISING
+        esp_ble_gap_config_ext_adv_data_raw(EXT_ADV_INSTANCE, (uint16_t) payload_size, payload);
+#else
         esp_ble_gap_config_adv_data_raw(payload, payload_size);
+#endif
     } 
 }
 
@@ -341,7 +499,12 @@ void stop_broadcasting()
     if (get_broadcast_state() == BROADCAST_CONTROLLER_BROADCASTING_RUNNING)
     {
         // Zgłoś żądanie stop transmisji do stosu BLE
+#if BLE_EXTENDED_ADVERTISING
+        const uint8_t ext_adv_instance = EXT_ADV_INSTANCE;
+        esp_ble_gap_ext_adv_stop(1, &ext_adv_instance);
+#else
         esp_ble_gap_stop_advertising();
+#endif
     }
 }
 
@@ -364,7 +527,14 @@ void start_broadcasting(esp_ble_adv_params_t * ble_adv_params) {
             ESP_LOGE(BROADCAST_LOG_GROUP, "Error while setting tx power!");
         }
         // Zgłoś żądanie startu do stosu BLE
+#if BLE_EXTENDED_ADVERTISING
+        // Start zestawu rozgłoszeniowego po potwierdzeniu parametrów (ESP_GAP_BLE_EXT_ADV_SET_PARAMS_COMPLETE_EVT)
+        esp_ble_gap_ext_adv_params_t ext_adv_params;
+        get_ext_adv_params(ble_adv_params, &ext_adv_params);
+        esp_ble_gap_ext_adv_set_params(EXT_ADV_INSTANCE, &ext_adv_params);
+#else
         esp_ble_gap_start_advertising(ble_adv_params);
+#endif
     }
 }
 
@@ -389,10 +559,27 @@ void start_scanning(esp_ble_scan_params_t scan_params, uint32_t scan_duration_s)
     }
     // Sprawdz czy skanowanie pakietów rozgłoszeniowych nieaktywne
     if (get_scanner_state() == SCANNER_CONTROLLER_SCANNING_NOT_ACTIVE) {
+#if BLE_EXTENDED_ADVERTISING
+        // Skanowanie rozszerzone odbiera też rozgłoszenia legacy, start po potwierdzeniu parametrów
+        esp_ble_ext_scan_params_t ext_scan_params = {
+            .own_addr_type = scan_params.own_addr_type,
+            .filter_policy = scan_params.scan_filter_policy,
+            .scan_duplicate = scan_params.scan_duplicate,
+            .cfg_mask = ESP_BLE_GAP_EXT_SCAN_CFG_UNCODE_MASK,
+            .uncoded_cfg = {
+                .scan_type = scan_params.scan_type,
+                .scan_interval = scan_params.scan_interval,
+                .scan_window = scan_params.scan_window
+            }
+        };
+        bc.ext_scan_duration = scan_duration_s * EXT_SCAN_DURATION_UNITS_PER_S;
+        esp_ble_gap_set_ext_scan_params(&ext_scan_params);
+#else
         // Ustaw parametry skanowania
         esp_ble_gap_set_scan_params(&scan_params);
         // Rozpocznij skanowanie
         esp_ble_gap_start_scanning(scan_duration_s);
+#endif
     }
 }
 
@@ -403,7 +590,11 @@ void stop_scanning()
     if (get_scanner_state() == SCANNER_CONTROLLER_SCANNING_ACTIVE)
     {
         // Zakoncz skanowanie
+#if BLE_EXTENDED_ADVERTISING
+        esp_ble_gap_stop_ext_scan();
+#else
         esp_ble_gap_stop_scanning();
+#endif
     }
 }
 
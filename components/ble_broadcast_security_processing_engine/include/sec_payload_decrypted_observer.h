@@ -2,8 +2,10 @@
 #define SEC_PAYLOAD_DECRYPTED_OBSERVER_H
 
 #include <stdint.h>
-#include "esp_gap_ble_api.h"
+#include "ble_addr.h"
 
+// Called from every processing shard task without serialization, so one observer may run concurrently
+// for different senders. Observers must be reentrant and guard or atomically update any state they share.
 typedef void (*payload_decrypted_observer_cb)(uint8_t *data, size_t data_len, esp_bd_addr_t mac_address);
 
 #endif
\ No newline at end of file
@@ -1,29 +1,45 @@
 #ifndef SEC_PDU_PROCESSING_H
 #define SEC_PDU_PROCESSING_H
 
-#include "esp_gap_ble_api.h"
+#include "ble_addr.h"
 #include "sec_payload_decrypted_observer.h"
 #include "beacon_pdu_data.h"
+#include "sender_registry.h"
+#include "spsc_ring.h"
 #include <stdint.h>
 #include <stddef.h>
 #include "config.h"
 
 #define MAX_PDU_RECEIVE_OBSERVERS 2
-#define MAX_BLE_CONSUMERS MAX_BLE_BROADCASTERS
+// Default number of observed senders, use start_up_sec_processing_for_senders to size it at runtime
+#define MAX_BLE_CONSUMERS MAX_OBSERVED_SENDERS
 
 
 typedef struct{
-    uint8_t data[MAX_GAP_DATA_LEN];
+    uint8_t data[MAX_BEACON_PDU_LEN];
     size_t data_len;
     esp_bd_addr_t mac_address;
 } ble_broadcast_pdu;
 
 int start_up_sec_processing();
 
+int start_up_sec_processing_for_senders(const uint16_t max_senders);
+
+// Senders are split between no_shards processing tasks (1..MAX_SEC_PDU_PROCESSING_SHARDS) by MAC address hash
+int start_up_sec_processing_with_shards(const uint16_t max_senders, const uint8_t no_shards);
+
+uint8_t get_sec_processing_shard_for_mac(const esp_bd_addr_t mac_address, const uint8_t no_shards);
+
 void register_payload_observer_cb(payload_decrypted_observer_cb observer_cb);
 
 bool create_ble_broadcast_pdu_for_dispatcher(ble_broadcast_pdu* pdu, uint8_t *data, size_t size, esp_bd_addr_t mac_address);
 
 void reset_processing();
 
+// Sender table counters of the authorization stage and the decryption stage
+void get_sender_eviction_stats(sender_eviction_stats *authorization_stats, sender_eviction_stats *processing_stats);
+
+// Counters of the handoff between GAP callback and authorization stage
+void get_scan_ring_stats(spsc_ring_stats *stats);
+
 #endif
\ No newline at end of file
@@ -0,0 +1,41 @@
+#ifndef ADV_INTERVAL_ESTIMATOR_H
+#define ADV_INTERVAL_ESTIMATOR_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Number of last authorized (pdu_no, timestamp) samples in the least squares fit
+#define ADV_INTERVAL_ESTIMATOR_WINDOW 8
+// Largest accepted difference between observed and key derived adv interval (sender clock skew + controller adv delay)
+#define ADV_INTERVAL_MAX_SKEW_PERMILLE 20
+
+// Running least squares fit of timestamp = interval * pdu_no + offset over a sliding window.
+// Sums are kept relative to the first sample of the key session, adding a sample and
+// predicting arrival time of the next PDU is O(1). Not thread safe, owner serializes access.
+typedef struct {
+    int64_t base_timestamp_us;
+    uint16_t base_pdu_no;
+    int32_t x[ADV_INTERVAL_ESTIMATOR_WINDOW];
+    int64_t y_ms[ADV_INTERVAL_ESTIMATOR_WINDOW];
+    uint8_t head;
+    uint8_t count;
+    int64_t sum_x;
+    int64_t sum_y;
+    int64_t sum_xx;
+    int64_t sum_xy;
+} adv_interval_estimator;
+
+// Starts a new key session with the given PDU as the only sample
+void reset_adv_interval_estimator(adv_interval_estimator *estimator, uint16_t pdu_no, int64_t timestamp_us);
+
+// Adds a sample, the oldest one leaves the window when it is full
+void add_sample_to_adv_interval_estimator(adv_interval_estimator *estimator, uint16_t pdu_no, int64_t timestamp_us);
+
+// Observed interval in 1/256 ms, clamped to ADV_INTERVAL_MAX_SKEW_PERMILLE around the key derived interval
+int64_t get_estimated_adv_interval_q8(const adv_interval_estimator *estimator, uint32_t adv_interval_ms);
+
+// Checks if the PDU arrived within tolerance of the time predicted by the fit
+bool is_pdu_arrival_expected(const adv_interval_estimator *estimator, uint16_t pdu_no, int64_t timestamp_us,
+                             uint32_t adv_interval_ms, int tolerance_ms);
+
+#endif
@@ -5,9 +5,15 @@
 #include "sec_pdu_processing.h"
 #include "sec_pdu_process_queue.h"
 #include "beacon_pdu_data.h"
+#include "sender_registry.h"
+#include "spsc_ring.h"
 
 
-bool init_adv_time_authorize_object();
+bool init_adv_time_authorize_object(sender_registry *registry);
+
+void get_adv_time_authorize_eviction_stats(sender_eviction_stats *stats);
+
+void get_adv_time_authorize_scan_ring_stats(spsc_ring_stats *stats);
 
 
 #endif
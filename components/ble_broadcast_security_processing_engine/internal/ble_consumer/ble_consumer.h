@@ -1,40 +1,52 @@
 #ifndef BLE_CONSUMER_H
 #define BLE_CONSUMER_H
 
-#include "esp_gap_ble_api.h"
+#include "ble_addr.h"
 #include "freertos/FreeRTOS.h"
 #include "stdint.h"
 #include "key_cache.h"
 #include "key_reconstructor.h"
 #include "beacon_pdu_data.h"
+#include "pdu_pool.h"
 
+// Budget of pool slots a single sender can hold in its deferred queue
 #define DEFERRED_QUEUE_SIZE 80
+// Keys a sender can wait for at once, PDUs of the oldest key are dropped when a new key does not fit
+#define DEFERRED_KEY_BUCKETS 4
 #define KEY_CACHE_SIZE 5
 
+// PDUs waiting for one key, released as a whole once the key is reconstructed
 typedef struct {
-    QueueHandle_t deferredQueue;
-    uint8_t deferred_queue_count;
+    pdu_pool_slot_list list;
+    uint32_t created_seq;
+    uint16_t key_id;
+    bool in_use;
+    bool release_pending;
+} deferred_key_bucket;
+
+typedef struct {
+    deferred_key_bucket deferred_buckets[DEFERRED_KEY_BUCKETS];
+    uint32_t deferred_bucket_seq;
+    uint16_t no_deferred_pdus;
     key_reconstruction_cache *key_cache;
     uint8_t key_cache_size;
-    int16_t recently_removed_key_id;
-    bool process_deferred_q_request_pending;
+    int32_t recently_removed_key_id;
 } ble_consumer_context;
 
 
+// Sender state owned by the processing shard task of the sender, accessed without locking.
+// Other tasks hand their requests (reconstructed keys) to the shard as messages.
 typedef struct {
     ble_consumer_context context;
     esp_bd_addr_t mac_address_arr;
     uint64_t last_pdu_timestamp;
     uint16_t last_pdu_key_id;
     uint8_t rollover;
-    SemaphoreHandle_t xMutex;
 } ble_consumer;
 
 
 ble_consumer * create_ble_consumer(const uint8_t key_cache_size);
 
-int create_ble_consumer_resources(ble_consumer *const p_ble_consumer, const uint8_t key_cache_size);
-
 int destroy_ble_consumer(ble_consumer *p_ble_consumer);
 
 int init_ble_consumer(ble_consumer *p_ble_consumer);
@@ -43,12 +55,19 @@ int reset_ble_consumer(ble_consumer * p_ble_consumer);
 
 bool is_pdu_in_deferred_queue(ble_consumer *p_ble_consumer);
 
-bool get_deferred_queue_item(ble_consumer* p_ble_consumer, beacon_pdu_data* pdu);
+uint16_t get_no_pdus_in_deferred_queue(ble_consumer *p_ble_consumer);
+
+bool is_pdu_for_key_in_deferred_queue(ble_consumer *p_ble_consumer, const uint16_t key_id);
+
+int add_to_deferred_queue(ble_consumer* p_ble_consumer, pdu_pool_slot* slot, const uint16_t key_id);
 
-int add_to_deferred_queue(ble_consumer* p_ble_consumer, beacon_pdu_data* pdu);
+// Marks PDUs of the key for release, they are taken with take_released_deferred_pdus
+int set_deferred_key_release_pending(ble_consumer* p_ble_consumer, const uint16_t key_id);
 
-void set_deferred_q_pending_processing(ble_consumer* p_ble_consumer, const bool request);
+// Detaches PDUs of one released key, returns false when no key is waiting for release
+bool take_released_deferred_pdus(ble_consumer* p_ble_consumer, uint16_t *key_id, pdu_pool_slot_list *list);
 
-bool is_deferred_queue_request_pending(ble_consumer* p_ble_consumer);
+// Gives PDUs of the key back to the pool without touching PDUs of other keys
+void drop_deferred_pdus_for_key(ble_consumer* p_ble_consumer, const uint16_t key_id);
 
 #endif
\ No newline at end of file
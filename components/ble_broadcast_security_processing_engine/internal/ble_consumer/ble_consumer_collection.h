@@ -4,27 +4,51 @@
 #include "stdint.h"
 #include "freertos/FreeRTOS.h"
 #include "ble_consumer.h"
+#include "sender_registry.h"
 
+// Called on the owning shard task when the consumer of a sender is freed or its index is taken by another sender
+typedef void (*consumer_removed_cb)(void *context, const esp_bd_addr_t mac_address);
+
+// Consumers are indexed by sender index from the shared sender registry,
+// consumer is allocated on the first PDU from a sender and freed when sender goes idle.
+// Owned by one processing shard task, only eviction stats are read from other tasks.
 typedef struct {
-    uint8_t size;
-    ble_consumer *arr;
-    uint8_t consumers_count;
-    SemaphoreHandle_t xMutex;
+    uint16_t size;
+    ble_consumer **arr;
+    uint16_t consumers_count;
+    uint8_t key_cache_size;
+    sender_registry *registry;
+    sender_eviction_stats eviction_stats;
+    consumer_removed_cb removed_cb;
+    void *removed_cb_context;
 } ble_consumer_collection;
 
 
-ble_consumer_collection * create_ble_consumer_collection(const uint8_t collection_size, const uint8_t sender_key_cache_size);
+ble_consumer_collection * create_ble_consumer_collection(sender_registry *registry, const uint8_t sender_key_cache_size);
 
 void destroy_ble_consumer_collection(ble_consumer_collection * p_ble_consumer_collection);
 
-ble_consumer * add_consumer_to_collection(ble_consumer_collection *p_collection, esp_bd_addr_t mac_address);
+void register_consumer_removed_callback(ble_consumer_collection * p_ble_consumer_collection, consumer_removed_cb cb, void *context);
+
+// Places the consumer at the index the authorizer assigned to the sender, the registry is never updated here.
+// Returns NULL when the index no longer belongs to the sender (PDU queued before the index was taken over).
+ble_consumer * add_consumer_to_collection(ble_consumer_collection *p_collection, const int sender_index, esp_bd_addr_t mac_address);
 
 ble_consumer * get_ble_consumer_from_collection(ble_consumer_collection * p_ble_consumer_collection, esp_bd_addr_t mac_address_arr);
 
+ble_consumer * get_ble_consumer_for_sender_index(ble_consumer_collection * p_ble_consumer_collection, const int sender_index, esp_bd_addr_t mac_address_arr);
+
+ble_consumer * get_ble_consumer_at_index(ble_consumer_collection * p_ble_consumer_collection, const uint16_t index);
+
+int remove_idle_consumers_from_collection(ble_consumer_collection * p_ble_consumer_collection, const uint32_t idle_timeout_ms);
+
+// Frees consumer heard least recently (if silent for SENDER_EVICTION_MIN_IDLE_MS), returns its index or -1
 int remove_lru_consumer_from_collection(ble_consumer_collection * p_ble_consumer_collection);
 
 int remove_consumer_from_collection(ble_consumer_collection * p_ble_consumer_collection, esp_bd_addr_t mac_address_arr);
 
 int get_active_no_consumers(ble_consumer_collection * p_ble_consumer_collection);
 
-#endif
\ No newline at end of file
+void get_consumer_collection_eviction_stats(ble_consumer_collection * p_ble_consumer_collection, sender_eviction_stats *stats);
+
+#endif
@@ -3,22 +3,23 @@
 #define KEY_CACHE_HPP
 
 #include "crypto/crypto.h"
-#include "freertos/FreeRTOS.h"
-#include "freertos/semphr.h"
 #include <stdint.h>
+#include <stdbool.h>
 
 typedef struct {
     key_128b key;
-    uint8_t key_id;
+    aes_key_schedule key_schedule;
+    uint16_t key_id;
+    bool in_use;
     uint64_t last_used_timestamp;
     uint8_t rollover;
 } key_reconstruction_map;
 
+// Key cache of one sender, owned by the processing shard task of the sender - not thread safe
 typedef struct {
     key_reconstruction_map* map;
-    SemaphoreHandle_t xMutexCacheAccess;
     uint8_t cache_size;
-    int16_t last_key_id_used;
+    int32_t last_key_id_used;
     int16_t last_key_index_in_map;
 } key_reconstruction_cache;
 
@@ -28,17 +29,21 @@ int destroy_key_cache(key_reconstruction_cache * const key_cache);
 
 int init_key_cache(key_reconstruction_cache * key_cache);
 
-int add_key_to_cache(key_reconstruction_cache * const key_cache, key_128b * key, uint8_t key_id);
+int add_key_to_cache(key_reconstruction_cache * const key_cache, key_128b * key, uint16_t key_id);
 
-int remove_key_from_cache(key_reconstruction_cache * const key_cache, uint8_t key_id);
+int remove_key_from_cache(key_reconstruction_cache * const key_cache, uint16_t key_id);
 
+// Removes the least recently used key, returns its key id or -1 when cache is empty
 int remove_lru_key_from_cache(key_reconstruction_cache * const key_cache);
 
-bool is_key_in_cache(key_reconstruction_cache * const key_cache, uint8_t key_id);
+bool is_key_in_cache(key_reconstruction_cache * const key_cache, uint16_t key_id);
 
 bool clear_cache(key_reconstruction_cache * const key_cache);
 
-const key_128b* get_key_from_cache(key_reconstruction_cache * const key_cache, uint8_t key_id);
+const key_128b* get_key_from_cache(key_reconstruction_cache * const key_cache, uint16_t key_id);
+
+// Returns AES context expanded when the key was added, valid until the key is removed from cache
+aes_key_schedule* get_key_schedule_from_cache(key_reconstruction_cache * const key_cache, uint16_t key_id);
 
 
 #endif
@@ -4,39 +4,57 @@
 #include <stdbool.h>
 #include <stdint.h>
 #include "crypto/crypto.h"
+#include "crypto/key_fragment_coding.h"
 #include "freertos/FreeRTOS.h"
 #include "freertos/semphr.h"
-#include "esp_gap_ble_api.h"
+#include "ble_addr.h"
 
+// Coded fragments (key fragments and parity fragments) collected for one key, any NO_KEY_FRAGMENTS of them rebuild it
 typedef struct{
+    uint8_t coded_fragments[NO_CODED_KEY_FRAGMENTS][KEY_FRAGMENT_SIZE];
     key_splitted key_fragments;
-    uint8_t key_id;
+    uint16_t key_id;
+    bool in_use;
     int no_collected_key_fragments;
-    bool decrypted_key_fragments[KEY_FRAGMENT_SIZE];
+    bool decrypted_key_fragments[NO_CODED_KEY_FRAGMENTS];
     key_128b key;
     esp_bd_addr_t consumer_mac_address;
+    uint32_t last_update_sequence;
 } key_management;
 
+// Keys of all senders in reconstruction, when full a new key takes the entry updated least recently.
+// xMutex is NULL for a collection owned by a single task.
 typedef struct {
     key_management * km;
     size_t key_management_size;
+    uint32_t next_update_sequence;
     SemaphoreHandle_t xMutex;
 } key_reconstruction_collection;
 
 key_reconstruction_collection* create_new_key_collection(size_t key_collection_size);
 
-void remove_key_from_collection(key_reconstruction_collection* key_collection, const esp_bd_addr_t consumer_mac_address, uint8_t key_id);
+// Collection without a mutex, only the creating task may access it
+key_reconstruction_collection* create_task_owned_key_collection(size_t key_collection_size);
 
-bool reconstruct_key_from_key_fragments(key_reconstruction_collection* key_collection, key_128b* km, const esp_bd_addr_t consumer_mac_address, uint8_t key_id);
+void destroy_key_collection(key_reconstruction_collection* key_collection);
 
-bool is_key_in_collection(key_reconstruction_collection* key_collection, const esp_bd_addr_t consumer_mac_address, uint8_t key_id);
+void remove_key_from_collection(key_reconstruction_collection* key_collection, const esp_bd_addr_t consumer_mac_address, uint16_t key_id);
 
-bool add_new_key_to_collection(key_reconstruction_collection* key_collection, esp_bd_addr_t consumer_mac_address, uint8_t key_id);
+bool reconstruct_key_from_key_fragments(key_reconstruction_collection* key_collection, key_128b* km, const esp_bd_addr_t consumer_mac_address, uint16_t key_id);
 
-void add_fragment_to_key_management(key_reconstruction_collection* key_collection, const esp_bd_addr_t consumer_mac_address, uint8_t key_id, uint8_t *fragment, uint8_t key_fragment_id);
+bool is_key_in_collection(key_reconstruction_collection* key_collection, const esp_bd_addr_t consumer_mac_address, uint16_t key_id);
 
-bool is_key_available(key_reconstruction_collection* key_collection, const esp_bd_addr_t consumer_mac_address, uint8_t key_id);
+// Takes the least recently updated entry when the collection is full
+bool add_new_key_to_collection(key_reconstruction_collection* key_collection, esp_bd_addr_t consumer_mac_address, uint16_t key_id);
 
-bool is_key_fragment_decrypted(key_reconstruction_collection* key_collection, const esp_bd_addr_t consumer_mac_address, uint8_t key_id, uint8_t key_fragment);
+// Drops every key of the sender still in reconstruction, for senders whose consumer was freed
+void remove_sender_keys_from_collection(key_reconstruction_collection* key_collection, const esp_bd_addr_t consumer_mac_address);
+
+// key_fragment_id is the coded fragment index, 0 to NO_CODED_KEY_FRAGMENTS - 1
+void add_fragment_to_key_management(key_reconstruction_collection* key_collection, const esp_bd_addr_t consumer_mac_address, uint16_t key_id, uint8_t *fragment, uint8_t key_fragment_id);
+
+bool is_key_available(key_reconstruction_collection* key_collection, const esp_bd_addr_t consumer_mac_address, uint16_t key_id);
+
+bool is_key_fragment_decrypted(key_reconstruction_collection* key_collection, const esp_bd_addr_t consumer_mac_address, uint16_t key_id, uint8_t key_fragment);
 
 #endif
\ No newline at end of file
@@ -2,7 +2,8 @@
 #define KEY_RECONSTRUCTOR_H
 
 #include "crypto/crypto.h"
-#include "esp_gap_ble_api.h"
+#include "ble_addr.h"
+#include "key_management.h"
 
 typedef enum{
     QUEUED_SUCCESS,
@@ -12,8 +13,9 @@ typedef enum{
     QUEUED_FAILED_KEY_ALREADY_RECONSTRUCTED
 } RECONSTRUCTION_QUEUEING_STATUS;
 
-int start_up_key_reconstructor(const uint8_t max_key_reconstrunction_count);
+int start_up_key_reconstructor(const uint16_t max_key_reconstrunction_count);
 
+// key_fragment_no is the coded fragment index, key fragments are followed by parity fragments (key_fragment_coding.h)
 RECONSTRUCTION_QUEUEING_STATUS queue_key_for_reconstruction(
     uint16_t key_id,
     uint8_t key_fragment_no,
@@ -23,8 +25,26 @@ RECONSTRUCTION_QUEUEING_STATUS queue_key_for_reconstruction(
     const esp_bd_addr_t consumer_mac_address
 );
 
-typedef void (*key_reconstruction_complete_cb)(uint8_t, key_128b * const, uint8_t *);
+// Drops keys of the sender still in reconstruction on the reconstruction task, fragments already queued may start a new one
+void remove_sender_from_key_reconstruction(const esp_bd_addr_t consumer_mac_address);
+
+typedef void (*key_reconstruction_complete_cb)(uint16_t, key_128b * const, uint8_t *);
 
 void register_callback_to_key_reconstruction(key_reconstruction_complete_cb cb);
 
+// Inline reconstruction on the calling task, without the reconstruction queue and task.
+// Every caller owns its collection, returns true with the full key once any NO_KEY_FRAGMENTS coded fragments are collected.
+key_reconstruction_collection* create_inline_key_reconstruction(const uint16_t max_key_reconstrunction_count);
+
+bool reconstruct_key_fragment_inline(
+    key_reconstruction_collection *key_collection,
+    uint16_t key_id,
+    uint8_t key_fragment_no,
+    uint8_t * encrypted_key_fragment,
+    uint8_t * key_hmac,
+    uint8_t xor_seed,
+    const esp_bd_addr_t consumer_mac_address,
+    key_128b *reconstructed_key
+);
+
 #endif
\ No newline at end of file
@@ -0,0 +1,65 @@
+#ifndef PDU_POOL_H
+#define PDU_POOL_H
+
+#include "ble_addr.h"
+#include "beacon_pdu_data.h"
+#include "pdu_latency.h"
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+
+// Fixed number of PDU buffers shared by authorization, dispatch and deferred queues.
+// Queues pass pointers to slots, a slot is filled once in scan callback and released
+// after decryption observers return or when PDU is dropped.
+#define PDU_POOL_SIZE 160
+
+typedef struct pdu_pool_slot pdu_pool_slot;
+
+struct pdu_pool_slot {
+    union {
+        uint8_t data[MAX_BEACON_PDU_LEN];
+        beacon_pdu_data pdu;
+        beacon_key_pdu_data key_pdu;
+    };
+    size_t size;
+    int64_t timestamp_us;
+    uint16_t pdu_no;
+    uint16_t key_id;
+    int16_t sender_index;
+    esp_bd_addr_t mac_address;
+    pdu_latency_trace latency;
+    pdu_pool_slot *next;
+    // Set between acquire and release, catches a slot released twice from different tasks
+    atomic_bool in_use;
+};
+
+// FIFO linked through the slots, per sender buffers take no memory beyond the pool.
+// Not thread safe, owner of the list serializes access.
+typedef struct {
+    pdu_pool_slot *head;
+    pdu_pool_slot *tail;
+    uint16_t count;
+} pdu_pool_slot_list;
+
+int init_pdu_pool();
+
+pdu_pool_slot* acquire_pdu_pool_slot();
+
+void release_pdu_pool_slot(pdu_pool_slot *slot);
+
+uint32_t get_no_free_pdu_pool_slots();
+
+// Data PDU view of the slot, payload size is filled in place without copying the adv data
+beacon_pdu_data* get_beacon_pdu_from_pool_slot(pdu_pool_slot *slot);
+
+void init_pdu_pool_slot_list(pdu_pool_slot_list *list);
+
+void push_to_pdu_pool_slot_list(pdu_pool_slot_list *list, pdu_pool_slot *slot);
+
+pdu_pool_slot* pop_from_pdu_pool_slot_list(pdu_pool_slot_list *list);
+
+// Gives every slot from the list back to the pool
+void release_pdu_pool_slot_list(pdu_pool_slot_list *list);
+
+#endif
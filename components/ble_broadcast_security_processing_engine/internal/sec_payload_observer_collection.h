@@ -3,10 +3,12 @@
 
 #include "sec_payload_decrypted_observer.h"
 #include "freertos/semphr.h"
+#include <stdatomic.h>
 
+// Observers are only added, mutex serializes adding, notification from processing shards reads without locking
 typedef struct {
     uint8_t collection_size;
-    payload_decrypted_observer_cb *observers;
+    _Atomic(payload_decrypted_observer_cb) *observers;
     SemaphoreHandle_t xMutex;
 } payload_decrypted_observer_collection;
 
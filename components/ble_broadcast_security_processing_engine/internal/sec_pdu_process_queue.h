@@ -3,8 +3,10 @@
 
 #include <stdint.h>
 #include <stddef.h>
-#include "esp_gap_ble_api.h"
+#include "ble_addr.h"
+#include "pdu_pool.h"
 
-int enqueue_pdu_for_processing(uint8_t* data, size_t size, esp_bd_addr_t mac_address);
+// Takes ownership of the slot, slot is released when PDU could not be queued
+int enqueue_pdu_for_processing(pdu_pool_slot* slot);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,103 @@
+#include "adv_interval_estimator.h"
+
+#include <string.h>
+
+#define Q8_ONE 256
+
+static int32_t get_x(const adv_interval_estimator *estimator, uint16_t pdu_no)
+{
+    // Numer pakietu względem początku sesji klucza, numery rosną w obrębie sesji
+    return (int32_t) ((uint16_t) (pdu_no - estimator->base_pdu_no));
+}
+
+static int64_t get_y_ms(const adv_interval_estimator *estimator, int64_t timestamp_us)
+{
+    return (timestamp_us - estimator->base_timestamp_us) / 1000;
+}
+
+void reset_adv_interval_estimator(adv_interval_estimator *estimator, uint16_t pdu_no, int64_t timestamp_us)
+{
+    memset(estimator, 0, sizeof(adv_interval_estimator));
+    estimator->base_pdu_no = pdu_no;
+    estimator->base_timestamp_us = timestamp_us;
+    add_sample_to_adv_interval_estimator(estimator, pdu_no, timestamp_us);
+}
+
+void add_sample_to_adv_interval_estimator(adv_interval_estimator *estimator, uint16_t pdu_no, int64_t timestamp_us)
+{
+    const int64_t x = get_x(estimator, pdu_no);
+    const int64_t y = get_y_ms(estimator, timestamp_us);
+
+    // Okno pełne - najstarsza próbka wypada z sum
+    if (estimator->count == ADV_INTERVAL_ESTIMATOR_WINDOW)
+    {
+        const int64_t old_x = estimator->x[estimator->head];
+        const int64_t old_y = estimator->y_ms[estimator->head];
+        estimator->sum_x -= old_x;
+        estimator->sum_y -= old_y;
+        estimator->sum_xx -= old_x * old_x;
+        estimator->sum_xy -= old_x * old_y;
+        estimator->head = (estimator->head + 1) % ADV_INTERVAL_ESTIMATOR_WINDOW;
+        estimator->count--;
+    }
+
+    const uint8_t index = (estimator->head + estimator->count) % ADV_INTERVAL_ESTIMATOR_WINDOW;
+    estimator->x[index] = (int32_t) x;
+    estimator->y_ms[index] = y;
+    estimator->sum_x += x;
+    estimator->sum_y += y;
+    estimator->sum_xx += x * x;
+    estimator->sum_xy += x * y;
+
+    estimator->count++;
+}
+
+int64_t get_estimated_adv_interval_q8(const adv_interval_estimator *estimator, uint32_t adv_interval_ms)
+{
+    const int64_t nominal_q8 = (int64_t) adv_interval_ms * Q8_ONE;
+    const int64_t min_q8 = nominal_q8 * (1000 - ADV_INTERVAL_MAX_SKEW_PERMILLE) / 1000;
+    const int64_t max_q8 = nominal_q8 * (1000 + ADV_INTERVAL_MAX_SKEW_PERMILLE) / 1000;
+
+    // Nachylenie prostej: (n*Sxy - Sx*Sy) / (n*Sxx - Sx^2)
+    const int64_t n = estimator->count;
+    const int64_t denominator = n * estimator->sum_xx - estimator->sum_x * estimator->sum_x;
+    if (n < 2 || denominator <= 0)
+    {
+        return nominal_q8;
+    }
+
+    const int64_t numerator = n * estimator->sum_xy - estimator->sum_x * estimator->sum_y;
+    int64_t interval_q8 = numerator * Q8_ONE / denominator;
+
+    // Nadawca musi rozgłaszać z interwałem wynikającym z ID klucza, dopuszczalny jest tylko dryft zegara
+    if (interval_q8 < min_q8)
+    {
+        interval_q8 = min_q8;
+    }
+    else if (interval_q8 > max_q8)
+    {
+        interval_q8 = max_q8;
+    }
+    return interval_q8;
+}
+
+bool is_pdu_arrival_expected(const adv_interval_estimator *estimator, uint16_t pdu_no, int64_t timestamp_us,
+                             uint32_t adv_interval_ms, int tolerance_ms)
+{
+    const int64_t n = estimator->count;
+    if (n == 0)
+    {
+        return false;
+    }
+
+    // Prosta przechodzi przez środek ciężkości próbek - jitter pojedynczych pakietów uśrednia się
+    // Przewidywany czas * n * 256 = Sy * 256 + interwał_q8 * (n * x - Sx)
+    const int64_t interval_q8 = get_estimated_adv_interval_q8(estimator, adv_interval_ms);
+    const int64_t x = get_x(estimator, pdu_no);
+    const int64_t y = get_y_ms(estimator, timestamp_us);
+    const int64_t predicted_scaled = estimator->sum_y * Q8_ONE + interval_q8 * (n * x - estimator->sum_x);
+    const int64_t difference_scaled = y * n * Q8_ONE - predicted_scaled;
+    const int64_t tolerance_scaled = (int64_t) tolerance_ms * n * Q8_ONE;
+
+    return difference_scaled <= tolerance_scaled && difference_scaled >= -tolerance_scaled;
+}
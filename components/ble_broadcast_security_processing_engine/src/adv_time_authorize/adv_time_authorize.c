@@ -1,13 +1,19 @@
 #include "sec_pdu_processing_scan_callback.h"
 #include "sec_pdu_processing.h"
 #include "adv_time_authorize.h"
+#include "adv_interval_estimator.h"
 #include "sec_pdu_process_queue.h"
 #include "beacon_pdu_data.h"
+#include "pdu_pool.h"
 #include "tasks_data.h"
+#include "tick_count_timestamp.h"
+#include "spsc_ring.h"
+#include "config.h"
 
 #include "test.h"
 
 #include <string.h>
+#include <stdlib.h>
 
 #include "freertos/FreeRTOS.h"
 #include "freertos/queue.h"
@@ -16,74 +22,116 @@
 
 #include <stdatomic.h>
 
+// Budget of pool slots a single sender can hold while waiting for authorization
 #define CONSUMER_PRIVATE_QUEUE_SIZE 50
 #define EVENT_QUEUE_SIZE 10
+// Handoff from GAP callback, sized for advertisement bursts delivered by the controller
+#define SCAN_RING_SIZE 64
 
+#define IDLE_SENDERS_CHECK_PERIOD_TICKS pdMS_TO_TICKS(1000)
+
+// PDUs authorized in one turn of a sender, then the sender goes to the back of the ready queue
 #define MAX_PDU_PROCESS_PER_CONSUMER 6
+// Sender with a pair to compare is scheduled at once with this many PDUs pending, otherwise after ADV_AUTHORIZE_MAX_HOLD_MS
 #define NO_PDU_IN_QUEUE_FOR_PROCESS 6
-
-#define MAX_BLOCK_TIME_TICKS pdMS_TO_TICKS(50)
+#define ADV_AUTHORIZE_MAX_HOLD_TICKS pdMS_TO_TICKS(ADV_AUTHORIZE_MAX_HOLD_MS)
+// Rejected PDUs in a row after which the interval estimator is restarted from the current PDU
+#define ADV_AUTHORIZE_MAX_CONSECUTIVE_REJECTS 3
 
 #define ADV_AUTHORIZE_LOG "ADV_AUTHRORIZE"
 
-#define EVENT_AUTHORIZE_PACKETS (1 << 1)
-
-typedef struct {
-    int64_t timestamp_us;
-    uint8_t data[MAX_GAP_DATA_LEN];
-    size_t size;
-    uint16_t pdu_no;
-    uint16_t key_id;
-} scan_pdu;
+#define EVENT_SCANNED_PDUS (1 << 2)
 
 typedef struct {
     esp_bd_addr_t consumer_addr;
-    scan_pdu last_processed_pdu;
-    QueueHandle_t privateQueue;
+    pdu_pool_slot *last_processed_pdu;
+    pdu_pool_slot_list pending_pdus;
+    adv_interval_estimator estimator;
+    uint64_t last_pdu_timestamp;
+    uint8_t rollover;
+    uint32_t generation;
+    TickType_t pending_since_ticks;
     uint16_t last_pdu_no;
     uint16_t last_pdu_key_id;
+    uint16_t estimator_key_id;
+    uint8_t consecutive_rejects;
     bool active;
+    bool scheduled;
 } consumer_authorization_structure;
 
+// FIFO of senders with PDUs ready for authorization, a sender is in it at most once
+typedef struct {
+    uint16_t *consumer_indexes;
+    uint16_t head;
+    uint16_t count;
+} ready_consumers_queue;
+
 typedef struct {
-    consumer_authorization_structure consumers[MAX_BLE_CONSUMERS];
+    consumer_authorization_structure *consumers;
+    uint16_t consumers_size;
+    sender_registry *registry;
+    sender_eviction_stats eviction_stats;
+    spsc_ring *scan_ring;
+    ready_consumers_queue ready_queue;
     SemaphoreHandle_t xMutex;
     TaskHandle_t xTaskHandle;
     EventGroupHandle_t eventGroup;
 } adv_time_authorize_structure;
 
 static adv_time_authorize_structure ao_control_structure;
-static esp_bd_addr_t zero_address_init = {0x00, 0x00, 0x00, 0x00, 0x00, 0x00};
 
 void adv_authorize_main(void *arg);
 int get_consumer_index_for_addr(esp_bd_addr_t mac_address);
 bool init_consumer_authorization_structure(consumer_authorization_structure *st);
-uint32_t get_no_messages_in_queue(QueueHandle_t queue);
-void process_authorization_for_consumer(uint8_t consumer_index);
-void save_last_scanned_pdu(scan_pdu *prev_scanned_pdu, scan_pdu *pdu);
-int get_tolerance_window_based_on_adv_interval(uint32_t adv_interval);
+void process_authorization_for_consumer(uint16_t consumer_index);
+void remove_idle_consumers();
+static void handle_scanned_pdus();
+int remove_lru_consumer();
 
 bool init_consumer_authorization_structure(consumer_authorization_structure *st)
 {
+    // Pakiety oczekujące na autoryzację trzymane są w slotach wspólnej puli, bez prywatnej kolejki per nadawca
+    // Generacja zmienia się przy każdym zwolnieniu struktury - pozwala wykryć eksmisję w trakcie autoryzacji
+    // Flaga kolejki gotowych zostaje - indeks może już czekać w kolejce, nowy nadawca nie doda go drugi raz
+    const uint32_t generation = st->generation;
+    const bool scheduled = st->scheduled;
     memset(st, 0, sizeof(consumer_authorization_structure));
-    memcpy(st->consumer_addr, zero_address_init, sizeof(esp_bd_addr_t));
-    st->privateQueue =  xQueueCreate(CONSUMER_PRIVATE_QUEUE_SIZE, sizeof(scan_pdu));
-    if (st->privateQueue == NULL)
-    {
-        ESP_LOGI(ADV_AUTHORIZE_LOG, "Private Queue init failed");
-        return false;
-    }
+    init_pdu_pool_slot_list(&(st->pending_pdus));
+    st->generation = generation + 1;
+    st->scheduled = scheduled;
 
     return true;
 }
 
-bool init_adv_time_authorize_object()
+bool init_adv_time_authorize_object(sender_registry *registry)
 {
     static bool is_initialized_alread = false;
 
     if (is_initialized_alread == false)
     {
-        for (int i = 0; i < MAX_BLE_CONSUMERS; i++)
+        if (registry == NULL)
+        {
+            ESP_LOGE(ADV_AUTHORIZE_LOG, "Sender registry not provided");
+            return is_initialized_alread;
+        }
+
+        ao_control_structure.registry = registry;
+        ao_control_structure.consumers_size = get_max_senders(registry);
+        ao_control_structure.consumers = (consumer_authorization_structure *) calloc(ao_control_structure.consumers_size, sizeof(consumer_authorization_structure));
+        if (ao_control_structure.consumers == NULL)
+        {
+            ESP_LOGE(ADV_AUTHORIZE_LOG, "Consumers alloc failed");
+            return is_initialized_alread;
+        }
+
+        ao_control_structure.ready_queue.consumer_indexes = (uint16_t *) calloc(ao_control_structure.consumers_size, sizeof(uint16_t));
+        if (ao_control_structure.ready_queue.consumer_indexes == NULL)
+        {
+            ESP_LOGE(ADV_AUTHORIZE_LOG, "Ready queue alloc failed");
+            return is_initialized_alread;
+        }
+
+        for (int i = 0; i < ao_control_structure.consumers_size; i++)
         {
             bool result_consumer = init_consumer_authorization_structure(&ao_control_structure.consumers[i]);
             if (result_consumer == false)
@@ -107,6 +155,14 @@ bool init_adv_time_authorize_object()
             return is_initialized_alread;
         }
 
+        // Newest advertisements are kept on overflow, timestamps of old ones are the least useful
+        ao_control_structure.scan_ring = create_spsc_ring(SCAN_RING_SIZE, SPSC_RING_DROP_OLDEST);
+        if (ao_control_structure.scan_ring == NULL)
+        {
+            ESP_LOGE(ADV_AUTHORIZE_LOG, "Scan ring alloc failed");
+            return is_initialized_alread;
+        }
+
         BaseType_t  taskCreateResult = xTaskCreatePinnedToCore(
             adv_authorize_main,
             tasksDataArr[ADV_TIME_AUTHORIZE_TASK].name, 
@@ -136,216 +192,448 @@ bool init_adv_time_authorize_object()
 
 int get_consumer_index_for_addr(esp_bd_addr_t mac_address)
 {
-    int index = -1;
-    int free_arr_index = -1;
-    for (int i = 0; i < MAX_BLE_CONSUMERS; i++)
+    // Indeks nadawcy ze wspólnego rejestru nadawców (tablica haszująca adresów MAC)
+    int index = add_sender_to_registry(ao_control_structure.registry, mac_address);
+
+    // Tablica nadawców pełna - zastąp najdawniej słyszanego nadawcę
+    if (index < 0)
     {
-        if (memcmp(ao_control_structure.consumers[i].consumer_addr, mac_address, sizeof(esp_bd_addr_t)) == 0)
+        if (remove_lru_consumer() == 0)
         {
-            index = i;
-            break;
+            index = add_sender_to_registry(ao_control_structure.registry, mac_address);
         }
-        else if (memcmp(ao_control_structure.consumers[i].consumer_addr, zero_address_init, sizeof(esp_bd_addr_t)) == 0)
+        else
         {
-            free_arr_index = i;
+            ao_control_structure.eviction_stats.rejected_senders++;
         }
     }
 
-    if (index == -1 && free_arr_index >= 0)
+    if (index >= 0 && ao_control_structure.consumers[index].active == false)
     {
-        memcpy(ao_control_structure.consumers[free_arr_index].consumer_addr, mac_address, sizeof(esp_bd_addr_t));
-        ao_control_structure.consumers[free_arr_index].active = true;
-        index = free_arr_index;
+        init_consumer_authorization_structure(&ao_control_structure.consumers[index]);
+        memcpy(ao_control_structure.consumers[index].consumer_addr, mac_address, sizeof(esp_bd_addr_t));
+        ao_control_structure.consumers[index].active = true;
     }
 
     return index;
 }
 
+// Wywoływane z zajętym mutexem ao_control_structure.xMutex
+static void release_consumer(consumer_authorization_structure *consumer)
+{
+    // Zwolnij sloty oczekujące, slot trzymany do porównania i indeks nadawcy w rejestrze
+    release_pdu_pool_slot_list(&(consumer->pending_pdus));
+    release_pdu_pool_slot(consumer->last_processed_pdu);
+    remove_sender_from_registry(ao_control_structure.registry, consumer->consumer_addr);
+    init_consumer_authorization_structure(consumer);
+}
 
-uint32_t get_no_messages_in_queue(QueueHandle_t queue)
+// Wywoływane z zajętym mutexem ao_control_structure.xMutex
+int remove_lru_consumer()
 {
-    return (uint32_t) uxQueueMessagesWaiting(queue);
+    int lru_index = -1;
+    uint32_t lru_elapsed_ms = 0;
+
+    for (int i = 0; i < ao_control_structure.consumers_size; i++)
+    {
+        consumer_authorization_structure *consumer = &(ao_control_structure.consumers[i]);
+        if (consumer->active == true)
+        {
+            uint32_t elapsed_ms = get_ms_elapsed_since_timestamp(&(consumer->last_pdu_timestamp));
+            if (lru_index < 0 || elapsed_ms > lru_elapsed_ms)
+            {
+                lru_index = i;
+                lru_elapsed_ms = elapsed_ms;
+            }
+        }
+    }
+
+    // Nadawca słyszany niedawno jest aktywny - nie wypieraj go
+    if (lru_index < 0 || lru_elapsed_ms < SENDER_EVICTION_MIN_IDLE_MS)
+    {
+        return -1;
+    }
+
+    release_consumer(&(ao_control_structure.consumers[lru_index]));
+    ao_control_structure.eviction_stats.lru_evictions++;
+    return 0;
+}
+
+void remove_idle_consumers()
+{
+    for (int i = 0; i < ao_control_structure.consumers_size; i++)
+    {
+        consumer_authorization_structure *consumer = &(ao_control_structure.consumers[i]);
+        if (xSemaphoreTake(ao_control_structure.xMutex, portMAX_DELAY) == pdTRUE)
+        {
+            if (consumer->active == true && consumer->pending_pdus.count == 0 &&
+                get_ms_elapsed_since_timestamp(&(consumer->last_pdu_timestamp)) >= SENDER_IDLE_TIMEOUT_MS)
+            {
+                release_consumer(consumer);
+                ao_control_structure.eviction_stats.idle_evictions++;
+            }
+            xSemaphoreGive(ao_control_structure.xMutex);
+        }
+    }
+}
+
+// Wywoływane z zajętym mutexem ao_control_structure.xMutex
+static bool has_pdus_to_compare(const consumer_authorization_structure *consumer)
+{
+    // Z rozgrzanym estymatorem pojedynczy pakiet jest autoryzowany od razu, bez czekania na parę
+    return consumer->pending_pdus.count >= 2 || (consumer->pending_pdus.count >= 1 && consumer->estimator.count > 0);
+}
+
+// Wywoływane z zajętym mutexem ao_control_structure.xMutex
+static void schedule_consumer(uint16_t consumer_index)
+{
+    consumer_authorization_structure *consumer = &(ao_control_structure.consumers[consumer_index]);
+    ready_consumers_queue *queue = &(ao_control_structure.ready_queue);
+    if (consumer->scheduled == false && queue->count < ao_control_structure.consumers_size)
+    {
+        queue->consumer_indexes[(queue->head + queue->count) % ao_control_structure.consumers_size] = consumer_index;
+        queue->count++;
+        consumer->scheduled = true;
+    }
+}
+
+static bool pop_scheduled_consumer(uint16_t *consumer_index)
+{
+    bool result = false;
+    if (xSemaphoreTake(ao_control_structure.xMutex, portMAX_DELAY) == pdTRUE)
+    {
+        ready_consumers_queue *queue = &(ao_control_structure.ready_queue);
+        if (queue->count > 0)
+        {
+            *consumer_index = queue->consumer_indexes[queue->head];
+            queue->head = (queue->head + 1) % ao_control_structure.consumers_size;
+            queue->count--;
+            ao_control_structure.consumers[*consumer_index].scheduled = false;
+            result = true;
+        }
+        xSemaphoreGive(ao_control_structure.xMutex);
+    }
+    return result;
+}
+
+// Wywoływane z zajętym mutexem ao_control_structure.xMutex
+// Pełna partia albo przekroczony czas przetrzymania - nadawca trafia do kolejki gotowych
+static void update_consumer_schedule(uint16_t consumer_index, TickType_t now_ticks)
+{
+    consumer_authorization_structure *consumer = &(ao_control_structure.consumers[consumer_index]);
+    if (consumer->active == true && consumer->scheduled == false && has_pdus_to_compare(consumer))
+    {
+        if (consumer->pending_pdus.count >= NO_PDU_IN_QUEUE_FOR_PROCESS ||
+            (now_ticks - consumer->pending_since_ticks) >= ADV_AUTHORIZE_MAX_HOLD_TICKS)
+        {
+            schedule_consumer(consumer_index);
+        }
+    }
+}
+
+// Schedules senders with expired hold time, returns ticks until the nearest hold deadline
+static TickType_t schedule_expired_consumers()
+{
+    TickType_t wait_ticks = IDLE_SENDERS_CHECK_PERIOD_TICKS;
+    if (xSemaphoreTake(ao_control_structure.xMutex, portMAX_DELAY) == pdTRUE)
+    {
+        const TickType_t now_ticks = xTaskGetTickCount();
+        for (int i = 0; i < ao_control_structure.consumers_size; i++)
+        {
+            consumer_authorization_structure *consumer = &(ao_control_structure.consumers[i]);
+            update_consumer_schedule(i, now_ticks);
+            if (consumer->active == true && consumer->scheduled == false && has_pdus_to_compare(consumer))
+            {
+                const TickType_t held_ticks = now_ticks - consumer->pending_since_ticks;
+                const TickType_t remaining_ticks = held_ticks >= ADV_AUTHORIZE_MAX_HOLD_TICKS ? 1 : ADV_AUTHORIZE_MAX_HOLD_TICKS - held_ticks;
+                wait_ticks = remaining_ticks < wait_ticks ? remaining_ticks : wait_ticks;
+            }
+        }
+        xSemaphoreGive(ao_control_structure.xMutex);
+    }
+    return wait_ticks;
 }
 
 void adv_authorize_main(void *arg)
 {
-    const uint32_t DELAY_TICKS = pdMS_TO_TICKS(20);
+    TickType_t last_idle_check_ticks = xTaskGetTickCount();
+    TickType_t wait_ticks = IDLE_SENDERS_CHECK_PERIOD_TICKS;
     while(1)
     {
-        // Pętla zdarzeń – oczekiwanie na zdarzenie autoryzacji pakietów
+        // Pętla zdarzeń – oczekiwanie na nowe pakiety albo na koniec czasu przetrzymania pakietów
         EventBits_t events = xEventGroupWaitBits(ao_control_structure.eventGroup,
-                EVENT_AUTHORIZE_PACKETS,
-                pdTRUE, pdFALSE, portMAX_DELAY);
+                EVENT_SCANNED_PDUS,
+                pdTRUE, pdFALSE, wait_ticks);
 
-        if (events &EVENT_AUTHORIZE_PACKETS)
+        // Pakiety przekazane z GAP callback - przypisanie do nadawców
+        if (events & EVENT_SCANNED_PDUS)
         {
-            // Przetwórz kolejki aktywnych nadawców
-            for (int i = 0; i < MAX_BLE_CONSUMERS; i++)
+            handle_scanned_pdus();
+        }
+        schedule_expired_consumers();
+
+        // Nadawcy obsługiwani po kolei (round robin), każdy maksymalnie MAX_PDU_PROCESS_PER_CONSUMER pakietów na turę
+        uint16_t consumer_index = 0;
+        while (pop_scheduled_consumer(&consumer_index))
+        {
+            process_authorization_for_consumer(consumer_index);
+
+            // Nowe pakiety z GAP callback nie czekają na obsłużenie całej kolejki gotowych
+            if (get_spsc_ring_count(ao_control_structure.scan_ring) > 0)
             {
-                if (ao_control_structure.consumers[i].active == true)
-                {
-                    process_authorization_for_consumer(i);
-                    vTaskDelay(DELAY_TICKS);
-                }
+                handle_scanned_pdus();
             }
         }
+        wait_ticks = schedule_expired_consumers();
+
+        // Zwolnienie zasobów nadawców, od których nie przychodzą już pakiety
+        if ((xTaskGetTickCount() - last_idle_check_ticks) >= IDLE_SENDERS_CHECK_PERIOD_TICKS)
+        {
+            last_idle_check_ticks = xTaskGetTickCount();
+            remove_idle_consumers();
+        }
     }
 
 }
 
-void process_authorization_for_consumer(const uint8_t consumer_index)
+void process_authorization_for_consumer(const uint16_t consumer_index)
 {
     // Wyciągnij z kolejki oczekujące pakiety do autoryzacji
     // Maksymalnie przetwórz liczbę elementów zdefiniowaną przez stała "MAX_PDU_PROCESS_PER_CONSUMER"
-    scan_pdu pdus[MAX_PDU_PROCESS_PER_CONSUMER] = {0};
+    pdu_pool_slot * pdus[MAX_PDU_PROCESS_PER_CONSUMER] = {0};
+    pdu_pool_slot * anchor_pdu = NULL;
+    adv_interval_estimator estimator;
+    uint16_t estimator_key_id = 0;
+    uint8_t consecutive_rejects = 0;
+    uint32_t generation = 0;
     int batchCount = 0;
-    while (batchCount < MAX_PDU_PROCESS_PER_CONSUMER &&
-        xQueueReceive(ao_control_structure.consumers[consumer_index].privateQueue, (void *)&pdus[batchCount], MAX_BLOCK_TIME_TICKS) == pdTRUE)
+    if (xSemaphoreTake(ao_control_structure.xMutex, portMAX_DELAY) == pdTRUE)
     {
-        batchCount++;
-    }
+        consumer_authorization_structure *consumer = &(ao_control_structure.consumers[consumer_index]);
+        while (batchCount < MAX_PDU_PROCESS_PER_CONSUMER &&
+            (pdus[batchCount] = pop_from_pdu_pool_slot_list(&(consumer->pending_pdus))) != NULL)
+        {
+            batchCount++;
+        }
 
-    int start_index = 1;
-    scan_pdu * last_scan_pdu = NULL; // Wskaźnik na pakiet aktualnie autoryzowany
-    if (ao_control_structure.consumers[consumer_index].last_processed_pdu.timestamp_us != 0)
-    {
-        // Jeżeli wcześniej żaden pakiet nie był autoryzowany dla tego nadawcy
-        // Weź pierwszy oczekujący pakiet
-        start_index = 0;
-        last_scan_pdu = &(ao_control_structure.consumers[consumer_index].last_processed_pdu);
+        // Slot kotwicy i estymator zabierane na czas autoryzacji, nadawca może zostać w tym czasie wyparty
+        anchor_pdu = consumer->last_processed_pdu;
+        consumer->last_processed_pdu = NULL;
+        estimator = consumer->estimator;
+        estimator_key_id = consumer->estimator_key_id;
+        consecutive_rejects = consumer->consecutive_rejects;
+        generation = consumer->generation;
+        xSemaphoreGive(ao_control_structure.xMutex);
     }
-    else
+
+    for (int i = 0; i < batchCount; i++)
     {
-        // Jeżeli wcześniej jakikolwiek pakiet autoryzowany dla tego nadawcy
-        // Weź pakiet, na którym skończyło się ostatnie przetwarzanie
-        last_scan_pdu = &pdus[0];
+        pdu_latency_record(&(pdus[i]->latency), pdus[i]->sender_index, PDU_STAGE_AUTHORIZER_DEQUEUE);
     }
 
-    for (int i = start_index; i < batchCount; i++)
+    for (int i = 0; i < batchCount; i++)
     {
-        // Sprawdź czy porównywane pakiety są z tej samej sesji
-        if (pdus[i].key_id == last_scan_pdu->key_id)
+        pdu_pool_slot *pdu = pdus[i];
+
+        // Nowa sesja klucza (inny interwał) albo kotwica sesji niepotwierdzona / seria odrzuceń
+        // Pakiet staje się kotwicą i czeka na potwierdzenie przez kolejny pakiet
+        bool start_session = estimator.count == 0 || pdu->key_id != estimator_key_id;
+        bool is_forwarded = false;
+
+        if (start_session == false)
         {
-            // Oblicz czas, który upłynął między odebranymi pakietami w ms
-            int64_t timestamp_diff_ms = ((pdus[i].timestamp_us - last_scan_pdu->timestamp_us) / 1000);
+            // Wyznacz interwał rozgłaszania z ID klucza i tolerancję
+            const uint32_t adv_time_for_key_id = get_adv_interval_from_key_id(pdu->key_id);
+            const int tolerance_window_ms = get_tolerance_window_based_on_adv_interval(adv_time_for_key_id);
 
-            // Wyznacz interwał rozgłaszania z ID klucza
-            uint32_t adv_time_for_key_id = get_adv_interval_from_key_id(pdus[i].key_id);
+            // Czas odbioru porównywany z prostą dopasowaną do ostatnich autoryzowanych pakietów - O(1) na pakiet
+            if (is_pdu_arrival_expected(&estimator, pdu->pdu_no, pdu->timestamp_us, adv_time_for_key_id, tolerance_window_ms))
+            {
+                // Potwierdzona kotwica przekazywana przed pakietem, który ją potwierdził
+                if (anchor_pdu != NULL)
+                {
+                    enqueue_pdu_for_processing(anchor_pdu);
+                    anchor_pdu = NULL;
+                }
+                add_sample_to_adv_interval_estimator(&estimator, pdu->pdu_no, pdu->timestamp_us);
+                consecutive_rejects = 0;
 
-            // Wyznacz jaki czas w ms powinien upłynąć pomiędzy pakietami
-            int64_t timestamp_diff_from_pdus = (int64_t) ((pdus[i].pdu_no - last_scan_pdu->pdu_no) * adv_time_for_key_id);
+                // Pakiet przekazywany dalej przez wskaźnik, właścicielem slotu staje się kolejka przetwarzania
+                enqueue_pdu_for_processing(pdu);
+                is_forwarded = true;
+            }
+            else
+            {
+                test_log_adv_time_not_authorize(ao_control_structure.consumers[consumer_index].consumer_addr);
+                consecutive_rejects++;
 
-            // Oblicz różnice między czasem, który powinien upłynąć, a tym z znacznikiów czasowych
-            int difference_timestamps = (int) (timestamp_diff_from_pdus - timestamp_diff_ms);
+                // Niepotwierdzona kotwica mogła być błędna, a seria odrzuceń oznacza zmianę rytmu nadawcy
+                start_session = anchor_pdu != NULL || consecutive_rejects >= ADV_AUTHORIZE_MAX_CONSECUTIVE_REJECTS;
+            }
+        }
 
-            // Oblicz tolerancję
-            const int PLUS_TOLERANCE_WINDOW_MS = get_tolerance_window_based_on_adv_interval(adv_time_for_key_id);
-            const int MINUS_TOLERANCE_WINDOW_MS = PLUS_TOLERANCE_WINDOW_MS * -1;
+        if (start_session == true)
+        {
+            release_pdu_pool_slot(anchor_pdu);
+            reset_adv_interval_estimator(&estimator, pdu->pdu_no, pdu->timestamp_us);
+            estimator_key_id = pdu->key_id;
+            consecutive_rejects = 0;
+            anchor_pdu = pdu;
+        }
+        else if (is_forwarded == false)
+        {
+            release_pdu_pool_slot(pdu);
+        }
+    }
 
-            // Sprawdź czy czas, który upłynął jest w zakresie błędu
-            if ((difference_timestamps <= PLUS_TOLERANCE_WINDOW_MS) && (difference_timestamps >=  MINUS_TOLERANCE_WINDOW_MS))
+    // Zapisz stan estymatora i kotwicę do potwierdzenia kolejnym pakietem
+    if (xSemaphoreTake(ao_control_structure.xMutex, portMAX_DELAY) == pdTRUE)
+    {
+        consumer_authorization_structure *consumer = &(ao_control_structure.consumers[consumer_index]);
+        if (consumer->generation == generation)
+        {
+            consumer->last_processed_pdu = anchor_pdu;
+            consumer->estimator = estimator;
+            consumer->estimator_key_id = estimator_key_id;
+            consumer->consecutive_rejects = consecutive_rejects;
+
+            // Pozostałe pakiety były już przetrzymane - nadawca wraca na koniec kolejki gotowych
+            if (has_pdus_to_compare(consumer))
             {
-                enqueue_pdu_for_processing(last_scan_pdu->data, last_scan_pdu->size, ao_control_structure.consumers[consumer_index].consumer_addr);
+                schedule_consumer(consumer_index);
             }
             else
             {
-                test_log_adv_time_not_authorize(ao_control_structure.consumers[consumer_index].consumer_addr);
+                consumer->pending_since_ticks = xTaskGetTickCount();
             }
         }
-
-        last_scan_pdu = &pdus[i];
+        else
+        {
+            release_pdu_pool_slot(anchor_pdu);
+        }
+        xSemaphoreGive(ao_control_structure.xMutex);
     }
 
-    // Zapisz aktualny pakiet jako następny do porównania/autoryzacji
-    save_last_scanned_pdu(&(ao_control_structure.consumers[consumer_index].last_processed_pdu), last_scan_pdu);
+}
 
+void get_adv_time_authorize_eviction_stats(sender_eviction_stats *stats)
+{
+    if (stats != NULL && xSemaphoreTake(ao_control_structure.xMutex, portMAX_DELAY) == pdTRUE)
+    {
+        *stats = ao_control_structure.eviction_stats;
+        xSemaphoreGive(ao_control_structure.xMutex);
+    }
 }
 
-int get_tolerance_window_based_on_adv_interval(uint32_t adv_interval)
+// Wywoływane z zajętym mutexem ao_control_structure.xMutex
+static void send_pdu_for_authorization(int consumer_index, pdu_pool_slot *slot)
 {
-    if (adv_interval >= 3000)
+    consumer_authorization_structure *consumer = &(ao_control_structure.consumers[consumer_index]);
+
+    // Budżet slotów nadawcy - jeden nadawca nie może zająć całej puli
+    if (consumer->pending_pdus.count >= CONSUMER_PRIVATE_QUEUE_SIZE)
     {
-        return adv_interval * 0.05;
+        ESP_LOGE(ADV_AUTHORIZE_LOG, "Failed add to queue! :(");
+        release_pdu_pool_slot(slot);
+        return;
     }
-    else if (adv_interval >= 1000)
+
+    slot->sender_index = (int16_t) consumer_index;
+    if (consumer->pending_pdus.count == 0)
     {
-        return adv_interval * 0.1;
+        consumer->pending_since_ticks = xTaskGetTickCount();
     }
-    else if (adv_interval > 500)
+    push_to_pdu_pool_slot_list(&(consumer->pending_pdus), slot);
+    save_timestamp(&(consumer->last_pdu_timestamp), &(consumer->rollover));
+
+    update_consumer_schedule(consumer_index, xTaskGetTickCount());
+}
+
+// Wywoływane z zajętym mutexem ao_control_structure.xMutex
+static void assign_scanned_pdu_to_consumer(pdu_pool_slot *slot)
+{
+    int consumer_index = get_consumer_index_for_addr(slot->mac_address);
+    if (consumer_index < 0)
     {
-        return adv_interval * 0.15;
+        release_pdu_pool_slot(slot);
+        return;
     }
-    else if (adv_interval > 200)
+
+    consumer_authorization_structure *consumer = &(ao_control_structure.consumers[consumer_index]);
+    if (consumer->last_pdu_key_id == slot->key_id)
     {
-        return adv_interval * 0.20;
+        if (slot->pdu_no > consumer->last_pdu_no)
+        {
+            consumer->last_pdu_no = slot->pdu_no;
+            send_pdu_for_authorization(consumer_index, slot);
+        }
+        else
+        {
+            release_pdu_pool_slot(slot);
+        }
     }
     else
     {
-        return adv_interval * 0.30;
+        consumer->last_pdu_no = slot->pdu_no;
+        consumer->last_pdu_key_id = slot->key_id;
+        send_pdu_for_authorization(consumer_index, slot);
     }
 }
 
-void save_last_scanned_pdu(scan_pdu *prev_scanned_pdu, scan_pdu *pdu)
+static void handle_scanned_pdus()
 {
-    memcpy(prev_scanned_pdu, pdu, sizeof(scan_pdu));
+    pdu_pool_slot *slot = NULL;
+    while (pop_from_spsc_ring(ao_control_structure.scan_ring, (void **) &slot))
+    {
+        pdu_latency_record(&(slot->latency), SENDER_REGISTRY_NO_INDEX, PDU_STAGE_SCAN_RING_DEQUEUE);
+        if (xSemaphoreTake(ao_control_structure.xMutex, portMAX_DELAY) == pdTRUE)
+        {
+            assign_scanned_pdu_to_consumer(slot);
+            xSemaphoreGive(ao_control_structure.xMutex);
+        }
+        else
+        {
+            release_pdu_pool_slot(slot);
+        }
+    }
+}
+
+void get_adv_time_authorize_scan_ring_stats(spsc_ring_stats *stats)
+{
+    get_spsc_ring_stats(ao_control_structure.scan_ring, stats);
 }
 
+// Kontekst GAP callback stosu BT - bez mutexów i czekania, pakiet trafia do pierścienia SPSC
 void scan_complete_callback(int64_t timestamp_us, uint8_t *data, size_t data_size, esp_bd_addr_t mac_address)
 {
-    if (data != NULL)
+    if (data == NULL || data_size > MAX_BEACON_PDU_LEN || data_size < (KEY_SESSION_OFFSET + sizeof(uint16_t)) ||
+        ao_control_structure.scan_ring == NULL || !is_pdu_in_beacon_pdu_format(data, data_size))
     {
-        if (is_pdu_in_beacon_pdu_format(data, data_size))
-        {
-            int consumer_index = get_consumer_index_for_addr(mac_address);
-            if (consumer_index >= 0)
-            {
-                scan_pdu pdu;
-                memcpy(pdu.data, data, data_size);
-                pdu.timestamp_us = timestamp_us;
-                memcpy(&(pdu.pdu_no), &(data[PDU_NO_OFFSET]), sizeof(uint16_t));
-                memcpy(&(pdu.key_id), &(data[KEY_SESSION_OFFSET]), sizeof(uint16_t));
-                pdu.size = data_size;
-                uint16_t key_id = get_key_id_from_key_session_data(pdu.key_id);
-                pdu.key_id = key_id;
-
-                if (ao_control_structure.consumers->last_pdu_key_id == pdu.key_id)
-                {
-                    if (pdu.pdu_no > ao_control_structure.consumers->last_pdu_no)
-                    {
-                        BaseType_t queue_send_result =  xQueueSend(ao_control_structure.consumers[consumer_index].privateQueue, &pdu, MAX_BLOCK_TIME_TICKS);
-                        if (queue_send_result != pdPASS)
-                        {
-                            ESP_LOGE(ADV_AUTHORIZE_LOG, "Failed add to queue! :(");
-                        }
-                        ao_control_structure.consumers->last_pdu_no = pdu.pdu_no;
-
-                        uint32_t no_messages_in_queue = get_no_messages_in_queue(ao_control_structure.consumers[consumer_index].privateQueue);
-                        if (no_messages_in_queue >= NO_PDU_IN_QUEUE_FOR_PROCESS)
-                        {
-                            xEventGroupSetBits(ao_control_structure.eventGroup, EVENT_AUTHORIZE_PACKETS);
-                        }
-                    }
-                }
-                else
-                {
-                    BaseType_t queue_send_result =  xQueueSend(ao_control_structure.consumers[consumer_index].privateQueue, &pdu, MAX_BLOCK_TIME_TICKS);
-                    if (queue_send_result != pdPASS)
-                    {
-                        ESP_LOGE(ADV_AUTHORIZE_LOG, "Failed add to queue! :(");
-                    }
-                    ao_control_structure.consumers->last_pdu_no = pdu.pdu_no;
-                    ao_control_structure.consumers->last_pdu_key_id = pdu.key_id;
-
-                    uint32_t no_messages_in_queue = get_no_messages_in_queue(ao_control_structure.consumers[consumer_index].privateQueue);
-                    if (no_messages_in_queue >= NO_PDU_IN_QUEUE_FOR_PROCESS)
-                    {
-                        xEventGroupSetBits(ao_control_structure.eventGroup, EVENT_AUTHORIZE_PACKETS);
-                    }
-                }
-
-            }
-        }
+        return;
     }
-}
 
+    // Jedyna kopia danych rozgłoszenia - dalej slot przekazywany jest przez wskaźnik
+    pdu_pool_slot *slot = acquire_pdu_pool_slot();
+    if (slot == NULL)
+    {
+        ESP_LOGE(ADV_AUTHORIZE_LOG, "No free PDU pool slot! :(");
+        return;
+    }
 
+    uint16_t key_session_data;
+    memcpy(slot->data, data, data_size);
+    memcpy(&(slot->pdu_no), &(data[PDU_NO_OFFSET]), sizeof(uint16_t));
+    memcpy(&key_session_data, &(data[KEY_SESSION_OFFSET]), sizeof(uint16_t));
+    slot->size = data_size;
+    slot->timestamp_us = timestamp_us;
+    slot->key_id = get_key_id_from_key_session_data(key_session_data);
+    slot->sender_index = SENDER_REGISTRY_NO_INDEX;
+    memcpy(slot->mac_address, mac_address, sizeof(esp_bd_addr_t));
+    pdu_latency_start(&(slot->latency));
+
+    pdu_pool_slot *dropped = NULL;
+    push_to_spsc_ring(ao_control_structure.scan_ring, slot, (void **) &dropped);
+    release_pdu_pool_slot(dropped);
+
+    xEventGroupSetBits(ao_control_structure.eventGroup, EVENT_SCANNED_PDUS);
+}
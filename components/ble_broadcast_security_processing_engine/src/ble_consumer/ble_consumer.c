@@ -1,77 +1,98 @@
 #include "beacon_pdu/beacon_pdu_data.h"
 #include "ble_consumer.h"
 
-#include "freertos/FreeRTOS.h"
-#include "freertos/semphr.h"
-
 #include "esp_log.h"
 
+#include <stdlib.h>
 #include <string.h>
 
-// Creates a new BLE consumer
-ble_consumer *create_ble_consumer(const uint8_t key_cache_size) {
-    ble_consumer *p_ble_consumer = (ble_consumer *)malloc(sizeof(ble_consumer));
-    if (!p_ble_consumer) {
-        ESP_LOGE("BLE_CONSUMER", "Failed to allocate memory for BLE consumer");
-        return NULL;
+static void init_deferred_buckets(ble_consumer_context *context)
+{
+    for (int i = 0; i < DEFERRED_KEY_BUCKETS; i++) {
+        init_pdu_pool_slot_list(&(context->deferred_buckets[i].list));
+        context->deferred_buckets[i].created_seq = 0;
+        context->deferred_buckets[i].key_id = 0;
+        context->deferred_buckets[i].in_use = false;
+        context->deferred_buckets[i].release_pending = false;
+    }
+    context->deferred_bucket_seq = 0;
+    context->no_deferred_pdus = 0;
+}
+
+static void release_deferred_bucket(ble_consumer_context *context, deferred_key_bucket *bucket)
+{
+    context->no_deferred_pdus -= bucket->list.count;
+    release_pdu_pool_slot_list(&(bucket->list));
+    bucket->in_use = false;
+    bucket->release_pending = false;
+}
+
+static void release_deferred_buckets(ble_consumer_context *context)
+{
+    for (int i = 0; i < DEFERRED_KEY_BUCKETS; i++) {
+        if (context->deferred_buckets[i].in_use) {
+            release_deferred_bucket(context, &(context->deferred_buckets[i]));
+        }
     }
+}
 
-    p_ble_consumer->context.key_cache_size = key_cache_size;
-    if (create_key_cache(&(p_ble_consumer->context.key_cache), key_cache_size) != 0) {
-        ESP_LOGE("BLE_CONSUMER", "Failed to create key cache");
-        free(p_ble_consumer);
-        return NULL;
+static deferred_key_bucket* find_deferred_bucket(ble_consumer_context *context, const uint16_t key_id)
+{
+    for (int i = 0; i < DEFERRED_KEY_BUCKETS; i++) {
+        if (context->deferred_buckets[i].in_use && context->deferred_buckets[i].key_id == key_id) {
+            return &(context->deferred_buckets[i]);
+        }
     }
+    return NULL;
+}
 
-    p_ble_consumer->context.deferredQueue = xQueueCreate(DEFERRED_QUEUE_SIZE, sizeof(beacon_pdu_data));
-    if (!p_ble_consumer->context.deferredQueue) {
-        ESP_LOGE("BLE_CONSUMER", "Failed to create deferred queue");
-        destroy_key_cache(p_ble_consumer->context.key_cache);
-        free(p_ble_consumer);
-        return NULL;
+// Free bucket for a new key, otherwise the oldest key not waiting for release gives its bucket away
+static deferred_key_bucket* claim_deferred_bucket(ble_consumer_context *context, const uint16_t key_id)
+{
+    deferred_key_bucket *bucket = NULL;
+    for (int i = 0; i < DEFERRED_KEY_BUCKETS; i++) {
+        deferred_key_bucket *candidate = &(context->deferred_buckets[i]);
+        if (!candidate->in_use) {
+            bucket = candidate;
+            break;
+        }
+
+        if (!candidate->release_pending && (bucket == NULL || candidate->created_seq < bucket->created_seq)) {
+            bucket = candidate;
+        }
     }
 
-    p_ble_consumer->xMutex = xSemaphoreCreateMutex();
-    if (!p_ble_consumer->xMutex) {
-        ESP_LOGE("BLE_CONSUMER", "Failed to create mutex");
-        vQueueDelete(p_ble_consumer->context.deferredQueue);
-        destroy_key_cache(p_ble_consumer->context.key_cache);
-        free(p_ble_consumer);
-        return NULL;
+    if (bucket != NULL) {
+        if (bucket->in_use) {
+            ESP_LOGW("BLE_CONSUMER", "Dropping %i deferred PDUs of key %i", bucket->list.count, bucket->key_id);
+            release_deferred_bucket(context, bucket);
+        }
+        bucket->key_id = key_id;
+        bucket->created_seq = context->deferred_bucket_seq++;
+        bucket->in_use = true;
     }
 
-    return p_ble_consumer;
+    return bucket;
 }
 
-int create_ble_consumer_resources(ble_consumer *const p_ble_consumer, const uint8_t key_cache_size)
-{
+// Creates a new BLE consumer, deferred PDUs are kept in pool slots so only the key cache is allocated here
+ble_consumer *create_ble_consumer(const uint8_t key_cache_size) {
+    ble_consumer *p_ble_consumer = (ble_consumer *)malloc(sizeof(ble_consumer));
+    if (!p_ble_consumer) {
+        ESP_LOGE("BLE_CONSUMER", "Failed to allocate memory for BLE consumer");
+        return NULL;
+    }
+
+    init_deferred_buckets(&(p_ble_consumer->context));
+
     p_ble_consumer->context.key_cache_size = key_cache_size;
     if (create_key_cache(&(p_ble_consumer->context.key_cache), key_cache_size) != 0) {
         ESP_LOGE("BLE_CONSUMER", "Failed to create key cache");
         free(p_ble_consumer);
-        return -1;
-    }
-
-    p_ble_consumer->context.deferredQueue = NULL;
-    p_ble_consumer->context.deferredQueue = xQueueCreate(DEFERRED_QUEUE_SIZE, sizeof(beacon_pdu_data));
-    if (!p_ble_consumer->context.deferredQueue) {
-        ESP_LOGE("BLE_CONSUMER", "Failed to create deferred queue");
-        destroy_key_cache(p_ble_consumer->context.key_cache);
-        free(p_ble_consumer);
-        return -1;
+        return NULL;
     }
 
-    p_ble_consumer->xMutex = NULL;
-    p_ble_consumer->xMutex = xSemaphoreCreateMutex();
-    if (!p_ble_consumer->xMutex) {
-        ESP_LOGE("BLE_CONSUMER", "Failed to create mutex");
-        vQueueDelete(p_ble_consumer->context.deferredQueue);
-        destroy_key_cache(p_ble_consumer->context.key_cache);
-        free(p_ble_consumer);
-        return -1;
-    }
-    
-    return 0;
+    return p_ble_consumer;
 }
 
 // Initializes BLE consumer context
@@ -80,10 +101,8 @@ int init_ble_consumer(ble_consumer *p_ble_consumer) {
         return -1;
     }
 
-    p_ble_consumer->context.process_deferred_q_request_pending = false;
     p_ble_consumer->last_pdu_timestamp = 0;
     p_ble_consumer->context.recently_removed_key_id = 0;
-    p_ble_consumer->context.deferred_queue_count = 0;
     p_ble_consumer->rollover = 0;
     p_ble_consumer->last_pdu_key_id = 0;
     memset(p_ble_consumer->mac_address_arr, 0, sizeof(p_ble_consumer->mac_address_arr));
@@ -97,15 +116,14 @@ int reset_ble_consumer(ble_consumer *p_ble_consumer) {
         return -1;
     }
 
-    
-    p_ble_consumer->context.process_deferred_q_request_pending = false;
     p_ble_consumer->last_pdu_timestamp = 0;
     p_ble_consumer->context.recently_removed_key_id = -1;
-    p_ble_consumer->context.deferred_queue_count = 0;
     p_ble_consumer->rollover = 0;
     memset(&(p_ble_consumer->mac_address_arr), 0, sizeof(p_ble_consumer->mac_address_arr));
     clear_cache(p_ble_consumer->context.key_cache);
-    xQueueReset(p_ble_consumer->context.deferredQueue);
+
+    // Deferred queue holds pool slots, give them back before dropping queue content
+    release_deferred_buckets(&(p_ble_consumer->context));
 
     return 0;
 }
@@ -116,116 +134,108 @@ int destroy_ble_consumer(ble_consumer *p_ble_consumer) {
         return -1;
     }
 
-    if (xSemaphoreTake(p_ble_consumer->xMutex, portMAX_DELAY) == pdTRUE) {
-        if (p_ble_consumer->context.deferredQueue) {
-            vQueueDelete(p_ble_consumer->context.deferredQueue);
-        }
+    release_deferred_buckets(&(p_ble_consumer->context));
+    if (p_ble_consumer->context.key_cache) {
+        destroy_key_cache(p_ble_consumer->context.key_cache);
+    }
+
+    free(p_ble_consumer);
+    return 0;
+}
 
-        if (p_ble_consumer->context.key_cache) {
-            destroy_key_cache(p_ble_consumer->context.key_cache);
+// Adds an item to the deferred queue of its key
+int add_to_deferred_queue(ble_consumer *p_ble_consumer, pdu_pool_slot *slot, const uint16_t key_id) {
+    if (!p_ble_consumer || !slot) {
+        return -1;
+    }
+
+    int status = -1;
+    ble_consumer_context *context = &(p_ble_consumer->context);
+    // Sender budget - one sender cannot take over the shared pool
+    if (context->no_deferred_pdus < DEFERRED_QUEUE_SIZE) {
+        deferred_key_bucket *bucket = find_deferred_bucket(context, key_id);
+        if (bucket == NULL) {
+            bucket = claim_deferred_bucket(context, key_id);
         }
 
-        xSemaphoreGive(p_ble_consumer->xMutex);
+        if (bucket != NULL) {
+            push_to_pdu_pool_slot_list(&(bucket->list), slot);
+            context->no_deferred_pdus++;
+            status = 0;
+        }
     }
 
-    vSemaphoreDelete(p_ble_consumer->xMutex);
-    free(p_ble_consumer);
-    return 0;
+    return status;
 }
 
-// Adds an item to the deferred queue
-int add_to_deferred_queue(ble_consumer *p_ble_consumer, beacon_pdu_data *pdu) {
-    if (!p_ble_consumer || !pdu) {
+int set_deferred_key_release_pending(ble_consumer *p_ble_consumer, const uint16_t key_id) {
+    if (!p_ble_consumer) {
         return -1;
     }
 
-    if (xQueueSend(p_ble_consumer->context.deferredQueue, (void *)pdu, 0) == pdTRUE) {
-        xSemaphoreTake(p_ble_consumer->xMutex, portMAX_DELAY);
-        p_ble_consumer->context.deferred_queue_count++;
-        xSemaphoreGive(p_ble_consumer->xMutex);
-        return 0;
+    deferred_key_bucket *bucket = find_deferred_bucket(&(p_ble_consumer->context), key_id);
+    if (bucket == NULL) {
+        return -1;
     }
 
-    return -1;
+    bucket->release_pending = true;
+    return 0;
 }
 
-// Gets an item from the deferred queue
-bool get_deferred_queue_item(ble_consumer *p_ble_consumer, beacon_pdu_data *pdu) {
-    if (!p_ble_consumer || !pdu) {
+bool take_released_deferred_pdus(ble_consumer *p_ble_consumer, uint16_t *key_id, pdu_pool_slot_list *list) {
+    if (!p_ble_consumer || !key_id || !list) {
         return false;
     }
 
-    bool result = false;
-    if (xSemaphoreTake(p_ble_consumer->xMutex, portMAX_DELAY) == pdTRUE)
-    {
-        if (xQueueReceive(p_ble_consumer->context.deferredQueue, pdu, 0) == pdTRUE) {
-            if (p_ble_consumer->context.deferred_queue_count > 0) {
-                p_ble_consumer->context.deferred_queue_count--;
-            }
-            result = true;
+    ble_consumer_context *context = &(p_ble_consumer->context);
+    for (int i = 0; i < DEFERRED_KEY_BUCKETS; i++) {
+        deferred_key_bucket *bucket = &(context->deferred_buckets[i]);
+        if (bucket->in_use && bucket->release_pending) {
+            // Whole list is handed over, slots stay linked
+            *list = bucket->list;
+            *key_id = bucket->key_id;
+            context->no_deferred_pdus -= bucket->list.count;
+            init_pdu_pool_slot_list(&(bucket->list));
+            bucket->in_use = false;
+            bucket->release_pending = false;
+            return true;
         }
-        xSemaphoreGive(p_ble_consumer->xMutex);
-    }
-    else
-    {
-        ESP_LOGI("BLE_CONSUMER", "Failed to acquire semaphore while getting from deferred queue");
     }
 
-    return result;
+    return false;
 }
 
-// Checks if there is a pending deferred queue processing request
-bool is_deferred_queue_request_pending(ble_consumer *p_ble_consumer) {
+void drop_deferred_pdus_for_key(ble_consumer *p_ble_consumer, const uint16_t key_id) {
     if (!p_ble_consumer) {
-        return false;
-    }
-    bool is_pending = false;
-    if (xSemaphoreTake(p_ble_consumer->xMutex, portMAX_DELAY) == pdTRUE)
-    {
-        is_pending = p_ble_consumer->context.process_deferred_q_request_pending;
-        xSemaphoreGive(p_ble_consumer->xMutex);
+        return;
     }
 
-    return is_pending;
+    deferred_key_bucket *bucket = find_deferred_bucket(&(p_ble_consumer->context), key_id);
+    if (bucket != NULL) {
+        release_deferred_bucket(&(p_ble_consumer->context), bucket);
+    }
 }
 
 bool is_pdu_in_deferred_queue(ble_consumer *p_ble_consumer)
+{
+    return get_no_pdus_in_deferred_queue(p_ble_consumer) > 0;
+}
+
+bool is_pdu_for_key_in_deferred_queue(ble_consumer *p_ble_consumer, const uint16_t key_id)
 {
     if (!p_ble_consumer) {
         return false;
     }
 
-    bool is_pdu_in_deferred_queue = false;
-    if (xSemaphoreTake(p_ble_consumer->xMutex, portMAX_DELAY) == pdTRUE)
-    {
-        is_pdu_in_deferred_queue = p_ble_consumer->context.deferred_queue_count == 0 ? false : true;
-        xSemaphoreGive(p_ble_consumer->xMutex);
-    }
-    else
-    {
-        ESP_LOGE("BLE_CONSUMER", "Failed to acquire mutex for setting deferred queue request.");
-    }
-    return is_pdu_in_deferred_queue;
+    // Bez oczekujących pakietów nie trzeba przeszukiwać kubełków
+    return p_ble_consumer->context.no_deferred_pdus > 0 && find_deferred_bucket(&(p_ble_consumer->context), key_id) != NULL;
 }
 
-void set_deferred_q_pending_processing(ble_consumer* p_ble_consumer, const bool request)
+uint16_t get_no_pdus_in_deferred_queue(ble_consumer *p_ble_consumer)
 {
-    if (!p_ble_consumer || !p_ble_consumer->xMutex) {
-        ESP_LOGE("BLE_CONSUMER", "Invalid BLE consumer or mutex not initialized.");
-        return;
+    if (!p_ble_consumer) {
+        return 0;
     }
 
-    if (xSemaphoreTake(p_ble_consumer->xMutex, pdMS_TO_TICKS(100)) == pdTRUE) {
-    // Avoid redundant updates
-        if (p_ble_consumer->context.process_deferred_q_request_pending != request) {
-            p_ble_consumer->context.process_deferred_q_request_pending = request;
-        }
-        xSemaphoreGive(p_ble_consumer->xMutex);
-    }
-    else
-    {
-        ESP_LOGE("BLE_CONSUMER", "Failed to acquire mutex after timeout.");
-    }
+    return p_ble_consumer->context.no_deferred_pdus;
 }
-
-
@@ -1,9 +1,18 @@
 #include "ble_consumer_collection.h"
 #include "tick_count_timestamp.h"
+#include "config.h"
 #include "esp_log.h"
 #include <string.h>
 
-ble_consumer_collection * create_ble_consumer_collection(const uint8_t collection_size, const uint8_t sender_key_cache_size) {
+int clear_ble_consumer_from_collection(ble_consumer_collection * p_ble_consumer_collection, const uint16_t index);
+
+ble_consumer_collection * create_ble_consumer_collection(sender_registry *registry, const uint8_t sender_key_cache_size) {
+    if (registry == NULL) {
+        ESP_LOGE("BLE_COLLECTION", "Sender registry not provided!");
+        return NULL;
+    }
+
+    const uint16_t collection_size = get_max_senders(registry);
     ble_consumer_collection *p_collection = (ble_consumer_collection *)malloc(sizeof(ble_consumer_collection));
     if (p_collection == NULL) {
         ESP_LOGE("BLE_COLLECTION", "Failed to allocate memory for BLE consumer collection!");
@@ -11,48 +20,21 @@ ble_consumer_collection * create_ble_consumer_collection(const uint8_t collectio
     }
 
     p_collection->consumers_count = 0;
+    memset(&(p_collection->eviction_stats), 0, sizeof(sender_eviction_stats));
     p_collection->size = collection_size;
-    p_collection->xMutex = xSemaphoreCreateMutex();
-
-    if (p_collection->xMutex == NULL) {
-        ESP_LOGE("BLE_COLLECTION", "Failed to create mutex!");
-        free(p_collection);
-        return NULL;
-    }
+    p_collection->registry = registry;
+    p_collection->removed_cb = NULL;
+    p_collection->removed_cb_context = NULL;
 
-    p_collection->arr = (ble_consumer *)malloc(sizeof(ble_consumer) * collection_size);
+    // Struktury nadawców tworzone są dopiero po odebraniu pierwszego pakietu od nadawcy
+    p_collection->key_cache_size = sender_key_cache_size;
+    p_collection->arr = (ble_consumer **)calloc(collection_size, sizeof(ble_consumer *));
     if (p_collection->arr == NULL) {
         ESP_LOGE("BLE_COLLECTION", "Failed to allocate memory for BLE consumers!");
-        vSemaphoreDelete(p_collection->xMutex);
         free(p_collection);
         return NULL;
     }
 
-    for (int i = 0; i < collection_size; i++) {
-        if (create_ble_consumer_resources(&p_collection->arr[i], sender_key_cache_size) != 0) {
-            ESP_LOGE("BLE_COLLECTION", "Failed to create ble consumer resources!");
-            for (int j = 0; j < i; j++) {
-                destroy_ble_consumer(&p_collection->arr[j]);
-            }
-            free(p_collection->arr);
-            vSemaphoreDelete(p_collection->xMutex);
-            free(p_collection);
-            return NULL;
-        }
-
-        if ( init_ble_consumer(&p_collection->arr[i]) != 0)
-        {
-            ESP_LOGE("BLE_COLLECTION", "Failed to init ble consumer resources!");
-            for (int j = 0; j < i; j++) {
-                destroy_ble_consumer(&p_collection->arr[j]);
-            }
-            free(p_collection->arr);
-            vSemaphoreDelete(p_collection->xMutex);
-            free(p_collection);
-            return NULL;
-        }
-    }
-
     return p_collection;
 }
 
@@ -60,41 +42,81 @@ void destroy_ble_consumer_collection(ble_consumer_collection * p_ble_consumer_co
 {
     if (p_ble_consumer_collection != NULL)
     {
-        if (p_ble_consumer_collection->xMutex)
-        {
-            vSemaphoreDelete(p_ble_consumer_collection->xMutex);
-        }
-
         if (p_ble_consumer_collection->arr)
         {
             for (int i = p_ble_consumer_collection->size - 1; i >= 0; i--)
             {
-                destroy_ble_consumer(&p_ble_consumer_collection->arr[i]);
+                if (p_ble_consumer_collection->arr[i] != NULL)
+                {
+                    destroy_ble_consumer(p_ble_consumer_collection->arr[i]);
+                }
             }
-            free(p_ble_consumer_collection);
+            free(p_ble_consumer_collection->arr);
         }
+        free(p_ble_consumer_collection);
     }
 }
 
-int get_first_free_index(ble_consumer_collection * p_ble_consumer_collection)
+void register_consumer_removed_callback(ble_consumer_collection * p_ble_consumer_collection, consumer_removed_cb cb, void *context)
 {
-    int index = -1;
-    esp_bd_addr_t zer_mac_address = {0};
     if (p_ble_consumer_collection != NULL)
     {
-        if (p_ble_consumer_collection->consumers_count < p_ble_consumer_collection->size)
+        p_ble_consumer_collection->removed_cb = cb;
+        p_ble_consumer_collection->removed_cb_context = context;
+    }
+}
+
+static void notify_consumer_removed(ble_consumer_collection * p_ble_consumer_collection, ble_consumer * p_ble_consumer)
+{
+    if (p_ble_consumer_collection->removed_cb != NULL)
+    {
+        p_ble_consumer_collection->removed_cb(p_ble_consumer_collection->removed_cb_context, p_ble_consumer->mac_address_arr);
+    }
+}
+
+static ble_consumer * create_and_init_ble_consumer(const uint8_t key_cache_size)
+{
+    ble_consumer * p_ble_consumer = create_ble_consumer(key_cache_size);
+    if (p_ble_consumer != NULL && init_ble_consumer(p_ble_consumer) != 0) {
+        destroy_ble_consumer(p_ble_consumer);
+        p_ble_consumer = NULL;
+    }
+    return p_ble_consumer;
+}
+
+static int remove_lru_consumer(ble_consumer_collection * p_ble_consumer_collection)
+{
+    int lru_index = -1;
+    uint32_t lru_elapsed_ms = 0;
+
+    for (uint16_t i = 0; i < p_ble_consumer_collection->size; i++)
+    {
+        ble_consumer * p_ble_consumer = p_ble_consumer_collection->arr[i];
+        if (p_ble_consumer != NULL)
         {
-            for (int i = 0; i < p_ble_consumer_collection->size; i++)
+            uint32_t elapsed_ms = get_ms_elapsed_since_timestamp(&(p_ble_consumer->last_pdu_timestamp));
+            if (lru_index < 0 || elapsed_ms > lru_elapsed_ms)
             {
-                if (0 == memcmp(&(p_ble_consumer_collection->arr[i].mac_address_arr), zer_mac_address, sizeof(esp_bd_addr_t)))
-                {
-                    index = i;
-                    break;
-                }
+                lru_index = i;
+                lru_elapsed_ms = elapsed_ms;
             }
         }
     }
-    return index;
+
+    // Nadawca słyszany niedawno jest aktywny - nie wypieraj go
+    if (lru_index < 0 || lru_elapsed_ms < SENDER_EVICTION_MIN_IDLE_MS)
+    {
+        return -1;
+    }
+
+    clear_ble_consumer_from_collection(p_ble_consumer_collection, lru_index);
+    p_ble_consumer_collection->eviction_stats.lru_evictions++;
+    return lru_index;
+}
+
+static bool is_consumer_assigned_to_mac_addr(ble_consumer * p_ble_consumer, esp_bd_addr_t mac_address_arr)
+{
+    return p_ble_consumer != NULL && 0 == memcmp(&(p_ble_consumer->mac_address_arr), mac_address_arr, sizeof(esp_bd_addr_t));
 }
 
 int get_index_for_mac_addr(ble_consumer_collection * p_ble_consumer_collection, esp_bd_addr_t mac_address_arr)
@@ -102,53 +124,68 @@ int get_index_for_mac_addr(ble_consumer_collection * p_ble_consumer_collection,
     int index = -1;
     if (p_ble_consumer_collection != NULL && mac_address_arr != NULL)
     {
-        for (int i = 0; i < p_ble_consumer_collection->size; i++)
+        // Wyszukanie w tablicy haszującej rejestru nadawców zamiast przeglądania całej tablicy
+        index = get_sender_index(p_ble_consumer_collection->registry, mac_address_arr);
+        if (index >= 0 && is_consumer_assigned_to_mac_addr(p_ble_consumer_collection->arr[index], mac_address_arr) == false)
         {
-            if (0 == memcmp(&(p_ble_consumer_collection->arr[i].mac_address_arr), mac_address_arr, sizeof(esp_bd_addr_t)))
-            {
-                index = i;
-                break;
-            }
+            index = -1;
         }
     }
 
     return index;
 }
 
-ble_consumer * add_consumer_to_collection(ble_consumer_collection *p_collection, esp_bd_addr_t mac_address) {
+ble_consumer * add_consumer_to_collection(ble_consumer_collection *p_collection, const int sender_index, esp_bd_addr_t mac_address) {
 
     ble_consumer * p_ble_consumer = NULL;
 
     // Sprawdz parametry wejsciowe
     if (p_collection == NULL || mac_address == NULL) return p_ble_consumer;
 
-    // Pobierz semafor
-    if (xSemaphoreTake(p_collection->xMutex, portMAX_DELAY) != pdTRUE) {
+    // Indeks nadaje autoryzator - shard tylko sprawdza, czy indeks nadal należy do tego adresu MAC
+    if (sender_index < 0 || sender_index >= p_collection->size || get_sender_index(p_collection->registry, mac_address) != sender_index) {
+        ESP_LOGW("BLE_COLLECTION", "Sender index %i no longer assigned to the sender, dropping PDU", sender_index);
         return p_ble_consumer;
     }
 
-    // Pobierz pierwszy wolny indeks w tablicy z nadawcami
-    int index = get_first_free_index(p_collection);
-    if (index >= 0) {
-        // Wyczyść strukturę nadawcy
-        reset_ble_consumer(&p_collection->arr[index]);
+    const int index = sender_index;
+    if (is_consumer_assigned_to_mac_addr(p_collection->arr[index], mac_address)) {
+        p_ble_consumer = p_collection->arr[index];
+    } else {
+        if (p_collection->arr[index] == NULL) {
+            // Utwórz strukturę nadawcy przy pierwszym pakiecie od nadawcy
+            p_ble_consumer = create_and_init_ble_consumer(p_collection->key_cache_size);
+            if (p_ble_consumer == NULL && remove_lru_consumer(p_collection) >= 0) {
+                // Brak pamięci - zwolnij strukturę najdawniej słyszanego nadawcy i spróbuj ponownie
+                p_ble_consumer = create_and_init_ble_consumer(p_collection->key_cache_size);
+            }
 
-        // Przekopiuj adres MAC nadawcy
-        memcpy(p_collection->arr[index].mac_address_arr, mac_address, sizeof(esp_bd_addr_t));
+            if (p_ble_consumer != NULL) {
+                p_collection->arr[index] = p_ble_consumer;
 
-        // Zapisz znacznik czasu ostatniego uzycia struktury nadawcy
-        save_timestamp(&p_collection->arr[index].last_pdu_timestamp, &p_collection->arr[index].rollover);
+                // Zwieksz liczbe aktywnych nadawcow
+                p_collection->consumers_count++;
+            }
+        } else {
+            // Indeks przejęty po nadawcy wypartym z rejestru - wyczyść strukturę nadawcy
+            p_ble_consumer = p_collection->arr[index];
+            notify_consumer_removed(p_collection, p_ble_consumer);
+            reset_ble_consumer(p_ble_consumer);
+            p_collection->eviction_stats.lru_evictions++;
+        }
 
-        // Zwieksz liczbe aktywnych nadawcow
-        p_collection->consumers_count++;
+        if (p_ble_consumer != NULL) {
+            // Przekopiuj adres MAC nadawcy
+            memcpy(p_ble_consumer->mac_address_arr, mac_address, sizeof(esp_bd_addr_t));
 
-        p_ble_consumer = &(p_collection->arr[index]);
-    } else {
-        ESP_LOGE("BLE_COLLECTION", "No space available for new consumer!");
+            // Zapisz znacznik czasu ostatniego uzycia struktury nadawcy
+            save_timestamp(&p_ble_consumer->last_pdu_timestamp, &p_ble_consumer->rollover);
+        } else {
+            ESP_LOGE("BLE_COLLECTION", "Failed to create consumer resources!");
+            p_collection->eviction_stats.rejected_senders++;
+        }
     }
 
-    // Zwolnij Mutex
-    xSemaphoreGive(p_collection->xMutex);
     return p_ble_consumer;
 }
 
@@ -159,64 +196,111 @@ ble_consumer * get_ble_consumer_from_collection(ble_consumer_collection * p_ble_
     // Sprawdz parametry wejsciowe
     if (p_ble_consumer_collection != NULL && mac_address_arr != NULL)
     {
-        // Pobierz Mutex
-        if (xSemaphoreTake(p_ble_consumer_collection->xMutex, portMAX_DELAY) == pdTRUE)
+        // Wyszukaj indeks nadawcy w tablicy na podstawie adresu MAC nadawcy
+        int index = get_index_for_mac_addr(p_ble_consumer_collection, mac_address_arr);
+
+        if (index >= 0)
         {
-            // Wyszukaj indeks nadawcy w tablicy na podstawie adresu MAC nadawcy
-            int index = get_index_for_mac_addr(p_ble_consumer_collection, mac_address_arr);
+            // Zapisz wskaznik na strukture nadawcy
+            p_ble_consumer = p_ble_consumer_collection->arr[index];
 
-            if (index >= 0)
-            {
-                // Zapisz wskaznik na strukture nadawcy
-                p_ble_consumer = &(p_ble_consumer_collection->arr[index]);
+            // Zapisz znacznik czasowy ostatniego uzycia
+            save_timestamp(&(p_ble_consumer->last_pdu_timestamp), &(p_ble_consumer->rollover));
+        }
+    }
 
-                // Zapisz znacznik czasowy ostatniego uzycia
-                save_timestamp(&(p_ble_consumer_collection->arr[index].last_pdu_timestamp), &(p_ble_consumer_collection->arr[index].rollover));
-            }
+    return p_ble_consumer;
+
+}
+
+ble_consumer * get_ble_consumer_for_sender_index(ble_consumer_collection * p_ble_consumer_collection, const int sender_index, esp_bd_addr_t mac_address_arr)
+{
+    ble_consumer * p_ble_consumer = NULL;
+
+    // Sprawdz parametry wejsciowe
+    if (p_ble_consumer_collection != NULL && mac_address_arr != NULL && sender_index >= 0 && sender_index < p_ble_consumer_collection->size)
+    {
+        // Struktura nadawcy mogła nie zostać jeszcze przypisana do tego indeksu
+        if (is_consumer_assigned_to_mac_addr(p_ble_consumer_collection->arr[sender_index], mac_address_arr))
+        {
+            p_ble_consumer = p_ble_consumer_collection->arr[sender_index];
 
-            // Zwolnij Mutex
-            xSemaphoreGive(p_ble_consumer_collection->xMutex);
+            // Zapisz znacznik czasowy ostatniego uzycia
+            save_timestamp(&(p_ble_consumer->last_pdu_timestamp), &(p_ble_consumer->rollover));
         }
     }
 
     return p_ble_consumer;
-
 }
 
-int clear_ble_consumer_from_collection(ble_consumer_collection * p_ble_consumer_collection, const uint8_t index)
+int clear_ble_consumer_from_collection(ble_consumer_collection * p_ble_consumer_collection, const uint16_t index)
 {
     int status = -1;
-    if (p_ble_consumer_collection != NULL)
+    if (p_ble_consumer_collection != NULL && p_ble_consumer_collection->arr[index] != NULL)
     {
-        // Wyczyść strukturę nadawcy
-        reset_ble_consumer(&(p_ble_consumer_collection->arr[index]));
+        // Zwolnij strukturę nadawcy razem z odroczonymi pakietami
+        notify_consumer_removed(p_ble_consumer_collection, p_ble_consumer_collection->arr[index]);
+        destroy_ble_consumer(p_ble_consumer_collection->arr[index]);
+        p_ble_consumer_collection->arr[index] = NULL;
 
         // Dekrementuj liczbe aktywnych nadawcow
         p_ble_consumer_collection->consumers_count--;
+        status = 0;
     }
     return status;
 }
 
+ble_consumer * get_ble_consumer_at_index(ble_consumer_collection * p_ble_consumer_collection, const uint16_t index)
+{
+    ble_consumer * p_ble_consumer = NULL;
+
+    if (p_ble_consumer_collection != NULL && index < p_ble_consumer_collection->size)
+    {
+        p_ble_consumer = p_ble_consumer_collection->arr[index];
+    }
+
+    return p_ble_consumer;
+}
+
+int remove_idle_consumers_from_collection(ble_consumer_collection * p_ble_consumer_collection, const uint32_t idle_timeout_ms)
+{
+    int removed_consumers = 0;
+
+    if (p_ble_consumer_collection == NULL)
+    {
+        return removed_consumers;
+    }
+
+    for (uint16_t i = 0; i < p_ble_consumer_collection->size; i++)
+    {
+        ble_consumer * p_ble_consumer = p_ble_consumer_collection->arr[i];
+        if (p_ble_consumer != NULL && get_ms_elapsed_since_timestamp(&(p_ble_consumer->last_pdu_timestamp)) >= idle_timeout_ms)
+        {
+            ESP_LOGI("BLE_COLLECTION", "Reclaiming idle consumer %02x:%02x:%02x:%02x:%02x:%02x",
+                p_ble_consumer->mac_address_arr[0], p_ble_consumer->mac_address_arr[1], p_ble_consumer->mac_address_arr[2],
+                p_ble_consumer->mac_address_arr[3], p_ble_consumer->mac_address_arr[4], p_ble_consumer->mac_address_arr[5]);
+            clear_ble_consumer_from_collection(p_ble_consumer_collection, i);
+            p_ble_consumer_collection->eviction_stats.idle_evictions++;
+            removed_consumers++;
+        }
+    }
+
+    return removed_consumers;
+}
+
 int remove_consumer_from_collection(ble_consumer_collection * p_ble_consumer_collection, esp_bd_addr_t mac_address_arr)
 {
     int status = -1;
     // Sprawdz parametry wejsciowe
     if (p_ble_consumer_collection != NULL && mac_address_arr != NULL)
     {
-        // Pobierz Mutex
-        if (xSemaphoreTake(p_ble_consumer_collection->xMutex, portMAX_DELAY) == pdTRUE)
-        {
-            // Wyszukaj indeks nadawcy w tablicy na podstawie adresu MAC nadawcy
-            int index = get_index_for_mac_addr(p_ble_consumer_collection, mac_address_arr);
-
-            if (index >= 0)
-            {
-                // Wyczysc strukture nadawcy
-                clear_ble_consumer_from_collection(p_ble_consumer_collection, index);
-            }
+        // Wyszukaj indeks nadawcy w tablicy na podstawie adresu MAC nadawcy
+        int index = get_index_for_mac_addr(p_ble_consumer_collection, mac_address_arr);
 
-            // Zwolnij Mutex
-            xSemaphoreGive(p_ble_consumer_collection->xMutex);
+        if (index >= 0)
+        {
+            // Wyczysc strukture nadawcy
+            clear_ble_consumer_from_collection(p_ble_consumer_collection, index);
         }
         status = 0;
     }
@@ -232,15 +316,8 @@ int get_active_no_consumers(ble_consumer_collection * p_ble_consumer_collection)
         return active_consumers_count;
     }
 
-    // Pobierz Mutex
-    if (xSemaphoreTake(p_ble_consumer_collection->xMutex, portMAX_DELAY) == pdTRUE)
-    {
-        // Odczytaj liczbe aktywnych nadawcow
-        active_consumers_count = p_ble_consumer_collection->consumers_count;
-
-        // Zwolnij Mutex
-        xSemaphoreGive(p_ble_consumer_collection->xMutex);
-    }
+    // Odczytaj liczbe aktywnych nadawcow
+    active_consumers_count = p_ble_consumer_collection->consumers_count;
 
     return active_consumers_count;
 }
@@ -248,5 +325,19 @@ int get_active_no_consumers(ble_consumer_collection * p_ble_consumer_collection)
 
 int remove_lru_consumer_from_collection(ble_consumer_collection * p_ble_consumer_collection)
 {
-    return -1;
+    int removed_index = -1;
+    if (p_ble_consumer_collection != NULL)
+    {
+        removed_index = remove_lru_consumer(p_ble_consumer_collection);
+    }
+    return removed_index;
+}
+
+void get_consumer_collection_eviction_stats(ble_consumer_collection * p_ble_consumer_collection, sender_eviction_stats *stats)
+{
+    // Odczyt z innego zadania - liczniki 32-bitowe, wartości mogą być spóźnione o kilka zdarzeń
+    if (p_ble_consumer_collection != NULL && stats != NULL)
+    {
+        *stats = p_ble_consumer_collection->eviction_stats;
+    }
 }
@@ -7,6 +7,9 @@
 
 static const char *KEY_CACHE_LOG_GROUP = "KEY CACHE LOG";
 
+static int get_key_index_and_mark_used(key_reconstruction_cache * const key_cache, uint16_t key_id);
+int remove_key_from_cache_at_index(key_reconstruction_cache * const key_cache, uint8_t index);
+
 int create_key_cache(key_reconstruction_cache ** key_cache, const uint8_t cache_size)
 {
     int status = 0;
@@ -18,7 +21,6 @@ int create_key_cache(key_reconstruction_cache ** key_cache, const uint8_t cache_
         (*key_cache)->cache_size = cache_size;
         (*key_cache)->last_key_id_used = -1;
         (*key_cache)->last_key_index_in_map = -1;
-        (*key_cache)->xMutexCacheAccess = NULL;
         
         if ((*key_cache)->map == NULL)
         {
@@ -50,11 +52,14 @@ int destroy_key_cache(key_reconstruction_cache * const key_cache)
     }
     else
     {
-        vSemaphoreDelete(key_cache->xMutexCacheAccess);
         for (int i = 0; i < key_cache->cache_size; i++)
         {
-            free(&(key_cache->map[i]));
+            if (key_cache->map[i].in_use)
+            {
+                free_aes_key_schedule(&(key_cache->map[i].key_schedule));
+            }
         }
+        free(key_cache->map);
         free(key_cache);
     }
     return status;
@@ -69,36 +74,22 @@ int init_key_cache(key_reconstruction_cache * key_cache)
         return -3;
     }
 
-    key_cache->xMutexCacheAccess = xSemaphoreCreateMutex();
-
-    if (key_cache->xMutexCacheAccess == NULL) {
-        status = -1;
-        ESP_LOGE(KEY_CACHE_LOG_GROUP, "Failed to create Key reconstruction Cache!");
-    }
-    else
+    //Init cache
+    for (int i = 0; i < key_cache->cache_size; i++)
     {
-        if (xSemaphoreTake(key_cache->xMutexCacheAccess, portMAX_DELAY))
-        {   
-            //Init cache
-            for (int i = 0; i < key_cache->cache_size; i++)
-            {
-                key_cache->map[i].key_id = 0;
-                reset_timestamp(&(key_cache->map[i].last_used_timestamp), &(key_cache->map[i].rollover));
-                memset(&(key_cache->map[i].key), 0, sizeof(key_cache->map[i].key));
-            }
-            xSemaphoreGive(key_cache->xMutexCacheAccess); // Release the mutex
-        }
-        else
-        {
-            ESP_LOGE(KEY_CACHE_LOG_GROUP, "Failed to acquire mutex for cache access");
-            status = -2; // Mutex acquisition failure
-        }
+        key_cache->map[i].in_use = false;
+        key_cache->map[i].key_id = 0;
+        reset_timestamp(&(key_cache->map[i].last_used_timestamp), &(key_cache->map[i].rollover));
+        memset(&(key_cache->map[i].key), 0, sizeof(key_cache->map[i].key));
+        memset(&(key_cache->map[i].key_schedule), 0, sizeof(key_cache->map[i].key_schedule));
     }
+    key_cache->last_key_id_used = -1;
+    key_cache->last_key_index_in_map = -1;
 
     return status;
 }
 
-int add_key_to_cache(key_reconstruction_cache * const key_cache, key_128b * key, uint8_t key_id)
+int add_key_to_cache(key_reconstruction_cache * const key_cache, key_128b * key, uint16_t key_id)
 {
     if (key_cache == NULL || key == NULL)
     {
@@ -109,99 +100,106 @@ int add_key_to_cache(key_reconstruction_cache * const key_cache, key_128b * key,
     int first_free_index = -1;
     bool key_is_already_in_cache = false;
 
-    if (xSemaphoreTake(key_cache->xMutexCacheAccess, portMAX_DELAY))
+    for (int i = 0; i < key_cache->cache_size; i++)
     {
-        for (int i = 0; i < key_cache->cache_size; i++)
+        if (!key_cache->map[i].in_use)
         {
-            if (key_cache->map[i].key_id == 0 && first_free_index < 0)
+            if (first_free_index < 0)
             {
                 first_free_index = i;
             }
-            else if (key_cache->map[i].key_id == key_id)
-            {
-                key_is_already_in_cache = true;
-            }
         }
-
-        if (first_free_index < 0)
+        else if (key_cache->map[i].key_id == key_id)
         {
-            status = -1; 
-        }
-        else if (key_is_already_in_cache == true)
-        {
-            status = 0;
-        }
-        else
-        {
-            save_timestamp(&(key_cache->map[first_free_index].last_used_timestamp), &(key_cache->map[first_free_index].rollover));
-            key_cache->map[first_free_index].key_id = key_id;
-            memcpy(&(key_cache->map[first_free_index].key), key, sizeof(key_cache->map[first_free_index].key));
-            status = 0;
-            if (key_cache->last_key_id_used == -1 && key_cache->last_key_index_in_map == -1)
-            {
-                key_cache->last_key_id_used = key_id;
-                key_cache->last_key_index_in_map = first_free_index;
-            }
+            key_is_already_in_cache = true;
         }
+    }
 
-        xSemaphoreGive(key_cache->xMutexCacheAccess); // Release the mutex
+    if (first_free_index < 0)
+    {
+        status = -1; 
+    }
+    else if (key_is_already_in_cache == true)
+    {
+        status = 0;
+    }
+    else if (init_aes_key_schedule(&(key_cache->map[first_free_index].key_schedule), key->key) != 0)
+    {
+        ESP_LOGE(KEY_CACHE_LOG_GROUP, "Failed to expand AES key for key id: %i", key_id);
+        status = -4;
     }
     else
     {
-        ESP_LOGE(KEY_CACHE_LOG_GROUP, "Failed to acquire mutex for cache access");
-        status = -2; // Mutex acquisition failure
+        save_timestamp(&(key_cache->map[first_free_index].last_used_timestamp), &(key_cache->map[first_free_index].rollover));
+        key_cache->map[first_free_index].key_id = key_id;
+        key_cache->map[first_free_index].in_use = true;
+        memcpy(&(key_cache->map[first_free_index].key), key, sizeof(key_cache->map[first_free_index].key));
+        status = 0;
+        if (key_cache->last_key_id_used == -1 && key_cache->last_key_index_in_map == -1)
+        {
+            key_cache->last_key_id_used = key_id;
+            key_cache->last_key_index_in_map = first_free_index;
+        }
     }
 
     return status;
 
 }
 
-int remove_key_from_cache(key_reconstruction_cache * const key_cache, uint8_t key_id)
+int remove_key_from_cache(key_reconstruction_cache * const key_cache, uint16_t key_id)
 {
     if (key_cache == NULL)
     {
         return -3;
     }
 
-    int status = 0;
-    if (xSemaphoreTake(key_cache->xMutexCacheAccess, portMAX_DELAY))
+    int key_index_in_map = -1;
+    for (int i = 0; i < key_cache->cache_size; i++)
     {
-        int key_index_in_map = -1;
-        for (int i = 0; i < key_cache->cache_size; i++)
+        if (key_cache->map[i].in_use && key_cache->map[i].key_id == key_id)
         {
-            if (key_cache->map[i].key_id == key_id)
-            {
-                key_index_in_map = i;
-                break;
-            }
+            key_index_in_map = i;
+            break;
         }
+    }
 
-        if (key_index_in_map >= 0)
-        {
-            reset_timestamp(&(key_cache->map[key_index_in_map].last_used_timestamp), &(key_cache->map[key_index_in_map].rollover));
-            key_cache->map[key_index_in_map].key_id = 0;
-            memset(&(key_cache->map[key_index_in_map].key), 0, sizeof(key_cache->map[key_index_in_map].key));
+    if (key_index_in_map >= 0)
+    {
+        remove_key_from_cache_at_index(key_cache, key_index_in_map);
+    }
 
-            if (key_id == key_cache->last_key_id_used)
-            {
-                key_cache->last_key_id_used = -1;
-                key_cache->last_key_index_in_map = -1;
-            }
+    return 0;
+}
 
-        }
+static int get_key_index_and_mark_used(key_reconstruction_cache * const key_cache, uint16_t key_id)
+{
+    if (key_id == key_cache->last_key_id_used && key_cache->last_key_index_in_map >= 0)
+    {
+        save_timestamp(&(key_cache->map[key_cache->last_key_index_in_map].last_used_timestamp), &(key_cache->map[key_cache->last_key_index_in_map].rollover));
+        return key_cache->last_key_index_in_map;
+    }
 
-        xSemaphoreGive(key_cache->xMutexCacheAccess); // Release the mutex
+    int key_index_in_map = -1;
+    for (int i = 0; i < key_cache->cache_size; i++)
+    {
+        if (key_cache->map[i].in_use && key_cache->map[i].key_id == key_id)
+        {
+            key_index_in_map = i;
+            break;
+        }
     }
-    else
+
+    if (key_index_in_map >= 0)
     {
-        ESP_LOGE(KEY_CACHE_LOG_GROUP, "Failed to acquire mutex for cache access");
-        status = -2; // Mutex acquisition failure
+        key_cache->last_key_id_used = key_id;
+        key_cache->last_key_index_in_map = key_index_in_map;
+        save_timestamp(&(key_cache->map[key_index_in_map].last_used_timestamp), &(key_cache->map[key_index_in_map].rollover));
     }
 
-    return status;
+    return key_index_in_map;
 }
 
-const key_128b* get_key_from_cache(key_reconstruction_cache * const key_cache, uint8_t key_id)
+const key_128b* get_key_from_cache(key_reconstruction_cache * const key_cache, uint16_t key_id)
 {
 
     key_128b* key = NULL;
@@ -211,46 +209,34 @@ const key_128b* get_key_from_cache(key_reconstruction_cache * const key_cache, u
         return key;
     }
 
-    if (xSemaphoreTake(key_cache->xMutexCacheAccess, portMAX_DELAY))
+    int key_index_in_map = get_key_index_and_mark_used(key_cache, key_id);
+    if (key_index_in_map >= 0)
     {
-        if (key_id == key_cache->last_key_id_used && key_cache->last_key_index_in_map >= 0)
-        {
-            key = &(key_cache->map[key_cache->last_key_index_in_map].key);
-            save_timestamp(&(key_cache->map[key_cache->last_key_index_in_map].last_used_timestamp), &(key_cache->map[key_cache->last_key_index_in_map].rollover));
-            xSemaphoreGive(key_cache->xMutexCacheAccess); // Release the mutex
-            return key;
-        }
-
+        key = &(key_cache->map[key_index_in_map].key);
+    }
 
-        int key_index_in_map = -1;
-        for (int i = 0; i < key_cache->cache_size; i++)
-        {
-            if (key_cache->map[i].key_id == key_id)
-            {
-                key_index_in_map = i;
-                break;
-            }
-        }
+    return key;
+}
 
-        if (key_index_in_map >= 0)
-        {
-            key = &(key_cache->map[key_index_in_map].key);
-            key_cache->last_key_id_used = key_id;
-            key_cache->last_key_index_in_map = key_index_in_map;
-            save_timestamp(&(key_cache->map[key_index_in_map].last_used_timestamp), &(key_cache->map[key_index_in_map].rollover));
-        }
+aes_key_schedule* get_key_schedule_from_cache(key_reconstruction_cache * const key_cache, uint16_t key_id)
+{
+    aes_key_schedule* key_schedule = NULL;
 
-        xSemaphoreGive(key_cache->xMutexCacheAccess); // Release the mutex
+    if (key_cache == NULL)
+    {
+        return key_schedule;
     }
-    else
+
+    int key_index_in_map = get_key_index_and_mark_used(key_cache, key_id);
+    if (key_index_in_map >= 0)
     {
-        ESP_LOGE(KEY_CACHE_LOG_GROUP, "Failed to acquire mutex for cache access");
-    } 
+        key_schedule = &(key_cache->map[key_index_in_map].key_schedule);
+    }
 
-    return key;
+    return key_schedule;
 }
 
-bool is_key_in_cache(key_reconstruction_cache * const key_cache, uint8_t key_id)
+bool is_key_in_cache(key_reconstruction_cache * const key_cache, uint16_t key_id)
 {
 
     bool status = false;
@@ -261,29 +247,20 @@ bool is_key_in_cache(key_reconstruction_cache * const key_cache, uint8_t key_id)
     }
 
 
-    if (xSemaphoreTake(key_cache->xMutexCacheAccess, portMAX_DELAY))
+    if (key_id == key_cache->last_key_id_used && key_cache->last_key_index_in_map >=0)
     {
-
-        if (key_id == key_cache->last_key_id_used && key_cache->last_key_index_in_map >=0)
-        {
-            status = true;
-        }
-        else
+        status = true;
+    }
+    else
+    {
+        for (int i = 0; i < key_cache->cache_size; i++)
         {
-            for (int i = 0; i < key_cache->cache_size; i++)
+            if (key_cache->map[i].in_use && key_cache->map[i].key_id == key_id)
             {
-                if (key_cache->map[i].key_id == key_id)
-                {
-                    status = true;
-                    break;
-                }
+                status = true;
+                break;
             }
         }
-        xSemaphoreGive(key_cache->xMutexCacheAccess); // Release the mutex
-    }
-    else
-    {
-        ESP_LOGE(KEY_CACHE_LOG_GROUP, "Failed to acquire mutex for cache access");
     }
 
     return status;
@@ -298,31 +275,27 @@ int remove_key_from_cache_at_index(key_reconstruction_cache * const key_cache, u
         return -3;
     }
 
-    if (xSemaphoreTake(key_cache->xMutexCacheAccess, portMAX_DELAY))
+    if (index >= key_cache->cache_size)
     {
-
-        if (index > key_cache->cache_size)
+        status = -1;
+    }
+    else
+    {
+        const bool was_in_use = key_cache->map[index].in_use;
+        reset_timestamp(&(key_cache->map[index].last_used_timestamp), &(key_cache->map[index].rollover));
+        key_cache->map[index].in_use = false;
+        key_cache->map[index].key_id = 0;
+        memset(&(key_cache->map[index].key), 0, sizeof(key_cache->map[index].key));
+        if (was_in_use)
         {
-            status = -1;
+            free_aes_key_schedule(&(key_cache->map[index].key_schedule));
         }
-        else
-        {
-            uint8_t key_id = key_cache->map[index].key_id;
-            reset_timestamp(&(key_cache->map[index].last_used_timestamp), &(key_cache->map[index].rollover));
-            key_cache->map[index].key_id = 0;
-            memset(&(key_cache->map[index].key), 0, sizeof(key_cache->map[index].key));
 
-            if (key_id == key_cache->last_key_id_used)
-            {
-                key_cache->last_key_id_used = -1;
-                key_cache->last_key_index_in_map = -1;
-            }
+        if (index == key_cache->last_key_index_in_map)
+        {
+            key_cache->last_key_id_used = -1;
+            key_cache->last_key_index_in_map = -1;
         }
-        xSemaphoreGive(key_cache->xMutexCacheAccess); // Release the mutex
-    }
-    else
-    {
-        ESP_LOGE(KEY_CACHE_LOG_GROUP, "Failed to acquire mutex for cache access");
     }
 
     return status;
@@ -339,26 +312,25 @@ int remove_lru_key_from_cache(key_reconstruction_cache * const key_cache)
     uint64_t min_combined_timestamp = UINT64_MAX;
 
 
-    if (xSemaphoreTake(key_cache->xMutexCacheAccess, portMAX_DELAY))
+    for (int i = 0; i < key_cache->cache_size; i++)
     {
-        for (int i = 0; i < key_cache->cache_size; i++)
+        uint64_t combined_timestamp = get_timestamp(&(key_cache->map[i].last_used_timestamp), &(key_cache->map[i].rollover));
+        if (combined_timestamp < min_combined_timestamp && key_cache->map[i].in_use)
         {
-            uint64_t combined_timestamp = get_timestamp(&(key_cache->map[i].last_used_timestamp), &(key_cache->map[i].rollover));
-            if (combined_timestamp < min_combined_timestamp && key_cache->map[i].key_id != 0)
-            {
-                min_combined_timestamp = combined_timestamp;
-                lru_index = i;
-            }
+            min_combined_timestamp = combined_timestamp;
+            lru_index = i;
         }
-        xSemaphoreGive(key_cache->xMutexCacheAccess); // Release the mutex
     }
 
-    if (lru_index >= 0)
+    if (lru_index < 0)
     {
-        remove_key_from_cache_at_index(key_cache, lru_index);
+        return -1; // No keys found
     }
 
-    return lru_index; // No keys found
+    // Zwracany ID klucza - odroczone pakiety usuwanego klucza są odrzucane po ID
+    const int lru_key_id = key_cache->map[lru_index].key_id;
+    remove_key_from_cache_at_index(key_cache, lru_index);
+    return lru_key_id;
 }
 
 bool clear_cache(key_reconstruction_cache * const key_cache)
@@ -6,9 +6,9 @@
 
 static const char* KEY_MNGMT_GROUP = "KEY_MANAGEMENT_GROUP";
 
-int get_key_index_in_collection(key_reconstruction_collection* key_collection, const esp_bd_addr_t consumer_mac_address, uint8_t key_id);
+int get_key_index_in_collection(key_reconstruction_collection* key_collection, const esp_bd_addr_t consumer_mac_address, uint16_t key_id);
 
-key_reconstruction_collection* create_new_key_collection(const size_t key_collection_size)
+static key_reconstruction_collection* allocate_key_collection(const size_t key_collection_size)
 {
     key_reconstruction_collection* p_key_collection = NULL;
     p_key_collection = (key_reconstruction_collection*) malloc(sizeof(key_reconstruction_collection));
@@ -23,7 +23,16 @@ key_reconstruction_collection* create_new_key_collection(const size_t key_collec
             free(p_key_collection);
             return NULL;
         }
+    }
+
+    return p_key_collection;
+}
 
+key_reconstruction_collection* create_new_key_collection(const size_t key_collection_size)
+{
+    key_reconstruction_collection* p_key_collection = allocate_key_collection(key_collection_size);
+    if (p_key_collection != NULL)
+    {
         p_key_collection->xMutex = xSemaphoreCreateRecursiveMutex();
         if (p_key_collection->xMutex == NULL) {
             ESP_LOGE(KEY_MNGMT_GROUP, "Failed to create mutex for key collection!");
@@ -36,16 +45,48 @@ key_reconstruction_collection* create_new_key_collection(const size_t key_collec
     return p_key_collection;
 }
 
-void remove_key_from_collection(key_reconstruction_collection* key_collection, const esp_bd_addr_t consumer_mac_address, uint8_t key_id)
+key_reconstruction_collection* create_task_owned_key_collection(const size_t key_collection_size)
+{
+    return allocate_key_collection(key_collection_size);
+}
+
+// Collection owned by one task has no mutex, every access comes from the owner
+static bool lock_key_collection(key_reconstruction_collection* key_collection)
+{
+    return key_collection->xMutex == NULL || xSemaphoreTake(key_collection->xMutex, portMAX_DELAY) == pdTRUE;
+}
+
+static void unlock_key_collection(key_reconstruction_collection* key_collection)
+{
+    if (key_collection->xMutex != NULL)
+    {
+        xSemaphoreGive(key_collection->xMutex);
+    }
+}
+
+void destroy_key_collection(key_reconstruction_collection* key_collection)
 {
-    if (xSemaphoreTake(key_collection->xMutex, portMAX_DELAY))
+    if (key_collection != NULL)
+    {
+        if (key_collection->xMutex != NULL)
+        {
+            vSemaphoreDelete(key_collection->xMutex);
+        }
+        free(key_collection->km);
+        free(key_collection);
+    }
+}
+
+void remove_key_from_collection(key_reconstruction_collection* key_collection, const esp_bd_addr_t consumer_mac_address, uint16_t key_id)
+{
+    if (lock_key_collection(key_collection))
     {
         int key_index_in_collection = get_key_index_in_collection(key_collection, consumer_mac_address, key_id);
         if (key_index_in_collection >= 0)
         {
             memset(&(key_collection->km[key_index_in_collection]), 0, sizeof(key_management));
         }
-        xSemaphoreGive(key_collection->xMutex);
+        unlock_key_collection(key_collection);
     }
     else
     {
@@ -53,7 +94,31 @@ void remove_key_from_collection(key_reconstruction_collection* key_collection, c
     }
 }
 
-bool reconstruct_key_from_key_fragments(key_reconstruction_collection* key_collection, key_128b* km, const esp_bd_addr_t consumer_mac_address, uint8_t key_id)
+void remove_sender_keys_from_collection(key_reconstruction_collection* key_collection, const esp_bd_addr_t consumer_mac_address)
+{
+    if (key_collection == NULL || consumer_mac_address == NULL)
+    {
+        return;
+    }
+
+    if (lock_key_collection(key_collection))
+    {
+        for (int i = 0; i < key_collection->key_management_size; i++)
+        {
+            if (key_collection->km[i].in_use && memcmp(key_collection->km[i].consumer_mac_address, consumer_mac_address, sizeof(esp_bd_addr_t)) == 0)
+            {
+                memset(&(key_collection->km[i]), 0, sizeof(key_management));
+            }
+        }
+        unlock_key_collection(key_collection);
+    }
+    else
+    {
+        ESP_LOGE(KEY_MNGMT_GROUP, "Failed to acquire mutex for removing sender keys.");
+    }
+}
+
+bool reconstruct_key_from_key_fragments(key_reconstruction_collection* key_collection, key_128b* km, const esp_bd_addr_t consumer_mac_address, uint16_t key_id)
 {
     bool key_reconstruction_result = false;
 
@@ -65,13 +130,28 @@ bool reconstruct_key_from_key_fragments(key_reconstruction_collection* key_colle
 
     if (is_key_available(key_collection, consumer_mac_address, key_id) == true)
     {   
-        if (xSemaphoreTake(key_collection->xMutex, portMAX_DELAY))
+        if (lock_key_collection(key_collection))
         {
             int key_index_in_collection = get_key_index_in_collection(key_collection, consumer_mac_address, key_id);
-            get_128b_key_from_fragments(&(key_collection->km[key_index_in_collection].key), &(key_collection->km[key_index_in_collection].key_fragments));
-            memcpy(km, &(key_collection->km[key_index_in_collection].key), sizeof(key_128b));
-            key_reconstruction_result = true;
-            xSemaphoreGive(key_collection->xMutex);
+            key_management *key_mngmt = &(key_collection->km[key_index_in_collection]);
+
+            // Any NO_KEY_FRAGMENTS coded fragments identify the key, missing key fragments are solved from parity ones
+            uint8_t received_mask = 0;
+            for (uint8_t i = 0; i < NO_CODED_KEY_FRAGMENTS; i++)
+            {
+                if (key_mngmt->decrypted_key_fragments[i] == true)
+                {
+                    received_mask |= (uint8_t) (1u << i);
+                }
+            }
+
+            if (decode_key_fragments(key_mngmt->coded_fragments, received_mask, &(key_mngmt->key_fragments)) == true)
+            {
+                get_128b_key_from_fragments(&(key_mngmt->key), &(key_mngmt->key_fragments));
+                memcpy(km, &(key_mngmt->key), sizeof(key_128b));
+                key_reconstruction_result = true;
+            }
+            unlock_key_collection(key_collection);
         }
         else
         {
@@ -81,13 +161,13 @@ bool reconstruct_key_from_key_fragments(key_reconstruction_collection* key_colle
     return key_reconstruction_result;
 }
 
-bool is_key_in_collection(key_reconstruction_collection* key_collection, const esp_bd_addr_t consumer_mac_address, uint8_t key_id)
+bool is_key_in_collection(key_reconstruction_collection* key_collection, const esp_bd_addr_t consumer_mac_address, uint16_t key_id)
 {
     bool result = false;
-    if (xSemaphoreTake(key_collection->xMutex, portMAX_DELAY))
+    if (lock_key_collection(key_collection))
     {
         result = get_key_index_in_collection(key_collection, consumer_mac_address, key_id) >= 0 ? true : false;
-        xSemaphoreGive(key_collection->xMutex);
+        unlock_key_collection(key_collection);
     }
     else
     {
@@ -96,7 +176,7 @@ bool is_key_in_collection(key_reconstruction_collection* key_collection, const e
     return result;
 }
 
-bool add_new_key_to_collection(key_reconstruction_collection* key_collection, esp_bd_addr_t consumer_mac_address, uint8_t key_id)
+bool add_new_key_to_collection(key_reconstruction_collection* key_collection, esp_bd_addr_t consumer_mac_address, uint16_t key_id)
 {
     bool result = false;
 
@@ -105,19 +185,41 @@ bool add_new_key_to_collection(key_reconstruction_collection* key_collection, es
         return result;
     }
 
-    if (xSemaphoreTake(key_collection->xMutex, portMAX_DELAY))
+    if (lock_key_collection(key_collection))
     {
+        int free_index = -1;
+        int oldest_index = -1;
         for (int i = 0; i < key_collection->key_management_size; i++)
         {
-            if (key_collection->km[i].key_id == 0)
+            if (key_collection->km[i].in_use == false)
             {
-                key_collection->km[i].key_id = key_id;
-                memcpy(key_collection->km[i].consumer_mac_address, consumer_mac_address, sizeof(esp_bd_addr_t));
-                result = true;
+                free_index = i;
                 break;
             }
+
+            if (oldest_index < 0 || (int32_t) (key_collection->km[i].last_update_sequence - key_collection->km[oldest_index].last_update_sequence) < 0)
+            {
+                oldest_index = i;
+            }
         }
-        xSemaphoreGive(key_collection->xMutex);
+
+        // Kolekcja pełna - najdawniej uzupełniany wpis należy do nadawcy, który odszedł, albo klucza, który przegapił rotację
+        if (free_index < 0 && oldest_index >= 0)
+        {
+            ESP_LOGD(KEY_MNGMT_GROUP, "Key collection full, dropping key ID %d in reconstruction", key_collection->km[oldest_index].key_id);
+            free_index = oldest_index;
+        }
+
+        if (free_index >= 0)
+        {
+            memset(&(key_collection->km[free_index]), 0, sizeof(key_management));
+            key_collection->km[free_index].in_use = true;
+            key_collection->km[free_index].key_id = key_id;
+            key_collection->km[free_index].last_update_sequence = key_collection->next_update_sequence++;
+            memcpy(key_collection->km[free_index].consumer_mac_address, consumer_mac_address, sizeof(esp_bd_addr_t));
+            result = true;
+        }
+        unlock_key_collection(key_collection);
     }
     else
     {
@@ -127,18 +229,20 @@ bool add_new_key_to_collection(key_reconstruction_collection* key_collection, es
     return result;
 }
 
-void add_fragment_to_key_management(key_reconstruction_collection* key_collection, const esp_bd_addr_t consumer_mac_address, uint8_t key_id, uint8_t *fragment, uint8_t key_fragment_id)
+void add_fragment_to_key_management(key_reconstruction_collection* key_collection, const esp_bd_addr_t consumer_mac_address, uint16_t key_id, uint8_t *fragment, uint8_t key_fragment_id)
 {
-    if (xSemaphoreTake(key_collection->xMutex, portMAX_DELAY))
+    if (lock_key_collection(key_collection))
     {
         int key_index = get_key_index_in_collection(key_collection, consumer_mac_address, key_id);
-        if (key_index >= 0)
+        if (key_index >= 0 && key_fragment_id < NO_CODED_KEY_FRAGMENTS &&
+            key_collection->km[key_index].decrypted_key_fragments[key_fragment_id] == false)
         {
-            add_fragment_to_key_spliited(&(key_collection->km[key_index].key_fragments), fragment, key_fragment_id);
+            memcpy(key_collection->km[key_index].coded_fragments[key_fragment_id], fragment, KEY_FRAGMENT_SIZE);
             key_collection->km[key_index].decrypted_key_fragments[key_fragment_id] = true;
             key_collection->km[key_index].no_collected_key_fragments++;
+            key_collection->km[key_index].last_update_sequence = key_collection->next_update_sequence++;
         }
-        xSemaphoreGive(key_collection->xMutex);
+        unlock_key_collection(key_collection);
     }
     else
     {
@@ -146,17 +250,17 @@ void add_fragment_to_key_management(key_reconstruction_collection* key_collectio
     }
 }
 
-bool is_key_available(key_reconstruction_collection* key_collection, const esp_bd_addr_t consumer_mac_address, uint8_t key_id)
+bool is_key_available(key_reconstruction_collection* key_collection, const esp_bd_addr_t consumer_mac_address, uint16_t key_id)
 {
     bool result = false;
-    if (xSemaphoreTake(key_collection->xMutex, portMAX_DELAY))
+    if (lock_key_collection(key_collection))
     {
         int index = get_key_index_in_collection(key_collection, consumer_mac_address, key_id);
         if (index >= 0 )
         {
-            result = key_collection->km[index].no_collected_key_fragments == 4 ? true : false;
+            result = key_collection->km[index].no_collected_key_fragments >= NO_KEY_FRAGMENTS ? true : false;
         }
-        xSemaphoreGive(key_collection->xMutex);
+        unlock_key_collection(key_collection);
     }
     else
     {
@@ -166,7 +270,7 @@ bool is_key_available(key_reconstruction_collection* key_collection, const esp_b
     return result;
 }
 
-int get_key_index_in_collection(key_reconstruction_collection* key_collection, const esp_bd_addr_t consumer_mac_address, uint8_t key_id)
+int get_key_index_in_collection(key_reconstruction_collection* key_collection, const esp_bd_addr_t consumer_mac_address, uint16_t key_id)
 {
     int index = -1;
     if (key_collection == NULL || consumer_mac_address == NULL)
@@ -176,7 +280,7 @@ int get_key_index_in_collection(key_reconstruction_collection* key_collection, c
 
     for (int i = 0; i < key_collection->key_management_size; i++)
     {
-        if (key_collection->km[i].key_id == key_id && memcmp(key_collection->km[i].consumer_mac_address, consumer_mac_address, sizeof(esp_bd_addr_t)) == 0)
+        if (key_collection->km[i].in_use && key_collection->km[i].key_id == key_id && memcmp(key_collection->km[i].consumer_mac_address, consumer_mac_address, sizeof(esp_bd_addr_t)) == 0)
         {
             index = i;
             break;
@@ -186,17 +290,17 @@ int get_key_index_in_collection(key_reconstruction_collection* key_collection, c
     return index;
 }
 
-bool is_key_fragment_decrypted(key_reconstruction_collection* key_collection, const esp_bd_addr_t consumer_mac_address, uint8_t key_id, uint8_t key_fragment)
+bool is_key_fragment_decrypted(key_reconstruction_collection* key_collection, const esp_bd_addr_t consumer_mac_address, uint16_t key_id, uint8_t key_fragment)
 {
     bool key_fragment_decrypted = false;
-    if (xSemaphoreTake(key_collection->xMutex, portMAX_DELAY))
+    if (lock_key_collection(key_collection))
     {
         int key_index_in_collection = get_key_index_in_collection(key_collection, consumer_mac_address, key_id);
-        if (key_index_in_collection >= 0)
+        if (key_index_in_collection >= 0 && key_fragment < NO_CODED_KEY_FRAGMENTS)
         {
             key_fragment_decrypted = key_collection->km[key_index_in_collection].decrypted_key_fragments[key_fragment] == true? true : false;
         }
-        xSemaphoreGive(key_collection->xMutex);
+        unlock_key_collection(key_collection);
     }
     else
     {
@@ -52,8 +52,9 @@ static key_reconstructor_control st_reconstructor_control = {
     .key_collection = NULL
 };
 
-void process_and_store_key_fragment(reconstructor_queue_element * q_element);
-bool init_reconstructor_resources(const uint8_t key_reconstruction_collection_size);
+void process_and_store_key_fragment(key_reconstruction_collection *key_collection, reconstructor_queue_element * q_element);
+static bool handle_key_fragment(key_reconstruction_collection *key_collection, reconstructor_queue_element *fragment, key_128b *reconstructed_key);
+bool init_reconstructor_resources(const uint16_t key_reconstruction_collection_size);
 void handle_event_new_key_fragment_in_queue();
 
 void reconstructor_main(void *arg)
@@ -88,44 +89,72 @@ void handle_event_new_key_fragment_in_queue()
 
     for (int i = 0; i < counter; i++)
     {
-        // Sprawdź czy klucz z ID z pakietu istnieje dla nadawcy
-        if (is_key_in_collection(st_reconstructor_control.key_collection, keyFragmentBatch[i].consumer_mac_address, keyFragmentBatch[i].key_id) == false)
+        key_128b reconstructed_key = {0};
+        if (handle_key_fragment(st_reconstructor_control.key_collection, &keyFragmentBatch[i], &reconstructed_key) == true &&
+            st_reconstructor_control.key_rec_cb != NULL)
         {
-            // Dodaj nowy klucz do kolekcji
-            add_new_key_to_collection(st_reconstructor_control.key_collection, keyFragmentBatch[i].consumer_mac_address, keyFragmentBatch[i].key_id);
-            test_log_key_reconstruction_start(keyFragmentBatch[i].consumer_mac_address, keyFragmentBatch[i].key_id);
+            // Zawołaj funkcję zwrotną klienta powiadamiając, że dany klucz dla danego nadawcy został zrekonstruowany
+            st_reconstructor_control.key_rec_cb(keyFragmentBatch[i].key_id, &reconstructed_key, keyFragmentBatch[i].consumer_mac_address);
         }
+    }
 
-        // Sprawdz czy fragment klucza został już odszyfrowanyy
-        if (is_key_fragment_decrypted(st_reconstructor_control.key_collection, keyFragmentBatch[i].consumer_mac_address, keyFragmentBatch[i].key_id, keyFragmentBatch[i].key_fragment_no) == false)
-        {
-            // Odszyfruj fragment klucza i zapisz go
-            process_and_store_key_fragment(&keyFragmentBatch[i]);
-        }
-        else
-        {
-            test_log_packet_received_key_fragment_already_decoded(keyFragmentBatch[i].consumer_mac_address);
-        }
+}
 
-        // Sprawdz czy caly klucz jest dostepny - zostały zebrane wszystkie fragmenty
-        if (is_key_available(st_reconstructor_control.key_collection, keyFragmentBatch[i].consumer_mac_address, keyFragmentBatch[i].key_id) == true)
-        {
-            key_128b reconstructed_key = {0};
-            // Dokonaj rekonstrukcji klucza - poskładaj fragmenty w pełen klucz
-            reconstruct_key_from_key_fragments(st_reconstructor_control.key_collection, &reconstructed_key, keyFragmentBatch[i].consumer_mac_address, keyFragmentBatch[i].key_id);
-            if (st_reconstructor_control.key_rec_cb != NULL)
-            {
-                // Zawołaj funkcję zwrotną klienta powiadamiając, że dany klucz dla danego nadawcy został zrekonstruowany
-                st_reconstructor_control.key_rec_cb(keyFragmentBatch[i].key_id, &reconstructed_key, keyFragmentBatch[i].consumer_mac_address);
-                remove_key_from_collection(st_reconstructor_control.key_collection, keyFragmentBatch[i].consumer_mac_address, keyFragmentBatch[i].key_id);
-            }
-        }
+// Decrypts and stores one fragment, returns true with the full key once all fragments are collected
+static bool handle_key_fragment(key_reconstruction_collection *key_collection, reconstructor_queue_element *fragment, key_128b *reconstructed_key)
+{
+    // Sprawdz czy fragment klucza został już odszyfrowanyy
+    if (is_key_fragment_decrypted(key_collection, fragment->consumer_mac_address, fragment->key_id, fragment->key_fragment_no) == false)
+    {
+        // Odszyfruj fragment klucza i zapisz go
+        process_and_store_key_fragment(key_collection, fragment);
+    }
+    else
+    {
+        test_log_packet_received_key_fragment_already_decoded(fragment->consumer_mac_address);
     }
 
+    // Sprawdz czy caly klucz jest dostepny - zostały zebrane wszystkie fragmenty
+    if (is_key_available(key_collection, fragment->consumer_mac_address, fragment->key_id) == false)
+    {
+        return false;
+    }
+
+    // Dokonaj rekonstrukcji klucza - poskładaj fragmenty w pełen klucz
+    bool result = reconstruct_key_from_key_fragments(key_collection, reconstructed_key, fragment->consumer_mac_address, fragment->key_id);
+    remove_key_from_collection(key_collection, fragment->consumer_mac_address, fragment->key_id);
+    return result;
 }
 
+key_reconstruction_collection* create_inline_key_reconstruction(const uint16_t max_key_reconstrunction_count)
+{
+    // Kolekcja należy do jednego sharda - bez mutexu na ścieżce każdego fragmentu
+    return create_task_owned_key_collection(max_key_reconstrunction_count);
+}
+
+bool reconstruct_key_fragment_inline(key_reconstruction_collection *key_collection, uint16_t key_id, uint8_t key_fragment_no,
+    uint8_t * encrypted_key_fragment, uint8_t * key_hmac, uint8_t xor_seed, const esp_bd_addr_t consumer_mac_address, key_128b *reconstructed_key)
+{
+    if (key_collection == NULL || encrypted_key_fragment == NULL || key_hmac == NULL || reconstructed_key == NULL)
+    {
+        ESP_LOGE(REC_LOG_GROUP, "Invalid parameters in %s", __func__);
+        return false;
+    }
+
+    reconstructor_queue_element fragment = {
+        .key_id = key_id,
+        .key_fragment_no = key_fragment_no,
+        .xor_seed = xor_seed
+    };
+    memcpy(fragment.encrypted_key_fragment, encrypted_key_fragment, KEY_FRAGMENT_SIZE);
+    memcpy(fragment.key_hmac, key_hmac, HMAC_SIZE);
+    memcpy(fragment.consumer_mac_address, consumer_mac_address, sizeof(esp_bd_addr_t));
+
+    return handle_key_fragment(key_collection, &fragment, reconstructed_key);
+}
 
-int start_up_key_reconstructor(const uint8_t max_key_reconstrunction_count) {
+
+int start_up_key_reconstructor(const uint16_t max_key_reconstrunction_count) {
 
     int status = 0;
     st_reconstructor_control.is_reconstructor_resources_init = init_reconstructor_resources(max_key_reconstrunction_count);
@@ -164,13 +193,21 @@ int start_up_key_reconstructor(const uint8_t max_key_reconstrunction_count) {
     return status;
 }
 
+void remove_sender_from_key_reconstruction(const esp_bd_addr_t consumer_mac_address)
+{
+    if (st_reconstructor_control.is_reconstructor_resources_init == true)
+    {
+        remove_sender_keys_from_collection(st_reconstructor_control.key_collection, consumer_mac_address);
+    }
+}
+
 void register_callback_to_key_reconstruction(key_reconstruction_complete_cb cb)
 {
     ESP_LOGI(REC_LOG_GROUP, "Callback has been registered");
     st_reconstructor_control.key_rec_cb = cb;
 }
 
-bool init_reconstructor_resources(const uint8_t key_reconstruction_collection_size)
+bool init_reconstructor_resources(const uint16_t key_reconstruction_collection_size)
 {
     st_reconstructor_control.eventGroup = xEventGroupCreate();
 
@@ -258,21 +295,24 @@ RECONSTRUCTION_QUEUEING_STATUS queue_key_for_reconstruction(uint16_t key_id, uin
     return result;
 }
 
-void process_and_store_key_fragment(reconstructor_queue_element * q_element)
+void process_and_store_key_fragment(key_reconstruction_collection *key_collection, reconstructor_queue_element * q_element)
 {
-    ESP_LOGI(REC_LOG_GROUP, "Trying to reconstruct key fragment: %i", q_element->key_fragment_no);
+    ESP_LOGD(REC_LOG_GROUP, "Trying to reconstruct key fragment: %i", q_element->key_fragment_no);
     uint8_t decrypted_key_fragment_buffer[KEY_FRAGMENT_SIZE] = {0};
-    uint8_t calculated_hmac_buffer[HMAC_SIZE] = {0};
 
     xor_decrypt_key_fragment(q_element->encrypted_key_fragment, decrypted_key_fragment_buffer, q_element->xor_seed);
 
-    calculate_hmac_of_fragment(decrypted_key_fragment_buffer, q_element->encrypted_key_fragment, calculated_hmac_buffer);
-
-    if (crypto_secure_memcmp(calculated_hmac_buffer, q_element->key_hmac, sizeof(calculated_hmac_buffer)) == 0)
+    if (verify_key_fragment_hmac(decrypted_key_fragment_buffer, q_element->encrypted_key_fragment, q_element->key_hmac) == 0)
     {
-        add_fragment_to_key_management(st_reconstructor_control.key_collection, q_element->consumer_mac_address, q_element->key_id, decrypted_key_fragment_buffer, q_element->key_fragment_no);
+        // Wpis klucza dopiero dla fragmentu z poprawnym HMAC - sfałszowane fragmenty nie zajmują kolekcji
+        if (is_key_in_collection(key_collection, q_element->consumer_mac_address, q_element->key_id) == false)
+        {
+            add_new_key_to_collection(key_collection, q_element->consumer_mac_address, q_element->key_id);
+            test_log_key_reconstruction_start(q_element->consumer_mac_address, q_element->key_id);
+        }
+        add_fragment_to_key_management(key_collection, q_element->consumer_mac_address, q_element->key_id, decrypted_key_fragment_buffer, q_element->key_fragment_no);
         test_log_packet_received_key_fragment_already_decoded(q_element->consumer_mac_address);
-        ESP_LOGI(REC_LOG_GROUP, "Successfully reconstructed key fragment no: %i", q_element->key_fragment_no);
+        ESP_LOGD(REC_LOG_GROUP, "Successfully reconstructed key fragment no: %i", q_element->key_fragment_no);
     }
     else
     {
@@ -0,0 +1,152 @@
+#include "pdu_pool.h"
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+
+#include "esp_log.h"
+
+#include <string.h>
+
+static const char * PDU_POOL_LOG_GROUP = "PDU_POOL";
+
+typedef struct {
+    pdu_pool_slot slots[PDU_POOL_SIZE];
+    QueueHandle_t freeSlotsQueue;
+    bool is_initialised;
+} pdu_pool_structure;
+
+static pdu_pool_structure pdu_pool_st = {
+    .freeSlotsQueue = NULL,
+    .is_initialised = false
+};
+
+int init_pdu_pool()
+{
+    if (pdu_pool_st.is_initialised == true)
+    {
+        return 0;
+    }
+
+    pdu_pool_st.freeSlotsQueue = xQueueCreate(PDU_POOL_SIZE, sizeof(pdu_pool_slot *));
+    if (pdu_pool_st.freeSlotsQueue == NULL)
+    {
+        ESP_LOGE(PDU_POOL_LOG_GROUP, "Free slots queue create failed!");
+        return -1;
+    }
+
+    for (int i = 0; i < PDU_POOL_SIZE; i++)
+    {
+        pdu_pool_slot *slot = &(pdu_pool_st.slots[i]);
+        memset(slot, 0, sizeof(pdu_pool_slot));
+        xQueueSend(pdu_pool_st.freeSlotsQueue, (void *) &slot, 0);
+    }
+
+    pdu_pool_st.is_initialised = true;
+    return 0;
+}
+
+pdu_pool_slot* acquire_pdu_pool_slot()
+{
+    pdu_pool_slot *slot = NULL;
+
+    if (pdu_pool_st.is_initialised == true)
+    {
+        if (xQueueReceive(pdu_pool_st.freeSlotsQueue, (void *) &slot, 0) != pdTRUE)
+        {
+            slot = NULL;
+        }
+        else
+        {
+            atomic_store_explicit(&(slot->in_use), true, memory_order_relaxed);
+        }
+    }
+
+    return slot;
+}
+
+void release_pdu_pool_slot(pdu_pool_slot *slot)
+{
+    if (slot == NULL)
+    {
+        return;
+    }
+
+    if (atomic_exchange_explicit(&(slot->in_use), false, memory_order_relaxed) == false)
+    {
+        ESP_LOGE(PDU_POOL_LOG_GROUP, "Slot %p released twice!", slot);
+        return;
+    }
+
+    if (xQueueSend(pdu_pool_st.freeSlotsQueue, (void *) &slot, 0) != pdTRUE)
+    {
+        ESP_LOGE(PDU_POOL_LOG_GROUP, "Free slots queue full, slot %p lost!", slot);
+    }
+}
+
+uint32_t get_no_free_pdu_pool_slots()
+{
+    if (pdu_pool_st.is_initialised == false)
+    {
+        return 0;
+    }
+
+    return (uint32_t) uxQueueMessagesWaiting(pdu_pool_st.freeSlotsQueue);
+}
+
+beacon_pdu_data* get_beacon_pdu_from_pool_slot(pdu_pool_slot *slot)
+{
+    if (slot == NULL)
+    {
+        return NULL;
+    }
+
+    slot->pdu.payload_size = get_payload_size_from_pdu(slot->size);
+    return &(slot->pdu);
+}
+
+void init_pdu_pool_slot_list(pdu_pool_slot_list *list)
+{
+    list->head = NULL;
+    list->tail = NULL;
+    list->count = 0;
+}
+
+void push_to_pdu_pool_slot_list(pdu_pool_slot_list *list, pdu_pool_slot *slot)
+{
+    slot->next = NULL;
+    if (list->tail == NULL)
+    {
+        list->head = slot;
+    }
+    else
+    {
+        list->tail->next = slot;
+    }
+    list->tail = slot;
+    list->count++;
+}
+
+pdu_pool_slot* pop_from_pdu_pool_slot_list(pdu_pool_slot_list *list)
+{
+    pdu_pool_slot *slot = list->head;
+    if (slot != NULL)
+    {
+        list->head = slot->next;
+        if (list->head == NULL)
+        {
+            list->tail = NULL;
+        }
+        slot->next = NULL;
+        list->count--;
+    }
+    return slot;
+}
+
+void release_pdu_pool_slot_list(pdu_pool_slot_list *list)
+{
+    pdu_pool_slot *slot = NULL;
+    while ((slot = pop_from_pdu_pool_slot_list(list)) != NULL)
+    {
+        release_pdu_pool_slot(slot);
+    }
+}
@@ -15,7 +15,7 @@ payload_decrypted_observer_collection * create_pdo_collection(const size_t colle
     }
 
     p_doc->collection_size = collection_size;
-    p_doc->observers = (payload_decrypted_observer_cb *) calloc(collection_size, sizeof(payload_decrypted_observer_cb));
+    p_doc->observers = (_Atomic(payload_decrypted_observer_cb) *) calloc(collection_size, sizeof(payload_decrypted_observer_cb));
     
     if (p_doc->observers == NULL)
     {
@@ -28,8 +28,7 @@ payload_decrypted_observer_collection * create_pdo_collection(const size_t colle
     if (p_doc->xMutex == NULL)
     {
         ESP_LOGI(PDO_LOG_GROUP, "Failed to malloc mem for Mutex");
-        for (int i = 0; i < collection_size; i++)
-            free(p_doc->observers[i]);
+        free(p_doc->observers);
         free(p_doc);
         return NULL;
     }
@@ -50,9 +49,9 @@ int add_observer_to_collection(payload_decrypted_observer_collection * colletion
         int i;
         for (i = 0; i < colletion->collection_size; i++)
         {
-            if (colletion->observers[i] == NULL)
+            if (atomic_load_explicit(&(colletion->observers[i]), memory_order_relaxed) == NULL)
             {
-                colletion->observers[i] = observer;
+                atomic_store_explicit(&(colletion->observers[i]), observer, memory_order_release);
                 break;
             }
         }
@@ -73,20 +72,14 @@ void notify_pdo_collection_observers(payload_decrypted_observer_collection * col
     if (decrypted_payload == NULL || payload_size == 0 || mac_address == NULL)
         return;
 
-    if (xSemaphoreTake(colletion->xMutex, portMAX_DELAY) == pdTRUE)
+    // Bez mutexa - shardy przetwarzania nie czekają na siebie nawzajem przy powiadamianiu
+    for (int i = 0; i < colletion->collection_size; i++)
     {
-        for (int i = 0; i < colletion->collection_size; i++)
+        payload_decrypted_observer_cb observer = atomic_load_explicit(&(colletion->observers[i]), memory_order_acquire);
+        if (observer != NULL)
         {
-            if (colletion->observers[i] != NULL)
-            {
-                colletion->observers[i](decrypted_payload, payload_size, mac_address);
-            }
+            observer(decrypted_payload, payload_size, mac_address);
         }
-        xSemaphoreGive(colletion->xMutex);
-    }
-    else
-    {
-        ESP_LOGI(PDO_LOG_GROUP, "Failed to obtained Mutex in notify_observers()");
     }
 
 }
\ No newline at end of file
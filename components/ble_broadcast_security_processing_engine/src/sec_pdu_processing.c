@@ -1,13 +1,17 @@
 #include "ble_consumer_collection.h"
 #include "ble_consumer.h"
 #include "beacon_pdu_data.h"
+#include "beacon_record_list.h"
 #include "sec_payload_observer_collection.h"
 #include "sec_pdu_processing.h"
 #include "sec_pdu_process_queue.h"
 #include "key_reconstructor.h"
 #include "key_cache.h"
+#include "pdu_pool.h"
+#include "sender_registry.h"
 #include "crypto.h"
 #include "test.h"
+#include "pdu_latency.h"
 
 #include "adv_time_authorize.h"
 
@@ -28,6 +32,12 @@
 #define MAX_PROCESSING_QUEUE_ELEMENTS 100
 #define MAX_PROCESSED_PDUS_AT_ONCE 20
 
+// Keys reconstructed at the same time, previous sizing (10 per sender) does not scale to hundreds of senders
+#define KEY_RECONSTRUCTIONS_PER_SENDER 2
+#define MIN_KEY_RECONSTRUCTIONS 20
+
+#define IDLE_SENDERS_CHECK_PERIOD_TICKS pdMS_TO_TICKS(1000)
+
 #define QUEUE_TIMEOUT_MS 50
 #define QUEUE_TIMEOUT_SYS_TICKS pdMS_TO_TICKS(QUEUE_TIMEOUT_MS)
 
@@ -36,63 +46,129 @@ static const char * SEC_PDU_PROC_LOG = "SEC_PDU_PROCESSING";
 // Event group flags
 #define EVENT_NEW_PDU (1 << 0)
 #define EVENT_KEY_RECONSTRUCTED (1 << 1)
-#define EVENT_PROCESS_DEFFERRED_PDUS (1 << 2)
+
+// Reconstructed keys waiting for the shard task, keys are rare compared to PDUs
+#define KEY_QUEUE_SIZE 8
 
 #define MAIN_PROCESSING_QUEUE_SIZE
 
+#define FNV_OFFSET_BASIS 2166136261UL
+#define FNV_PRIME 16777619UL
 
 
+// Reconstructed key handed from the key reconstruction task to the shard owning the sender
+typedef struct {
+    key_128b key;
+    esp_bd_addr_t mac_address;
+    uint16_t key_id;
+} reconstructed_key_message;
+
+// Processing task with its own queue and consumers, a sender is always handled by the same shard
+// so consumer state, key caches and deferred queues are never shared between shards.
+// Only the shard task touches its consumers, other tasks send messages through the shard queues.
 typedef struct {
     TaskHandle_t xSecProcessingTask;
     QueueHandle_t processingQueue;
+    QueueHandle_t keyQueue;
     EventGroupHandle_t eventGroup;
     ble_consumer_collection* consumer_collection;
+    key_reconstruction_collection* key_collection;
+} sec_pdu_processing_shard;
+
+typedef struct {
+    sec_pdu_processing_shard shards[MAX_SEC_PDU_PROCESSING_SHARDS];
+    uint8_t no_shards;
+    sender_registry* registry;
     size_t ble_consumer_collection_size;
     bool is_sec_pdu_processing_initialised;
     payload_decrypted_observer_collection * payload_decription_subcribers_collection;
 } sec_pdu_processing_control;
 
 static sec_pdu_processing_control sec_pdu_st = {
-    .xSecProcessingTask = NULL,
-    .processingQueue = NULL,
-    .eventGroup = NULL,
-    .consumer_collection = NULL,
+    .shards = {{0}},
+    .no_shards = SEC_PDU_PROCESSING_SHARDS,
+    .registry = NULL,
     .ble_consumer_collection_size = MAX_BLE_CONSUMERS,
     .is_sec_pdu_processing_initialised = false,
     .payload_decription_subcribers_collection = NULL
 };
 
-typedef struct {
-    uint8_t data[MAX_GAP_DATA_LEN];
-    size_t size;
-    esp_bd_addr_t mac_address;
-} beacon_pdu_data_with_mac_addr;
-
-static int add_to_consumer_deferred_queue(ble_consumer* p_ble_consumer, beacon_pdu_data* pdu);
-static int process_deferred_queue(ble_consumer * p_ble_consumer);
-static void decrypt_pdu(const key_128b * const key, beacon_pdu_data * pdu, uint8_t * output, uint8_t output_len);
-static void decrypt_and_notify(const key_128b *key, beacon_pdu_data *pdu, esp_bd_addr_t mac_address);
+static int add_to_consumer_deferred_queue(ble_consumer* p_ble_consumer, pdu_pool_slot* slot, const uint16_t key_id);
+static int process_deferred_queue(ble_consumer * p_ble_consumer, const uint16_t key_id, pdu_pool_slot_list * released_pdus);
+static bool decrypt_pdu(aes_key_schedule * const key_schedule, beacon_pdu_data * pdu);
+static void notify_payload_observers(pdu_pool_slot *slot);
+static void decrypt_and_notify(aes_key_schedule *key_schedule, pdu_pool_slot *slot);
 static int init_sec_processing_resources();
-static void handle_event_new_pdu();
-static void handle_event_process_deferred_pdus();
+static void handle_event_new_pdu(sec_pdu_processing_shard *shard);
+static void handle_event_key_reconstructed(sec_pdu_processing_shard *shard);
+static void handle_key_fragment_pdu(sec_pdu_processing_shard *shard, pdu_pool_slot *slot, beacon_crypto_data *bcd, const uint8_t coded_fragment_index);
+static void add_reconstructed_key(sec_pdu_processing_shard *shard, reconstructed_key_message *message);
+static uint16_t get_key_reconstructions_count(const uint16_t max_senders);
+static void remove_consumer_key_reconstructions(void *context, const esp_bd_addr_t mac_address);
 static double get_queue_elements_in_percentage(const uint32_t queue_count, const uint32_t queue_size)
 {
     return (double)(queue_count / ((double)queue_size));
 }
 
-static void log_processing_queue_size()
+static void log_processing_queue_size(sec_pdu_processing_shard *shard)
 {
-    test_log_processing_queue_percentage(get_queue_elements_in_percentage(uxQueueMessagesWaiting(sec_pdu_st.processingQueue), MAX_PROCESSING_QUEUE_ELEMENTS));
+    test_log_processing_queue_percentage(get_queue_elements_in_percentage(uxQueueMessagesWaiting(shard->processingQueue), MAX_PROCESSING_QUEUE_ELEMENTS));
+}
+
+uint8_t get_sec_processing_shard_for_mac(const esp_bd_addr_t mac_address, const uint8_t no_shards)
+{
+    uint32_t hash = FNV_OFFSET_BASIS;
+    for (size_t i = 0; i < sizeof(esp_bd_addr_t); i++)
+    {
+        hash ^= mac_address[i];
+        hash *= FNV_PRIME;
+    }
+    return no_shards > 1 ? (uint8_t) (hash % no_shards) : 0;
+}
+
+static sec_pdu_processing_shard* get_shard_for_mac(const esp_bd_addr_t mac_address)
+{
+    return &(sec_pdu_st.shards[get_sec_processing_shard_for_mac(mac_address, sec_pdu_st.no_shards)]);
 }
 
 void reset_processing()
 {
 }
 
+void get_sender_eviction_stats(sender_eviction_stats *authorization_stats, sender_eviction_stats *processing_stats)
+{
+    if (sec_pdu_st.is_sec_pdu_processing_initialised)
+    {
+        get_adv_time_authorize_eviction_stats(authorization_stats);
+
+        // Sumaryczne liczniki wszystkich shardów
+        if (processing_stats != NULL)
+        {
+            memset(processing_stats, 0, sizeof(sender_eviction_stats));
+            for (uint8_t i = 0; i < sec_pdu_st.no_shards; i++)
+            {
+                sender_eviction_stats shard_stats = {0};
+                get_consumer_collection_eviction_stats(sec_pdu_st.shards[i].consumer_collection, &shard_stats);
+                processing_stats->idle_evictions += shard_stats.idle_evictions;
+                processing_stats->lru_evictions += shard_stats.lru_evictions;
+                processing_stats->rejected_senders += shard_stats.rejected_senders;
+            }
+        }
+    }
+}
+
+void get_scan_ring_stats(spsc_ring_stats *stats)
+{
+    if (sec_pdu_st.is_sec_pdu_processing_initialised)
+    {
+        get_adv_time_authorize_scan_ring_stats(stats);
+    }
+}
+
 bool create_ble_broadcast_pdu_for_dispatcher(ble_broadcast_pdu* pdu, uint8_t *data, size_t size, esp_bd_addr_t mac_address)
 {
     bool result = false;
-    if (size <= MAX_GAP_DATA_LEN)
+    if (size <= MAX_BEACON_PDU_LEN)
     {
         memcpy(pdu->data, data, size);
         pdu->data_len = size;
@@ -117,106 +193,163 @@ void register_payload_observer_cb(payload_decrypted_observer_cb observer_cb)
 
 void sec_processing_main(void *arg)
 {
+    sec_pdu_processing_shard *shard = (sec_pdu_processing_shard *) arg;
+    TickType_t last_idle_check_ticks = xTaskGetTickCount();
 
     while (1)
     {
         // Pętla zdarzeń - oczekiwanie na nowe zdarzenie
-        EventBits_t events = xEventGroupWaitBits(sec_pdu_st.eventGroup,
-                                                 EVENT_NEW_PDU | EVENT_PROCESS_DEFFERRED_PDUS,
-                                                 pdTRUE, pdFALSE, portMAX_DELAY);
+        EventBits_t events = xEventGroupWaitBits(shard->eventGroup,
+                                                 EVENT_NEW_PDU | EVENT_KEY_RECONSTRUCTED,
+                                                 pdTRUE, pdFALSE, IDLE_SENDERS_CHECK_PERIOD_TICKS);
 
         // Obsługa zdarzenia przyjścia nowego pakietu do przetworzenia
         if (events & EVENT_NEW_PDU) {
-            handle_event_new_pdu();
+            handle_event_new_pdu(shard);
         }
 
-        // Obsługa zdarzenia przetworzenia kolejki odroczonych pakietów
-        if (events & EVENT_PROCESS_DEFFERRED_PDUS)
+        // Obsługa zdarzenia odtworzenia klucza - klucz trafia do pamięci podręcznej, odroczone pakiety są odszyfrowywane
+        if (events & EVENT_KEY_RECONSTRUCTED)
         {
-            handle_event_process_deferred_pdus();
+            handle_event_key_reconstructed(shard);
         }
 
+        // Zwolnienie zasobów nadawców, od których nie przychodzą już pakiety
+        if ((xTaskGetTickCount() - last_idle_check_ticks) >= IDLE_SENDERS_CHECK_PERIOD_TICKS)
+        {
+            last_idle_check_ticks = xTaskGetTickCount();
+            remove_idle_consumers_from_collection(shard->consumer_collection, SENDER_IDLE_TIMEOUT_MS);
+        }
     }
 }
 
-void handle_event_new_pdu()
+void handle_event_new_pdu(sec_pdu_processing_shard *shard)
 {
     int batchCount = 0;
-    beacon_pdu_data_with_mac_addr pduBatch[MAX_PROCESSED_PDUS_AT_ONCE] = {0};
+    pdu_pool_slot * pduBatch[MAX_PROCESSED_PDUS_AT_ONCE] = {0};
+    // Partia z pakietów już czekających - shard nie blokuje się w oczekiwaniu na jej zapełnienie
     while (batchCount < MAX_PROCESSED_PDUS_AT_ONCE &&
-        xQueueReceive(sec_pdu_st.processingQueue, (void *)&pduBatch[batchCount], QUEUE_TIMEOUT_SYS_TICKS) == pdTRUE)
+        xQueueReceive(shard->processingQueue, (void *)&pduBatch[batchCount], 0) == pdTRUE)
     {
+        pdu_latency_record(&(pduBatch[batchCount]->latency), pduBatch[batchCount]->sender_index, PDU_STAGE_PROCESSING_DEQUEUE);
         batchCount++;
     }
 
-    const key_128b * key = NULL;
+    // Reszta kolejki w kolejnym obrocie pętli zdarzeń, bez czekania na kolejny pakiet
+    if (uxQueueMessagesWaiting(shard->processingQueue) > 0)
+    {
+        xEventGroupSetBits(shard->eventGroup, EVENT_NEW_PDU);
+    }
+
+    aes_key_schedule * key_schedule = NULL;
     ble_consumer * p_ble_consumer = NULL;
 
     for (int i = 0; i < batchCount; i++)
     {
-        p_ble_consumer = get_ble_consumer_from_collection(sec_pdu_st.consumer_collection, pduBatch[i].mac_address);
-        if (p_ble_consumer == NULL && get_active_no_consumers(sec_pdu_st.consumer_collection) < MAX_BLE_CONSUMERS)
+        p_ble_consumer = get_ble_consumer_for_sender_index(shard->consumer_collection, pduBatch[i]->sender_index, pduBatch[i]->mac_address);
+        if (p_ble_consumer == NULL)
         {
-            p_ble_consumer = add_consumer_to_collection(sec_pdu_st.consumer_collection, pduBatch[i].mac_address);
+            p_ble_consumer = add_consumer_to_collection(shard->consumer_collection, pduBatch[i]->sender_index, pduBatch[i]->mac_address);
             if (p_ble_consumer == NULL)
             {
                 ESP_LOGE(SEC_PDU_PROC_LOG, "Failed adding new consumer to collection :(");
             }
             else
             {
-                ESP_LOGI(SEC_PDU_PROC_LOG, "Successfully addded consumer to collection, count of active consumers: %i", get_active_no_consumers(sec_pdu_st.consumer_collection)); 
+                ESP_LOGI(SEC_PDU_PROC_LOG, "Successfully addded consumer to collection, count of active consumers: %i", get_active_no_consumers(shard->consumer_collection)); 
             }
         }
 
         if (p_ble_consumer == NULL)
         {
             ESP_LOGE(SEC_PDU_PROC_LOG, "Failed acquairing ble consumer from collection :(");
+            release_pdu_pool_slot(pduBatch[i]);
             continue;
         }
 
-        command cmd = get_command_from_pdu(pduBatch[i].data, pduBatch[i].size);
+        command cmd = get_command_from_pdu(pduBatch[i]->data, pduBatch[i]->size);
 
         switch (cmd)
         {
             case DATA_CMD:
+            case AEAD_DATA_CMD:
+            case RECORDS_DATA_CMD:
+            case AEAD_RECORDS_DATA_CMD:
+            case DATA_KEY_FRAGMENT_CMD:
+            case DATA_KEY_PARITY_FRAGMENT_CMD:
             {
-                beacon_pdu_data pdu;
-                get_beacon_pdu_from_adv_data(&pdu, pduBatch[i].data, pduBatch[i].size);
-                uint16_t key_id = get_key_id_from_key_session_data(pdu.key_session_data);
-                key = get_key_from_cache(p_ble_consumer->context.key_cache, key_id);
+                if (pduBatch[i]->size < BEACON_PDU_HEADER_SIZE)
+                {
+                    release_pdu_pool_slot(pduBatch[i]);
+                    break;
+                }
+                beacon_pdu_data * pdu = get_beacon_pdu_from_pool_slot(pduBatch[i]);
+                uint16_t key_id = get_key_id_from_key_session_data(pdu->key_session_data);
+                if (cmd == DATA_KEY_FRAGMENT_CMD || cmd == DATA_KEY_PARITY_FRAGMENT_CMD)
+                {
+                    // Fragment klucza najpierw - złożony klucz pozwala odszyfrować dane tego samego PDU bez kolejki odroczonej
+                    beacon_crypto_data bcd;
+                    if (take_key_fragment_from_data_pdu(pdu, &bcd) == false)
+                    {
+                        test_log_bad_structure_packet(pduBatch[i]->mac_address);
+                        release_pdu_pool_slot(pduBatch[i]);
+                        break;
+                    }
+
+                    const uint16_t fragment_key_id = get_key_id_from_key_session_data(bcd.key_session_data);
+                    if (get_key_schedule_from_cache(p_ble_consumer->context.key_cache, fragment_key_id) == NULL)
+                    {
+                        handle_key_fragment_pdu(shard, pduBatch[i], &bcd, get_coded_key_fragment_index(cmd, bcd.key_session_data));
+                    }
+                }
+                key_schedule = get_key_schedule_from_cache(p_ble_consumer->context.key_cache, key_id);
                 p_ble_consumer->last_pdu_key_id = key_id;
-                if (key == NULL || is_pdu_in_deferred_queue(p_ble_consumer) > 0)
+                // PDUs of a key still waiting for release keep their order behind the deferred ones
+                if (key_schedule == NULL || is_pdu_for_key_in_deferred_queue(p_ble_consumer, key_id))
                 {
-                    add_to_consumer_deferred_queue(p_ble_consumer, &pdu);
+                    pdu_latency_record(&(pduBatch[i]->latency), pduBatch[i]->sender_index, PDU_STAGE_DEFERRED);
+                    add_to_consumer_deferred_queue(p_ble_consumer, pduBatch[i], key_id);
                 }
                 else
                 {
-                    decrypt_and_notify(key, &pdu, pduBatch[i].mac_address);
+                    pdu_latency_record(&(pduBatch[i]->latency), pduBatch[i]->sender_index, PDU_STAGE_KEY_CACHE_HIT);
+                    decrypt_and_notify(key_schedule, pduBatch[i]);
                 }
             }
             break;
 
             case KEY_FRAGMENT_CMD:
+            case KEY_PARITY_FRAGMENT_CMD:
             {
-                beacon_key_pdu_data * pdu = (beacon_key_pdu_data *) pduBatch[i].data;
-                uint16_t key_id = get_key_id_from_key_session_data(pdu->bcd.key_session_data);
-                uint8_t key_fragment_index = get_key_fragment_index_from_key_session_data(pdu->bcd.key_session_data);
-                key = get_key_from_cache(p_ble_consumer->context.key_cache, key_id);
-                p_ble_consumer->last_pdu_key_id = key_id;
-                if (key == NULL)
+                beacon_key_pdu_data * pdu = &(pduBatch[i]->key_pdu);
+                const uint8_t no_fragments = get_no_key_fragments_from_pdu(pduBatch[i]->size);
+                if (no_fragments == 0)
                 {
-                    queue_key_for_reconstruction(key_id, key_fragment_index, 
-                        pdu->bcd.enc_key_fragment, pdu->bcd.key_fragment_hmac, 
-                        pdu->bcd.xor_seed, pduBatch[i].mac_address);
+                    test_log_bad_structure_packet(pduBatch[i]->mac_address);
                 }
-                else
+
+                // Każdy fragment sprawdzany osobno - klucz może zostać złożony przed ostatnim fragmentem PDU
+                for (uint8_t fragment = 0; fragment < no_fragments; fragment++)
                 {
-                    test_log_packet_received_key_fragment_already_decoded(p_ble_consumer->mac_address_arr);
+                    beacon_crypto_data * bcd = &(pdu->bcd[fragment]);
+                    uint16_t key_id = get_key_id_from_key_session_data(bcd->key_session_data);
+                    key_schedule = get_key_schedule_from_cache(p_ble_consumer->context.key_cache, key_id);
+                    p_ble_consumer->last_pdu_key_id = key_id;
+                    if (key_schedule == NULL)
+                    {
+                        handle_key_fragment_pdu(shard, pduBatch[i], bcd, get_coded_key_fragment_index(cmd, bcd->key_session_data));
+                    }
+                    else
+                    {
+                        test_log_packet_received_key_fragment_already_decoded(p_ble_consumer->mac_address_arr);
+                    }
                 }
+                release_pdu_pool_slot(pduBatch[i]);
             }
             break;
 
             default:
+                release_pdu_pool_slot(pduBatch[i]);
                 break;
 
         };
@@ -224,136 +357,138 @@ void handle_event_new_pdu()
     }
 }
 
-// Handle deferred PDUs event
-static void handle_event_process_deferred_pdus() {
-    ESP_LOGI(SEC_PDU_PROC_LOG, "Processing deferred queue...");
-    for (size_t i = 0; i < sec_pdu_st.ble_consumer_collection_size; i++) {
-        ble_consumer *consumer = &(sec_pdu_st.consumer_collection->arr[i]);
-        if (consumer != NULL)
-        {
-            if (is_deferred_queue_request_pending(consumer)) {
-                process_deferred_queue(consumer);
-                if (!is_pdu_in_deferred_queue(consumer)) {
-                    set_deferred_q_pending_processing(consumer, false);
-                } else {
-                    xEventGroupSetBits(sec_pdu_st.eventGroup, EVENT_PROCESS_DEFFERRED_PDUS);
-                }
-            }
-        }
-        else
-        {
-            ESP_LOGI(SEC_PDU_PROC_LOG, "BLE Consumer NULL PTR");
-        }
-    }
-}
-
-
-// Decrypt PDU and notify callback
-void decrypt_and_notify(const key_128b *key, beacon_pdu_data *pdu, esp_bd_addr_t mac_address) {
-    if (pdu == NULL && mac_address == NULL)
+// Decrypt PDU in place, notify callback and give slot back to the pool once observers return
+void decrypt_and_notify(aes_key_schedule *key_schedule, pdu_pool_slot *slot) {
+    if (slot == NULL)
         return;
-    uint8_t output[MAX_PDU_PAYLOAD_SIZE] = {0};
-    decrypt_pdu(key, pdu, output, MAX_PDU_PAYLOAD_SIZE);
+    beacon_pdu_data *pdu = &(slot->pdu);
     if (pdu->payload_size > MAX_PDU_PAYLOAD_SIZE)
     {
         ESP_LOGE(SEC_PDU_PROC_LOG, "PDU PAYLOAD SIZE %i GREATER THAN MAX SIZE!", (int) pdu->payload_size);
     }
-    notify_pdo_collection_observers(sec_pdu_st.payload_decription_subcribers_collection, output, pdu->payload_size, mac_address);
+    else if (decrypt_pdu(key_schedule, pdu) == false)
+    {
+        // Sfałszowany lub uszkodzony pakiet odrzucony przed obserwatorami
+        ESP_LOGW(SEC_PDU_PROC_LOG, "AEAD tag mismatch, PDU %u dropped", (unsigned) pdu->pdu_no);
+        test_log_bad_structure_packet(slot->mac_address);
+    }
+    else
+    {
+        pdu_latency_record(&(slot->latency), slot->sender_index, PDU_STAGE_DECRYPTED);
+        notify_payload_observers(slot);
+        pdu_latency_record(&(slot->latency), slot->sender_index, PDU_STAGE_OBSERVERS_NOTIFIED);
+    }
+    release_pdu_pool_slot(slot);
 }
 
-void decrypt_pdu(const key_128b * const key, beacon_pdu_data * pdu, uint8_t * output, uint8_t output_len)
+// Returns false for AEAD PDUs failing tag verification, payload_size of AEAD PDUs is reduced by the tag
+bool decrypt_pdu(aes_key_schedule * const key_schedule, beacon_pdu_data * pdu)
 {
-    if (output_len == MAX_PDU_PAYLOAD_SIZE)
+    if (is_aead_data_command(pdu->cmd))
     {
-        uint8_t nonce[NONCE_SIZE] = {0};
-        build_nonce(nonce, &(pdu->marker), pdu->key_session_data, pdu->xor_seed);
-        aes_ctr_decrypt_payload(pdu->payload, pdu->payload_size, key->key, nonce, output);
+        if (pdu->payload_size < DATA_PDU_AEAD_TAG_SIZE)
+        {
+            return false;
+        }
+
+        uint8_t nonce[AES_CCM_NONCE_SIZE] = {0};
+        build_aead_nonce(nonce, pdu);
+        const size_t ciphertext_size = pdu->payload_size - DATA_PDU_AEAD_TAG_SIZE;
+        pdu->payload_size = ciphertext_size;
+        return aes_ccm_auth_decrypt_with_key_schedule(key_schedule, nonce, pdu->payload, ciphertext_size, pdu->payload,
+                                                      &(pdu->payload[ciphertext_size]), DATA_PDU_AEAD_TAG_SIZE) == 0;
     }
+
+    uint8_t nonce[NONCE_SIZE] = {0};
+    build_nonce(nonce, &(pdu->marker), pdu->key_session_data, pdu->xor_seed);
+    // AES CTR allows the same buffer as input and output
+    aes_ctr_decrypt_payload_with_key_schedule(pdu->payload, pdu->payload_size, key_schedule, nonce, pdu->payload);
+    return true;
 }
 
-int process_deferred_queue(ble_consumer * p_ble_consumer)
+// Observers get every record of a record list PDU as a separate payload, other PDUs are passed whole
+void notify_payload_observers(pdu_pool_slot *slot)
 {
-    if (p_ble_consumer == NULL)
+    beacon_pdu_data *pdu = &(slot->pdu);
+    if (is_record_list_command(pdu->cmd) == false)
     {
-        return -1;
+        notify_pdo_collection_observers(sec_pdu_st.payload_decription_subcribers_collection, pdu->payload, pdu->payload_size, slot->mac_address);
+        return;
     }
 
-    beacon_pdu_data pduBatch[MAX_PROCESSED_PDUS_AT_ONCE] = {0};
-    int counter = 0;
-    while (counter < MAX_PROCESSED_PDUS_AT_ONCE && get_deferred_queue_item(p_ble_consumer, &(pduBatch[counter])) == pdTRUE) {
-        counter++;
+    // Rekordy przekazywane bez kopiowania, wskaźniki do slotu ważne do jego zwolnienia
+    size_t offset = 0;
+    const uint8_t *record = NULL;
+    size_t record_size = 0;
+    while (get_next_record_from_record_list(pdu->payload, pdu->payload_size, &offset, &record, &record_size))
+    {
+        notify_pdo_collection_observers(sec_pdu_st.payload_decription_subcribers_collection, (uint8_t *) record, record_size, slot->mac_address);
     }
-    
-    if (counter == 0)
-        return -1;
 
-    uint16_t last_key_id = get_key_id_from_key_session_data(pduBatch[0].key_session_data);
-    const key_128b *key = get_key_from_cache(p_ble_consumer->context.key_cache, last_key_id);
+    if (offset != pdu->payload_size)
+    {
+        ESP_LOGW(SEC_PDU_PROC_LOG, "Malformed record list in PDU %u, %u of %u bytes delivered",
+                 (unsigned) pdu->pdu_no, (unsigned) offset, (unsigned) pdu->payload_size);
+        test_log_bad_structure_packet(slot->mac_address);
+    }
+}
 
-    for (int i = 0; i < counter; i++)
+int process_deferred_queue(ble_consumer * p_ble_consumer, const uint16_t key_id, pdu_pool_slot_list * released_pdus)
+{
+    if (p_ble_consumer == NULL || released_pdus == NULL)
     {
-        uint16_t key_id = get_key_id_from_key_session_data(pduBatch[i].key_session_data);
+        return -1;
+    }
 
-        if (last_key_id != key_id)
-        {
-            key = get_key_from_cache(p_ble_consumer->context.key_cache, key_id);
-            last_key_id = key_id;
-        }
+    const int counter = released_pdus->count;
+    aes_key_schedule *key_schedule = get_key_schedule_from_cache(p_ble_consumer->context.key_cache, key_id);
+    if (key_schedule == NULL)
+    {
+        // Key evicted before its PDUs were released
+        ESP_LOGE(SEC_PDU_PROC_LOG, "DROPPED %i PACKETS OF KEY %i!", counter, key_id);
+        release_pdu_pool_slot_list(released_pdus);
+        return 0;
+    }
 
-        if (key != NULL)
-        {
-            decrypt_and_notify(key, &(pduBatch[i]), p_ble_consumer->mac_address_arr);
-        }
-        else
-        {   
-            // Drop PDU from removed key
-            if (key_id == p_ble_consumer->last_pdu_key_id)
-            {
-                add_to_consumer_deferred_queue(p_ble_consumer, &pduBatch[i]);
-            }
-            else
-            {
-                ESP_LOGE(SEC_PDU_PROC_LOG, "DROPPED PACKET!");
-            }
-        }
+    // Klucz pobrany raz dla wszystkich zwolnionych pakietów
+    pdu_pool_slot *slot = NULL;
+    while ((slot = pop_from_pdu_pool_slot_list(released_pdus)) != NULL)
+    {
+        decrypt_and_notify(key_schedule, slot);
     }
 
     return counter;
 }
 
 
-int add_to_consumer_deferred_queue(ble_consumer* p_ble_consumer, beacon_pdu_data* pdu)
+int add_to_consumer_deferred_queue(ble_consumer* p_ble_consumer, pdu_pool_slot* slot, const uint16_t key_id)
 {
     BaseType_t stats = pdFAIL;
     if (sec_pdu_st.is_sec_pdu_processing_initialised == true)
     {
-        if (pdu != NULL)
+        if (slot != NULL)
         {
-            add_to_deferred_queue(p_ble_consumer, pdu);
+            stats = add_to_deferred_queue(p_ble_consumer, slot, key_id) == 0 ? pdPASS : pdFAIL;
         }
     }
 
-    return stats;
-}
-
-int update_key_in_cache(ble_consumer* p_ble_consumer, uint8_t key_id, const key_128b* reconstructed_key) {
-    int status = add_key_to_cache(p_ble_consumer->context.key_cache, reconstructed_key, key_id);
-    if (status != -1) {
-        p_ble_consumer->context.recently_removed_key_id = remove_lru_key_from_cache(p_ble_consumer->context.key_cache);
-        status = add_key_to_cache(p_ble_consumer->context.key_cache, reconstructed_key, key_id);
-    }
-    else if (status != -3)
+    if (stats != pdPASS)
     {
-        ESP_LOGE(SEC_PDU_PROC_LOG, "add_key_to_cache null ptr");
+        release_pdu_pool_slot(slot);
     }
-    return status;
-}
 
+    return stats;
+}
 
-void key_reconstruction_complete(uint8_t key_id, key_128b * const reconstructed_key, uint8_t *mac_address)
+// Called on the shard task owning the sender
+static void add_reconstructed_key(sec_pdu_processing_shard *shard, reconstructed_key_message *message)
 {
+    const uint16_t key_id = message->key_id;
+    key_128b * const reconstructed_key = &(message->key);
+    uint8_t *mac_address = message->mac_address;
+
     // Retrieve BLE consumer associated with mac_address
-    ble_consumer * p_ble_consumer = get_ble_consumer_from_collection(sec_pdu_st.consumer_collection, mac_address);
+    ble_consumer * p_ble_consumer = get_ble_consumer_from_collection(shard->consumer_collection, mac_address);
     if (p_ble_consumer == NULL)
     {
         ESP_LOGE(SEC_PDU_PROC_LOG, "BLE Consumer NULL for MAC address: %02x:%02x:%02x:%02x:%02x:%02x",
@@ -367,7 +502,7 @@ void key_reconstruction_complete(uint8_t key_id, key_128b * const reconstructed_
 
 
     test_log_key_reconstruction_end(mac_address, key_id);
-    double queue_percentage = get_queue_elements_in_percentage(p_ble_consumer->context.deferred_queue_count, DEFERRED_QUEUE_SIZE);
+    double queue_percentage = get_queue_elements_in_percentage(get_no_pdus_in_deferred_queue(p_ble_consumer), DEFERRED_QUEUE_SIZE);
     test_log_deferred_queue_percentage(queue_percentage, p_ble_consumer->mac_address_arr);
 
     // Attempt to add the reconstructed key to the cache
@@ -378,6 +513,10 @@ void key_reconstruction_complete(uint8_t key_id, key_128b * const reconstructed_
         // Cache full; remove LRU and retry
         p_ble_consumer->context.recently_removed_key_id = remove_lru_key_from_cache(p_ble_consumer->context.key_cache);
         ESP_LOGE(SEC_PDU_PROC_LOG, "Removed key id: %i", p_ble_consumer->context.recently_removed_key_id);
+        if (p_ble_consumer->context.recently_removed_key_id >= 0)
+        {
+            drop_deferred_pdus_for_key(p_ble_consumer, p_ble_consumer->context.recently_removed_key_id);
+        }
         status = add_key_to_cache(p_ble_consumer->context.key_cache, reconstructed_key, key_id);
         if (status != 0)
         {
@@ -394,9 +533,16 @@ void key_reconstruction_complete(uint8_t key_id, key_128b * const reconstructed_
         // Key successfully added to cache
         ESP_LOG_BUFFER_HEX("Key: ", reconstructed_key->key, sizeof(key_128b));
 
-        // Mark deferred queue for processing
-        set_deferred_q_pending_processing(p_ble_consumer, true);
-        xEventGroupSetBits(sec_pdu_st.eventGroup, EVENT_PROCESS_DEFFERRED_PDUS);
+        // Release PDUs waiting for this key, before any newer PDU of the key is taken from the processing queue
+        if (set_deferred_key_release_pending(p_ble_consumer, key_id) == 0)
+        {
+            uint16_t released_key_id = 0;
+            pdu_pool_slot_list released_pdus;
+            while (take_released_deferred_pdus(p_ble_consumer, &released_key_id, &released_pdus))
+            {
+                process_deferred_queue(p_ble_consumer, released_key_id, &released_pdus);
+            }
+        }
     }
     else
     {
@@ -405,62 +551,244 @@ void key_reconstruction_complete(uint8_t key_id, key_128b * const reconstructed_
     }
 }
 
-int init_sec_processing_resources()
+// coded_fragment_index covers parity fragments too, see get_coded_key_fragment_index()
+static void handle_key_fragment_pdu(sec_pdu_processing_shard *shard, pdu_pool_slot *slot, beacon_crypto_data *bcd, const uint8_t coded_fragment_index)
 {
-    int status = 0;
+    const uint16_t key_id = get_key_id_from_key_session_data(bcd->key_session_data);
+    const uint8_t key_fragment_index = coded_fragment_index;
+#if KEY_RECONSTRUCTION_INLINE
+    // Fragment odszyfrowany na miejscu - bez kolejki i zadania rekonstrukcji, klucz od razu trafia do pamięci podręcznej nadawcy
+    reconstructed_key_message message = {
+        .key_id = key_id
+    };
+    memcpy(message.mac_address, slot->mac_address, sizeof(esp_bd_addr_t));
+    if (reconstruct_key_fragment_inline(shard->key_collection, key_id, key_fragment_index,
+            bcd->enc_key_fragment, bcd->key_fragment_hmac,
+            bcd->xor_seed, slot->mac_address, &(message.key)) == true)
+    {
+        add_reconstructed_key(shard, &message);
+    }
+#else
+    queue_key_for_reconstruction(key_id, key_fragment_index, 
+        bcd->enc_key_fragment, bcd->key_fragment_hmac, 
+        bcd->xor_seed, slot->mac_address);
+#endif
+}
+
+static void handle_event_key_reconstructed(sec_pdu_processing_shard *shard)
+{
+    reconstructed_key_message message;
+    while (xQueueReceive(shard->keyQueue, &message, 0) == pdTRUE)
+    {
+        add_reconstructed_key(shard, &message);
+    }
+}
+
+// Called on the key reconstruction task, consumer state is left to the shard owning the sender
+void key_reconstruction_complete(uint16_t key_id, key_128b * const reconstructed_key, uint8_t *mac_address)
+{
+    sec_pdu_processing_shard *shard = get_shard_for_mac(mac_address);
+
+    reconstructed_key_message message = {
+        .key_id = key_id
+    };
+    memcpy(&(message.key), reconstructed_key, sizeof(key_128b));
+    memcpy(message.mac_address, mac_address, sizeof(esp_bd_addr_t));
+
+    // Czekaj na miejsce w kolejce zamiast gubić klucz - po powrocie zadanie rekonstrukcji usuwa klucz z kolekcji,
+    // więc zgubiony klucz nie zostałby złożony ponownie. Zadanie shardu nigdy nie czeka bez limitu na zadanie rekonstrukcji i zawsze opróżnia kolejkę
+    xQueueSend(shard->keyQueue, &message, portMAX_DELAY);
+    xEventGroupSetBits(shard->eventGroup, EVENT_KEY_RECONSTRUCTED);
+}
+
+// Consumer of the sender freed by its shard (idle, LRU or index taken over), keys it left half built would never complete
+static void remove_consumer_key_reconstructions(void *context, const esp_bd_addr_t mac_address)
+{
+#if KEY_RECONSTRUCTION_INLINE
+    sec_pdu_processing_shard *shard = (sec_pdu_processing_shard *) context;
+    remove_sender_keys_from_collection(shard->key_collection, mac_address);
+#else
+    (void) context;
+    remove_sender_from_key_reconstruction(mac_address);
+#endif
+}
+
+static uint16_t get_key_reconstructions_count(const uint16_t max_senders)
+{
+    const uint32_t count = (uint32_t) max_senders * KEY_RECONSTRUCTIONS_PER_SENDER;
+    return count < MIN_KEY_RECONSTRUCTIONS ? MIN_KEY_RECONSTRUCTIONS : (uint16_t) (count > UINT16_MAX ? UINT16_MAX : count);
+}
 
+static void destroy_sec_processing_shard(sec_pdu_processing_shard *shard)
+{
+    if (shard->processingQueue != NULL)
+    {
+        vQueueDelete(shard->processingQueue);
+        shard->processingQueue = NULL;
+    }
+
+    if (shard->keyQueue != NULL)
+    {
+        vQueueDelete(shard->keyQueue);
+        shard->keyQueue = NULL;
+    }
+
+    if (shard->eventGroup != NULL)
+    {
+        vEventGroupDelete(shard->eventGroup);
+        shard->eventGroup = NULL;
+    }
+
+    if (shard->consumer_collection != NULL)
+    {
+        destroy_ble_consumer_collection(shard->consumer_collection);
+        shard->consumer_collection = NULL;
+    }
+
+    if (shard->key_collection != NULL)
+    {
+        destroy_key_collection(shard->key_collection);
+        shard->key_collection = NULL;
+    }
+}
+
+static int init_sec_processing_shard(sec_pdu_processing_shard *shard)
+{
     //init processingQueue
-    sec_pdu_st.processingQueue = xQueueCreate(MAX_PROCESSING_QUEUE_ELEMENTS, sizeof(beacon_pdu_data_with_mac_addr));
-    if (sec_pdu_st.processingQueue == NULL)
+    shard->processingQueue = xQueueCreate(MAX_PROCESSING_QUEUE_ELEMENTS, sizeof(pdu_pool_slot *));
+    if (shard->processingQueue == NULL)
     {
         ESP_LOGE(SEC_PDU_PROC_LOG, "processing queue create failed!");
-        status = -1;
-        return status;
+        return -1;
     }
 
-    sec_pdu_st.eventGroup = xEventGroupCreate();
+    shard->keyQueue = xQueueCreate(KEY_QUEUE_SIZE, sizeof(reconstructed_key_message));
+    if (shard->keyQueue == NULL)
+    {
+        destroy_sec_processing_shard(shard);
+        ESP_LOGE(SEC_PDU_PROC_LOG, "key queue create failed!");
+        return -4;
+    }
 
-    if (sec_pdu_st.eventGroup == NULL) {
-        status = -2;
-        vEventGroupDelete(sec_pdu_st.eventGroup);
-        vQueueDelete(sec_pdu_st.processingQueue);
+    shard->eventGroup = xEventGroupCreate();
+    if (shard->eventGroup == NULL)
+    {
+        destroy_sec_processing_shard(shard);
         ESP_LOGE(SEC_PDU_PROC_LOG, "event group create failed!");
-        return status;
+        return -2;
     }
 
-    sec_pdu_st.consumer_collection = create_ble_consumer_collection(sec_pdu_st.ble_consumer_collection_size, KEY_CACHE_SIZE);
-    if (sec_pdu_st.consumer_collection == NULL)
+    // Kolekcje shardów indeksowane wspólnym rejestrem, każdy shard wypełnia tylko indeksy swoich nadawców
+    shard->consumer_collection = create_ble_consumer_collection(sec_pdu_st.registry, KEY_CACHE_SIZE);
+    if (shard->consumer_collection == NULL)
     {
-        status = -3;
-        vQueueDelete(sec_pdu_st.processingQueue);
-        vEventGroupDelete(sec_pdu_st.eventGroup);
+        destroy_sec_processing_shard(shard);
         ESP_LOGE(SEC_PDU_PROC_LOG, "ble consumer collection create failed!");
+        return -3;
+    }
+    register_consumer_removed_callback(shard->consumer_collection, remove_consumer_key_reconstructions, shard);
+
+#if KEY_RECONSTRUCTION_INLINE
+    // Klucze w trakcie rekonstrukcji dzielone między shardy tak jak nadawcy
+    const uint16_t key_reconstructions = get_key_reconstructions_count(sec_pdu_st.ble_consumer_collection_size) / sec_pdu_st.no_shards + 1;
+    shard->key_collection = create_inline_key_reconstruction(key_reconstructions);
+    if (shard->key_collection == NULL)
+    {
+        destroy_sec_processing_shard(shard);
+        ESP_LOGE(SEC_PDU_PROC_LOG, "key reconstruction collection create failed!");
+        return -5;
+    }
+#endif
+
+    return 0;
+}
+
+int init_sec_processing_resources()
+{
+    int status = 0;
+
+    if (init_pdu_pool() != 0)
+    {
+        ESP_LOGE(SEC_PDU_PROC_LOG, "pdu pool init failed!");
+        status = -5;
+        return status;
+    }
+
+    sec_pdu_st.registry = create_sender_registry(sec_pdu_st.ble_consumer_collection_size);
+    if (sec_pdu_st.registry == NULL)
+    {
+        status = -6;
+        ESP_LOGE(SEC_PDU_PROC_LOG, "sender registry create failed!");
+        return status;
+    }
+
+    for (uint8_t i = 0; i < sec_pdu_st.no_shards && status == 0; i++)
+    {
+        status = init_sec_processing_shard(&(sec_pdu_st.shards[i]));
+        if (status != 0)
+        {
+            for (uint8_t j = 0; j < i; j++)
+            {
+                destroy_sec_processing_shard(&(sec_pdu_st.shards[j]));
+            }
+        }
+    }
+
+    if (status != 0)
+    {
+        return status;
     }
 
     sec_pdu_st.payload_decription_subcribers_collection = create_pdo_collection(MAX_PDU_RECEIVE_OBSERVERS);
-    if (sec_pdu_st.consumer_collection == NULL)
+    if (sec_pdu_st.payload_decription_subcribers_collection == NULL)
     {
         status = -4;
-        vQueueDelete(sec_pdu_st.processingQueue);
-        vEventGroupDelete(sec_pdu_st.eventGroup);
-        destroy_ble_consumer_collection(sec_pdu_st.consumer_collection);
-        ESP_LOGE(SEC_PDU_PROC_LOG, "ble consumer collection create failed!");
+        for (uint8_t i = 0; i < sec_pdu_st.no_shards; i++)
+        {
+            destroy_sec_processing_shard(&(sec_pdu_st.shards[i]));
+        }
+        ESP_LOGE(SEC_PDU_PROC_LOG, "payload observer collection create failed!");
     }
 
     return status;
 }
 
 int start_up_sec_processing()
+{
+    return start_up_sec_processing_for_senders(MAX_BLE_CONSUMERS);
+}
+
+int start_up_sec_processing_for_senders(const uint16_t max_senders)
+{
+    return start_up_sec_processing_with_shards(max_senders, SEC_PDU_PROCESSING_SHARDS);
+}
+
+int start_up_sec_processing_with_shards(const uint16_t max_senders, const uint8_t no_shards)
 {
     int status = 0;
 
+    if (max_senders == 0 || no_shards == 0 || no_shards > MAX_SEC_PDU_PROCESSING_SHARDS)
+    {
+        return -1;
+    }
+
+    if (sec_pdu_st.is_sec_pdu_processing_initialised == false)
+    {
+        sec_pdu_st.ble_consumer_collection_size = max_senders;
+        sec_pdu_st.no_shards = no_shards;
+    }
+
     status = init_sec_processing_resources();
 
-    status = init_adv_time_authorize_object() == true? 0: 1;
+    if (status == 0)
+    {
+        status = init_adv_time_authorize_object(sec_pdu_st.registry) == true? 0: 1;
+    }
 
+#if KEY_RECONSTRUCTION_INLINE == 0
     if (status == 0)
     {
-        int key_reconstructor_status = start_up_key_reconstructor(MAX_BLE_CONSUMERS * 10);
+        int key_reconstructor_status = start_up_key_reconstructor(get_key_reconstructions_count(max_senders));
         if (key_reconstructor_status != 0)
         {
             status = -3;
@@ -470,30 +798,38 @@ int start_up_sec_processing()
             register_callback_to_key_reconstruction(key_reconstruction_complete);
         }
     }
+#endif
 
     if (status == 0)
     {
         sec_pdu_st.is_sec_pdu_processing_initialised = true;
-        if (sec_pdu_st.xSecProcessingTask == NULL)
+        for (uint8_t i = 0; i < sec_pdu_st.no_shards && status == 0; i++)
         {
+            sec_pdu_processing_shard *shard = &(sec_pdu_st.shards[i]);
+            if (shard->xSecProcessingTask != NULL)
+            {
+                continue;
+            }
+
+            // Każdy shard przypięty do rdzenia z tablicy secPduProcessingShardCores
             BaseType_t  taskCreateResult = xTaskCreatePinnedToCore(
                 sec_processing_main,
                 tasksDataArr[SEC_PDU_PROCESSING].name, 
                 tasksDataArr[SEC_PDU_PROCESSING].stackSize,
-                NULL,
+                shard,
                 tasksDataArr[SEC_PDU_PROCESSING].priority,
-                &(sec_pdu_st.xSecProcessingTask),
-                tasksDataArr[SEC_PDU_PROCESSING].core
+                &(shard->xSecProcessingTask),
+                secPduProcessingShardCores[i]
                 );
         
             if (taskCreateResult != pdPASS)
             {
                 status = -2;
-                ESP_LOGE(SEC_PDU_PROC_LOG, "Task was not created successfully! :(");
+                ESP_LOGE(SEC_PDU_PROC_LOG, "Task of shard %i was not created successfully! :(", i);
             }
             else
             {
-                ESP_LOGI(SEC_PDU_PROC_LOG, "Task was created successfully! :)");
+                ESP_LOGI(SEC_PDU_PROC_LOG, "Task of shard %i was created successfully on core %i! :)", i, (int) secPduProcessingShardCores[i]);
             }
         }
     }
@@ -502,25 +838,28 @@ int start_up_sec_processing()
 }
 
 
-int enqueue_pdu_for_processing(uint8_t* data, size_t size, esp_bd_addr_t mac_address)
+int enqueue_pdu_for_processing(pdu_pool_slot* slot)
 {
     BaseType_t stats = pdFAIL;
 
     if (sec_pdu_st.is_sec_pdu_processing_initialised == true)
     {   
-        if (data != NULL && mac_address != NULL)
+        if (slot != NULL)
         {
-            beacon_pdu_data_with_mac_addr temp_pdu = {0};
-            memcpy(temp_pdu.data, data, size);
-            temp_pdu.size = size;
-            memcpy(temp_pdu.mac_address, mac_address, sizeof(esp_bd_addr_t));
-            stats = xQueueSend(sec_pdu_st.processingQueue, ( void * ) &temp_pdu, QUEUE_TIMEOUT_SYS_TICKS);
+            // Pakiet trafia do sharda właściciela nadawcy
+            sec_pdu_processing_shard *shard = get_shard_for_mac(slot->mac_address);
+            stats = xQueueSend(shard->processingQueue, ( void * ) &slot, QUEUE_TIMEOUT_SYS_TICKS);
             if (stats)
             {
-                xEventGroupSetBits(sec_pdu_st.eventGroup, EVENT_NEW_PDU);
+                xEventGroupSetBits(shard->eventGroup, EVENT_NEW_PDU);
             }
         }
     }
 
+    if (stats != pdPASS)
+    {
+        release_pdu_pool_slot(slot);
+    }
+
     return stats;
 }
@@ -0,0 +1,63 @@
+#include "unity.h"
+#include "ble_consumer_collection.h"
+#include "sender_registry.h"
+
+#include <string.h>
+
+static const esp_bd_addr_t first_mac_address = {0x24, 0x0A, 0xC4, 0x00, 0x01, 0x01};
+static const esp_bd_addr_t second_mac_address = {0x24, 0x0A, 0xC4, 0x00, 0x01, 0x02};
+
+TEST_CASE("consumer is placed at the sender index assigned by the registry", "[consumer_collection]")
+{
+    sender_registry *registry = create_sender_registry(4);
+    TEST_ASSERT_NOT_NULL(registry);
+    ble_consumer_collection *collection = create_ble_consumer_collection(registry, KEY_CACHE_SIZE);
+    TEST_ASSERT_NOT_NULL(collection);
+
+    add_sender_to_registry(registry, second_mac_address);
+    const int sender_index = add_sender_to_registry(registry, first_mac_address);
+    ble_consumer *p_ble_consumer = add_consumer_to_collection(collection, sender_index, (uint8_t *) first_mac_address);
+    TEST_ASSERT_NOT_NULL(p_ble_consumer);
+    TEST_ASSERT_TRUE(p_ble_consumer == get_ble_consumer_for_sender_index(collection, sender_index, (uint8_t *) first_mac_address));
+    TEST_ASSERT_EQUAL(2, get_no_registered_senders(registry));
+
+    destroy_ble_consumer_collection(collection);
+    destroy_sender_registry(registry);
+}
+
+TEST_CASE("unregistered sender does not get a consumer or a registry index", "[consumer_collection]")
+{
+    sender_registry *registry = create_sender_registry(4);
+    TEST_ASSERT_NOT_NULL(registry);
+    ble_consumer_collection *collection = create_ble_consumer_collection(registry, KEY_CACHE_SIZE);
+    TEST_ASSERT_NOT_NULL(collection);
+
+    TEST_ASSERT_NULL(add_consumer_to_collection(collection, 0, (uint8_t *) first_mac_address));
+    TEST_ASSERT_EQUAL(0, get_no_registered_senders(registry));
+    TEST_ASSERT_EQUAL(0, get_active_no_consumers(collection));
+
+    destroy_ble_consumer_collection(collection);
+    destroy_sender_registry(registry);
+}
+
+TEST_CASE("PDU queued before its sender index was taken over is dropped", "[consumer_collection]")
+{
+    sender_registry *registry = create_sender_registry(1);
+    TEST_ASSERT_NOT_NULL(registry);
+    ble_consumer_collection *collection = create_ble_consumer_collection(registry, KEY_CACHE_SIZE);
+    TEST_ASSERT_NOT_NULL(collection);
+
+    // The authorizer frees the index of the first sender and gives it to the second one
+    const int first_index = add_sender_to_registry(registry, first_mac_address);
+    remove_sender_from_registry(registry, first_mac_address);
+    const int second_index = add_sender_to_registry(registry, second_mac_address);
+    TEST_ASSERT_EQUAL(first_index, second_index);
+
+    TEST_ASSERT_NULL(add_consumer_to_collection(collection, first_index, (uint8_t *) first_mac_address));
+    TEST_ASSERT_NOT_NULL(add_consumer_to_collection(collection, second_index, (uint8_t *) second_mac_address));
+    TEST_ASSERT_EQUAL(1, get_no_registered_senders(registry));
+    TEST_ASSERT_EQUAL(1, get_active_no_consumers(collection));
+
+    destroy_ble_consumer_collection(collection);
+    destroy_sender_registry(registry);
+}
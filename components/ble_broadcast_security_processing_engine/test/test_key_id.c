@@ -0,0 +1,109 @@
+#include "unity.h"
+#include "ble_consumer.h"
+#include "key_cache.h"
+#include "key_management.h"
+#include "pdu_pool.h"
+
+#include <string.h>
+
+// Key ids are 14 bit, these two differ only above the low byte
+#define TEST_KEY_ID 0x1234
+#define TEST_ALIASED_KEY_ID 0x0034
+
+static void fill_key(key_128b *key, uint8_t seed)
+{
+    for (size_t i = 0; i < sizeof(key->key); i++)
+    {
+        key->key[i] = (uint8_t) (seed + i);
+    }
+}
+
+TEST_CASE("key cache keeps keys whose ids share the low byte apart", "[key_id]")
+{
+    key_reconstruction_cache *key_cache = NULL;
+    TEST_ASSERT_EQUAL(0, create_key_cache(&key_cache, KEY_CACHE_SIZE));
+    TEST_ASSERT_EQUAL(0, init_key_cache(key_cache));
+
+    key_128b key = {0};
+    key_128b aliased_key = {0};
+    key_128b zero_id_key = {0};
+    fill_key(&key, 0x10);
+    fill_key(&aliased_key, 0x80);
+    fill_key(&zero_id_key, 0xC0);
+    TEST_ASSERT_EQUAL(0, add_key_to_cache(key_cache, &key, TEST_KEY_ID));
+    TEST_ASSERT_FALSE(is_key_in_cache(key_cache, TEST_ALIASED_KEY_ID));
+    TEST_ASSERT_EQUAL(0, add_key_to_cache(key_cache, &aliased_key, TEST_ALIASED_KEY_ID));
+    // Key id 0 is a regular session id, not a free slot marker
+    TEST_ASSERT_EQUAL(0, add_key_to_cache(key_cache, &zero_id_key, 0));
+
+    TEST_ASSERT_EQUAL_HEX8_ARRAY(key.key, get_key_from_cache(key_cache, TEST_KEY_ID)->key, sizeof(key.key));
+    TEST_ASSERT_EQUAL_HEX8_ARRAY(aliased_key.key, get_key_from_cache(key_cache, TEST_ALIASED_KEY_ID)->key, sizeof(key.key));
+    TEST_ASSERT_EQUAL_HEX8_ARRAY(zero_id_key.key, get_key_from_cache(key_cache, 0)->key, sizeof(key.key));
+    TEST_ASSERT_NOT_EQUAL(get_key_schedule_from_cache(key_cache, TEST_KEY_ID), get_key_schedule_from_cache(key_cache, TEST_ALIASED_KEY_ID));
+
+    TEST_ASSERT_EQUAL(0, remove_key_from_cache(key_cache, TEST_ALIASED_KEY_ID));
+    TEST_ASSERT_TRUE(is_key_in_cache(key_cache, TEST_KEY_ID));
+    TEST_ASSERT_TRUE(is_key_in_cache(key_cache, 0));
+    TEST_ASSERT_FALSE(is_key_in_cache(key_cache, TEST_ALIASED_KEY_ID));
+
+    TEST_ASSERT_EQUAL(0, destroy_key_cache(key_cache));
+}
+
+TEST_CASE("deferred PDUs are released by the full key id", "[key_id]")
+{
+    TEST_ASSERT_EQUAL(0, init_pdu_pool());
+    const uint32_t free_slots = get_no_free_pdu_pool_slots();
+
+    ble_consumer *p_ble_consumer = create_ble_consumer(KEY_CACHE_SIZE);
+    TEST_ASSERT_NOT_NULL(p_ble_consumer);
+    TEST_ASSERT_EQUAL(0, init_ble_consumer(p_ble_consumer));
+
+    pdu_pool_slot *slot = acquire_pdu_pool_slot();
+    pdu_pool_slot *aliased_slot = acquire_pdu_pool_slot();
+    TEST_ASSERT_NOT_NULL(slot);
+    TEST_ASSERT_NOT_NULL(aliased_slot);
+    TEST_ASSERT_EQUAL(0, add_to_deferred_queue(p_ble_consumer, slot, TEST_KEY_ID));
+    TEST_ASSERT_EQUAL(0, add_to_deferred_queue(p_ble_consumer, aliased_slot, TEST_ALIASED_KEY_ID));
+
+    TEST_ASSERT_EQUAL(0, set_deferred_key_release_pending(p_ble_consumer, TEST_KEY_ID));
+    uint16_t released_key_id = 0;
+    pdu_pool_slot_list released_pdus;
+    init_pdu_pool_slot_list(&released_pdus);
+    TEST_ASSERT_TRUE(take_released_deferred_pdus(p_ble_consumer, &released_key_id, &released_pdus));
+    TEST_ASSERT_EQUAL(TEST_KEY_ID, released_key_id);
+    TEST_ASSERT_EQUAL(1, released_pdus.count);
+    TEST_ASSERT_EQUAL_PTR(slot, released_pdus.head);
+
+    TEST_ASSERT_FALSE(is_pdu_for_key_in_deferred_queue(p_ble_consumer, TEST_KEY_ID));
+    TEST_ASSERT_TRUE(is_pdu_for_key_in_deferred_queue(p_ble_consumer, TEST_ALIASED_KEY_ID));
+    TEST_ASSERT_FALSE(take_released_deferred_pdus(p_ble_consumer, &released_key_id, &released_pdus));
+
+    release_pdu_pool_slot_list(&released_pdus);
+    TEST_ASSERT_EQUAL(0, destroy_ble_consumer(p_ble_consumer));
+    TEST_ASSERT_EQUAL(free_slots, get_no_free_pdu_pool_slots());
+}
+
+TEST_CASE("key fragments are collected by the full key id", "[key_id]")
+{
+    key_reconstruction_collection *key_collection = create_new_key_collection(2);
+    TEST_ASSERT_NOT_NULL(key_collection);
+
+    esp_bd_addr_t mac_address = {0x24, 0x0A, 0xC4, 0x00, 0x00, 0x01};
+    TEST_ASSERT_TRUE(add_new_key_to_collection(key_collection, mac_address, TEST_KEY_ID));
+    TEST_ASSERT_FALSE(is_key_in_collection(key_collection, mac_address, TEST_ALIASED_KEY_ID));
+    TEST_ASSERT_TRUE(add_new_key_to_collection(key_collection, mac_address, TEST_ALIASED_KEY_ID));
+
+    uint8_t fragment[KEY_FRAGMENT_SIZE] = {0};
+    for (uint8_t i = 0; i < NO_KEY_FRAGMENTS; i++)
+    {
+        add_fragment_to_key_management(key_collection, mac_address, TEST_KEY_ID, fragment, i);
+    }
+
+    TEST_ASSERT_TRUE(is_key_available(key_collection, mac_address, TEST_KEY_ID));
+    TEST_ASSERT_FALSE(is_key_available(key_collection, mac_address, TEST_ALIASED_KEY_ID));
+    TEST_ASSERT_FALSE(is_key_fragment_decrypted(key_collection, mac_address, TEST_ALIASED_KEY_ID, 0));
+
+    remove_key_from_collection(key_collection, mac_address, TEST_KEY_ID);
+    TEST_ASSERT_TRUE(is_key_in_collection(key_collection, mac_address, TEST_ALIASED_KEY_ID));
+    destroy_key_collection(key_collection);
+}
@@ -0,0 +1,119 @@
+#include "unity.h"
+#include "ble_consumer_collection.h"
+#include "key_management.h"
+#include "key_reconstructor.h"
+#include "sender_registry.h"
+#include "test.h"
+
+#include <string.h>
+
+#define TEST_KEY_ID 0x0123
+#define TEST_XOR_SEED 0x5A
+
+static const esp_bd_addr_t test_mac_address = {0x24, 0x0A, 0xC4, 0x00, 0x00, 0x01};
+static const esp_bd_addr_t other_mac_address = {0x24, 0x0A, 0xC4, 0x00, 0x00, 0x02};
+
+// Masked fragment with its HMAC as the sender puts it into a key PDU
+static void fill_key_fragment(uint8_t encrypted_fragment[KEY_FRAGMENT_SIZE], uint8_t hmac[HMAC_SIZE], uint8_t seed)
+{
+    uint8_t fragment[KEY_FRAGMENT_SIZE];
+    for (size_t i = 0; i < KEY_FRAGMENT_SIZE; i++)
+    {
+        fragment[i] = (uint8_t) (seed + i);
+    }
+    xor_encrypt_key_fragment(fragment, encrypted_fragment, TEST_XOR_SEED);
+    calculate_hmac_of_fragment(fragment, encrypted_fragment, hmac);
+}
+
+TEST_CASE("key fragment with a bad HMAC does not take a collection entry", "[key_reconstruction]")
+{
+    // Rejected fragments are counted by the test framework
+    init_test();
+    key_reconstruction_collection *key_collection = create_inline_key_reconstruction(1);
+    TEST_ASSERT_NOT_NULL(key_collection);
+    // Owned by the shard, no mutex on the per fragment path
+    TEST_ASSERT_NULL(key_collection->xMutex);
+
+    uint8_t encrypted_fragment[KEY_FRAGMENT_SIZE];
+    uint8_t hmac[HMAC_SIZE];
+    key_128b key;
+    fill_key_fragment(encrypted_fragment, hmac, 0x10);
+    hmac[0] ^= 0x01;
+    TEST_ASSERT_FALSE(reconstruct_key_fragment_inline(key_collection, TEST_KEY_ID, 0, encrypted_fragment, hmac, TEST_XOR_SEED, test_mac_address, &key));
+    TEST_ASSERT_FALSE(is_key_in_collection(key_collection, test_mac_address, TEST_KEY_ID));
+
+    hmac[0] ^= 0x01;
+    TEST_ASSERT_FALSE(reconstruct_key_fragment_inline(key_collection, TEST_KEY_ID, 0, encrypted_fragment, hmac, TEST_XOR_SEED, test_mac_address, &key));
+    TEST_ASSERT_TRUE(is_key_in_collection(key_collection, test_mac_address, TEST_KEY_ID));
+    TEST_ASSERT_TRUE(is_key_fragment_decrypted(key_collection, test_mac_address, TEST_KEY_ID, 0));
+
+    destroy_key_collection(key_collection);
+}
+
+TEST_CASE("full key collection gives the least recently updated entry to a new key", "[key_reconstruction]")
+{
+    key_reconstruction_collection *key_collection = create_new_key_collection(2);
+    TEST_ASSERT_NOT_NULL(key_collection);
+
+    uint8_t fragment[KEY_FRAGMENT_SIZE] = {0};
+    TEST_ASSERT_TRUE(add_new_key_to_collection(key_collection, (uint8_t *) test_mac_address, TEST_KEY_ID));
+    TEST_ASSERT_TRUE(add_new_key_to_collection(key_collection, (uint8_t *) test_mac_address, TEST_KEY_ID + 1));
+    // The older key receives a fragment and becomes the most recently updated one
+    add_fragment_to_key_management(key_collection, test_mac_address, TEST_KEY_ID, fragment, 0);
+
+    TEST_ASSERT_TRUE(add_new_key_to_collection(key_collection, (uint8_t *) other_mac_address, TEST_KEY_ID));
+    TEST_ASSERT_TRUE(is_key_in_collection(key_collection, test_mac_address, TEST_KEY_ID));
+    TEST_ASSERT_TRUE(is_key_fragment_decrypted(key_collection, test_mac_address, TEST_KEY_ID, 0));
+    TEST_ASSERT_FALSE(is_key_in_collection(key_collection, test_mac_address, TEST_KEY_ID + 1));
+    TEST_ASSERT_TRUE(is_key_in_collection(key_collection, other_mac_address, TEST_KEY_ID));
+    TEST_ASSERT_FALSE(is_key_fragment_decrypted(key_collection, other_mac_address, TEST_KEY_ID, 0));
+
+    destroy_key_collection(key_collection);
+}
+
+TEST_CASE("keys in reconstruction are removed by sender", "[key_reconstruction]")
+{
+    key_reconstruction_collection *key_collection = create_new_key_collection(3);
+    TEST_ASSERT_NOT_NULL(key_collection);
+
+    TEST_ASSERT_TRUE(add_new_key_to_collection(key_collection, (uint8_t *) test_mac_address, TEST_KEY_ID));
+    TEST_ASSERT_TRUE(add_new_key_to_collection(key_collection, (uint8_t *) test_mac_address, TEST_KEY_ID + 1));
+    TEST_ASSERT_TRUE(add_new_key_to_collection(key_collection, (uint8_t *) other_mac_address, TEST_KEY_ID));
+
+    remove_sender_keys_from_collection(key_collection, test_mac_address);
+    TEST_ASSERT_FALSE(is_key_in_collection(key_collection, test_mac_address, TEST_KEY_ID));
+    TEST_ASSERT_FALSE(is_key_in_collection(key_collection, test_mac_address, TEST_KEY_ID + 1));
+    TEST_ASSERT_TRUE(is_key_in_collection(key_collection, other_mac_address, TEST_KEY_ID));
+
+    destroy_key_collection(key_collection);
+}
+
+static esp_bd_addr_t removed_mac_address;
+static int no_removed_consumers;
+
+static void count_removed_consumer(void *context, const esp_bd_addr_t mac_address)
+{
+    (void) context;
+    memcpy(removed_mac_address, mac_address, sizeof(esp_bd_addr_t));
+    no_removed_consumers++;
+}
+
+TEST_CASE("freed consumer is reported to the removal callback", "[key_reconstruction]")
+{
+    sender_registry *registry = create_sender_registry(2);
+    TEST_ASSERT_NOT_NULL(registry);
+    ble_consumer_collection *collection = create_ble_consumer_collection(registry, KEY_CACHE_SIZE);
+    TEST_ASSERT_NOT_NULL(collection);
+    register_consumer_removed_callback(collection, count_removed_consumer, NULL);
+    no_removed_consumers = 0;
+
+    const int sender_index = add_sender_to_registry(registry, test_mac_address);
+    TEST_ASSERT_NOT_NULL(add_consumer_to_collection(collection, sender_index, (uint8_t *) test_mac_address));
+    TEST_ASSERT_EQUAL(0, no_removed_consumers);
+    TEST_ASSERT_EQUAL(1, remove_idle_consumers_from_collection(collection, 0));
+    TEST_ASSERT_EQUAL(1, no_removed_consumers);
+    TEST_ASSERT_EQUAL_HEX8_ARRAY(test_mac_address, removed_mac_address, sizeof(esp_bd_addr_t));
+
+    destroy_ble_consumer_collection(collection);
+    destroy_sender_registry(registry);
+}
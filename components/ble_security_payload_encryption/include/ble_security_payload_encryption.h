@@ -2,14 +2,69 @@
 #define BLE_PDU_ENGINE_ENCRYPTOR_H
 
 #include "beacon_pdu_data.h"
+#include "beacon_record_list.h"
+#include "key_fragment_cadence.h"
 #include "stddef.h"
 
+// Coalesces application messages into one record list PDU (RECORDS_DATA_CMD / AEAD_RECORDS_DATA_CMD).
+// Records are flushed when the next one does not fit or the oldest one waited max_delay_ms,
+// not thread safe, owner serializes access
+typedef struct {
+    uint8_t records[MAX_PDU_PAYLOAD_SIZE];
+    size_t size;
+    size_t capacity;
+    uint16_t no_records;
+    int64_t first_record_timestamp_us;
+    int64_t max_delay_us;
+    bool aead;
+} payload_aggregator;
+
 bool init_payload_encryption();
 
 bool set_key_replacement_pdu_count(const uint32_t count);
 
+void set_key_fragment_piggybacking(const bool enabled);
+
+// Key fragments put into every key PDU, 1 to MAX_KEY_FRAGMENTS_PER_PDU
+bool set_key_fragments_per_pdu(const uint8_t count);
+
+// Parity fragments sent after every round of key fragments, 0 to NO_KEY_PARITY_FRAGMENTS.
+// Observers rebuild the key from any NO_KEY_FRAGMENTS distinct fragments of the round
+bool set_key_parity_fragments(const uint8_t count);
+
+// Fragments of the next key are sent with its key id during the last count PDUs of every key session,
+// in data PDUs carrying a key fragment and behind the first fragment of key PDUs. 0 generates the key at rotation
+void set_key_handover_slots(const uint32_t count);
+
+// Replaces the key fragment PDU cadence (SENDER_KEY_FRAGMENT_CADENCE_TAPERED in config.h by default),
+// the next PDU becomes a key PDU. context of the policy must outlive the sender
+void set_key_fragment_cadence_policy(const key_fragment_cadence_policy *policy);
+
+// Asked once per sender slot, true when the slot goes to get_key_fragment_pdu(), false for a data PDU
+bool is_key_fragment_pdu_due();
+
+// Payloads up to MAX_DATA_KEY_FRAGMENT_PDU_PAYLOAD_SIZE carry the next key fragment (DATA_KEY_FRAGMENT_CMD)
+// (DATA_KEY_PARITY_FRAGMENT_CMD for a parity fragment) when piggybacking is enabled, longer ones are sent as DATA_CMD
 int encrypt_payload(uint8_t * payload, size_t payload_size, beacon_pdu_data * encrypted_pdu);
 
+// AEAD_DATA_CMD PDU, payload_size of the PDU includes DATA_PDU_AEAD_TAG_SIZE bytes of tag
+int encrypt_payload_aead(uint8_t * payload, size_t payload_size, beacon_pdu_data * encrypted_pdu);
+
+void init_payload_aggregator(payload_aggregator * aggregator, const uint32_t max_delay_ms, const bool aead);
+
+// Queues the payload as a record, when it does not fit the queued records are encrypted into encrypted_pdu first.
+// Returns 1 when encrypted_pdu is ready to send, 0 when the payload was only queued, negative value on error
+int add_payload_to_aggregator(payload_aggregator * aggregator, uint8_t * payload, size_t payload_size, beacon_pdu_data * encrypted_pdu);
+
+// Encrypts the queued records once the oldest one waited max_delay_ms, return value as add_payload_to_aggregator
+int flush_payload_aggregator_if_due(payload_aggregator * aggregator, const int64_t now_us, beacon_pdu_data * encrypted_pdu);
+
+// Encrypts the queued records regardless of their age, return value as add_payload_to_aggregator
+int flush_payload_aggregator(payload_aggregator * aggregator, beacon_pdu_data * encrypted_pdu);
+
+// Key PDU with up to key_fragments_per_pdu next fragments of the current key, no_fragments is set accordingly.
+// Key and parity fragments go into separate PDUs (KEY_FRAGMENT_CMD / KEY_PARITY_FRAGMENT_CMD).
+// The first fragment always belongs to the current key, during key handover the rest to the next key
 int get_key_fragment_pdu(beacon_key_pdu_data * key_pdu);
 
 uint32_t get_time_interval_for_current_session_key();
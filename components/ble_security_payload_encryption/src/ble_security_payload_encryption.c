@@ -1,5 +1,7 @@
 #include "ble_security_payload_encryption.h"
 #include "crypto.h"
+#include "key_fragment_coding.h"
+#include "key_fragment_cadence.h"
 
 #include "esp_log.h"
 #include "esp_random.h"
@@ -21,12 +23,43 @@ static key_splitted splitted_pre_shared_key;
 static key_128b next_pre_shared_key; 
 static key_splitted next_splitted_pre_shared_key;
 static uint16_t key_id;
+static uint16_t next_key_id;
+static bool is_next_key_announced = false;
 static uint8_t encrypt_payload_arr[MAX_PDU_PAYLOAD_SIZE] = {0};
 static  esp_timer_handle_t key_replacement_timer;
 void key_replacement_cb();
 
 static volatile uint32_t key_replacement_packet_counter = TEST_NO_PACKETS_TO_KEY_REPLACE;
 static volatile uint64_t encrypted_packet_counter = 0;
+static bool is_key_fragment_piggybacking_enabled = SENDER_PIGGYBACK_KEY_FRAGMENTS;
+static uint8_t key_fragments_per_pdu = (SENDER_KEY_FRAGMENTS_PER_PDU < MAX_KEY_FRAGMENTS_PER_PDU) ? SENDER_KEY_FRAGMENTS_PER_PDU : MAX_KEY_FRAGMENTS_PER_PDU;
+static uint8_t key_parity_fragments = (SENDER_KEY_PARITY_FRAGMENTS < NO_KEY_PARITY_FRAGMENTS) ? SENDER_KEY_PARITY_FRAGMENTS : NO_KEY_PARITY_FRAGMENTS;
+static uint8_t next_coded_key_fragment = 0;
+static uint8_t next_key_coded_fragment = 0;
+static uint32_t key_handover_slots = SENDER_KEY_HANDOVER_SLOTS;
+
+#if SENDER_KEY_FRAGMENT_CADENCE_TAPERED
+static const tapered_key_fragment_cadence_config tapered_key_fragment_cadence = {
+    .burst_slots = SENDER_KEY_CADENCE_BURST_SLOTS,
+    .burst_gap = SENDER_KEY_CADENCE_BURST_GAP,
+    .taper_step_slots = SENDER_KEY_CADENCE_TAPER_STEP_SLOTS,
+    .floor_gap = SENDER_KEY_CADENCE_FLOOR_GAP,
+};
+static key_fragment_scheduler key_fragment_pdu_scheduler = {
+    .policy = {
+        .get_data_pdus_between_key_pdus = get_tapered_key_fragment_cadence,
+        .context = &tapered_key_fragment_cadence,
+    },
+#else
+static const uint16_t fixed_key_fragment_cadence_gap = PDU_TO_KEY_FRAGMENT_RATIO;
+static key_fragment_scheduler key_fragment_pdu_scheduler = {
+    .policy = {
+        .get_data_pdus_between_key_pdus = get_fixed_key_fragment_cadence,
+        .context = &fixed_key_fragment_cadence_gap,
+    },
+#endif
+    .data_pdus_since_key_pdu = UINT16_MAX,
+};
 
 
 uint16_t get_current_key_id()
@@ -39,33 +72,113 @@ uint32_t get_time_interval_for_current_session_key()
     return get_adv_interval_from_key_id(get_current_key_id());
 }
 
-void key_replacement_cb()
+uint16_t get_random_key_id() {
+    return esp_random() & 0x3FFF;  // Mask to ensure range [0x0000, 0x3FFF]
+}
+
+// Generates the key of the next session, from now on its fragments can be announced with next_key_id
+static void prepare_next_key()
 {
     generate_128b_key(&next_pre_shared_key);
     ESP_LOG_BUFFER_HEX("New key: ", next_pre_shared_key.key, sizeof(next_pre_shared_key));
     split_128b_key_to_fragment(&next_pre_shared_key, &next_splitted_pre_shared_key);
-    memcpy(&pre_shared_key, &next_pre_shared_key, sizeof(pre_shared_key));
-    memcpy(&splitted_pre_shared_key, &next_splitted_pre_shared_key, sizeof(pre_shared_key));
+
+    next_key_id = get_random_key_id();
+
+    next_key_coded_fragment = 0;
+    is_next_key_announced = true;
 }
 
-uint16_t get_random_key_id() {
-    return esp_random() & 0x3FFF;  // Mask to ensure range [0x0000, 0x3FFF]
+void key_replacement_cb()
+{
+    if (is_next_key_announced == false)
+    {
+        prepare_next_key();
+    }
+    memcpy(&pre_shared_key, &next_pre_shared_key, sizeof(pre_shared_key));
+    memcpy(&splitted_pre_shared_key, &next_splitted_pre_shared_key, sizeof(splitted_pre_shared_key));
+    key_id = next_key_id;
+    is_next_key_announced = false;
 }
 
 uint16_t get_next_key_fragment()
 {
-    static uint16_t key_fragment_no = 0;
-    uint16_t return_fragment_no = key_fragment_no;
+    uint16_t return_fragment_no = next_coded_key_fragment;
     
-    key_fragment_no++;
-    if (key_fragment_no > 3)
+    next_coded_key_fragment++;
+    if (next_coded_key_fragment >= NO_KEY_FRAGMENTS + key_parity_fragments)
     {
-        key_fragment_no = 0;
+        next_coded_key_fragment = 0;
     }
 
     return return_fragment_no; 
 }
 
+static bool is_next_key_fragment_parity()
+{
+    return next_coded_key_fragment >= NO_KEY_FRAGMENTS;
+}
+
+// Masked coded fragment of the key with its HMAC, shared by key PDUs and data PDUs carrying a fragment
+static void fill_key_fragment(beacon_crypto_data *bcd, key_splitted *splitted_key, const uint16_t fragment_key_id, const uint8_t coded_fragment_no)
+{
+    const uint8_t random_xor_seed = get_random_seed();
+
+    // Fragment parzystości liczony z fragmentów klucza, indeks w sesji klucza liczony od pierwszego fragmentu parzystości
+    uint8_t parity_fragment[KEY_FRAGMENT_SIZE];
+    uint8_t *key_fragment = splitted_key->fragment[coded_fragment_no % NO_KEY_FRAGMENTS];
+    if (coded_fragment_no >= NO_KEY_FRAGMENTS)
+    {
+        encode_key_parity_fragment(splitted_key, coded_fragment_no - NO_KEY_FRAGMENTS, parity_fragment);
+        key_fragment = parity_fragment;
+    }
+
+    bcd->key_session_data = produce_key_session_data(fragment_key_id, coded_fragment_no % NO_KEY_FRAGMENTS);
+    bcd->xor_seed = random_xor_seed;
+
+    xor_encrypt_key_fragment(key_fragment, bcd->enc_key_fragment, random_xor_seed);
+
+    calculate_hmac_of_fragment(key_fragment, bcd->enc_key_fragment, bcd->key_fragment_hmac);
+}
+
+static void fill_next_key_fragment(beacon_crypto_data *bcd)
+{
+    fill_key_fragment(bcd, &splitted_pre_shared_key, key_id, get_next_key_fragment());
+}
+
+// Next coded fragment of the announced key, parity selects the kind of fragment when the PDU command already fixed it
+static void fill_next_announced_key_fragment(beacon_crypto_data *bcd, const bool parity)
+{
+    if ((next_key_coded_fragment >= NO_KEY_FRAGMENTS) != parity)
+    {
+        next_key_coded_fragment = parity ? NO_KEY_FRAGMENTS : 0;
+    }
+
+    fill_key_fragment(bcd, &next_splitted_pre_shared_key, next_key_id, next_key_coded_fragment);
+
+    next_key_coded_fragment++;
+    if (next_key_coded_fragment >= NO_KEY_FRAGMENTS + key_parity_fragments)
+    {
+        next_key_coded_fragment = 0;
+    }
+}
+
+static void replace_key_if_due()
+{
+    if (encrypted_packet_counter % key_replacement_packet_counter == 0)
+    {
+        ESP_LOGI(MSG_SENDER_LOG_GROUP, "Key replacement in progress...");
+        key_replacement_cb();
+        encrypted_packet_counter = 0;
+    }
+    else if (is_next_key_announced == false && key_handover_slots != 0 &&
+             encrypted_packet_counter + key_handover_slots >= key_replacement_packet_counter)
+    {
+        ESP_LOGI(MSG_SENDER_LOG_GROUP, "Next key announced...");
+        prepare_next_key();
+    }
+}
+
 bool init_payload_encryption()
 {
     static bool isInitialized = false;
@@ -86,74 +199,244 @@ bool set_key_replacement_pdu_count(const uint32_t count)
     return true;
 }
 
-int encrypt_payload(uint8_t * payload, size_t payload_size, beacon_pdu_data * encrypted_pdu)
+void set_key_fragment_piggybacking(const bool enabled)
+{
+    is_key_fragment_piggybacking_enabled = enabled;
+}
+
+bool set_key_fragments_per_pdu(const uint8_t count)
+{
+    if (count == 0 || count > MAX_KEY_FRAGMENTS_PER_PDU)
+    {
+        ESP_LOGE(MSG_SENDER_LOG_GROUP, "Key fragments per PDU must be in range 1-%d", (int) MAX_KEY_FRAGMENTS_PER_PDU);
+        return false;
+    }
+
+    key_fragments_per_pdu = count;
+    return true;
+}
+
+bool set_key_parity_fragments(const uint8_t count)
+{
+    if (count > NO_KEY_PARITY_FRAGMENTS)
+    {
+        ESP_LOGE(MSG_SENDER_LOG_GROUP, "Key parity fragments must be in range 0-%d", (int) NO_KEY_PARITY_FRAGMENTS);
+        return false;
+    }
+
+    key_parity_fragments = count;
+    next_coded_key_fragment = 0;
+    return true;
+}
+
+void set_key_handover_slots(const uint32_t count)
+{
+    key_handover_slots = count;
+}
+
+void set_key_fragment_cadence_policy(const key_fragment_cadence_policy *policy)
+{
+    init_key_fragment_scheduler(&key_fragment_pdu_scheduler, policy);
+}
+
+bool is_key_fragment_pdu_due()
+{
+    // Kolejny PDU zmienia klucz, gdy licznik osiągnie key_replacement_packet_counter - wtedy jest pierwszym w sesji
+    const uint32_t session_slot = (uint32_t) ((encrypted_packet_counter + 1) % key_replacement_packet_counter);
+    return schedule_key_fragment_pdu(&key_fragment_pdu_scheduler, session_slot);
+}
+
+static int encrypt_data_pdu(uint8_t * payload, size_t payload_size, beacon_pdu_data * encrypted_pdu, const command cmd)
 {
     encrypted_packet_counter++;
-    
-    if (payload_size > MAX_PDU_PAYLOAD_SIZE)
+
+    const bool is_aead = is_aead_data_command(cmd);
+    // Fragment klucza jawny przed szyfrogramem, ma własne maskowanie i HMAC
+    const size_t key_fragment_size = (cmd == DATA_KEY_FRAGMENT_CMD || cmd == DATA_KEY_PARITY_FRAGMENT_CMD) ? CRYPT_DATA_SIZE : 0;
+    if (payload_size + key_fragment_size > (is_aead ? MAX_AEAD_PDU_PAYLOAD_SIZE : MAX_PDU_PAYLOAD_SIZE))
     {
         ESP_LOGE(MSG_SENDER_LOG_GROUP, "Payload size exceeds maximum allowed size");
         return 1;
     }
 
-    if (encrypted_packet_counter % key_replacement_packet_counter == 0)
-    {
-        ESP_LOGI(MSG_SENDER_LOG_GROUP, "Key replacement in progress...");
-        key_replacement_cb();
-        key_id = get_random_key_id();
-        encrypted_packet_counter = 0;
-    }
+    replace_key_if_due();
 
     const uint8_t random_xor_seed = get_random_seed();
-    uint8_t nonce[NONCE_SIZE] = {0};
-
     uint16_t pdu_key_session_data = produce_key_session_data(key_id, 0);
     encrypted_pdu->key_session_data = pdu_key_session_data;
     encrypted_pdu->xor_seed = random_xor_seed;
     encrypted_pdu->pdu_no = encrypted_packet_counter;
-    encrypted_pdu->cmd = DATA_CMD;
+    encrypted_pdu->cmd = cmd;
+
+    if (is_aead == false)
+    {
+        // W końcówce sesji PDU danych zapowiadają kolejny klucz, rodzaj fragmentu ustalany dopiero po ewentualnej zmianie klucza
+        if (key_fragment_size != 0 && is_next_key_announced)
+        {
+            const bool parity = next_key_coded_fragment >= NO_KEY_FRAGMENTS;
+            encrypted_pdu->cmd = parity ? DATA_KEY_PARITY_FRAGMENT_CMD : DATA_KEY_FRAGMENT_CMD;
+            fill_next_announced_key_fragment((beacon_crypto_data *) encrypted_pdu->payload, parity);
+        }
+        else if (key_fragment_size != 0)
+        {
+            encrypted_pdu->cmd = is_next_key_fragment_parity() ? DATA_KEY_PARITY_FRAGMENT_CMD : DATA_KEY_FRAGMENT_CMD;
+            fill_next_key_fragment((beacon_crypto_data *) encrypted_pdu->payload);
+        }
+
+        uint8_t nonce[NONCE_SIZE] = {0};
+        build_nonce(nonce, &(encrypted_pdu->marker), pdu_key_session_data, random_xor_seed);
+
+        uint8_t encrypt_payload_arr[MAX_PDU_PAYLOAD_SIZE] = {0};  // Local buffer for encryption
+        memcpy(encrypt_payload_arr, payload, payload_size);
+
+        uint8_t encrypted_payload[MAX_PDU_PAYLOAD_SIZE] = {0};  // Output buffer
+        aes_ctr_encrypt_payload(encrypt_payload_arr, payload_size, pre_shared_key.key, nonce, encrypted_payload);
+
+        memcpy(&(encrypted_pdu->payload[key_fragment_size]), encrypted_payload, payload_size);
+        encrypted_pdu->payload_size = key_fragment_size + payload_size;
+        return 0;
+    }
 
-    build_nonce(nonce, &(encrypted_pdu->marker), pdu_key_session_data, random_xor_seed);
+    // Nonce z nagłówka PDU - nagłówek jest uwierzytelniony razem z ładunkiem
+    uint8_t nonce[AES_CCM_NONCE_SIZE] = {0};
+    build_aead_nonce(nonce, encrypted_pdu);
 
-    uint8_t encrypt_payload_arr[MAX_PDU_PAYLOAD_SIZE] = {0};  // Local buffer for encryption
-    memcpy(encrypt_payload_arr, payload, payload_size);
+    aes_key_schedule key_schedule;
+    if (init_aes_key_schedule(&key_schedule, pre_shared_key.key) != 0)
+    {
+        ESP_LOGE(MSG_SENDER_LOG_GROUP, "AES key schedule init failed");
+        return 2;
+    }
 
-    uint8_t encrypted_payload[MAX_PDU_PAYLOAD_SIZE] = {0};  // Output buffer
-    aes_ctr_encrypt_payload(encrypt_payload_arr, payload_size, pre_shared_key.key, nonce, encrypted_payload);
+    int status = aes_ccm_encrypt_and_tag_with_key_schedule(&key_schedule, nonce, payload, payload_size,
+                                                           encrypted_pdu->payload, &(encrypted_pdu->payload[payload_size]),
+                                                           DATA_PDU_AEAD_TAG_SIZE);
+    free_aes_key_schedule(&key_schedule);
+    if (status != 0)
+    {
+        ESP_LOGE(MSG_SENDER_LOG_GROUP, "AEAD encryption failed: %d", status);
+        return 3;
+    }
 
-    memcpy(encrypted_pdu->payload, encrypted_payload, payload_size);
-    encrypted_pdu->payload_size = payload_size;
+    encrypted_pdu->payload_size = payload_size + DATA_PDU_AEAD_TAG_SIZE;
 
     return 0;
 }
 
-int get_key_fragment_pdu(beacon_key_pdu_data * key_pdu)
+int encrypt_payload(uint8_t * payload, size_t payload_size, beacon_pdu_data * encrypted_pdu)
 {
-    encrypted_packet_counter++;
+    // Wolne miejsce w rozgłoszeniu wykorzystane na kolejny fragment klucza
+    const bool carry_key_fragment = is_key_fragment_piggybacking_enabled && payload_size <= MAX_DATA_KEY_FRAGMENT_PDU_PAYLOAD_SIZE;
+    return encrypt_data_pdu(payload, payload_size, encrypted_pdu, carry_key_fragment ? DATA_KEY_FRAGMENT_CMD : DATA_CMD);
+}
 
-    if (encrypted_packet_counter % key_replacement_packet_counter == 0)
+int encrypt_payload_aead(uint8_t * payload, size_t payload_size, beacon_pdu_data * encrypted_pdu)
+{
+    return encrypt_data_pdu(payload, payload_size, encrypted_pdu, AEAD_DATA_CMD);
+}
+
+void init_payload_aggregator(payload_aggregator * aggregator, const uint32_t max_delay_ms, const bool aead)
+{
+    memset(aggregator, 0, sizeof(payload_aggregator));
+    aggregator->capacity = aead ? MAX_AEAD_PDU_PAYLOAD_SIZE : MAX_PDU_PAYLOAD_SIZE;
+    aggregator->max_delay_us = (int64_t) max_delay_ms * 1000;
+    aggregator->aead = aead;
+}
+
+int flush_payload_aggregator(payload_aggregator * aggregator, beacon_pdu_data * encrypted_pdu)
+{
+    if (aggregator->no_records == 0)
     {
-        ESP_LOGI(MSG_SENDER_LOG_GROUP, "Key replacement in progress...");
-        key_replacement_cb();
-        key_id = get_random_key_id();
-        encrypted_packet_counter = 0;
+        return 0;
     }
 
-    const uint8_t key_fragment_no = get_next_key_fragment();
-    const uint8_t random_xor_seed = get_random_seed();
-    uint8_t nonce[NONCE_SIZE] = {0};
+    const command cmd = aggregator->aead ? AEAD_RECORDS_DATA_CMD : RECORDS_DATA_CMD;
+    const int status = encrypt_data_pdu(aggregator->records, aggregator->size, encrypted_pdu, cmd);
+
+    // Rekordy porzucane także po błędzie - kolejne wywołanie nie powtórzy tego samego błędu
+    aggregator->size = 0;
+    aggregator->no_records = 0;
+
+    if (status != 0)
+    {
+        return -status;
+    }
+    return 1;
+}
+
+int flush_payload_aggregator_if_due(payload_aggregator * aggregator, const int64_t now_us, beacon_pdu_data * encrypted_pdu)
+{
+    if (aggregator->no_records == 0 || now_us - aggregator->first_record_timestamp_us < aggregator->max_delay_us)
+    {
+        return 0;
+    }
+
+    return flush_payload_aggregator(aggregator, encrypted_pdu);
+}
+
+int add_payload_to_aggregator(payload_aggregator * aggregator, uint8_t * payload, size_t payload_size, beacon_pdu_data * encrypted_pdu)
+{
+    if (payload == NULL || payload_size == 0 || payload_size > MAX_RECORD_SIZE ||
+        get_record_list_entry_size(payload_size) > aggregator->capacity)
+    {
+        ESP_LOGE(MSG_SENDER_LOG_GROUP, "Payload of %u bytes does not fit into a record list", (unsigned) payload_size);
+        return -1;
+    }
+
+    int status = 0;
+    // Rekord nie mieści się w bieżącym PDU - najpierw wysyłane są rekordy już zebrane
+    if (get_record_list_entry_size(payload_size) > aggregator->capacity - aggregator->size)
+    {
+        status = flush_payload_aggregator(aggregator, encrypted_pdu);
+        if (status < 0)
+        {
+            return status;
+        }
+    }
+
+    if (aggregator->no_records == 0)
+    {
+        aggregator->first_record_timestamp_us = esp_timer_get_time();
+    }
+
+    add_record_to_record_list(aggregator->records, aggregator->capacity, &(aggregator->size), payload, payload_size);
+    aggregator->no_records++;
+
+    return status;
+}
+
+int get_key_fragment_pdu(beacon_key_pdu_data * key_pdu)
+{
+    encrypted_packet_counter++;
+
+    replace_key_if_due();
 
-    uint16_t pdu_key_session_data = produce_key_session_data(key_id, key_fragment_no);
-    key_pdu->bcd.key_session_data = pdu_key_session_data;
-    key_pdu->bcd.xor_seed = random_xor_seed;
     key_pdu->pdu_no = encrypted_packet_counter;
-    key_pdu->cmd = KEY_FRAGMENT_CMD;
+    const bool parity = is_next_key_fragment_parity();
+    key_pdu->cmd = parity ? KEY_PARITY_FRAGMENT_CMD : KEY_FRAGMENT_CMD;
 
-    xor_encrypt_key_fragment(splitted_pre_shared_key.fragment[key_fragment_no], key_pdu->bcd.enc_key_fragment, random_xor_seed);
-        
-    calculate_hmac_of_fragment(splitted_pre_shared_key.fragment[key_fragment_no], key_pdu->bcd.enc_key_fragment, key_pdu->bcd.key_fragment_hmac);
+    // Pierwszy fragment zawsze bieżącego klucza - odbiorca autoryzuje PDU interwałem wynikającym z jego ID
+    fill_next_key_fragment(&(key_pdu->bcd[0]));
+    key_pdu->no_fragments = 1;
 
-    build_nonce(nonce, &(key_pdu->marker), pdu_key_session_data, random_xor_seed);
+    // Kolejne fragmenty, każdy z własnym ziarnem XOR i HMAC, w końcówce sesji fragmenty zapowiadanego klucza.
+    // Komenda określa rodzaj wszystkich fragmentów w PDU, więc fragmenty klucza i parzystości nie są mieszane
+    while (key_pdu->no_fragments < key_fragments_per_pdu)
+    {
+        if (is_next_key_announced)
+        {
+            fill_next_announced_key_fragment(&(key_pdu->bcd[key_pdu->no_fragments]), parity);
+        }
+        else if (is_next_key_fragment_parity() == parity)
+        {
+            fill_next_key_fragment(&(key_pdu->bcd[key_pdu->no_fragments]));
+        }
+        else
+        {
+            break;
+        }
+        key_pdu->no_fragments++;
+    }
 
     return 0;
 }
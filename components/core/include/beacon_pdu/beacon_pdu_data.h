@@ -5,6 +5,7 @@
 #include <stdint.h>
 #include <stddef.h>
 #include <stdbool.h>
+#include "sdkconfig.h"
 #include "beacon_crypto_data.h"
 #include "beacon_marker.h"
 
@@ -13,13 +14,52 @@ typedef uint8_t command;
 #define MIN_ADV_TIME_MS 3000
 #define MAX_ADV_TIME_MS 5000
 #define SCALE_SINGLE_MS 80
-
+#define MAX_KEY_ID_VAL 0x3FFF
+
+// Extended advertising (BLE 5) transport, follows the Bluedroid BLE 5.0 features option unless set by the build.
+// Sender and receivers must use the same setting, PDU length limits below depend on it
+#ifndef BLE_EXTENDED_ADVERTISING
+#if defined(CONFIG_BT_BLE_50_FEATURES_SUPPORTED) && CONFIG_BT_BLE_50_FEATURES_SUPPORTED
+#define BLE_EXTENDED_ADVERTISING 1
+#else
+#define BLE_EXTENDED_ADVERTISING 0
+#endif
+#endif
+
+// Legacy advertising data
 #define MAX_GAP_DATA_LEN 31
-#define MAX_PDU_PAYLOAD_SIZE (MAX_GAP_DATA_LEN - (sizeof(uint16_t)) - (MARKER_STRUCT_SIZE) - (sizeof(command) - sizeof(uint16_t)))
+// Extended advertising data of a single advertising set without host side chaining
+#define MAX_EXT_GAP_DATA_LEN 251
+
+#if BLE_EXTENDED_ADVERTISING
+#define MAX_BEACON_PDU_LEN MAX_EXT_GAP_DATA_LEN
+#else
+#define MAX_BEACON_PDU_LEN MAX_GAP_DATA_LEN
+#endif
+
+// Marker, command, PDU number, key session data and XOR seed in front of every data PDU payload
+#define BEACON_PDU_HEADER_SIZE ((MARKER_STRUCT_SIZE) + sizeof(command) + (2 * sizeof(uint16_t)) + sizeof(uint8_t))
+#define MAX_PDU_PAYLOAD_SIZE (MAX_BEACON_PDU_LEN - BEACON_PDU_HEADER_SIZE)
 #define NONCE_SIZE 16
 
 #define DATA_CMD 1
 #define KEY_FRAGMENT_CMD 2
+// Data PDU with AES-CCM payload, the truncated tag follows the ciphertext in the payload field
+#define AEAD_DATA_CMD 3
+// Data PDUs whose decrypted payload is a length prefixed record list (beacon_record_list.h), CTR and AES-CCM variant
+#define RECORDS_DATA_CMD 4
+#define AEAD_RECORDS_DATA_CMD 5
+// AES-CTR data PDU whose payload starts with one plain beacon_crypto_data key fragment followed by the ciphertext
+#define DATA_KEY_FRAGMENT_CMD 6
+// Variants of KEY_FRAGMENT_CMD and DATA_KEY_FRAGMENT_CMD carrying Reed-Solomon parity fragments (key_fragment_coding.h),
+// the fragment index in key session data is the parity index
+#define KEY_PARITY_FRAGMENT_CMD 7
+#define DATA_KEY_PARITY_FRAGMENT_CMD 8
+
+// Truncated AES-CCM tag of AEAD_DATA_CMD PDUs, even value 4 to 8 bytes, sender and receivers must agree
+#define DATA_PDU_AEAD_TAG_SIZE 4
+_Static_assert(DATA_PDU_AEAD_TAG_SIZE >= 4 && DATA_PDU_AEAD_TAG_SIZE <= 8 && (DATA_PDU_AEAD_TAG_SIZE % 2) == 0,
+               "AEAD tag must be an even number of bytes from 4 to 8");
 
 #define COMMAND_OFFSET sizeof(beacon_marker)
 #define PDU_NO_OFFSET ((sizeof(beacon_marker)) + (sizeof(command)))
@@ -35,25 +75,63 @@ typedef struct {
     size_t payload_size;
 }__attribute__((packed)) beacon_pdu_data;
 
+// Largest AEAD payload whose PDU with tag still fits into adv data
+#define MAX_AEAD_PDU_PAYLOAD_SIZE (MAX_PDU_PAYLOAD_SIZE - DATA_PDU_AEAD_TAG_SIZE)
+
+// Largest payload leaving room for a key fragment in a DATA_KEY_FRAGMENT_CMD PDU
+#define MAX_DATA_KEY_FRAGMENT_PDU_PAYLOAD_SIZE (MAX_PDU_PAYLOAD_SIZE - CRYPT_DATA_SIZE)
+
+
+// Marker, command and PDU number in front of the key fragments of a KEY_FRAGMENT_CMD PDU
+#define BEACON_KEY_PDU_HEADER_SIZE ((MARKER_STRUCT_SIZE) + sizeof(command) + sizeof(uint16_t))
+#define KEY_FRAGMENTS_FITTING_IN_PDU ((MAX_BEACON_PDU_LEN - BEACON_KEY_PDU_HEADER_SIZE) / CRYPT_DATA_SIZE)
+// Key fragments carried by one KEY_FRAGMENT_CMD PDU, each with its own session data, seed and HMAC.
+// Their number follows from the adv data length, a PDU with a single fragment is the original format
+#define MAX_KEY_FRAGMENTS_PER_PDU (KEY_FRAGMENTS_FITTING_IN_PDU < NO_KEY_FRAGMENTS ? KEY_FRAGMENTS_FITTING_IN_PDU : NO_KEY_FRAGMENTS)
 
 typedef struct {
     beacon_marker marker;
     command cmd;
     uint16_t pdu_no;
-    beacon_crypto_data bcd;
+    beacon_crypto_data bcd[MAX_KEY_FRAGMENTS_PER_PDU];
+    uint8_t no_fragments;
 }__attribute__((packed)) beacon_key_pdu_data;
 
 
 size_t get_beacon_pdu_data_len(beacon_pdu_data * pdu);
 
-size_t get_beacon_key_pdu_data_len();
+// Adv data length of the key PDU with its no_fragments fragments
+size_t get_beacon_key_pdu_data_len(beacon_key_pdu_data * pdu);
 
+// Number of key fragments in a key PDU received in adv data of total_pdu_len bytes, 0 when the length is malformed
+uint8_t get_no_key_fragments_from_pdu(size_t total_pdu_len);
+
+// Payload length of a data PDU received in adv data of total_pdu_len bytes, 0 when shorter than the header
 size_t get_payload_size_from_pdu(size_t total_pdu_len);
 
 bool get_beacon_pdu_from_adv_data(beacon_pdu_data * pdu, uint8_t *data, size_t size);
 
 command get_command_from_pdu(uint8_t *data, size_t size); 
 
+// Copies the key fragment of a DATA_KEY_FRAGMENT_CMD or DATA_KEY_PARITY_FRAGMENT_CMD PDU into bcd and moves the ciphertext to the start of the payload,
+// the PDU continues as a DATA_CMD PDU. False when the payload is shorter than the key fragment
+bool take_key_fragment_from_data_pdu(beacon_pdu_data *pdu, beacon_crypto_data *bcd);
+
+// Commands whose key fragments are parity fragments
+bool is_key_parity_fragment_command(command cmd);
+
+// Coded fragment index (0 to NO_CODED_KEY_FRAGMENTS - 1) of a fragment with session_data sent in a PDU with cmd
+uint8_t get_coded_key_fragment_index(command cmd, uint16_t session_data);
+
+// Commands of PDUs in beacon_pdu_data format, decrypted with the session key
+bool is_data_command(command cmd);
+
+// Data commands with AES-CCM payload and DATA_PDU_AEAD_TAG_SIZE bytes of tag
+bool is_aead_data_command(command cmd);
+
+// Data commands carrying a record list instead of a single message
+bool is_record_list_command(command cmd);
+
 esp_err_t build_beacon_pdu_data (uint16_t key_session_data, uint8_t* payload, size_t payload_size, beacon_pdu_data *bpd);
 
 esp_err_t build_beacon_key_pdu_data (beacon_crypto_data* bcd, beacon_key_pdu_data *bpd);
@@ -66,6 +144,9 @@ bool is_pdu_in_beacon_pdu_format(uint8_t *data, size_t size);
 
 void build_nonce(uint8_t nonce[NONCE_SIZE], const beacon_marker* marker, uint16_t key_session_data, uint8_t xor_seed);
 
+// Nonce of AEAD data PDUs, covers every header field so header changes fail tag verification
+void build_aead_nonce(uint8_t nonce[AES_CCM_NONCE_SIZE], const beacon_pdu_data* pdu);
+
 uint16_t produce_key_session_data(uint16_t key_id, uint8_t key_fragment);
 
 uint8_t produce_key_exchange_data(uint8_t pdu_time_interval_ms, uint8_t key_exchange_counter);
@@ -82,4 +163,7 @@ uint8_t get_key_expected_time_interval_multiplier(uint8_t key_exchange_data);
 
 uint32_t get_adv_interval_from_key_id(uint16_t key_id);
 
+// Allowed deviation from adv interval in ms for adv time authorization
+int get_tolerance_window_based_on_adv_interval(uint32_t adv_interval);
+
 #endif
\ No newline at end of file
@@ -0,0 +1,27 @@
+#ifndef BEACON_RECORD_LIST_H
+#define BEACON_RECORD_LIST_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+// Payload of RECORDS_DATA_CMD / AEAD_RECORDS_DATA_CMD PDUs: records one after another, each as
+// a single length byte followed by the record. Empty records are not allowed, so a zero length
+// byte or a record crossing the end of the list marks a malformed list.
+#define RECORD_LIST_LENGTH_PREFIX_SIZE 1
+#define MAX_RECORD_SIZE UINT8_MAX
+
+// Bytes occupied in the list by a record of record_size bytes
+size_t get_record_list_entry_size(size_t record_size);
+
+// Appends a record at list_size, false when it is empty, too long or does not fit into capacity
+bool add_record_to_record_list(uint8_t *list, size_t capacity, size_t *list_size, const uint8_t *record, size_t record_size);
+
+// Returns the record at offset and moves offset past it, false at the end of the list or on malformed data.
+// The record points into the list, no copy is made
+bool get_next_record_from_record_list(const uint8_t *list, size_t list_size, size_t *offset, const uint8_t **record, size_t *record_size);
+
+// Number of records in the list, -1 when the list is malformed
+int get_record_list_count(const uint8_t *list, size_t list_size);
+
+#endif
@@ -0,0 +1,43 @@
+#ifndef KEY_FRAGMENT_CADENCE_H
+#define KEY_FRAGMENT_CADENCE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Decides how many data PDUs the sender puts between two key fragment PDUs. session_slot is the position
+// of the next PDU in the key session, 0 is the first PDU sent with a new key. context is passed back unchanged.
+typedef uint16_t (*key_fragment_cadence_fn)(const void *context, const uint32_t session_slot);
+
+typedef struct {
+    key_fragment_cadence_fn get_data_pdus_between_key_pdus;
+    const void *context;
+} key_fragment_cadence_policy;
+
+// Same cadence for the whole session, context points to a uint16_t with the number of data PDUs between key PDUs
+uint16_t get_fixed_key_fragment_cadence(const void *context, const uint32_t session_slot);
+
+// Dense key PDUs right after key rotation, when every observer needs the new key, then the gap grows
+// by one data PDU every taper_step_slots up to floor_gap, which bounds the key wait of late joiners
+typedef struct {
+    uint32_t burst_slots;
+    uint16_t burst_gap;
+    uint32_t taper_step_slots;
+    uint16_t floor_gap;
+} tapered_key_fragment_cadence_config;
+
+// context points to a tapered_key_fragment_cadence_config
+uint16_t get_tapered_key_fragment_cadence(const void *context, const uint32_t session_slot);
+
+// Counts data PDUs since the last key PDU against the policy, not thread safe, owner serializes access
+typedef struct {
+    key_fragment_cadence_policy policy;
+    uint16_t data_pdus_since_key_pdu;
+} key_fragment_scheduler;
+
+// The first scheduled PDU is a key PDU
+void init_key_fragment_scheduler(key_fragment_scheduler *scheduler, const key_fragment_cadence_policy *policy);
+
+// Returns true when the PDU at session_slot should be a key fragment PDU, false for a data PDU
+bool schedule_key_fragment_pdu(key_fragment_scheduler *scheduler, const uint32_t session_slot);
+
+#endif
@@ -0,0 +1,18 @@
+#ifndef BLE_ADDR_H
+#define BLE_ADDR_H
+
+#include "sdkconfig.h"
+
+// Bluedroid is not available on the linux (host) target, only the address type is needed there
+#if CONFIG_IDF_TARGET_LINUX
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#define ESP_BD_ADDR_LEN 6
+typedef uint8_t esp_bd_addr_t[ESP_BD_ADDR_LEN];
+#else
+#include "esp_gap_ble_api.h"
+#endif
+
+#endif
@@ -0,0 +1,55 @@
+#ifndef SENDER_REGISTRY_H
+#define SENDER_REGISTRY_H
+
+#include "ble_addr.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#define SENDER_REGISTRY_NO_INDEX -1
+
+// Counters of per sender tables (authorization, processing) using the registry indexes
+typedef struct {
+    uint32_t idle_evictions;
+    uint32_t lru_evictions;
+    uint32_t rejected_senders;
+} sender_eviction_stats;
+
+// Hashed MAC address -> sender index map, the index is dense (0..max_senders-1)
+// and is used by the receiver modules to address their per sender state
+typedef struct {
+    esp_bd_addr_t mac_address;
+    int16_t sender_index;
+} sender_registry_bucket;
+
+typedef struct {
+    sender_registry_bucket *buckets;
+    uint16_t buckets_mask;
+    esp_bd_addr_t *sender_mac_addresses;
+    int16_t *free_indexes;
+    uint16_t free_indexes_count;
+    uint16_t max_senders;
+    uint16_t senders_count;
+    SemaphoreHandle_t xMutex;
+} sender_registry;
+
+sender_registry* create_sender_registry(const uint16_t max_senders);
+
+void destroy_sender_registry(sender_registry *registry);
+
+int get_sender_index(sender_registry *registry, const esp_bd_addr_t mac_address);
+
+// Returns index of already registered sender or registers a new one, -1 when registry is full
+int add_sender_to_registry(sender_registry *registry, const esp_bd_addr_t mac_address);
+
+int remove_sender_from_registry(sender_registry *registry, const esp_bd_addr_t mac_address);
+
+bool get_sender_mac_address(sender_registry *registry, const int sender_index, esp_bd_addr_t mac_address);
+
+uint16_t get_max_senders(sender_registry *registry);
+
+uint16_t get_no_registered_senders(sender_registry *registry);
+
+#endif
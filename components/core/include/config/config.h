@@ -8,10 +8,55 @@
 #define NO_PACKET_TO_SEND 2000
 #define TEST_NO_PACKETS_TO_KEY_REPLACE 200
 #define PDU_TO_KEY_FRAGMENT_RATIO 3
+// Key handover: during the last SENDER_KEY_HANDOVER_SLOTS PDUs of a key session data PDUs carrying a key fragment
+// and key PDUs (behind their first fragment) carry fragments of the next key tagged with its key id, so observers
+// cache the next key before its first PDU. 0 - the next key is generated and used at the same PDU
+#define SENDER_KEY_HANDOVER_SLOTS 48
+// Key fragment PDU cadence: 0 - PDU_TO_KEY_FRAGMENT_RATIO data PDUs between key PDUs for the whole session,
+// 1 - tapered (key_fragment_cadence.h): SENDER_KEY_CADENCE_BURST_GAP data PDUs between key PDUs in the first
+// SENDER_KEY_CADENCE_BURST_SLOTS slots after key rotation, then one more every SENDER_KEY_CADENCE_TAPER_STEP_SLOTS
+// up to SENDER_KEY_CADENCE_FLOOR_GAP, which bounds the key wait of observers joining late in the session
+#define SENDER_KEY_FRAGMENT_CADENCE_TAPERED 1
+#define SENDER_KEY_CADENCE_BURST_SLOTS 8
+#define SENDER_KEY_CADENCE_BURST_GAP 1
+#define SENDER_KEY_CADENCE_TAPER_STEP_SLOTS 16
+#define SENDER_KEY_CADENCE_FLOOR_GAP 5
+// Key fragments packed into one key PDU, limited to MAX_KEY_FRAGMENTS_PER_PDU (2 in legacy adv data, 4 in extended)
+#define SENDER_KEY_FRAGMENTS_PER_PDU 2
+// Reed-Solomon parity fragments sent after the 4 key fragments of every round (0 to NO_KEY_PARITY_FRAGMENTS),
+// observers rebuild the key from any 4 distinct fragments so lost PDUs do not wait for the next round
+#define SENDER_KEY_PARITY_FRAGMENTS 4
+// AES-CTR data PDUs with room left (payload up to MAX_DATA_KEY_FRAGMENT_PDU_PAYLOAD_SIZE) carry the next key fragment
+#define SENDER_PIGGYBACK_KEY_FRAGMENTS 1
+// Data PDUs sent as AEAD_DATA_CMD (AES-CCM with truncated tag) instead of plain AES-CTR DATA_CMD
+#define SENDER_DATA_PDU_AEAD 0
+// Test payloads are coalesced into record list PDUs (RECORDS_DATA_CMD / AEAD_RECORDS_DATA_CMD), a PDU is sent
+// when the next payload does not fit or the oldest queued payload waited SENDER_AGGREGATION_MAX_DELAY_MS
+#define SENDER_PAYLOAD_AGGREGATION 0
+#define SENDER_AGGREGATION_MAX_DELAY_MS 10000
 #define TEST_PAYLOAD_BYTES_LEN PAYLOAD_10_BYTES
 
 // OBSERVER CONFIG
 #define SENDERS_NUMBER 2
 #define MAX_BLE_BROADCASTERS 2
+// Default number of senders tracked by the receiver at the same time
+#define MAX_OBSERVED_SENDERS 32
+// Sender state (authorization buffers, key cache, deferred PDUs) is released after this time without PDUs
+#define SENDER_IDLE_TIMEOUT_MS 30000
+// With full sender table the least recently heard sender is replaced only when silent at least this long,
+// otherwise the new sender is rejected
+#define SENDER_EVICTION_MIN_IDLE_MS 1000
+// Number of processing tasks (shards), senders are assigned to shards by MAC address hash
+#define SEC_PDU_PROCESSING_SHARDS 2
+// Key fragments are reconstructed on the processing shard task, the key goes straight into the sender key cache.
+// With 0 fragments go through the key reconstruction queue and task
+#define KEY_RECONSTRUCTION_INLINE 1
+// Longest time a PDU waits in the authorizer for more PDUs of its sender before it is authorized,
+// PDUs are checked one by one against the sender's interval estimate so no batching is needed by default
+#define ADV_AUTHORIZE_MAX_HOLD_MS 0
+// Log every beacon PDU as "CAPTURE:<timestamp_us>,<mac>,<adv data>" for the host replay app
+#define RECEIVER_PDU_CAPTURE 0
+// Per stage PDU latency histograms (GAP callback -> observers), dumped at the end of test measurement
+#define PDU_LATENCY_HISTOGRAMS 1
 
 #endif
\ No newline at end of file
@@ -3,11 +3,21 @@
 
 #include <stddef.h>
 #include <stdint.h>
+#include "mbedtls/aes.h"
 
 #define KEY_FRAGMENT_SIZE 4
 #define NO_KEY_FRAGMENTS 4
 #define KEY_SIZE ((KEY_FRAGMENT_SIZE) * (NO_KEY_FRAGMENTS))
 #define HMAC_SIZE 4
+#define HMAC_SHA256_DIGEST_SIZE 32
+// Longest message whose HMAC inner hash fits into the block after the key pad block
+#define HMAC_SINGLE_BLOCK_MAX_MESSAGE_SIZE 55
+#define AES_CTR_BLOCK_SIZE 16
+// AES-CCM with 2 byte length field, payload up to 64 kB and 13 byte nonce
+#define AES_CCM_LENGTH_SIZE 2
+#define AES_CCM_NONCE_SIZE (AES_CTR_BLOCK_SIZE - 1 - AES_CCM_LENGTH_SIZE)
+#define AES_CCM_MAX_PAYLOAD_SIZE 0xFFFF
+#define AES_CCM_MIN_TAG_SIZE 4
 
 typedef struct {
     uint8_t  fragment[NO_KEY_FRAGMENTS][KEY_FRAGMENT_SIZE];
@@ -17,6 +27,11 @@ typedef struct {
     uint8_t key[KEY_SIZE];
 } key_128b;
 
+// Expanded AES-128 key, set up once per session key and reused for every PDU of that session
+typedef struct {
+    mbedtls_aes_context aes;
+} aes_key_schedule;
+
 void generate_128b_key(key_128b * key);
 
 void split_128b_key_to_fragment(key_128b * key, key_splitted * key_splitted);
@@ -29,14 +44,40 @@ int aes_ctr_encrypt_payload(uint8_t *input, size_t length, uint8_t *key, uint8_t
 
 int aes_ctr_decrypt_payload(uint8_t *input, size_t length, uint8_t *key, uint8_t *nonce, uint8_t *output);
 
+int init_aes_key_schedule(aes_key_schedule * key_schedule, const uint8_t *key);
+
+void free_aes_key_schedule(aes_key_schedule * key_schedule);
+
+int aes_ctr_decrypt_payload_with_key_schedule(uint8_t *input, size_t length, aes_key_schedule * key_schedule, uint8_t *nonce, uint8_t *output);
+
+// AES-CCM (RFC 3610) without associated data on the cached key schedule, tag_size is even 4 to 16 bytes
+int aes_ccm_encrypt_and_tag_with_key_schedule(aes_key_schedule * key_schedule, const uint8_t nonce[AES_CCM_NONCE_SIZE],
+                                              const uint8_t *input, size_t length, uint8_t *output, uint8_t *tag, size_t tag_size);
+
+// Returns -3 and zeroes output when the tag does not match, input and output may be the same buffer
+int aes_ccm_auth_decrypt_with_key_schedule(aes_key_schedule * key_schedule, const uint8_t nonce[AES_CCM_NONCE_SIZE],
+                                           const uint8_t *input, size_t length, uint8_t *output, const uint8_t *tag, size_t tag_size);
+
 void xor_encrypt_key_fragment(uint8_t  fragment[KEY_FRAGMENT_SIZE], uint8_t  encrypted_fragment[KEY_FRAGMENT_SIZE], uint8_t xor_seed);
 
 void xor_decrypt_key_fragment(uint8_t  encrypted_fragment[KEY_FRAGMENT_SIZE], uint8_t  decrypted_fragment[KEY_FRAGMENT_SIZE], uint8_t xor_seed);
 
 uint8_t get_random_seed();
 
+// Generic HMAC-SHA256 through mbedtls md, sets up (allocates) and frees the md context on every call
+void calculate_hmac(const uint8_t *key, size_t key_len, const uint8_t *message, size_t message_len, uint8_t *output);
+
+// HMAC-SHA256 of a message up to HMAC_SINGLE_BLOCK_MAX_MESSAGE_SIZE bytes with a key up to one block,
+// computed with 4 SHA-256 block compressions on the stack without heap allocation
+int calculate_hmac_single_block(const uint8_t *key, size_t key_len, const uint8_t *message, size_t message_len,
+                                uint8_t output[HMAC_SHA256_DIGEST_SIZE]);
+
+// Writes HMAC_SIZE bytes of the truncated fragment HMAC keyed with the decrypted fragment
 void calculate_hmac_of_fragment(uint8_t *key_fragment, uint8_t *encrypted_fragment, uint8_t *hmac_output);
 
+// Returns 0 when the truncated HMAC of the encrypted fragment keyed with the decrypted fragment matches expected_hmac
+int verify_key_fragment_hmac(const uint8_t *key_fragment, const uint8_t *encrypted_fragment, const uint8_t *expected_hmac);
+
 int crypto_secure_memcmp(const void *a, const void *b, size_t size);
 
 #endif
\ No newline at end of file
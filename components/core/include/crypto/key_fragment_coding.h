@@ -0,0 +1,23 @@
+#ifndef KEY_FRAGMENT_CODING_H
+#define KEY_FRAGMENT_CODING_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "crypto.h"
+
+// Systematic Reed-Solomon code over GF(256) of the key fragments. Coded fragments 0 to NO_KEY_FRAGMENTS - 1
+// are the key fragments themselves, parity fragments follow, any NO_KEY_FRAGMENTS distinct coded fragments
+// rebuild the key. Parity rows form a Cauchy matrix, so every square submatrix of the generator is invertible.
+#define NO_KEY_PARITY_FRAGMENTS 4
+#define NO_CODED_KEY_FRAGMENTS ((NO_KEY_FRAGMENTS) + (NO_KEY_PARITY_FRAGMENTS))
+
+_Static_assert(NO_CODED_KEY_FRAGMENTS <= 8, "Coded fragment mask is 8 bits wide");
+
+// Parity fragment parity_index (0 to NO_KEY_PARITY_FRAGMENTS - 1) of the key fragments
+void encode_key_parity_fragment(const key_splitted *key_fragments, uint8_t parity_index, uint8_t parity_fragment[KEY_FRAGMENT_SIZE]);
+
+// Rebuilds the key fragments from coded fragments marked in received_mask (bit i set when coded fragment i is valid).
+// Returns false when fewer than NO_KEY_FRAGMENTS coded fragments were received
+bool decode_key_fragments(const uint8_t coded_fragments[NO_CODED_KEY_FRAGMENTS][KEY_FRAGMENT_SIZE], uint8_t received_mask, key_splitted *key_fragments);
+
+#endif
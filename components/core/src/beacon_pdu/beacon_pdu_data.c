@@ -1,10 +1,16 @@
 #include "beacon_pdu/beacon_pdu_data.h"
+#include "crypto/key_fragment_coding.h"
 #include <string.h>
-#include <math.h>
 #include "esp_log.h"
 
 static const char* BEACON_PDU_GROUP = "BEACON_PDU_GROUP";
 
+_Static_assert(offsetof(beacon_pdu_data, payload) == BEACON_PDU_HEADER_SIZE, "Data PDU header layout mismatch");
+_Static_assert(BEACON_PDU_HEADER_SIZE <= AES_CCM_NONCE_SIZE, "PDU header does not fit into AEAD nonce");
+_Static_assert(offsetof(beacon_key_pdu_data, bcd) == BEACON_KEY_PDU_HEADER_SIZE, "Key PDU header layout mismatch");
+_Static_assert(MAX_KEY_FRAGMENTS_PER_PDU >= 1, "Key fragment does not fit into adv data");
+_Static_assert(NO_KEY_PARITY_FRAGMENTS <= 4, "Parity index must fit into 2 bit fragment index of key session data");
+
 beacon_marker my_marker = {
     .marker = {0xFF, 0x8, 0x0}
 };
@@ -30,7 +36,8 @@ esp_err_t build_beacon_key_pdu_data (beacon_crypto_data* bcd, beacon_key_pdu_dat
     }
 
     memcpy(&(bpd->marker), &my_marker, sizeof(beacon_marker));
-    memcpy(&(bpd->bcd), bcd, sizeof(beacon_crypto_data));
+    memcpy(&(bpd->bcd[0]), bcd, sizeof(beacon_crypto_data));
+    bpd->no_fragments = 1;
     bpd->cmd = KEY_FRAGMENT_CMD;
 
     return ESP_OK;
@@ -38,7 +45,7 @@ esp_err_t build_beacon_key_pdu_data (beacon_crypto_data* bcd, beacon_key_pdu_dat
 
 bool get_beacon_pdu_from_adv_data(beacon_pdu_data * pdu, uint8_t *data, size_t size)
 {
-    if (pdu == NULL || data == NULL)
+    if (pdu == NULL || data == NULL || size < BEACON_PDU_HEADER_SIZE || size > MAX_BEACON_PDU_LEN)
         return false;
 
     memcpy((void *) pdu, (void *) data, size);
@@ -77,6 +84,48 @@ command get_command_from_pdu(uint8_t *data, size_t size)
         break;
 
 
+        case AEAD_DATA_CMD:
+        {
+            cmd = AEAD_DATA_CMD;
+        }
+        break;
+
+
+        case RECORDS_DATA_CMD:
+        {
+            cmd = RECORDS_DATA_CMD;
+        }
+        break;
+
+
+        case AEAD_RECORDS_DATA_CMD:
+        {
+            cmd = AEAD_RECORDS_DATA_CMD;
+        }
+        break;
+
+
+        case DATA_KEY_FRAGMENT_CMD:
+        {
+            cmd = DATA_KEY_FRAGMENT_CMD;
+        }
+        break;
+
+
+        case KEY_PARITY_FRAGMENT_CMD:
+        {
+            cmd = KEY_PARITY_FRAGMENT_CMD;
+        }
+        break;
+
+
+        case DATA_KEY_PARITY_FRAGMENT_CMD:
+        {
+            cmd = DATA_KEY_PARITY_FRAGMENT_CMD;
+        }
+        break;
+
+
         default:
             break;
     }
@@ -84,6 +133,48 @@ command get_command_from_pdu(uint8_t *data, size_t size)
     return cmd;
 }
 
+bool take_key_fragment_from_data_pdu(beacon_pdu_data *pdu, beacon_crypto_data *bcd)
+{
+    if (pdu == NULL || bcd == NULL || pdu->payload_size < CRYPT_DATA_SIZE || pdu->payload_size > MAX_PDU_PAYLOAD_SIZE)
+    {
+        return false;
+    }
+
+    memcpy(bcd, pdu->payload, CRYPT_DATA_SIZE);
+    pdu->payload_size -= CRYPT_DATA_SIZE;
+    memmove(pdu->payload, &(pdu->payload[CRYPT_DATA_SIZE]), pdu->payload_size);
+    // CTR nonce does not cover the command, after the split the PDU is a plain data PDU
+    pdu->cmd = DATA_CMD;
+    return true;
+}
+
+bool is_data_command(command cmd)
+{
+    return cmd == DATA_CMD || cmd == AEAD_DATA_CMD || cmd == RECORDS_DATA_CMD || cmd == AEAD_RECORDS_DATA_CMD ||
+           cmd == DATA_KEY_FRAGMENT_CMD || cmd == DATA_KEY_PARITY_FRAGMENT_CMD;
+}
+
+bool is_key_parity_fragment_command(command cmd)
+{
+    return cmd == KEY_PARITY_FRAGMENT_CMD || cmd == DATA_KEY_PARITY_FRAGMENT_CMD;
+}
+
+uint8_t get_coded_key_fragment_index(command cmd, uint16_t session_data)
+{
+    const uint8_t index = get_key_fragment_index_from_key_session_data(session_data);
+    return is_key_parity_fragment_command(cmd) ? (uint8_t) (NO_KEY_FRAGMENTS + index) : index;
+}
+
+bool is_aead_data_command(command cmd)
+{
+    return cmd == AEAD_DATA_CMD || cmd == AEAD_RECORDS_DATA_CMD;
+}
+
+bool is_record_list_command(command cmd)
+{
+    return cmd == RECORDS_DATA_CMD || cmd == AEAD_RECORDS_DATA_CMD;
+}
+
 bool is_pdu_in_beacon_pdu_format(uint8_t *data, size_t size) 
 {
     bool is_pdu_beacon_format = false;
@@ -137,6 +228,14 @@ void build_nonce(uint8_t nonce[NONCE_SIZE], const beacon_marker* marker, uint16_
     // The remaining bytes of the nonce are already zero-filled from memset.
 }
 
+void build_aead_nonce(uint8_t nonce[AES_CCM_NONCE_SIZE], const beacon_pdu_data* pdu)
+{
+    memset(nonce, 0, AES_CCM_NONCE_SIZE);
+
+    // Marker, command, PDU number, key session data and XOR seed as sent over the air
+    memcpy(nonce, pdu, BEACON_PDU_HEADER_SIZE);
+}
+
 uint16_t get_key_id_from_key_session_data(uint16_t session_data)
 {
     static const uint16_t MASK = 0x3FFF;
@@ -168,9 +267,25 @@ size_t get_beacon_pdu_data_len(beacon_pdu_data * pdu)
     return (sizeof(pdu->key_session_data) + sizeof(pdu->pdu_no) + sizeof(pdu->xor_seed) + sizeof(pdu->marker) + pdu->payload_size + sizeof(pdu->cmd));
 }
 
-size_t get_beacon_key_pdu_data_len()
+size_t get_beacon_key_pdu_data_len(beacon_key_pdu_data * pdu)
+{
+    return BEACON_KEY_PDU_HEADER_SIZE + (pdu->no_fragments * CRYPT_DATA_SIZE);
+}
+
+uint8_t get_no_key_fragments_from_pdu(size_t total_pdu_len)
 {
-    return (sizeof(beacon_key_pdu_data));
+    if (total_pdu_len < BEACON_KEY_PDU_HEADER_SIZE + CRYPT_DATA_SIZE)
+    {
+        return 0;
+    }
+
+    const size_t fragments_len = total_pdu_len - BEACON_KEY_PDU_HEADER_SIZE;
+    if ((fragments_len % CRYPT_DATA_SIZE) != 0 || (fragments_len / CRYPT_DATA_SIZE) > MAX_KEY_FRAGMENTS_PER_PDU)
+    {
+        return 0;
+    }
+
+    return (uint8_t) (fragments_len / CRYPT_DATA_SIZE);
 }
 
 uint16_t produce_key_session_data(uint16_t key_id, uint8_t key_fragment)
@@ -198,23 +313,49 @@ uint8_t produce_key_exchange_data(uint8_t pdu_time_interval_ms, uint8_t key_exch
 
 size_t get_payload_size_from_pdu(size_t total_pdu_len)
 {
-    return (total_pdu_len - (sizeof(uint16_t) + sizeof(command) + sizeof(uint8_t) + sizeof(uint16_t) + MARKER_STRUCT_SIZE));
+    if (total_pdu_len < BEACON_PDU_HEADER_SIZE)
+    {
+        return 0;
+    }
+    return (total_pdu_len - BEACON_PDU_HEADER_SIZE);
 }
 
 uint32_t get_adv_interval_from_key_id(uint16_t key_id)
 {
-    static const uint16_t MAX_KEY_ID_VAL = 0x3FFF;
-    static const uint16_t MIN_KEY_ID_VAL = 0x0000;
-
-    // Scale key_id to the range of advertisement intervals using floating-point arithmetic
-    double raw_interval = MIN_ADV_TIME_MS + ((double)key_id * ((double)(MAX_ADV_TIME_MS - MIN_ADV_TIME_MS) / (double)MAX_KEY_ID_VAL));
-
-    // Round to the nearest multiple of 80ms
-    uint32_t rounded_interval = (uint32_t)(round(raw_interval / SCALE_SINGLE_MS) * SCALE_SINGLE_MS);
+    // Integer form of round((MIN + key_id * (MAX - MIN) / MAX_KEY_ID_VAL) / SCALE) * SCALE, targets without FPU
+    // Numerator and denominator are doubled so the half of MIN / SCALE stays integer, fits uint32_t for any key_id
+    const uint32_t numerator = 2u * ((uint32_t) MIN_ADV_TIME_MS * MAX_KEY_ID_VAL + (uint32_t) key_id * (MAX_ADV_TIME_MS - MIN_ADV_TIME_MS))
+                               + (uint32_t) MAX_KEY_ID_VAL * SCALE_SINGLE_MS;
+    const uint32_t rounded_interval = (numerator / (2u * (uint32_t) MAX_KEY_ID_VAL * SCALE_SINGLE_MS)) * SCALE_SINGLE_MS;
 
     // Ensure the value is within bounds
     if (rounded_interval < MIN_ADV_TIME_MS) return MIN_ADV_TIME_MS;
     if (rounded_interval > MAX_ADV_TIME_MS) return MAX_ADV_TIME_MS;
 
     return rounded_interval;
-}
\ No newline at end of file
+}
+
+int get_tolerance_window_based_on_adv_interval(uint32_t adv_interval)
+{
+    // Percentages as integer fractions, truncated the same way as the former double multiplication
+    if (adv_interval >= 3000)
+    {
+        return adv_interval / 20;
+    }
+    else if (adv_interval >= 1000)
+    {
+        return adv_interval / 10;
+    }
+    else if (adv_interval > 500)
+    {
+        return (adv_interval * 3) / 20;
+    }
+    else if (adv_interval > 200)
+    {
+        return adv_interval / 5;
+    }
+    else
+    {
+        return (adv_interval * 3) / 10;
+    }
+}
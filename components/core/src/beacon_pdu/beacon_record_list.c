@@ -0,0 +1,65 @@
+#include "beacon_pdu/beacon_record_list.h"
+#include <string.h>
+
+size_t get_record_list_entry_size(size_t record_size)
+{
+    return RECORD_LIST_LENGTH_PREFIX_SIZE + record_size;
+}
+
+bool add_record_to_record_list(uint8_t *list, size_t capacity, size_t *list_size, const uint8_t *record, size_t record_size)
+{
+    if (list == NULL || list_size == NULL || record == NULL || record_size == 0 || record_size > MAX_RECORD_SIZE)
+    {
+        return false;
+    }
+
+    if (*list_size > capacity || get_record_list_entry_size(record_size) > capacity - *list_size)
+    {
+        return false;
+    }
+
+    list[*list_size] = (uint8_t) record_size;
+    memcpy(&list[*list_size + RECORD_LIST_LENGTH_PREFIX_SIZE], record, record_size);
+    *list_size += get_record_list_entry_size(record_size);
+    return true;
+}
+
+bool get_next_record_from_record_list(const uint8_t *list, size_t list_size, size_t *offset, const uint8_t **record, size_t *record_size)
+{
+    if (list == NULL || offset == NULL || record == NULL || record_size == NULL)
+    {
+        return false;
+    }
+
+    if (*offset >= list_size || list_size - *offset < RECORD_LIST_LENGTH_PREFIX_SIZE)
+    {
+        return false;
+    }
+
+    // Długość z nadawcy niezaufana - rekord nie może wyjść poza listę
+    const size_t size = list[*offset];
+    if (size == 0 || size > list_size - *offset - RECORD_LIST_LENGTH_PREFIX_SIZE)
+    {
+        return false;
+    }
+
+    *record = &list[*offset + RECORD_LIST_LENGTH_PREFIX_SIZE];
+    *record_size = size;
+    *offset += get_record_list_entry_size(size);
+    return true;
+}
+
+int get_record_list_count(const uint8_t *list, size_t list_size)
+{
+    size_t offset = 0;
+    const uint8_t *record = NULL;
+    size_t record_size = 0;
+    int count = 0;
+
+    while (get_next_record_from_record_list(list, list_size, &offset, &record, &record_size))
+    {
+        count++;
+    }
+
+    return offset == list_size ? count : -1;
+}
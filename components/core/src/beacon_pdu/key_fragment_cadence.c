@@ -0,0 +1,44 @@
+#include "beacon_pdu/key_fragment_cadence.h"
+#include <stddef.h>
+
+uint16_t get_fixed_key_fragment_cadence(const void *context, const uint32_t session_slot)
+{
+    (void) session_slot;
+    return *((const uint16_t *) context);
+}
+
+uint16_t get_tapered_key_fragment_cadence(const void *context, const uint32_t session_slot)
+{
+    const tapered_key_fragment_cadence_config *config = (const tapered_key_fragment_cadence_config *) context;
+    if (session_slot < config->burst_slots)
+    {
+        return config->burst_gap;
+    }
+
+    if (config->taper_step_slots == 0)
+    {
+        return config->floor_gap;
+    }
+
+    const uint32_t gap = (uint32_t) config->burst_gap + 1 + (session_slot - config->burst_slots) / config->taper_step_slots;
+    return gap < config->floor_gap ? (uint16_t) gap : config->floor_gap;
+}
+
+void init_key_fragment_scheduler(key_fragment_scheduler *scheduler, const key_fragment_cadence_policy *policy)
+{
+    scheduler->policy = *policy;
+    scheduler->data_pdus_since_key_pdu = UINT16_MAX;
+}
+
+bool schedule_key_fragment_pdu(key_fragment_scheduler *scheduler, const uint32_t session_slot)
+{
+    const uint16_t gap = scheduler->policy.get_data_pdus_between_key_pdus(scheduler->policy.context, session_slot);
+    if (scheduler->data_pdus_since_key_pdu >= gap)
+    {
+        scheduler->data_pdus_since_key_pdu = 0;
+        return true;
+    }
+
+    scheduler->data_pdus_since_key_pdu++;
+    return false;
+}
@@ -0,0 +1,244 @@
+#include "sender_registry.h"
+#include "esp_log.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define FNV_OFFSET_BASIS 2166136261u
+#define FNV_PRIME 16777619u
+
+// Hash table is kept at most half full, so linear probing stays short
+#define BUCKETS_PER_SENDER 2
+
+static const char * SENDER_REGISTRY_LOG_GROUP = "SENDER_REGISTRY";
+
+static uint32_t hash_mac_address(const esp_bd_addr_t mac_address)
+{
+    uint32_t hash = FNV_OFFSET_BASIS;
+    for (int i = 0; i < ESP_BD_ADDR_LEN; i++)
+    {
+        hash ^= mac_address[i];
+        hash *= FNV_PRIME;
+    }
+    return hash;
+}
+
+static uint16_t get_buckets_count(const uint16_t max_senders)
+{
+    uint32_t buckets_count = 4;
+    while (buckets_count < (uint32_t) max_senders * BUCKETS_PER_SENDER)
+    {
+        buckets_count <<= 1;
+    }
+    return (uint16_t) buckets_count;
+}
+
+// Position of the bucket holding mac address or the empty bucket ending its probe sequence
+static uint16_t find_bucket(sender_registry *registry, const esp_bd_addr_t mac_address)
+{
+    uint16_t position = hash_mac_address(mac_address) & registry->buckets_mask;
+    while (registry->buckets[position].sender_index != SENDER_REGISTRY_NO_INDEX &&
+           memcmp(registry->buckets[position].mac_address, mac_address, sizeof(esp_bd_addr_t)) != 0)
+    {
+        position = (position + 1) & registry->buckets_mask;
+    }
+    return position;
+}
+
+// Backward shift deletion - keeps probe sequences intact without tombstones
+static void remove_bucket(sender_registry *registry, uint16_t position)
+{
+    registry->buckets[position].sender_index = SENDER_REGISTRY_NO_INDEX;
+    uint16_t next = position;
+    while (1)
+    {
+        next = (next + 1) & registry->buckets_mask;
+        if (registry->buckets[next].sender_index == SENDER_REGISTRY_NO_INDEX)
+        {
+            break;
+        }
+
+        uint16_t home = hash_mac_address(registry->buckets[next].mac_address) & registry->buckets_mask;
+        bool home_between = (position <= next) ? (position < home && home <= next) : (position < home || home <= next);
+        if (home_between == false)
+        {
+            registry->buckets[position] = registry->buckets[next];
+            registry->buckets[next].sender_index = SENDER_REGISTRY_NO_INDEX;
+            position = next;
+        }
+    }
+}
+
+sender_registry* create_sender_registry(const uint16_t max_senders)
+{
+    if (max_senders == 0 || max_senders > INT16_MAX / BUCKETS_PER_SENDER)
+    {
+        ESP_LOGE(SENDER_REGISTRY_LOG_GROUP, "Unsupported number of senders: %u", (unsigned) max_senders);
+        return NULL;
+    }
+
+    sender_registry *registry = (sender_registry *) calloc(1, sizeof(sender_registry));
+    if (registry == NULL)
+    {
+        ESP_LOGE(SENDER_REGISTRY_LOG_GROUP, "Failed to allocate memory for sender registry!");
+        return NULL;
+    }
+
+    const uint16_t buckets_count = get_buckets_count(max_senders);
+    registry->buckets_mask = buckets_count - 1;
+    registry->max_senders = max_senders;
+    registry->buckets = (sender_registry_bucket *) malloc(sizeof(sender_registry_bucket) * buckets_count);
+    registry->sender_mac_addresses = (esp_bd_addr_t *) calloc(max_senders, sizeof(esp_bd_addr_t));
+    registry->free_indexes = (int16_t *) malloc(sizeof(int16_t) * max_senders);
+    registry->xMutex = xSemaphoreCreateMutex();
+
+    if (registry->buckets == NULL || registry->sender_mac_addresses == NULL || registry->free_indexes == NULL || registry->xMutex == NULL)
+    {
+        ESP_LOGE(SENDER_REGISTRY_LOG_GROUP, "Failed to allocate sender registry resources!");
+        destroy_sender_registry(registry);
+        return NULL;
+    }
+
+    for (uint16_t i = 0; i < buckets_count; i++)
+    {
+        registry->buckets[i].sender_index = SENDER_REGISTRY_NO_INDEX;
+    }
+
+    // Lowest indexes are handed out first
+    for (uint16_t i = 0; i < max_senders; i++)
+    {
+        registry->free_indexes[i] = (int16_t) (max_senders - 1 - i);
+    }
+    registry->free_indexes_count = max_senders;
+
+    return registry;
+}
+
+void destroy_sender_registry(sender_registry *registry)
+{
+    if (registry == NULL)
+    {
+        return;
+    }
+
+    if (registry->xMutex != NULL)
+    {
+        vSemaphoreDelete(registry->xMutex);
+    }
+    free(registry->buckets);
+    free(registry->sender_mac_addresses);
+    free(registry->free_indexes);
+    free(registry);
+}
+
+int get_sender_index(sender_registry *registry, const esp_bd_addr_t mac_address)
+{
+    int sender_index = SENDER_REGISTRY_NO_INDEX;
+
+    if (registry == NULL || mac_address == NULL)
+    {
+        return sender_index;
+    }
+
+    if (xSemaphoreTake(registry->xMutex, portMAX_DELAY) == pdTRUE)
+    {
+        sender_index = registry->buckets[find_bucket(registry, mac_address)].sender_index;
+        xSemaphoreGive(registry->xMutex);
+    }
+
+    return sender_index;
+}
+
+int add_sender_to_registry(sender_registry *registry, const esp_bd_addr_t mac_address)
+{
+    int sender_index = SENDER_REGISTRY_NO_INDEX;
+
+    if (registry == NULL || mac_address == NULL)
+    {
+        return sender_index;
+    }
+
+    if (xSemaphoreTake(registry->xMutex, portMAX_DELAY) == pdTRUE)
+    {
+        uint16_t position = find_bucket(registry, mac_address);
+        sender_index = registry->buckets[position].sender_index;
+
+        if (sender_index == SENDER_REGISTRY_NO_INDEX && registry->free_indexes_count > 0)
+        {
+            sender_index = registry->free_indexes[--registry->free_indexes_count];
+            memcpy(registry->buckets[position].mac_address, mac_address, sizeof(esp_bd_addr_t));
+            registry->buckets[position].sender_index = (int16_t) sender_index;
+            memcpy(registry->sender_mac_addresses[sender_index], mac_address, sizeof(esp_bd_addr_t));
+            registry->senders_count++;
+        }
+
+        xSemaphoreGive(registry->xMutex);
+    }
+
+    return sender_index;
+}
+
+int remove_sender_from_registry(sender_registry *registry, const esp_bd_addr_t mac_address)
+{
+    int sender_index = SENDER_REGISTRY_NO_INDEX;
+
+    if (registry == NULL || mac_address == NULL)
+    {
+        return sender_index;
+    }
+
+    if (xSemaphoreTake(registry->xMutex, portMAX_DELAY) == pdTRUE)
+    {
+        uint16_t position = find_bucket(registry, mac_address);
+        sender_index = registry->buckets[position].sender_index;
+
+        if (sender_index != SENDER_REGISTRY_NO_INDEX)
+        {
+            remove_bucket(registry, position);
+            memset(registry->sender_mac_addresses[sender_index], 0, sizeof(esp_bd_addr_t));
+            registry->free_indexes[registry->free_indexes_count++] = (int16_t) sender_index;
+            registry->senders_count--;
+        }
+
+        xSemaphoreGive(registry->xMutex);
+    }
+
+    return sender_index;
+}
+
+bool get_sender_mac_address(sender_registry *registry, const int sender_index, esp_bd_addr_t mac_address)
+{
+    bool result = false;
+
+    if (registry == NULL || mac_address == NULL || sender_index < 0 || sender_index >= registry->max_senders)
+    {
+        return result;
+    }
+
+    if (xSemaphoreTake(registry->xMutex, portMAX_DELAY) == pdTRUE)
+    {
+        memcpy(mac_address, registry->sender_mac_addresses[sender_index], sizeof(esp_bd_addr_t));
+        result = registry->buckets[find_bucket(registry, mac_address)].sender_index == sender_index;
+        xSemaphoreGive(registry->xMutex);
+    }
+
+    return result;
+}
+
+uint16_t get_max_senders(sender_registry *registry)
+{
+    return registry != NULL ? registry->max_senders : 0;
+}
+
+uint16_t get_no_registered_senders(sender_registry *registry)
+{
+    uint16_t senders_count = 0;
+
+    if (registry != NULL && xSemaphoreTake(registry->xMutex, portMAX_DELAY) == pdTRUE)
+    {
+        senders_count = registry->senders_count;
+        xSemaphoreGive(registry->xMutex);
+    }
+
+    return senders_count;
+}
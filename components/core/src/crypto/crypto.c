@@ -1,13 +1,35 @@
 #include "crypto/crypto.h"
 #include <stdio.h>
 #include <string.h>
-#include "esp_crc.h"
+#include <stdbool.h>
 #include "mbedtls/aes.h"
 #include "mbedtls/gcm.h"
 #include "mbedtls/md.h"
 #include "esp_random.h"
 #include "esp_log.h"
 
+#define SHA256_BLOCK_SIZE 64
+#define SHA256_STATE_WORDS 8
+#define HMAC_IPAD 0x36
+#define HMAC_OPAD 0x5C
+
+#define ROTR32(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static const uint32_t sha256_initial_state[SHA256_STATE_WORDS] = {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+};
+
+static const uint32_t sha256_round_constants[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
 static const char * crypto_log_group = "CRYPTO";
 
 void generate_128b_key(key_128b * key)
@@ -48,27 +70,172 @@ void add_fragment_to_key_spliited(key_splitted * key_splitted, uint8_t *fragment
     memcpy(key_splitted->fragment[fragment_index], fragment, KEY_FRAGMENT_SIZE);
 }
 
-int aes_ctr_encrypt_payload(uint8_t *input, size_t length, uint8_t *key, uint8_t *nonce, uint8_t *output) {
-    mbedtls_aes_context aes;
-    mbedtls_aes_init(&aes);
+int init_aes_key_schedule(aes_key_schedule * key_schedule, const uint8_t *key)
+{
+    if (key_schedule == NULL || key == NULL) {
+        return -1;
+    }
+
+    mbedtls_aes_init(&(key_schedule->aes));
 
-    if (mbedtls_aes_setkey_enc(&aes, key, 128) != 0) {
-        mbedtls_aes_free(&aes);
+    if (mbedtls_aes_setkey_enc(&(key_schedule->aes), key, 128) != 0) {
+        mbedtls_aes_free(&(key_schedule->aes));
         return -1;
     }
 
+    return 0;
+}
+
+void free_aes_key_schedule(aes_key_schedule * key_schedule)
+{
+    if (key_schedule != NULL) {
+        mbedtls_aes_free(&(key_schedule->aes));
+    }
+}
+
+int aes_ctr_decrypt_payload_with_key_schedule(uint8_t *input, size_t length, aes_key_schedule * key_schedule, uint8_t *nonce, uint8_t *output)
+{
     size_t nc_off = 0;
     uint8_t stream_block[16] = {0};
 
-    if (mbedtls_aes_crypt_ctr(&aes, length, &nc_off, nonce, stream_block, input, output) != 0) {
-        mbedtls_aes_free(&aes);
+    if (mbedtls_aes_crypt_ctr(&(key_schedule->aes), length, &nc_off, nonce, stream_block, input, output) != 0) {
+        return -2;
+    }
+
+    return 0;
+}
+
+// CCM block with flags, nonce and a 2 byte big endian counter or message length (RFC 3610, L = 2)
+static void build_ccm_block(uint8_t block[AES_CTR_BLOCK_SIZE], uint8_t flags, const uint8_t nonce[AES_CCM_NONCE_SIZE], uint16_t value)
+{
+    block[0] = flags;
+    memcpy(&block[1], nonce, AES_CCM_NONCE_SIZE);
+    block[AES_CTR_BLOCK_SIZE - 2] = (uint8_t) (value >> 8);
+    block[AES_CTR_BLOCK_SIZE - 1] = (uint8_t) value;
+}
+
+static bool is_ccm_tag_size_valid(size_t tag_size)
+{
+    return tag_size >= AES_CCM_MIN_TAG_SIZE && tag_size <= AES_CTR_BLOCK_SIZE && (tag_size % 2) == 0;
+}
+
+// CBC-MAC of B0 and the zero padded plaintext, no associated data - PDU header is bound through the nonce
+static int ccm_cbc_mac(aes_key_schedule * key_schedule, const uint8_t nonce[AES_CCM_NONCE_SIZE], const uint8_t *plaintext,
+                       size_t length, size_t tag_size, uint8_t mac[AES_CTR_BLOCK_SIZE])
+{
+    const uint8_t flags = (uint8_t) ((((tag_size - 2) / 2) << 3) | (AES_CCM_LENGTH_SIZE - 1));
+    build_ccm_block(mac, flags, nonce, (uint16_t) length);
+    if (mbedtls_aes_crypt_ecb(&(key_schedule->aes), MBEDTLS_AES_ENCRYPT, mac, mac) != 0) {
+        return -2;
+    }
+
+    for (size_t offset = 0; offset < length; offset += AES_CTR_BLOCK_SIZE) {
+        const size_t block_length = (length - offset) < AES_CTR_BLOCK_SIZE ? (length - offset) : AES_CTR_BLOCK_SIZE;
+        for (size_t i = 0; i < block_length; i++) {
+            mac[i] ^= plaintext[offset + i];
+        }
+        if (mbedtls_aes_crypt_ecb(&(key_schedule->aes), MBEDTLS_AES_ENCRYPT, mac, mac) != 0) {
+            return -2;
+        }
+    }
+
+    return 0;
+}
+
+// CTR part of CCM, counter block 0 encrypts the tag, payload starts at counter 1
+static int ccm_ctr(aes_key_schedule * key_schedule, const uint8_t nonce[AES_CCM_NONCE_SIZE], const uint8_t *input,
+                   size_t length, uint8_t *output, uint8_t mac[AES_CTR_BLOCK_SIZE])
+{
+    const uint8_t flags = AES_CCM_LENGTH_SIZE - 1;
+    uint8_t keystream[AES_CTR_BLOCK_SIZE];
+    uint16_t counter = 0;
+
+    build_ccm_block(keystream, flags, nonce, counter++);
+    if (mbedtls_aes_crypt_ecb(&(key_schedule->aes), MBEDTLS_AES_ENCRYPT, keystream, keystream) != 0) {
+        return -2;
+    }
+    for (size_t i = 0; i < AES_CTR_BLOCK_SIZE; i++) {
+        mac[i] ^= keystream[i];
+    }
+
+    for (size_t offset = 0; offset < length; offset += AES_CTR_BLOCK_SIZE) {
+        build_ccm_block(keystream, flags, nonce, counter++);
+        if (mbedtls_aes_crypt_ecb(&(key_schedule->aes), MBEDTLS_AES_ENCRYPT, keystream, keystream) != 0) {
+            return -2;
+        }
+        const size_t block_length = (length - offset) < AES_CTR_BLOCK_SIZE ? (length - offset) : AES_CTR_BLOCK_SIZE;
+        for (size_t i = 0; i < block_length; i++) {
+            output[offset + i] = input[offset + i] ^ keystream[i];
+        }
+    }
+
+    return 0;
+}
+
+int aes_ccm_encrypt_and_tag_with_key_schedule(aes_key_schedule * key_schedule, const uint8_t nonce[AES_CCM_NONCE_SIZE],
+                                              const uint8_t *input, size_t length, uint8_t *output, uint8_t *tag, size_t tag_size)
+{
+    uint8_t mac[AES_CTR_BLOCK_SIZE];
+
+    if (key_schedule == NULL || nonce == NULL || input == NULL || output == NULL || tag == NULL ||
+        length > AES_CCM_MAX_PAYLOAD_SIZE || is_ccm_tag_size_valid(tag_size) == false) {
+        return -1;
+    }
+
+    if (ccm_cbc_mac(key_schedule, nonce, input, length, tag_size, mac) != 0 ||
+        ccm_ctr(key_schedule, nonce, input, length, output, mac) != 0) {
+        return -2;
+    }
+
+    memcpy(tag, mac, tag_size);
+    return 0;
+}
+
+int aes_ccm_auth_decrypt_with_key_schedule(aes_key_schedule * key_schedule, const uint8_t nonce[AES_CCM_NONCE_SIZE],
+                                           const uint8_t *input, size_t length, uint8_t *output, const uint8_t *tag, size_t tag_size)
+{
+    uint8_t encrypted_mac[AES_CTR_BLOCK_SIZE] = {0};
+    uint8_t mac[AES_CTR_BLOCK_SIZE];
+
+    if (key_schedule == NULL || nonce == NULL || input == NULL || output == NULL || tag == NULL ||
+        length > AES_CCM_MAX_PAYLOAD_SIZE || is_ccm_tag_size_valid(tag_size) == false) {
+        return -1;
+    }
+
+    // Odszyfrowanie przed sprawdzeniem znacznika - CBC-MAC liczony jest z tekstu jawnego
+    if (ccm_ctr(key_schedule, nonce, input, length, output, encrypted_mac) != 0 ||
+        ccm_cbc_mac(key_schedule, nonce, output, length, tag_size, mac) != 0) {
+        memset(output, 0, length);
         return -2;
     }
 
-    mbedtls_aes_free(&aes);
+    // encrypted_mac holds S0 now, expected tag = CBC-MAC ^ S0
+    for (size_t i = 0; i < tag_size; i++) {
+        mac[i] ^= encrypted_mac[i];
+    }
+
+    if (crypto_secure_memcmp(mac, tag, tag_size) != 0) {
+        // Niezweryfikowany tekst jawny nie może wyjść poza funkcję
+        memset(output, 0, length);
+        return -3;
+    }
+
     return 0;
 }
 
+int aes_ctr_encrypt_payload(uint8_t *input, size_t length, uint8_t *key, uint8_t *nonce, uint8_t *output) {
+    aes_key_schedule key_schedule;
+
+    if (init_aes_key_schedule(&key_schedule, key) != 0) {
+        return -1;
+    }
+
+    int status = aes_ctr_decrypt_payload_with_key_schedule(input, length, &key_schedule, nonce, output);
+
+    free_aes_key_schedule(&key_schedule);
+    return status;
+}
+
 int aes_ctr_decrypt_payload(uint8_t *input, size_t length, uint8_t *key, uint8_t *nonce, uint8_t *output) {
     return aes_ctr_encrypt_payload(input, length, key, nonce, output);
 }
@@ -146,8 +313,110 @@ void calculate_hmac(const uint8_t *key, size_t key_len, const uint8_t *message,
 }
 
 void calculate_hmac_of_fragment(uint8_t *key_fragment, uint8_t *encrypted_fragment, uint8_t *hmac_output) {
+    uint8_t hmac[HMAC_SHA256_DIGEST_SIZE];
     // Policz HMAC dla zaszyfrowanego fragmentu używająć odszyfrowanego fragmentu jako klucz
-    calculate_hmac(key_fragment, KEY_FRAGMENT_SIZE, encrypted_fragment, KEY_FRAGMENT_SIZE, hmac_output);
+    calculate_hmac_single_block(key_fragment, KEY_FRAGMENT_SIZE, encrypted_fragment, KEY_FRAGMENT_SIZE, hmac);
+    // Do PDU trafia tylko obcięty znacznik
+    memcpy(hmac_output, hmac, HMAC_SIZE);
+}
+
+static uint32_t load_be32(const uint8_t *data)
+{
+    return ((uint32_t) data[0] << 24) | ((uint32_t) data[1] << 16) | ((uint32_t) data[2] << 8) | (uint32_t) data[3];
+}
+
+static void store_be32(uint8_t *data, uint32_t value)
+{
+    data[0] = (uint8_t) (value >> 24);
+    data[1] = (uint8_t) (value >> 16);
+    data[2] = (uint8_t) (value >> 8);
+    data[3] = (uint8_t) value;
+}
+
+static void sha256_compress(uint32_t state[SHA256_STATE_WORDS], const uint8_t block[SHA256_BLOCK_SIZE])
+{
+    uint32_t w[16];
+    for (int i = 0; i < 16; i++) {
+        w[i] = load_be32(&block[i * 4]);
+    }
+
+    uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+    uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+
+    for (int i = 0; i < 64; i++) {
+        // Harmonogram wiadomości liczony w miejscu na 16 słowach zamiast tablicy 64 słów
+        if (i >= 16) {
+            const uint32_t w15 = w[(i - 15) & 15];
+            const uint32_t w2 = w[(i - 2) & 15];
+            const uint32_t s0 = ROTR32(w15, 7) ^ ROTR32(w15, 18) ^ (w15 >> 3);
+            const uint32_t s1 = ROTR32(w2, 17) ^ ROTR32(w2, 19) ^ (w2 >> 10);
+            w[i & 15] += s0 + w[(i - 7) & 15] + s1;
+        }
+
+        const uint32_t t1 = h + (ROTR32(e, 6) ^ ROTR32(e, 11) ^ ROTR32(e, 25)) + ((e & f) ^ (~e & g))
+                            + sha256_round_constants[i] + w[i & 15];
+        const uint32_t t2 = (ROTR32(a, 2) ^ ROTR32(a, 13) ^ ROTR32(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+        h = g;
+        g = f;
+        f = e;
+        e = d + t1;
+        d = c;
+        c = b;
+        b = a;
+        a = t1 + t2;
+    }
+
+    state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+    state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+}
+
+// SHA-256(pad_block || data) where pad_block is the key XORed with ipad/opad and data fits into the second block
+static void sha256_pad_block_and_data(const uint8_t *key, size_t key_len, uint8_t pad, const uint8_t *data, size_t data_len,
+                                      uint8_t digest[HMAC_SHA256_DIGEST_SIZE])
+{
+    uint8_t block[SHA256_BLOCK_SIZE];
+    uint32_t state[SHA256_STATE_WORDS];
+    memcpy(state, sha256_initial_state, sizeof(state));
+
+    memset(block, pad, sizeof(block));
+    for (size_t i = 0; i < key_len; i++) {
+        block[i] ^= key[i];
+    }
+    sha256_compress(state, block);
+
+    // Drugi blok: dane, bit 1, zera i długość w bitach - wiadomość razem z blokiem klucza
+    memset(block, 0, sizeof(block));
+    memcpy(block, data, data_len);
+    block[data_len] = 0x80;
+    store_be32(&block[SHA256_BLOCK_SIZE - 4], (uint32_t) ((SHA256_BLOCK_SIZE + data_len) * 8));
+    sha256_compress(state, block);
+
+    for (int i = 0; i < SHA256_STATE_WORDS; i++) {
+        store_be32(&digest[i * 4], state[i]);
+    }
+}
+
+int calculate_hmac_single_block(const uint8_t *key, size_t key_len, const uint8_t *message, size_t message_len,
+                                uint8_t output[HMAC_SHA256_DIGEST_SIZE])
+{
+    if (key == NULL || message == NULL || output == NULL ||
+        key_len > SHA256_BLOCK_SIZE || message_len > HMAC_SINGLE_BLOCK_MAX_MESSAGE_SIZE) {
+        return -1;
+    }
+
+    uint8_t inner_digest[HMAC_SHA256_DIGEST_SIZE];
+    sha256_pad_block_and_data(key, key_len, HMAC_IPAD, message, message_len, inner_digest);
+    sha256_pad_block_and_data(key, key_len, HMAC_OPAD, inner_digest, sizeof(inner_digest), output);
+    return 0;
+}
+
+int verify_key_fragment_hmac(const uint8_t *key_fragment, const uint8_t *encrypted_fragment, const uint8_t *expected_hmac)
+{
+    uint8_t calculated_hmac[HMAC_SHA256_DIGEST_SIZE];
+    if (calculate_hmac_single_block(key_fragment, KEY_FRAGMENT_SIZE, encrypted_fragment, KEY_FRAGMENT_SIZE, calculated_hmac) != 0) {
+        return -1;
+    }
+    return crypto_secure_memcmp(calculated_hmac, expected_hmac, HMAC_SIZE);
 }
 
 // Constant-time memory comparison
@@ -0,0 +1,146 @@
+#include "crypto/key_fragment_coding.h"
+#include <string.h>
+
+// x^8 + x^4 + x^3 + x^2 + 1
+#define GF256_REDUCTION_POLYNOMIAL 0x1D
+
+static uint8_t gf256_mul(uint8_t a, uint8_t b)
+{
+    uint8_t product = 0;
+    while (b != 0)
+    {
+        if (b & 1)
+        {
+            product ^= a;
+        }
+        const uint8_t carry = a & 0x80;
+        a <<= 1;
+        if (carry)
+        {
+            a ^= GF256_REDUCTION_POLYNOMIAL;
+        }
+        b >>= 1;
+    }
+    return product;
+}
+
+// a^254 = a^-1 in GF(256), a != 0
+static uint8_t gf256_inv(uint8_t a)
+{
+    uint8_t result = 1;
+    uint8_t power = a;
+    for (uint8_t exponent = 254; exponent != 0; exponent >>= 1)
+    {
+        if (exponent & 1)
+        {
+            result = gf256_mul(result, power);
+        }
+        power = gf256_mul(power, power);
+    }
+    return result;
+}
+
+// Generator row of coded fragment: unit row for key fragments, 1 / (x_p + y_j) with x_p = NO_KEY_FRAGMENTS + p, y_j = j for parity
+static void get_generator_row(uint8_t coded_index, uint8_t row[NO_KEY_FRAGMENTS])
+{
+    for (uint8_t j = 0; j < NO_KEY_FRAGMENTS; j++)
+    {
+        if (coded_index < NO_KEY_FRAGMENTS)
+        {
+            row[j] = coded_index == j ? 1 : 0;
+        }
+        else
+        {
+            row[j] = gf256_inv((uint8_t) (coded_index ^ j));
+        }
+    }
+}
+
+void encode_key_parity_fragment(const key_splitted *key_fragments, uint8_t parity_index, uint8_t parity_fragment[KEY_FRAGMENT_SIZE])
+{
+    uint8_t row[NO_KEY_FRAGMENTS];
+    get_generator_row((uint8_t) (NO_KEY_FRAGMENTS + parity_index), row);
+
+    memset(parity_fragment, 0, KEY_FRAGMENT_SIZE);
+    for (uint8_t j = 0; j < NO_KEY_FRAGMENTS; j++)
+    {
+        for (uint8_t byte = 0; byte < KEY_FRAGMENT_SIZE; byte++)
+        {
+            parity_fragment[byte] ^= gf256_mul(row[j], key_fragments->fragment[j][byte]);
+        }
+    }
+}
+
+bool decode_key_fragments(const uint8_t coded_fragments[NO_CODED_KEY_FRAGMENTS][KEY_FRAGMENT_SIZE], uint8_t received_mask, key_splitted *key_fragments)
+{
+    // Key fragments first - without losses no arithmetic is needed
+    uint8_t matrix[NO_KEY_FRAGMENTS][NO_KEY_FRAGMENTS];
+    uint8_t symbols[NO_KEY_FRAGMENTS][KEY_FRAGMENT_SIZE];
+    uint8_t no_rows = 0;
+    for (uint8_t coded_index = 0; coded_index < NO_CODED_KEY_FRAGMENTS && no_rows < NO_KEY_FRAGMENTS; coded_index++)
+    {
+        if (received_mask & (1u << coded_index))
+        {
+            get_generator_row(coded_index, matrix[no_rows]);
+            memcpy(symbols[no_rows], coded_fragments[coded_index], KEY_FRAGMENT_SIZE);
+            no_rows++;
+        }
+    }
+
+    if (no_rows < NO_KEY_FRAGMENTS)
+    {
+        return false;
+    }
+
+    // Gauss-Jordan elimination of matrix * key_fragments = symbols, every 4x4 submatrix of the generator is invertible
+    for (uint8_t column = 0; column < NO_KEY_FRAGMENTS; column++)
+    {
+        uint8_t pivot = column;
+        while (matrix[pivot][column] == 0)
+        {
+            pivot++;
+        }
+
+        if (pivot != column)
+        {
+            uint8_t tmp_row[NO_KEY_FRAGMENTS];
+            uint8_t tmp_symbol[KEY_FRAGMENT_SIZE];
+            memcpy(tmp_row, matrix[pivot], NO_KEY_FRAGMENTS);
+            memcpy(matrix[pivot], matrix[column], NO_KEY_FRAGMENTS);
+            memcpy(matrix[column], tmp_row, NO_KEY_FRAGMENTS);
+            memcpy(tmp_symbol, symbols[pivot], KEY_FRAGMENT_SIZE);
+            memcpy(symbols[pivot], symbols[column], KEY_FRAGMENT_SIZE);
+            memcpy(symbols[column], tmp_symbol, KEY_FRAGMENT_SIZE);
+        }
+
+        const uint8_t pivot_inv = gf256_inv(matrix[column][column]);
+        for (uint8_t j = 0; j < NO_KEY_FRAGMENTS; j++)
+        {
+            matrix[column][j] = gf256_mul(matrix[column][j], pivot_inv);
+        }
+        for (uint8_t byte = 0; byte < KEY_FRAGMENT_SIZE; byte++)
+        {
+            symbols[column][byte] = gf256_mul(symbols[column][byte], pivot_inv);
+        }
+
+        for (uint8_t row = 0; row < NO_KEY_FRAGMENTS; row++)
+        {
+            const uint8_t factor = matrix[row][column];
+            if (row == column || factor == 0)
+            {
+                continue;
+            }
+            for (uint8_t j = 0; j < NO_KEY_FRAGMENTS; j++)
+            {
+                matrix[row][j] ^= gf256_mul(factor, matrix[column][j]);
+            }
+            for (uint8_t byte = 0; byte < KEY_FRAGMENT_SIZE; byte++)
+            {
+                symbols[row][byte] ^= gf256_mul(factor, symbols[column][byte]);
+            }
+        }
+    }
+
+    memcpy(key_fragments->fragment, symbols, sizeof(key_fragments->fragment));
+    return true;
+}
@@ -0,0 +1,45 @@
+#include "unity.h"
+#include "beacon_pdu_data.h"
+
+#include <math.h>
+#include <stdint.h>
+
+#define TEST_MAX_CHECKED_ADV_INTERVAL_MS (2 * MAX_ADV_TIME_MS)
+
+// Floating point get_adv_interval_from_key_id used before the integer form, reference for bit exactness
+static uint32_t reference_adv_interval_from_key_id(uint16_t key_id)
+{
+    double raw_interval = MIN_ADV_TIME_MS + ((double)key_id * ((double)(MAX_ADV_TIME_MS - MIN_ADV_TIME_MS) / (double)MAX_KEY_ID_VAL));
+    uint32_t rounded_interval = (uint32_t)(round(raw_interval / SCALE_SINGLE_MS) * SCALE_SINGLE_MS);
+    if (rounded_interval < MIN_ADV_TIME_MS) return MIN_ADV_TIME_MS;
+    if (rounded_interval > MAX_ADV_TIME_MS) return MAX_ADV_TIME_MS;
+    return rounded_interval;
+}
+
+// Floating point tolerance window used before the integer form
+static int reference_tolerance_window(uint32_t adv_interval)
+{
+    if (adv_interval >= 3000) return adv_interval * 0.05;
+    else if (adv_interval >= 1000) return adv_interval * 0.1;
+    else if (adv_interval > 500) return adv_interval * 0.15;
+    else if (adv_interval > 200) return adv_interval * 0.20;
+    else return adv_interval * 0.30;
+}
+
+TEST_CASE("adv interval matches the floating point form for every key id", "[adv_interval]")
+{
+    for (uint32_t key_id = 0; key_id <= MAX_KEY_ID_VAL; key_id++)
+    {
+        TEST_ASSERT_EQUAL_UINT32_MESSAGE(reference_adv_interval_from_key_id((uint16_t) key_id),
+                                         get_adv_interval_from_key_id((uint16_t) key_id), "key id");
+    }
+}
+
+TEST_CASE("tolerance window matches the floating point form for every adv interval", "[adv_interval]")
+{
+    for (uint32_t adv_interval = 0; adv_interval <= TEST_MAX_CHECKED_ADV_INTERVAL_MS; adv_interval++)
+    {
+        TEST_ASSERT_EQUAL_INT_MESSAGE(reference_tolerance_window(adv_interval),
+                                      get_tolerance_window_based_on_adv_interval(adv_interval), "adv interval");
+    }
+}
@@ -0,0 +1,135 @@
+#include "unity.h"
+#include "beacon_pdu_data.h"
+#include "crypto.h"
+#include "key_fragment_coding.h"
+
+#include <string.h>
+
+static void fill_bytes(uint8_t *data, size_t size, uint8_t seed)
+{
+    for (size_t i = 0; i < size; i++)
+    {
+        data[i] = (uint8_t) (seed + i * 31);
+    }
+}
+
+TEST_CASE("single block HMAC matches mbedtls HMAC", "[crypto]")
+{
+    uint8_t key[KEY_FRAGMENT_SIZE];
+    uint8_t message[HMAC_SINGLE_BLOCK_MAX_MESSAGE_SIZE];
+    uint8_t expected[HMAC_SHA256_DIGEST_SIZE];
+    uint8_t output[HMAC_SHA256_DIGEST_SIZE];
+
+    for (size_t message_len = 0; message_len <= HMAC_SINGLE_BLOCK_MAX_MESSAGE_SIZE; message_len++)
+    {
+        fill_bytes(key, sizeof(key), (uint8_t) message_len);
+        fill_bytes(message, message_len, (uint8_t) (message_len * 7));
+        calculate_hmac(key, sizeof(key), message, message_len, expected);
+        TEST_ASSERT_EQUAL(0, calculate_hmac_single_block(key, sizeof(key), message, message_len, output));
+        TEST_ASSERT_EQUAL_HEX8_ARRAY(expected, output, HMAC_SHA256_DIGEST_SIZE);
+    }
+
+    TEST_ASSERT_NOT_EQUAL(0, calculate_hmac_single_block(key, sizeof(key), message, HMAC_SINGLE_BLOCK_MAX_MESSAGE_SIZE + 1, output));
+}
+
+TEST_CASE("key fragment HMAC verifies only the fragment it was made for", "[crypto]")
+{
+    uint8_t fragment[KEY_FRAGMENT_SIZE];
+    uint8_t encrypted_fragment[KEY_FRAGMENT_SIZE];
+    uint8_t decrypted_fragment[KEY_FRAGMENT_SIZE];
+    uint8_t hmac[HMAC_SIZE];
+
+    fill_bytes(fragment, sizeof(fragment), 0x42);
+    xor_encrypt_key_fragment(fragment, encrypted_fragment, 0x9C);
+    calculate_hmac_of_fragment(fragment, encrypted_fragment, hmac);
+
+    xor_decrypt_key_fragment(encrypted_fragment, decrypted_fragment, 0x9C);
+    TEST_ASSERT_EQUAL_HEX8_ARRAY(fragment, decrypted_fragment, KEY_FRAGMENT_SIZE);
+    TEST_ASSERT_EQUAL(0, verify_key_fragment_hmac(decrypted_fragment, encrypted_fragment, hmac));
+
+    // Wrong XOR seed gives a different fragment
+    xor_decrypt_key_fragment(encrypted_fragment, decrypted_fragment, 0x9D);
+    TEST_ASSERT_NOT_EQUAL(0, verify_key_fragment_hmac(decrypted_fragment, encrypted_fragment, hmac));
+
+    hmac[0] ^= 0x01;
+    TEST_ASSERT_NOT_EQUAL(0, verify_key_fragment_hmac(fragment, encrypted_fragment, hmac));
+}
+
+TEST_CASE("AEAD data PDU decrypts and rejects a modified header or payload", "[crypto]")
+{
+    const size_t payload_size = MAX_AEAD_PDU_PAYLOAD_SIZE;
+    uint8_t plaintext[MAX_AEAD_PDU_PAYLOAD_SIZE];
+    uint8_t output[MAX_AEAD_PDU_PAYLOAD_SIZE];
+    const uint8_t zeroed_output[MAX_AEAD_PDU_PAYLOAD_SIZE] = {0};
+    uint8_t nonce[AES_CCM_NONCE_SIZE];
+    beacon_pdu_data pdu;
+    key_128b key;
+
+    fill_bytes(key.key, sizeof(key.key), 0x3C);
+    fill_bytes(plaintext, payload_size, 0x01);
+    aes_key_schedule key_schedule;
+    TEST_ASSERT_EQUAL(0, init_aes_key_schedule(&key_schedule, key.key));
+
+    TEST_ASSERT_EQUAL(ESP_OK, build_beacon_pdu_data(produce_key_session_data(1, 0), plaintext, payload_size, &pdu));
+    pdu.cmd = AEAD_DATA_CMD;
+    pdu.pdu_no = 7;
+    pdu.xor_seed = 0x11;
+    pdu.payload_size = payload_size + DATA_PDU_AEAD_TAG_SIZE;
+    build_aead_nonce(nonce, &pdu);
+    TEST_ASSERT_EQUAL(0, aes_ccm_encrypt_and_tag_with_key_schedule(&key_schedule, nonce, plaintext, payload_size, pdu.payload,
+                                                                   &(pdu.payload[payload_size]), DATA_PDU_AEAD_TAG_SIZE));
+
+    TEST_ASSERT_EQUAL(0, aes_ccm_auth_decrypt_with_key_schedule(&key_schedule, nonce, pdu.payload, payload_size, output,
+                                                                &(pdu.payload[payload_size]), DATA_PDU_AEAD_TAG_SIZE));
+    TEST_ASSERT_EQUAL_HEX8_ARRAY(plaintext, output, payload_size);
+
+    // The nonce covers the header, a changed PDU number fails the tag and the output is zeroed
+    pdu.pdu_no++;
+    build_aead_nonce(nonce, &pdu);
+    TEST_ASSERT_EQUAL(-3, aes_ccm_auth_decrypt_with_key_schedule(&key_schedule, nonce, pdu.payload, payload_size, output,
+                                                                 &(pdu.payload[payload_size]), DATA_PDU_AEAD_TAG_SIZE));
+    TEST_ASSERT_EQUAL_HEX8_ARRAY(zeroed_output, output, payload_size);
+
+    pdu.pdu_no--;
+    build_aead_nonce(nonce, &pdu);
+    pdu.payload[0] ^= 0x80;
+    TEST_ASSERT_EQUAL(-3, aes_ccm_auth_decrypt_with_key_schedule(&key_schedule, nonce, pdu.payload, payload_size, output,
+                                                                 &(pdu.payload[payload_size]), DATA_PDU_AEAD_TAG_SIZE));
+
+    free_aes_key_schedule(&key_schedule);
+}
+
+TEST_CASE("any NO_KEY_FRAGMENTS coded fragments rebuild the key", "[crypto]")
+{
+    uint8_t coded_fragments[NO_CODED_KEY_FRAGMENTS][KEY_FRAGMENT_SIZE];
+    key_128b key;
+    key_splitted key_fragments;
+
+    fill_bytes(key.key, sizeof(key.key), 0x77);
+    split_128b_key_to_fragment(&key, &key_fragments);
+    for (uint8_t i = 0; i < NO_CODED_KEY_FRAGMENTS; i++)
+    {
+        if (i < NO_KEY_FRAGMENTS)
+        {
+            memcpy(coded_fragments[i], key_fragments.fragment[i], KEY_FRAGMENT_SIZE);
+        }
+        else
+        {
+            encode_key_parity_fragment(&key_fragments, i - NO_KEY_FRAGMENTS, coded_fragments[i]);
+        }
+    }
+
+    for (uint32_t received_mask = 0; received_mask < (1u << NO_CODED_KEY_FRAGMENTS); received_mask++)
+    {
+        key_splitted decoded_fragments = {0};
+        const bool decoded = decode_key_fragments((const uint8_t (*)[KEY_FRAGMENT_SIZE]) coded_fragments, (uint8_t) received_mask,
+                                                  &decoded_fragments);
+        TEST_ASSERT_EQUAL(__builtin_popcount(received_mask) >= NO_KEY_FRAGMENTS, decoded);
+        if (decoded)
+        {
+            key_128b decoded_key;
+            get_128b_key_from_fragments(&decoded_key, &decoded_fragments);
+            TEST_ASSERT_EQUAL_HEX8_ARRAY(key.key, decoded_key.key, KEY_SIZE);
+        }
+    }
+}
@@ -0,0 +1,142 @@
+#include "unity.h"
+#include "beacon_pdu_data.h"
+#include "beacon_record_list.h"
+
+#include <string.h>
+
+#define TEST_KEY_ID 0x1234
+
+static void fill_bytes(uint8_t *data, size_t size, uint8_t seed)
+{
+    for (size_t i = 0; i < size; i++)
+    {
+        data[i] = (uint8_t) (seed + i * 31);
+    }
+}
+
+TEST_CASE("data PDU of every payload length survives adv data serialization", "[pdu_codec]")
+{
+    uint8_t adv_data[MAX_BEACON_PDU_LEN];
+    uint8_t payload[MAX_PDU_PAYLOAD_SIZE];
+    beacon_pdu_data pdu;
+    beacon_pdu_data parsed_pdu;
+
+    for (size_t payload_size = 0; payload_size <= MAX_PDU_PAYLOAD_SIZE; payload_size++)
+    {
+        fill_bytes(payload, payload_size, (uint8_t) payload_size);
+        memset(&pdu, 0, sizeof(pdu));
+        TEST_ASSERT_EQUAL(ESP_OK, build_beacon_pdu_data(produce_key_session_data(TEST_KEY_ID, 0), payload, payload_size, &pdu));
+        pdu.pdu_no = (uint16_t) payload_size;
+        pdu.payload_size = payload_size;
+
+        const size_t adv_data_len = get_beacon_pdu_data_len(&pdu);
+        TEST_ASSERT_EQUAL(BEACON_PDU_HEADER_SIZE + payload_size, adv_data_len);
+        TEST_ASSERT_LESS_OR_EQUAL(MAX_BEACON_PDU_LEN, adv_data_len);
+        memcpy(adv_data, &pdu, adv_data_len);
+
+        TEST_ASSERT_TRUE(is_pdu_in_beacon_pdu_format(adv_data, adv_data_len));
+        TEST_ASSERT_EQUAL(DATA_CMD, get_command_from_pdu(adv_data, adv_data_len));
+        TEST_ASSERT_TRUE(get_beacon_pdu_from_adv_data(&parsed_pdu, adv_data, adv_data_len));
+        TEST_ASSERT_EQUAL(payload_size, parsed_pdu.payload_size);
+        TEST_ASSERT_EQUAL(pdu.pdu_no, parsed_pdu.pdu_no);
+        TEST_ASSERT_EQUAL(TEST_KEY_ID, get_key_id_from_key_session_data(parsed_pdu.key_session_data));
+        if (payload_size > 0)
+        {
+            TEST_ASSERT_EQUAL_HEX8_ARRAY(payload, parsed_pdu.payload, payload_size);
+        }
+    }
+}
+
+TEST_CASE("adv data outside the data PDU length limits is rejected", "[pdu_codec]")
+{
+    uint8_t adv_data[MAX_BEACON_PDU_LEN + 1] = {0};
+    beacon_pdu_data parsed_pdu;
+
+    TEST_ASSERT_FALSE(get_beacon_pdu_from_adv_data(&parsed_pdu, adv_data, MAX_BEACON_PDU_LEN + 1));
+    TEST_ASSERT_FALSE(get_beacon_pdu_from_adv_data(&parsed_pdu, adv_data, BEACON_PDU_HEADER_SIZE - 1));
+    TEST_ASSERT_EQUAL(0, get_payload_size_from_pdu(BEACON_PDU_HEADER_SIZE - 1));
+}
+
+TEST_CASE("key PDU fragment count follows the adv data length", "[pdu_codec]")
+{
+    for (uint8_t no_fragments = 1; no_fragments <= MAX_KEY_FRAGMENTS_PER_PDU; no_fragments++)
+    {
+        beacon_key_pdu_data pdu = {0};
+        pdu.no_fragments = no_fragments;
+        const size_t adv_data_len = get_beacon_key_pdu_data_len(&pdu);
+        TEST_ASSERT_LESS_OR_EQUAL(MAX_BEACON_PDU_LEN, adv_data_len);
+        TEST_ASSERT_EQUAL(no_fragments, get_no_key_fragments_from_pdu(adv_data_len));
+    }
+
+    // No fragment, a partial fragment or more fragments than fit into the PDU
+    TEST_ASSERT_EQUAL(0, get_no_key_fragments_from_pdu(BEACON_KEY_PDU_HEADER_SIZE));
+    TEST_ASSERT_EQUAL(0, get_no_key_fragments_from_pdu(BEACON_KEY_PDU_HEADER_SIZE + CRYPT_DATA_SIZE + 1));
+    TEST_ASSERT_EQUAL(0, get_no_key_fragments_from_pdu(BEACON_KEY_PDU_HEADER_SIZE + (MAX_KEY_FRAGMENTS_PER_PDU + 1) * CRYPT_DATA_SIZE));
+}
+
+TEST_CASE("key fragment is split off the front of a data PDU payload", "[pdu_codec]")
+{
+    uint8_t payload[MAX_PDU_PAYLOAD_SIZE];
+    const size_t ciphertext_size = MAX_DATA_KEY_FRAGMENT_PDU_PAYLOAD_SIZE;
+    beacon_crypto_data bcd = {0};
+    beacon_crypto_data taken_bcd;
+    beacon_pdu_data pdu;
+
+    bcd.key_session_data = produce_key_session_data(TEST_KEY_ID, 2);
+    bcd.xor_seed = 0x5A;
+    fill_bytes(bcd.enc_key_fragment, KEY_FRAGMENT_SIZE, 0x10);
+    fill_bytes(bcd.key_fragment_hmac, HMAC_SIZE, 0x20);
+    memcpy(payload, &bcd, CRYPT_DATA_SIZE);
+    fill_bytes(&payload[CRYPT_DATA_SIZE], ciphertext_size, 0x30);
+
+    TEST_ASSERT_EQUAL(ESP_OK, build_beacon_pdu_data(produce_key_session_data(TEST_KEY_ID, 0), payload, CRYPT_DATA_SIZE + ciphertext_size, &pdu));
+    pdu.cmd = DATA_KEY_FRAGMENT_CMD;
+    pdu.payload_size = CRYPT_DATA_SIZE + ciphertext_size;
+    TEST_ASSERT_TRUE(take_key_fragment_from_data_pdu(&pdu, &taken_bcd));
+    TEST_ASSERT_EQUAL(DATA_CMD, pdu.cmd);
+    TEST_ASSERT_EQUAL(ciphertext_size, pdu.payload_size);
+    TEST_ASSERT_EQUAL_HEX8_ARRAY(&payload[CRYPT_DATA_SIZE], pdu.payload, ciphertext_size);
+    TEST_ASSERT_EQUAL_HEX8_ARRAY((uint8_t *) &bcd, (uint8_t *) &taken_bcd, CRYPT_DATA_SIZE);
+    TEST_ASSERT_EQUAL(2, get_key_fragment_index_from_key_session_data(taken_bcd.key_session_data));
+
+    // Payload shorter than a key fragment
+    pdu.payload_size = CRYPT_DATA_SIZE - 1;
+    TEST_ASSERT_FALSE(take_key_fragment_from_data_pdu(&pdu, &taken_bcd));
+}
+
+TEST_CASE("record list keeps records in order and rejects malformed lists", "[pdu_codec]")
+{
+    uint8_t list[MAX_PDU_PAYLOAD_SIZE];
+    uint8_t record[16];
+    size_t list_size = 0;
+    int no_records = 0;
+
+    fill_bytes(record, sizeof(record), 0);
+    while (add_record_to_record_list(list, sizeof(list), &list_size, record, 1 + no_records % sizeof(record)))
+    {
+        no_records++;
+    }
+    TEST_ASSERT_GREATER_THAN(0, no_records);
+    TEST_ASSERT_EQUAL(no_records, get_record_list_count(list, list_size));
+
+    size_t offset = 0;
+    const uint8_t *parsed_record = NULL;
+    size_t record_size = 0;
+    for (int i = 0; i < no_records; i++)
+    {
+        TEST_ASSERT_TRUE(get_next_record_from_record_list(list, list_size, &offset, &parsed_record, &record_size));
+        TEST_ASSERT_EQUAL(1 + i % sizeof(record), record_size);
+        TEST_ASSERT_EQUAL_HEX8_ARRAY(record, parsed_record, record_size);
+    }
+    TEST_ASSERT_FALSE(get_next_record_from_record_list(list, list_size, &offset, &parsed_record, &record_size));
+    TEST_ASSERT_EQUAL(list_size, offset);
+    TEST_ASSERT_FALSE(add_record_to_record_list(list, sizeof(list), &list_size, record, 0));
+
+    // Record length past the end of the list or an empty record
+    const uint8_t truncated_list[] = {3, 0xAA, 0xBB, 5, 0x01};
+    const uint8_t empty_record_list[] = {1, 0xAA, 0};
+    TEST_ASSERT_EQUAL(-1, get_record_list_count(truncated_list, sizeof(truncated_list)));
+    TEST_ASSERT_EQUAL(-1, get_record_list_count(empty_record_list, sizeof(empty_record_list)));
+    TEST_ASSERT_EQUAL(-1, get_record_list_count(truncated_list, 3));
+    TEST_ASSERT_EQUAL(1, get_record_list_count(truncated_list, 4));
+}
@@ -0,0 +1,57 @@
+#ifndef PDU_LATENCY_H
+#define PDU_LATENCY_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Log2 buckets: bucket 0 holds 0 us, bucket i holds [2^(i-1), 2^i) us, last bucket everything above
+#define PDU_LATENCY_NO_BUCKETS 24
+// Senders with own histograms (by sender index), PDUs of all senders go to the aggregate histograms
+#define PDU_LATENCY_MAX_SENDERS 8
+#define PDU_LATENCY_ALL_SENDERS (-1)
+
+// Every stage histogram holds time since previous recorded stage of the same PDU
+typedef enum {
+    // Sender not known yet, recorded only in the aggregate
+    PDU_STAGE_SCAN_RING_DEQUEUE = 0,
+    PDU_STAGE_AUTHORIZER_DEQUEUE,
+    PDU_STAGE_PROCESSING_DEQUEUE,
+    PDU_STAGE_KEY_CACHE_HIT,
+    PDU_STAGE_DEFERRED,
+    PDU_STAGE_DECRYPTED,
+    PDU_STAGE_OBSERVERS_NOTIFIED,
+    // GAP callback to observers notified
+    PDU_STAGE_END_TO_END,
+    PDU_NO_STAGES
+} pdu_latency_stage;
+
+typedef struct {
+    uint32_t buckets[PDU_LATENCY_NO_BUCKETS];
+    uint32_t count;
+    uint32_t max_us;
+} pdu_latency_histogram;
+
+// Travels with the PDU, written only by the task owning the PDU at the moment
+typedef struct {
+    int64_t gap_callback_us;
+    int64_t last_stage_us;
+} pdu_latency_trace;
+
+// GAP callback stage, starts the trace
+void pdu_latency_start(pdu_latency_trace *trace);
+
+void pdu_latency_record(pdu_latency_trace *trace, int16_t sender_index, pdu_latency_stage stage);
+
+// Snapshot of one histogram, sender_index PDU_LATENCY_ALL_SENDERS for the aggregate
+bool get_pdu_latency_histogram(int16_t sender_index, pdu_latency_stage stage, pdu_latency_histogram *histogram);
+
+// Upper bound in us of the bucket holding the given percentile, capped by the max seen
+uint32_t get_pdu_latency_percentile_us(const pdu_latency_histogram *histogram, uint8_t percentile);
+
+const char* get_pdu_latency_stage_name(pdu_latency_stage stage);
+
+void reset_pdu_latency_histograms();
+
+void log_pdu_latency_histograms();
+
+#endif
@@ -1,7 +1,7 @@
 #ifndef TEST_H
 #define TEST_H
 
-#include "esp_gap_ble_api.h"
+#include "ble_addr.h"
 #include "stdint.h"
 
 #define TEST_ESP_LOG_GROUP "TEST_LOG_GROUP"
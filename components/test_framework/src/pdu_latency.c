@@ -0,0 +1,189 @@
+#include "pdu_latency.h"
+#include "config.h"
+#include "test.h"
+#include "esp_timer.h"
+#include "esp_log.h"
+
+#include <stdatomic.h>
+#include <string.h>
+
+typedef struct {
+    atomic_uint_fast32_t buckets[PDU_LATENCY_NO_BUCKETS];
+    atomic_uint_fast32_t count;
+    atomic_uint_fast32_t max_us;
+} pdu_latency_atomic_histogram;
+
+// Row PDU_LATENCY_MAX_SENDERS holds the aggregate of all senders
+static pdu_latency_atomic_histogram latency_histograms[PDU_LATENCY_MAX_SENDERS + 1][PDU_NO_STAGES];
+
+static const char * const stage_names[PDU_NO_STAGES] = {
+    "SCAN RING DEQUEUE",
+    "AUTHORIZER DEQUEUE",
+    "PROCESSING DEQUEUE",
+    "KEY CACHE HIT",
+    "DEFERRED",
+    "DECRYPTED",
+    "OBSERVERS NOTIFIED",
+    "END TO END"
+};
+
+static uint8_t get_bucket_index(uint32_t latency_us)
+{
+    if (latency_us == 0)
+    {
+        return 0;
+    }
+
+    const uint8_t index = (uint8_t) (32 - __builtin_clz(latency_us));
+    return index < PDU_LATENCY_NO_BUCKETS ? index : PDU_LATENCY_NO_BUCKETS - 1;
+}
+
+// Relaxed atomics only - writers on different tasks never wait for each other, readers get approximate snapshot
+static void add_to_histogram(pdu_latency_atomic_histogram *histogram, uint32_t latency_us)
+{
+    atomic_fetch_add_explicit(&(histogram->buckets[get_bucket_index(latency_us)]), 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&(histogram->count), 1, memory_order_relaxed);
+
+    uint_fast32_t max_us = atomic_load_explicit(&(histogram->max_us), memory_order_relaxed);
+    while (latency_us > max_us &&
+           !atomic_compare_exchange_weak_explicit(&(histogram->max_us), &max_us, latency_us, memory_order_relaxed, memory_order_relaxed))
+    {
+    }
+}
+
+static void record_latency(int16_t sender_index, pdu_latency_stage stage, int64_t latency_us)
+{
+    const uint32_t latency = latency_us <= 0 ? 0 : (latency_us > UINT32_MAX ? UINT32_MAX : (uint32_t) latency_us);
+    if (sender_index >= 0 && sender_index < PDU_LATENCY_MAX_SENDERS)
+    {
+        add_to_histogram(&(latency_histograms[sender_index][stage]), latency);
+    }
+    add_to_histogram(&(latency_histograms[PDU_LATENCY_MAX_SENDERS][stage]), latency);
+}
+
+void pdu_latency_start(pdu_latency_trace *trace)
+{
+#if PDU_LATENCY_HISTOGRAMS
+    if (trace != NULL)
+    {
+        trace->gap_callback_us = esp_timer_get_time();
+        trace->last_stage_us = trace->gap_callback_us;
+    }
+#endif
+}
+
+void pdu_latency_record(pdu_latency_trace *trace, int16_t sender_index, pdu_latency_stage stage)
+{
+#if PDU_LATENCY_HISTOGRAMS
+    if (trace == NULL || stage >= PDU_STAGE_END_TO_END)
+    {
+        return;
+    }
+
+    const int64_t now_us = esp_timer_get_time();
+    record_latency(sender_index, stage, now_us - trace->last_stage_us);
+    trace->last_stage_us = now_us;
+
+    if (stage == PDU_STAGE_OBSERVERS_NOTIFIED)
+    {
+        record_latency(sender_index, PDU_STAGE_END_TO_END, now_us - trace->gap_callback_us);
+    }
+#endif
+}
+
+bool get_pdu_latency_histogram(int16_t sender_index, pdu_latency_stage stage, pdu_latency_histogram *histogram)
+{
+    if (histogram == NULL || stage >= PDU_NO_STAGES || sender_index >= PDU_LATENCY_MAX_SENDERS || sender_index < PDU_LATENCY_ALL_SENDERS)
+    {
+        return false;
+    }
+
+    const int row = sender_index == PDU_LATENCY_ALL_SENDERS ? PDU_LATENCY_MAX_SENDERS : sender_index;
+    pdu_latency_atomic_histogram *source = &(latency_histograms[row][stage]);
+    for (int i = 0; i < PDU_LATENCY_NO_BUCKETS; i++)
+    {
+        histogram->buckets[i] = atomic_load_explicit(&(source->buckets[i]), memory_order_relaxed);
+    }
+    histogram->count = atomic_load_explicit(&(source->count), memory_order_relaxed);
+    histogram->max_us = atomic_load_explicit(&(source->max_us), memory_order_relaxed);
+
+    return true;
+}
+
+uint32_t get_pdu_latency_percentile_us(const pdu_latency_histogram *histogram, uint8_t percentile)
+{
+    if (histogram == NULL || histogram->count == 0)
+    {
+        return 0;
+    }
+
+    const uint64_t rank = (((uint64_t) histogram->count * (percentile > 100 ? 100 : percentile)) + 99) / 100;
+    uint64_t seen = 0;
+    for (int i = 0; i < PDU_LATENCY_NO_BUCKETS - 1; i++)
+    {
+        seen += histogram->buckets[i];
+        if (seen >= rank && seen > 0)
+        {
+            const uint32_t bucket_upper_us = i == 0 ? 0 : (1u << i) - 1;
+            return bucket_upper_us < histogram->max_us ? bucket_upper_us : histogram->max_us;
+        }
+    }
+
+    return histogram->max_us;
+}
+
+const char* get_pdu_latency_stage_name(pdu_latency_stage stage)
+{
+    return stage < PDU_NO_STAGES ? stage_names[stage] : "UNKNOWN";
+}
+
+void reset_pdu_latency_histograms()
+{
+    for (int row = 0; row <= PDU_LATENCY_MAX_SENDERS; row++)
+    {
+        for (int stage = 0; stage < PDU_NO_STAGES; stage++)
+        {
+            pdu_latency_atomic_histogram *histogram = &(latency_histograms[row][stage]);
+            for (int i = 0; i < PDU_LATENCY_NO_BUCKETS; i++)
+            {
+                atomic_store_explicit(&(histogram->buckets[i]), 0, memory_order_relaxed);
+            }
+            atomic_store_explicit(&(histogram->count), 0, memory_order_relaxed);
+            atomic_store_explicit(&(histogram->max_us), 0, memory_order_relaxed);
+        }
+    }
+}
+
+static void log_histograms_for_row(int16_t sender_index)
+{
+    pdu_latency_histogram histogram;
+    for (int stage = 0; stage < PDU_NO_STAGES; stage++)
+    {
+        if (get_pdu_latency_histogram(sender_index, (pdu_latency_stage) stage, &histogram) && histogram.count > 0)
+        {
+            ESP_LOGI(TEST_ESP_LOG_GROUP, "%-20s n=%lu p50<=%lu us p90<=%lu us p99<=%lu us max=%lu us",
+                     stage_names[stage], (unsigned long) histogram.count,
+                     (unsigned long) get_pdu_latency_percentile_us(&histogram, 50),
+                     (unsigned long) get_pdu_latency_percentile_us(&histogram, 90),
+                     (unsigned long) get_pdu_latency_percentile_us(&histogram, 99),
+                     (unsigned long) histogram.max_us);
+        }
+    }
+}
+
+void log_pdu_latency_histograms()
+{
+#if PDU_LATENCY_HISTOGRAMS
+    ESP_LOGI(TEST_ESP_LOG_GROUP, "----------PDU LATENCY ALL SENDERS-------------");
+    log_histograms_for_row(PDU_LATENCY_ALL_SENDERS);
+    for (int16_t sender_index = 0; sender_index < PDU_LATENCY_MAX_SENDERS; sender_index++)
+    {
+        pdu_latency_histogram histogram;
+        if (get_pdu_latency_histogram(sender_index, PDU_STAGE_AUTHORIZER_DEQUEUE, &histogram) && histogram.count > 0)
+        {
+            ESP_LOGI(TEST_ESP_LOG_GROUP, "----------PDU LATENCY SENDER INDEX %i-------------", (int) sender_index);
+            log_histograms_for_row(sender_index);
+        }
+    }
+#endif
+}
@@ -1,9 +1,11 @@
 #include "test.h"
+#include "pdu_latency.h"
 #include "esp_timer.h"
 #include "esp_log.h"
 #include <string.h>
+#include <stdatomic.h>
 
-#include "esp_gap_ble_api.h"
+#include "ble_addr.h"
 #include "beacon_pdu_data.h"
 
 #include "freertos/FreeRTOS.h"
@@ -32,18 +34,18 @@ typedef struct {
     uint16_t no_checks;
 } queue_fill_info;
 
+// Packet counters are updated by payload observers running on every processing shard task at once
 typedef struct {
     esp_bd_addr_t mac_address;
-    SemaphoreHandle_t xMutex;
-    uint32_t total_packets_received;
+    _Atomic uint32_t total_packets_received;
     double total_key_reconstruction_time;
     double avarage_key_reconstruction_time;
     uint16_t no_reconstructed_keys;
     key_reconstruction_info key_rec_data;
     queue_fill_info deferred_queue;
-    uint32_t no_bad_structure_packets;
-    uint32_t wrongly_decoded_data_packets;
-    uint32_t unauthorize_packets;
+    _Atomic uint32_t no_bad_structure_packets;
+    _Atomic uint32_t wrongly_decoded_data_packets;
+    _Atomic uint32_t unauthorize_packets;
 } test_consumer;
 
 typedef struct {
@@ -81,23 +83,29 @@ typedef struct {
 } test_packet_structure;
 static const TickType_t TEST_QUEUE_WAIT_SYSTICKS = pdMS_TO_TICKS(50);
 
-static uint32_t counter = 0;
+static _Atomic uint32_t counter = 0;
 
-void increment_received_packet_for_consumer(test_consumer * consumer)
+// Returns the number of packets received including this one
+uint32_t increment_received_packet_for_consumer(test_consumer * consumer)
 {
-    if (xSemaphoreTake(consumer->xMutex, TEST_SEMAPHORE_MAX_BLOCK_TIME_SYSTICK) == pdPASS)
-    {
-        consumer->total_packets_received++;
-        xSemaphoreGive(consumer->xMutex);
-    }
+    return atomic_fetch_add(&(consumer->total_packets_received), 1) + 1;
 }
 
 void increment_unauthorize_packet_for_consumer(test_consumer * consumer)
 {
-    if (xSemaphoreTake(consumer->xMutex, TEST_SEMAPHORE_MAX_BLOCK_TIME_SYSTICK) == pdPASS)
+    atomic_fetch_add(&(consumer->unauthorize_packets), 1);
+}
+
+static void log_received_packets_milestone(const uint32_t total_packets_received, uint8_t *data, size_t data_len)
+{
+    if (total_packets_received % PACKET_CONST_COUNTER == 0)
     {
-        consumer->unauthorize_packets++;
-        xSemaphoreGive(consumer->xMutex);
+        const uint32_t milestone = atomic_fetch_add(&counter, 1) + 1;
+        if (data != NULL)
+        {
+            ESP_LOG_BUFFER_HEX("TEST_LOG_GROUP: Sender addr", data, data_len);
+        }
+        ESP_LOGI(TEST_ESP_LOG_GROUP, "%lu Packet has been received!", (uint32_t) (milestone * PACKET_CONST_COUNTER));
     }
 }
 
@@ -172,12 +180,6 @@ void reset_test_consumers_structure()
         ble_test_consumers[i].deferred_queue.total_fill = 0;
         ble_test_consumers[i].unauthorize_packets = 0;
         memset(ble_test_consumers[i].mac_address, 0, sizeof(esp_bd_addr_t));
-
-        ble_test_consumers[i].xMutex = xSemaphoreCreateMutex();
-        if (ble_test_consumers[i].xMutex == NULL)
-        {
-            ESP_LOGE(TEST_ESP_LOG_GROUP, "Failed to initialized Semaphore");
-        }
     }
 
     memset(ble_test_producer.mac_address, 0, sizeof(esp_bd_addr_t));
@@ -186,6 +188,8 @@ void reset_test_consumers_structure()
     consumer_sec_processing_queue.no_checks = 0;
     consumer_sec_processing_queue.total_fill = 0;
 
+    reset_pdu_latency_histograms();
+
 }
 
 int get_consumer_index(esp_bd_addr_t mac_address)
@@ -288,26 +292,26 @@ void handle_queue_for_receiver(test_packet_structure * pdu)
 
     if ((index = get_consumer_index(pdu->mac_addr)) >= 0)
     {
-        ESP_LOGI(TEST_ESP_LOG_GROUP, "Packet %lu has been received!", ++ble_test_consumers[index].total_packets_received);
+        ESP_LOGI(TEST_ESP_LOG_GROUP, "Packet %lu has been received!", increment_received_packet_for_consumer(&ble_test_consumers[index]));
         ESP_LOG_BUFFER_HEXDUMP("TEST_LOG_GROUP: Packet received from", pdu->mac_addr, sizeof(esp_bd_addr_t), 0);
         ESP_LOG_BUFFER_HEXDUMP("TEST_LOG_GROUP: Packet payload", pdu->packet, pdu->pdu_payload_size, 0);
         if (is_data_decoded_valid(pdu->packet, pdu->pdu_payload_size) == false)
         {
             ESP_LOGE(TEST_ESP_LOG_GROUP, "Packet payload is wrong after decoding!");
-            ble_test_consumers[index].wrongly_decoded_data_packets++;
+            atomic_fetch_add(&(ble_test_consumers[index].wrongly_decoded_data_packets), 1);
         }
     }
     else
     {
         if ((index = add_consumer_to_table(pdu->mac_addr)) >= 0)
         {
-            ESP_LOGI(TEST_ESP_LOG_GROUP, "Packet %lu has been received!", ++ble_test_consumers[index].total_packets_received);
+            ESP_LOGI(TEST_ESP_LOG_GROUP, "Packet %lu has been received!", increment_received_packet_for_consumer(&ble_test_consumers[index]));
             ESP_LOG_BUFFER_HEXDUMP("TEST_LOG_GROUP: Packet received from", pdu->mac_addr, sizeof(esp_bd_addr_t), 0);
             ESP_LOG_BUFFER_HEXDUMP("TEST_LOG_GROUP: Packet payload", pdu->packet, pdu->pdu_payload_size, 0);
             if (is_data_decoded_valid(pdu->packet, pdu->pdu_payload_size) == false)
             {
                 ESP_LOGE(TEST_ESP_LOG_GROUP, "Packet payload is wrong after decoding!");
-                ble_test_consumers[index].wrongly_decoded_data_packets++;
+                atomic_fetch_add(&(ble_test_consumers[index].wrongly_decoded_data_packets), 1);
             }
         }
     }
@@ -383,6 +387,7 @@ void end_test_measurment()
                 }
             }
         }
+        log_pdu_latency_histograms();
     }
     else
     {
@@ -418,20 +423,11 @@ void test_log_packet_received(uint8_t *data, size_t data_len, esp_bd_addr_t mac_
     {
         if (is_data_decoded_valid(data, data_len) == false)
         {
-            ble_test_consumers[index].wrongly_decoded_data_packets++;
+            atomic_fetch_add(&(ble_test_consumers[index].wrongly_decoded_data_packets), 1);
         }
         else
         {
-            increment_received_packet_for_consumer(&ble_test_consumers[index]);
-
-            if (ble_test_consumers[index].total_packets_received % PACKET_CONST_COUNTER == 0)
-            {
-                counter++;
-                ESP_LOG_BUFFER_HEX("TEST_LOG_GROUP: Sender addr", data, data_len);
-                ESP_LOGI(TEST_ESP_LOG_GROUP, "%lu Packet has been received!", (uint32_t) (counter * PACKET_CONST_COUNTER));
-            }
-
-            
+            log_received_packets_milestone(increment_received_packet_for_consumer(&ble_test_consumers[index]), data, data_len);
         }
     }
     else
@@ -440,17 +436,11 @@ void test_log_packet_received(uint8_t *data, size_t data_len, esp_bd_addr_t mac_
         {
             if (is_data_decoded_valid(data, data_len) == false)
             {
-                ble_test_consumers[index].wrongly_decoded_data_packets++;
+                atomic_fetch_add(&(ble_test_consumers[index].wrongly_decoded_data_packets), 1);
             }
             else
             {
-                increment_received_packet_for_consumer(&ble_test_consumers[index]);
-                if (ble_test_consumers[index].total_packets_received % PACKET_CONST_COUNTER == 0)
-                {
-                    counter++;
-                    ESP_LOG_BUFFER_HEX("TEST_LOG_GROUP: Sender addr", data, data_len);
-                    ESP_LOGI(TEST_ESP_LOG_GROUP, "%lu Packet has been received!", (uint32_t) (counter * PACKET_CONST_COUNTER));
-                }
+                log_received_packets_milestone(increment_received_packet_for_consumer(&ble_test_consumers[index]), data, data_len);
             }
         }
     }
@@ -461,12 +451,7 @@ void test_log_packet_received_key_fragment_already_decoded(esp_bd_addr_t mac_add
     int index = -1;
     if ((index = get_consumer_index(mac_address)) >= 0)
     {
-        increment_received_packet_for_consumer(&ble_test_consumers[index]);
-        if (ble_test_consumers[index].total_packets_received % PACKET_CONST_COUNTER == 0)
-        {
-            counter++;
-            ESP_LOGI(TEST_ESP_LOG_GROUP, "%lu Packet has been received!", (uint32_t) (counter * PACKET_CONST_COUNTER));
-        }
+        log_received_packets_milestone(increment_received_packet_for_consumer(&ble_test_consumers[index]), NULL, 0);
     }
 }
 
@@ -478,13 +463,13 @@ void test_log_bad_structure_packet(esp_bd_addr_t addr)
     int index = -1;
     if ((index = get_consumer_index(addr)) >= 0)
     {
-        ble_test_consumers[index].no_bad_structure_packets++;
+        atomic_fetch_add(&(ble_test_consumers[index].no_bad_structure_packets), 1);
     }
     else
     {
         if ((index = add_consumer_to_table(addr)) >= 0)
         {
-            ble_test_consumers[index].no_bad_structure_packets++;
+            atomic_fetch_add(&(ble_test_consumers[index].no_bad_structure_packets), 1);
         }
     }
 }
@@ -499,8 +484,8 @@ void test_log_packet_send(uint8_t *data, size_t data_len, esp_bd_addr_t mac_addr
     ++ble_test_producer.total_packets_send;
     if (ble_test_producer.total_packets_send % PACKET_CONST_COUNTER == 0)
     {
-        counter++;
-        ESP_LOGI(TEST_ESP_LOG_GROUP, "%lu Packet has been sent!", (uint32_t) (counter * PACKET_CONST_COUNTER));
+        const uint32_t milestone = atomic_fetch_add(&counter, 1) + 1;
+        ESP_LOGI(TEST_ESP_LOG_GROUP, "%lu Packet has been sent!", (uint32_t) (milestone * PACKET_CONST_COUNTER));
     }
 }
 
@@ -509,8 +494,8 @@ void test_log_key_fragment_send()
     ++ble_test_producer.total_packets_send;
     if (ble_test_producer.total_packets_send % PACKET_CONST_COUNTER == 0)
     {
-        counter++;
-        ESP_LOGI(TEST_ESP_LOG_GROUP, "%lu Packet has been sent!", (uint32_t) (counter * PACKET_CONST_COUNTER));
+        const uint32_t milestone = atomic_fetch_add(&counter, 1) + 1;
+        ESP_LOGI(TEST_ESP_LOG_GROUP, "%lu Packet has been sent!", (uint32_t) (milestone * PACKET_CONST_COUNTER));
     }
 }
 
@@ -541,8 +526,8 @@ void test_log_key_reconstruction_end(esp_bd_addr_t mac_address, uint16_t key_id)
             ble_test_consumers[index].no_reconstructed_keys++;
             ble_test_consumers[index].total_key_reconstruction_time += ble_test_consumers[index].key_rec_data.key_reconstruction_end_ms - ble_test_consumers[index].key_rec_data.key_reconstruction_start_ms;
             ble_test_consumers[index].avarage_key_reconstruction_time = (double) (ble_test_consumers[index].total_key_reconstruction_time / ble_test_consumers[index].no_reconstructed_keys);
+            ESP_LOGI(TEST_ESP_LOG_GROUP, "KeyID %i has been reconstructed in time ms %i", (int) key_id, (int)(ble_test_consumers[index].key_rec_data.key_reconstruction_end_ms - ble_test_consumers[index].key_rec_data.key_reconstruction_start_ms));
         }
-        ESP_LOGI(TEST_ESP_LOG_GROUP, "KeyID %i has been reconstructed in time ms %i", (int) key_id, (int)(ble_test_consumers[index].key_rec_data.key_reconstruction_end_ms - ble_test_consumers[index].key_rec_data.key_reconstruction_start_ms));
     }
 }
 
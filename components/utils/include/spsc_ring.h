@@ -0,0 +1,52 @@
+#ifndef SPSC_RING_H
+#define SPSC_RING_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+
+// Single producer / single consumer ring of pointers, push never blocks nor loops.
+// With SPSC_RING_DROP_OLDEST producer takes the oldest item over when the ring is full,
+// so the consumer pop retries when its item was taken meanwhile.
+typedef enum {
+    SPSC_RING_DROP_NEWEST,
+    SPSC_RING_DROP_OLDEST
+} spsc_ring_overflow_policy;
+
+typedef struct {
+    uint32_t pushed;
+    uint32_t dropped_newest;
+    uint32_t dropped_oldest;
+    // Items waiting for the consumer when the stats were taken
+    uint32_t count;
+    uint32_t capacity;
+} spsc_ring_stats;
+
+typedef struct {
+    _Atomic(void *) *items;
+    uint32_t mask;
+    spsc_ring_overflow_policy policy;
+    atomic_uint_fast32_t head;
+    atomic_uint_fast32_t tail;
+    atomic_uint_fast32_t pushed;
+    atomic_uint_fast32_t dropped_newest;
+    atomic_uint_fast32_t dropped_oldest;
+} spsc_ring;
+
+// Capacity is rounded up to power of two
+spsc_ring* create_spsc_ring(const uint32_t capacity, const spsc_ring_overflow_policy policy);
+
+void destroy_spsc_ring(spsc_ring *ring);
+
+// Producer side. Returns false when the item was not stored (drop newest).
+// *dropped is set to the item which left the ring without being popped (the pushed one or the oldest), NULL otherwise
+bool push_to_spsc_ring(spsc_ring *ring, void *item, void **dropped);
+
+// Consumer side
+bool pop_from_spsc_ring(spsc_ring *ring, void **item);
+
+uint32_t get_spsc_ring_count(spsc_ring *ring);
+
+void get_spsc_ring_stats(spsc_ring *ring, spsc_ring_stats *stats);
+
+#endif
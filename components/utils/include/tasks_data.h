@@ -18,6 +18,11 @@ typedef enum {
     ADV_TIME_AUTHORIZE_TASK
 } KNOWN_TASKS;
 
+// Each processing shard is a separate SEC_PDU_PROCESSING task pinned to its own core
+#define MAX_SEC_PDU_PROCESSING_SHARDS 4
+
 extern taskData tasksDataArr[];
 
+extern const uint32_t secPduProcessingShardCores[MAX_SEC_PDU_PROCESSING_SHARDS];
+
 #endif
\ No newline at end of file
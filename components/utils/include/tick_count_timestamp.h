@@ -9,5 +9,7 @@ uint64_t get_timestamp(uint64_t * tick_count_timestamp, uint8_t * rollover);
 
 void reset_timestamp(uint64_t * tick_count_timestamp, uint8_t * rollover);
 
+uint32_t get_ms_elapsed_since_timestamp(uint64_t * tick_count_timestamp);
+
 
 #endif
\ No newline at end of file
@@ -0,0 +1,154 @@
+#include "spsc_ring.h"
+
+#include <stdlib.h>
+#include <stddef.h>
+
+static uint32_t round_up_to_power_of_two(uint32_t value)
+{
+    uint32_t result = 1;
+    while (result < value)
+    {
+        result <<= 1;
+    }
+    return result;
+}
+
+spsc_ring* create_spsc_ring(const uint32_t capacity, const spsc_ring_overflow_policy policy)
+{
+    if (capacity == 0 || capacity > (1u << 30))
+    {
+        return NULL;
+    }
+
+    spsc_ring *ring = (spsc_ring *) malloc(sizeof(spsc_ring));
+    if (ring == NULL)
+    {
+        return NULL;
+    }
+
+    const uint32_t size = round_up_to_power_of_two(capacity);
+    ring->items = (_Atomic(void *) *) calloc(size, sizeof(_Atomic(void *)));
+    if (ring->items == NULL)
+    {
+        free(ring);
+        return NULL;
+    }
+
+    ring->mask = size - 1;
+    ring->policy = policy;
+    atomic_init(&(ring->head), 0);
+    atomic_init(&(ring->tail), 0);
+    atomic_init(&(ring->pushed), 0);
+    atomic_init(&(ring->dropped_newest), 0);
+    atomic_init(&(ring->dropped_oldest), 0);
+
+    return ring;
+}
+
+void destroy_spsc_ring(spsc_ring *ring)
+{
+    if (ring != NULL)
+    {
+        free(ring->items);
+        free(ring);
+    }
+}
+
+bool push_to_spsc_ring(spsc_ring *ring, void *item, void **dropped)
+{
+    if (dropped != NULL)
+    {
+        *dropped = NULL;
+    }
+
+    if (ring == NULL)
+    {
+        return false;
+    }
+
+    const uint_fast32_t head = atomic_load_explicit(&(ring->head), memory_order_relaxed);
+    uint_fast32_t tail = atomic_load_explicit(&(ring->tail), memory_order_acquire);
+
+    if ((uint32_t) (head - tail) > ring->mask)
+    {
+        if (ring->policy == SPSC_RING_DROP_NEWEST)
+        {
+            atomic_fetch_add_explicit(&(ring->dropped_newest), 1, memory_order_relaxed);
+            if (dropped != NULL)
+            {
+                *dropped = item;
+            }
+            return false;
+        }
+
+        // Oldest item was written by this producer, take it over unless consumer popped it meanwhile -
+        // either way one place is free after the exchange
+        void *oldest = atomic_load_explicit(&(ring->items[tail & ring->mask]), memory_order_relaxed);
+        if (atomic_compare_exchange_strong_explicit(&(ring->tail), &tail, tail + 1, memory_order_acq_rel, memory_order_acquire))
+        {
+            atomic_fetch_add_explicit(&(ring->dropped_oldest), 1, memory_order_relaxed);
+            if (dropped != NULL)
+            {
+                *dropped = oldest;
+            }
+        }
+    }
+
+    atomic_store_explicit(&(ring->items[head & ring->mask]), item, memory_order_relaxed);
+    atomic_store_explicit(&(ring->head), head + 1, memory_order_release);
+    atomic_fetch_add_explicit(&(ring->pushed), 1, memory_order_relaxed);
+
+    return true;
+}
+
+bool pop_from_spsc_ring(spsc_ring *ring, void **item)
+{
+    if (ring == NULL || item == NULL)
+    {
+        return false;
+    }
+
+    uint_fast32_t tail = atomic_load_explicit(&(ring->tail), memory_order_acquire);
+    while (true)
+    {
+        const uint_fast32_t head = atomic_load_explicit(&(ring->head), memory_order_acquire);
+        if (tail == head)
+        {
+            return false;
+        }
+
+        void *candidate = atomic_load_explicit(&(ring->items[tail & ring->mask]), memory_order_relaxed);
+        // Fails only when producer dropped this item, tail is reloaded by the exchange
+        if (atomic_compare_exchange_weak_explicit(&(ring->tail), &tail, tail + 1, memory_order_acq_rel, memory_order_acquire))
+        {
+            *item = candidate;
+            return true;
+        }
+    }
+}
+
+uint32_t get_spsc_ring_count(spsc_ring *ring)
+{
+    if (ring == NULL)
+    {
+        return 0;
+    }
+
+    const uint_fast32_t tail = atomic_load_explicit(&(ring->tail), memory_order_acquire);
+    const uint_fast32_t head = atomic_load_explicit(&(ring->head), memory_order_acquire);
+    return (uint32_t) (head - tail);
+}
+
+void get_spsc_ring_stats(spsc_ring *ring, spsc_ring_stats *stats)
+{
+    if (ring == NULL || stats == NULL)
+    {
+        return;
+    }
+
+    stats->pushed = atomic_load_explicit(&(ring->pushed), memory_order_relaxed);
+    stats->dropped_newest = atomic_load_explicit(&(ring->dropped_newest), memory_order_relaxed);
+    stats->dropped_oldest = atomic_load_explicit(&(ring->dropped_oldest), memory_order_relaxed);
+    stats->count = get_spsc_ring_count(ring);
+    stats->capacity = ring->mask + 1;
+}
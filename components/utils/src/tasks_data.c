@@ -7,4 +7,7 @@ taskData tasksDataArr[] = {
     {"KEY_RECONSTRUCTION_TASK", 4096U, 13U, 1U},
     {"PC_SERIAL COMMUNICATION_TASK", 4096U, 4U, 1U},
     {"ADV_TIME_AUTHORIZE_TASK", 4096U, 17U, 1U}
-};
\ No newline at end of file
+};
+
+// Shard 0 stays on the core of the other receiver tasks, next shards use the mostly idle core 0
+const uint32_t secPduProcessingShardCores[MAX_SEC_PDU_PROCESSING_SHARDS] = {1U, 0U, 1U, 0U};
\ No newline at end of file
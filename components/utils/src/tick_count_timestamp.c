@@ -31,4 +31,14 @@ void reset_timestamp(uint64_t * tick_count_timestamp, uint8_t * rollover)
         rollover = 0;
         tick_count_timestamp = 0;
     }
-}
\ No newline at end of file
+}
+uint32_t get_ms_elapsed_since_timestamp(uint64_t * tick_count_timestamp)
+{
+    if (tick_count_timestamp == NULL)
+    {
+        return 0;
+    }
+    // Unsigned difference of 32 bit tick counts stays valid across tick count rollover
+    uint32_t elapsed_ticks = (uint32_t) xTaskGetTickCount() - (uint32_t) (*tick_count_timestamp);
+    return (uint32_t) pdTICKS_TO_MS(elapsed_ticks);
+}
@@ -0,0 +1,224 @@
+#include "unity.h"
+#include "spsc_ring.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#define TEST_RING_CAPACITY 4
+#define TEST_CONCURRENT_RING_CAPACITY 8
+#define TEST_CONCURRENT_NO_ITEMS 20000
+// Producer yields after bursts of 6 and 18 items, shorter and longer than the ring
+#define TEST_PRODUCER_SHORT_BURST 6
+#define TEST_PRODUCER_BURSTS_PERIOD 24
+
+// Items are sequence numbers starting at 1, so no item is NULL
+static void *item_for_sequence(uint32_t sequence)
+{
+    return (void *) (uintptr_t) sequence;
+}
+
+static uint32_t sequence_of_item(void *item)
+{
+    return (uint32_t) (uintptr_t) item;
+}
+
+TEST_CASE("full ring with drop newest keeps the stored items", "[spsc_ring]")
+{
+    spsc_ring *ring = create_spsc_ring(TEST_RING_CAPACITY, SPSC_RING_DROP_NEWEST);
+    TEST_ASSERT_NOT_NULL(ring);
+
+    void *dropped = item_for_sequence(0xFFFF);
+    for (uint32_t i = 1; i <= TEST_RING_CAPACITY; i++)
+    {
+        TEST_ASSERT_TRUE(push_to_spsc_ring(ring, item_for_sequence(i), &dropped));
+        TEST_ASSERT_NULL(dropped);
+    }
+
+    TEST_ASSERT_FALSE(push_to_spsc_ring(ring, item_for_sequence(TEST_RING_CAPACITY + 1), &dropped));
+    TEST_ASSERT_EQUAL_UINT32(TEST_RING_CAPACITY + 1, sequence_of_item(dropped));
+
+    spsc_ring_stats stats;
+    get_spsc_ring_stats(ring, &stats);
+    TEST_ASSERT_EQUAL_UINT32(TEST_RING_CAPACITY, stats.pushed);
+    TEST_ASSERT_EQUAL_UINT32(1, stats.dropped_newest);
+    TEST_ASSERT_EQUAL_UINT32(0, stats.dropped_oldest);
+    TEST_ASSERT_EQUAL_UINT32(TEST_RING_CAPACITY, stats.count);
+    TEST_ASSERT_EQUAL_UINT32(TEST_RING_CAPACITY, stats.capacity);
+
+    void *item = NULL;
+    for (uint32_t i = 1; i <= TEST_RING_CAPACITY; i++)
+    {
+        TEST_ASSERT_TRUE(pop_from_spsc_ring(ring, &item));
+        TEST_ASSERT_EQUAL_UINT32(i, sequence_of_item(item));
+    }
+    TEST_ASSERT_FALSE(pop_from_spsc_ring(ring, &item));
+    TEST_ASSERT_EQUAL_UINT32(0, get_spsc_ring_count(ring));
+
+    destroy_spsc_ring(ring);
+}
+
+TEST_CASE("full ring with drop oldest hands the oldest item back", "[spsc_ring]")
+{
+    spsc_ring *ring = create_spsc_ring(TEST_RING_CAPACITY, SPSC_RING_DROP_OLDEST);
+    TEST_ASSERT_NOT_NULL(ring);
+
+    void *dropped = NULL;
+    for (uint32_t i = 1; i <= TEST_RING_CAPACITY; i++)
+    {
+        TEST_ASSERT_TRUE(push_to_spsc_ring(ring, item_for_sequence(i), &dropped));
+        TEST_ASSERT_NULL(dropped);
+    }
+
+    TEST_ASSERT_TRUE(push_to_spsc_ring(ring, item_for_sequence(TEST_RING_CAPACITY + 1), &dropped));
+    TEST_ASSERT_EQUAL_UINT32(1, sequence_of_item(dropped));
+    TEST_ASSERT_TRUE(push_to_spsc_ring(ring, item_for_sequence(TEST_RING_CAPACITY + 2), &dropped));
+    TEST_ASSERT_EQUAL_UINT32(2, sequence_of_item(dropped));
+
+    spsc_ring_stats stats;
+    get_spsc_ring_stats(ring, &stats);
+    TEST_ASSERT_EQUAL_UINT32(TEST_RING_CAPACITY + 2, stats.pushed);
+    TEST_ASSERT_EQUAL_UINT32(0, stats.dropped_newest);
+    TEST_ASSERT_EQUAL_UINT32(2, stats.dropped_oldest);
+    TEST_ASSERT_EQUAL_UINT32(TEST_RING_CAPACITY, stats.count);
+
+    void *item = NULL;
+    for (uint32_t i = 3; i <= TEST_RING_CAPACITY + 2; i++)
+    {
+        TEST_ASSERT_TRUE(pop_from_spsc_ring(ring, &item));
+        TEST_ASSERT_EQUAL_UINT32(i, sequence_of_item(item));
+    }
+    TEST_ASSERT_FALSE(pop_from_spsc_ring(ring, &item));
+
+    destroy_spsc_ring(ring);
+}
+
+TEST_CASE("capacity is rounded up to a power of two", "[spsc_ring]")
+{
+    spsc_ring *ring = create_spsc_ring(5, SPSC_RING_DROP_NEWEST);
+    TEST_ASSERT_NOT_NULL(ring);
+
+    spsc_ring_stats stats;
+    get_spsc_ring_stats(ring, &stats);
+    TEST_ASSERT_EQUAL_UINT32(8, stats.capacity);
+    TEST_ASSERT_NULL(create_spsc_ring(0, SPSC_RING_DROP_NEWEST));
+
+    destroy_spsc_ring(ring);
+}
+
+typedef struct {
+    spsc_ring *ring;
+    // Times each sequence number was dropped by the producer, index 0 unused
+    uint8_t *dropped_times;
+    SemaphoreHandle_t done;
+} producer_context;
+
+static void producer_task(void *arg)
+{
+    producer_context *ctx = (producer_context *) arg;
+    for (uint32_t i = 1; i <= TEST_CONCURRENT_NO_ITEMS; i++)
+    {
+        void *dropped = NULL;
+        push_to_spsc_ring(ctx->ring, item_for_sequence(i), &dropped);
+        if (dropped != NULL)
+        {
+            ctx->dropped_times[sequence_of_item(dropped)]++;
+        }
+        const uint32_t burst_position = i % TEST_PRODUCER_BURSTS_PERIOD;
+        if (burst_position == TEST_PRODUCER_SHORT_BURST || burst_position == 0)
+        {
+            // Items are both popped and dropped
+            taskYIELD();
+        }
+    }
+    xSemaphoreGive(ctx->done);
+    vTaskDelete(NULL);
+}
+
+static void check_concurrent_push_and_pop(const spsc_ring_overflow_policy policy)
+{
+    spsc_ring *ring = create_spsc_ring(TEST_CONCURRENT_RING_CAPACITY, policy);
+    TEST_ASSERT_NOT_NULL(ring);
+    uint8_t *dropped_times = (uint8_t *) calloc(TEST_CONCURRENT_NO_ITEMS + 1, sizeof(uint8_t));
+    uint8_t *popped_times = (uint8_t *) calloc(TEST_CONCURRENT_NO_ITEMS + 1, sizeof(uint8_t));
+    TEST_ASSERT_NOT_NULL(dropped_times);
+    TEST_ASSERT_NOT_NULL(popped_times);
+
+    producer_context ctx = {
+        .ring = ring,
+        .dropped_times = dropped_times,
+        .done = xSemaphoreCreateBinary()
+    };
+    TEST_ASSERT_NOT_NULL(ctx.done);
+    TEST_ASSERT_EQUAL(pdPASS, xTaskCreate(producer_task, "spsc_producer", 4096, &ctx, 5, NULL));
+
+    // Consumer on the test task, popped items must keep the push order
+    uint32_t last_sequence = 0;
+    bool is_producer_done = false;
+    while (true)
+    {
+        void *item = NULL;
+        if (pop_from_spsc_ring(ring, &item))
+        {
+            const uint32_t sequence = sequence_of_item(item);
+            TEST_ASSERT_TRUE(sequence > last_sequence && sequence <= TEST_CONCURRENT_NO_ITEMS);
+            popped_times[sequence]++;
+            last_sequence = sequence;
+        }
+        else if (is_producer_done)
+        {
+            break;
+        }
+        else if (xSemaphoreTake(ctx.done, 0) == pdTRUE)
+        {
+            // Ring emptied once more after the last push
+            is_producer_done = true;
+        }
+        else
+        {
+            taskYIELD();
+        }
+    }
+
+    uint32_t no_popped = 0;
+    uint32_t no_dropped = 0;
+    for (uint32_t i = 1; i <= TEST_CONCURRENT_NO_ITEMS; i++)
+    {
+        TEST_ASSERT_EQUAL_UINT8(1, popped_times[i] + dropped_times[i]);
+        no_popped += popped_times[i];
+        no_dropped += dropped_times[i];
+    }
+
+    spsc_ring_stats stats;
+    get_spsc_ring_stats(ring, &stats);
+    TEST_ASSERT_EQUAL_UINT32(0, stats.count);
+    TEST_ASSERT_EQUAL_UINT32(no_dropped, stats.dropped_newest + stats.dropped_oldest);
+    TEST_ASSERT_EQUAL_UINT32(TEST_CONCURRENT_NO_ITEMS, no_popped + no_dropped);
+    if (policy == SPSC_RING_DROP_NEWEST)
+    {
+        TEST_ASSERT_EQUAL_UINT32(0, stats.dropped_oldest);
+        TEST_ASSERT_EQUAL_UINT32(TEST_CONCURRENT_NO_ITEMS - stats.dropped_newest, stats.pushed);
+    }
+    else
+    {
+        TEST_ASSERT_EQUAL_UINT32(0, stats.dropped_newest);
+        TEST_ASSERT_EQUAL_UINT32(TEST_CONCURRENT_NO_ITEMS, stats.pushed);
+    }
+
+    vSemaphoreDelete(ctx.done);
+    free(popped_times);
+    free(dropped_times);
+    destroy_spsc_ring(ring);
+}
+
+TEST_CASE("concurrent producer and consumer with drop newest pass every item once in order", "[spsc_ring]")
+{
+    check_concurrent_push_and_pop(SPSC_RING_DROP_NEWEST);
+}
+
+TEST_CASE("concurrent producer and consumer with drop oldest pass every item once in order", "[spsc_ring]")
+{
+    check_concurrent_push_and_pop(SPSC_RING_DROP_OLDEST);
+}
@@ -10,6 +10,7 @@
 #include "config.h"
 
 #include <string.h>
+#include <stdio.h>
 
 #include "freertos/FreeRTOS.h"
 #include "freertos/semphr.h"
@@ -204,11 +205,34 @@ void handle_cleanup_state(int *state)
     *state = RECEIVER_WAIT_FOR_TEST_START_PDU;
 }
 
+void log_captured_pdu(int64_t timestamp_us, uint8_t *data, size_t data_size, esp_bd_addr_t mac_address)
+{
+    char mac_hex[(sizeof(esp_bd_addr_t) * 2) + 1] = {0};
+    char data_hex[(MAX_BEACON_PDU_LEN * 2) + 1] = {0};
+
+    for (int i = 0; i < sizeof(esp_bd_addr_t); i++)
+    {
+        sprintf(&mac_hex[i * 2], "%02x", mac_address[i]);
+    }
+
+    for (int i = 0; i < data_size && i < MAX_BEACON_PDU_LEN; i++)
+    {
+        sprintf(&data_hex[i * 2], "%02x", data[i]);
+    }
+
+    ESP_LOGI(BLE_GAP_LOG_GROUP, "CAPTURE:%lld,%s,%s", (long long) timestamp_us, mac_hex, data_hex);
+}
+
 void receiver_app_scan_complete_callback(int64_t timestamp_us, uint8_t *data, size_t data_size, esp_bd_addr_t mac_address)
 {
     if (data == NULL)
         return;
 
+    if (RECEIVER_PDU_CAPTURE && is_pdu_in_beacon_pdu_format(data, data_size))
+    {
+        log_captured_pdu(timestamp_us, data, data_size, mac_address);
+    }
+
     static bool received_test_start = false;
     static bool received_test_end = false;
 
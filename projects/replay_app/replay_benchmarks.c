@@ -0,0 +1,1484 @@
+#include "replay_benchmarks.h"
+#include "beacon_pdu_data.h"
+#include "beacon_record_list.h"
+#include "crypto.h"
+#include "key_fragment_coding.h"
+#include "key_fragment_cadence.h"
+#include "config.h"
+#include "sender_registry.h"
+#include "sec_pdu_processing.h"
+#include "sec_pdu_processing_scan_callback.h"
+#include "ble_security_payload_encryption.h"
+#include "tasks_data.h"
+#include "test.h"
+#include "pdu_latency.h"
+#include "esp_log.h"
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#define BENCH_NO_PDUS 256
+#define BENCH_ROUNDS 200
+
+#define BENCH_MAX_SENDERS 256
+#define BENCH_SENDER_LOOKUPS 200000
+
+#define BENCH_ADV_INTERVAL_ROUNDS 100
+
+#define BENCH_ENGINE_STALL_MS 500
+// Senders of all engine benchmarks together, each benchmark keeps its own MAC address range
+#define BENCH_ENGINE_MAX_SENDERS 128
+
+#define BENCH_SHARD_SENDERS 32
+#define BENCH_SHARD_PDUS_PER_SENDER 32
+#define BENCH_SHARD_ROUNDS 20
+#define BENCH_SHARD_PAYLOAD_SIZE 10
+#define BENCH_SHARD_MAC_BASE 0x010000
+
+// Returned by bench_join_sender_stream() for an observer still without the key after its slot budget
+#define BENCH_JOINER_NOT_KEYED (-2)
+
+#define BENCH_KEY_FRAGMENTS 1024
+#define BENCH_HMAC_ROUNDS 50
+
+#define BENCH_AEAD_ROUNDS 200
+
+#define BENCH_CODEC_ROUNDS 200
+
+#define BENCH_AGGREGATION_MESSAGES 4096
+
+#define BENCH_KEY_PDU_KEYS 1024
+
+#define BENCH_PIGGYBACK_JOINERS 16
+#define BENCH_PIGGYBACK_MAX_SLOTS 64
+#define BENCH_PIGGYBACK_MAC_BASE 0x020000
+
+#define BENCH_KEY_LOSS_KEYS 4096
+#define BENCH_KEY_LOSS_MAX_SLOTS 256
+
+#define BENCH_CADENCE_SESSIONS 32
+#define BENCH_CADENCE_LOSS_PERCENT 20
+
+#define BENCH_HANDOVER_ROTATIONS 16
+#define BENCH_HANDOVER_MAC_BASE 0x030000
+
+static const char * BENCH_LOG_GROUP = "REPLAY_BENCH";
+
+typedef struct {
+    const char *name;
+    int (*run)(void);
+} replay_benchmark;
+
+typedef struct {
+    uint64_t ns;
+    uint64_t cycles;
+} bench_sample;
+
+static bench_sample bench_now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    bench_sample sample = {
+        .ns = ((uint64_t) ts.tv_sec * 1000000000ULL) + (uint64_t) ts.tv_nsec,
+#if defined(__x86_64__) || defined(__i386__)
+        .cycles = __rdtsc()
+#else
+        .cycles = 0
+#endif
+    };
+    return sample;
+}
+
+static void bench_report(const char *label, bench_sample start, bench_sample end, uint32_t no_ops)
+{
+    ESP_LOGI(BENCH_LOG_GROUP, "%s: %.1f ns/PDU, %.1f cycles/PDU",
+             label,
+             (double) (end.ns - start.ns) / (double) no_ops,
+             (double) (end.cycles - start.cycles) / (double) no_ops);
+}
+
+static void fill_pattern(uint8_t *data, size_t len, uint8_t seed)
+{
+    for (size_t i = 0; i < len; i++)
+    {
+        data[i] = (uint8_t) (seed + (i * 31));
+    }
+}
+
+// Per PDU key expansion (aes_ctr_decrypt_payload) against key schedule expanded once per session key
+static int bench_aes_key_schedule()
+{
+    static beacon_pdu_data pdus[BENCH_NO_PDUS];
+    static uint8_t output_per_pdu_setkey[BENCH_NO_PDUS][MAX_PDU_PAYLOAD_SIZE];
+    static uint8_t output_cached[BENCH_NO_PDUS][MAX_PDU_PAYLOAD_SIZE];
+
+    key_128b key;
+    fill_pattern(key.key, sizeof(key.key), 0x5A);
+
+    for (int i = 0; i < BENCH_NO_PDUS; i++)
+    {
+        uint8_t payload[MAX_PDU_PAYLOAD_SIZE];
+        fill_pattern(payload, sizeof(payload), (uint8_t) i);
+        build_beacon_pdu_data(produce_key_session_data(1, 0), payload, sizeof(payload), &pdus[i]);
+        pdus[i].payload_size = sizeof(payload);
+        pdus[i].pdu_no = (uint16_t) i;
+        pdus[i].xor_seed = (uint8_t) i;
+    }
+
+    uint8_t nonce[NONCE_SIZE];
+    bench_sample start = bench_now();
+    for (int round = 0; round < BENCH_ROUNDS; round++)
+    {
+        for (int i = 0; i < BENCH_NO_PDUS; i++)
+        {
+            build_nonce(nonce, &(pdus[i].marker), pdus[i].key_session_data, pdus[i].xor_seed);
+            aes_ctr_decrypt_payload(pdus[i].payload, pdus[i].payload_size, key.key, nonce, output_per_pdu_setkey[i]);
+        }
+    }
+    bench_sample end = bench_now();
+    bench_report("AES CTR per PDU setkey", start, end, BENCH_ROUNDS * BENCH_NO_PDUS);
+
+    aes_key_schedule key_schedule;
+    start = bench_now();
+    if (init_aes_key_schedule(&key_schedule, key.key) != 0)
+    {
+        ESP_LOGE(BENCH_LOG_GROUP, "Key schedule init failed");
+        return -1;
+    }
+    for (int round = 0; round < BENCH_ROUNDS; round++)
+    {
+        for (int i = 0; i < BENCH_NO_PDUS; i++)
+        {
+            build_nonce(nonce, &(pdus[i].marker), pdus[i].key_session_data, pdus[i].xor_seed);
+            aes_ctr_decrypt_payload_with_key_schedule(pdus[i].payload, pdus[i].payload_size, &key_schedule, nonce, output_cached[i]);
+        }
+    }
+    end = bench_now();
+    free_aes_key_schedule(&key_schedule);
+    bench_report("AES CTR cached key schedule", start, end, BENCH_ROUNDS * BENCH_NO_PDUS);
+
+    if (memcmp(output_per_pdu_setkey, output_cached, sizeof(output_cached)) != 0)
+    {
+        ESP_LOGE(BENCH_LOG_GROUP, "Cached key schedule output differs from per PDU setkey output!");
+        return -1;
+    }
+
+    return 0;
+}
+
+static void fill_sender_mac_address(esp_bd_addr_t mac_address, uint32_t sender_no)
+{
+    // Same vendor prefix for all senders, as for a fleet of beacons from one manufacturer
+    const uint8_t vendor_prefix[3] = {0x24, 0x0A, 0xC4};
+    memcpy(mac_address, vendor_prefix, sizeof(vendor_prefix));
+    mac_address[3] = (uint8_t) (sender_no >> 16);
+    mac_address[4] = (uint8_t) (sender_no >> 8);
+    mac_address[5] = (uint8_t) sender_no;
+}
+
+// Linear memcmp scan used by consumer collection and authorizer before the sender registry
+static int linear_sender_lookup(esp_bd_addr_t *mac_addresses, uint16_t no_senders, const esp_bd_addr_t mac_address)
+{
+    for (int i = 0; i < no_senders; i++)
+    {
+        if (memcmp(mac_addresses[i], mac_address, sizeof(esp_bd_addr_t)) == 0)
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static int bench_sender_lookup()
+{
+    static esp_bd_addr_t mac_addresses[BENCH_MAX_SENDERS];
+    static int registry_indexes[BENCH_MAX_SENDERS];
+
+    for (uint16_t no_senders = 2; no_senders <= BENCH_MAX_SENDERS; no_senders *= 2)
+    {
+        sender_registry *registry = create_sender_registry(no_senders);
+        if (registry == NULL)
+        {
+            ESP_LOGE(BENCH_LOG_GROUP, "Sender registry create failed");
+            return -1;
+        }
+
+        for (uint16_t i = 0; i < no_senders; i++)
+        {
+            fill_sender_mac_address(mac_addresses[i], i * 7919u);
+            registry_indexes[i] = add_sender_to_registry(registry, mac_addresses[i]);
+        }
+
+        // Pseudo random access order, the same for both lookups
+        uint32_t lcg = 12345;
+        volatile int sink = 0;
+        bench_sample start = bench_now();
+        for (uint32_t i = 0; i < BENCH_SENDER_LOOKUPS; i++)
+        {
+            lcg = lcg * 1664525u + 1013904223u;
+            sink += linear_sender_lookup(mac_addresses, no_senders, mac_addresses[(lcg >> 16) % no_senders]);
+        }
+        bench_sample end = bench_now();
+        ESP_LOGI(BENCH_LOG_GROUP, "%3u senders linear scan: %.1f ns/lookup, %.1f cycles/lookup", (unsigned) no_senders,
+                 (double) (end.ns - start.ns) / BENCH_SENDER_LOOKUPS, (double) (end.cycles - start.cycles) / BENCH_SENDER_LOOKUPS);
+
+        lcg = 12345;
+        int mismatches = 0;
+        start = bench_now();
+        for (uint32_t i = 0; i < BENCH_SENDER_LOOKUPS; i++)
+        {
+            lcg = lcg * 1664525u + 1013904223u;
+            const uint32_t sender_no = (lcg >> 16) % no_senders;
+            mismatches += get_sender_index(registry, mac_addresses[sender_no]) != registry_indexes[sender_no];
+        }
+        end = bench_now();
+        ESP_LOGI(BENCH_LOG_GROUP, "%3u senders hashed registry: %.1f ns/lookup, %.1f cycles/lookup", (unsigned) no_senders,
+                 (double) (end.ns - start.ns) / BENCH_SENDER_LOOKUPS, (double) (end.cycles - start.cycles) / BENCH_SENDER_LOOKUPS);
+
+        // Removal must keep the other senders reachable
+        for (uint16_t i = 0; i < no_senders; i += 2)
+        {
+            remove_sender_from_registry(registry, mac_addresses[i]);
+        }
+        for (uint16_t i = 0; i < no_senders; i++)
+        {
+            const int expected_index = (i % 2 == 0) ? SENDER_REGISTRY_NO_INDEX : registry_indexes[i];
+            mismatches += get_sender_index(registry, mac_addresses[i]) != expected_index;
+        }
+
+        destroy_sender_registry(registry);
+
+        if (mismatches != 0)
+        {
+            ESP_LOGE(BENCH_LOG_GROUP, "Sender registry returned %i wrong indexes", mismatches);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+// Bit exactness against the former floating point form is checked by the [adv_interval] unit tests
+static int bench_adv_interval()
+{
+    const uint32_t no_ops = BENCH_ADV_INTERVAL_ROUNDS * (MAX_KEY_ID_VAL + 1);
+    volatile uint32_t sink = 0;
+    bench_sample start = bench_now();
+    for (int round = 0; round < BENCH_ADV_INTERVAL_ROUNDS; round++)
+    {
+        for (uint32_t key_id = 0; key_id <= MAX_KEY_ID_VAL; key_id++)
+        {
+            const uint32_t adv_interval = get_adv_interval_from_key_id((uint16_t) key_id);
+            sink += adv_interval + get_tolerance_window_based_on_adv_interval(adv_interval);
+        }
+    }
+    bench_sample end = bench_now();
+    bench_report("Adv interval + tolerance integer", start, end, no_ops);
+
+    return 0;
+}
+
+static atomic_uint_fast32_t bench_decrypted_payloads = 0;
+
+static void bench_payload_decrypted_cb(uint8_t *data, size_t data_len, esp_bd_addr_t mac_address)
+{
+    atomic_fetch_add(&bench_decrypted_payloads, 1);
+}
+
+static uint8_t bench_get_engine_shards()
+{
+    const char *shards_env = getenv(REPLAY_SHARDS_ENV);
+    return shards_env != NULL ? (uint8_t) atoi(shards_env) : SEC_PDU_PROCESSING_SHARDS;
+}
+
+// Receiver pipeline shared by the engine benchmarks, started once per process with REPLAY_SHARDS processing shards.
+// Every benchmark feeds it from its own range of sender MAC addresses
+static int bench_start_engine()
+{
+    static bool is_engine_started = false;
+    if (is_engine_started == false)
+    {
+        init_test();
+        int status = start_up_sec_processing_with_shards(BENCH_ENGINE_MAX_SENDERS, bench_get_engine_shards());
+        if (status != 0)
+        {
+            ESP_LOGE(BENCH_LOG_GROUP, "Sec PDU processing start failed: %i", status);
+            return -1;
+        }
+        register_payload_observer_cb(bench_payload_decrypted_cb);
+        init_payload_encryption();
+        is_engine_started = true;
+    }
+
+    return 0;
+}
+
+// One advertisement of the sender stream with the scan time of a sender following the adv interval of its key
+typedef struct {
+    uint8_t data[MAX_BEACON_PDU_LEN];
+    size_t data_size;
+    int64_t timestamp_us;
+    bool is_key_pdu;
+} bench_sender_pdu;
+
+// Next PDU of the shipped sender (ble_security_payload_encryption) in the slot order of sender_app:
+// key fragment PDU when the cadence asks for it, otherwise payload encrypted into a data PDU
+static int bench_take_sender_pdu(uint8_t *payload, size_t payload_size, int64_t *timestamp_us, bench_sender_pdu *sender_pdu)
+{
+    sender_pdu->is_key_pdu = is_key_fragment_pdu_due();
+    if (sender_pdu->is_key_pdu)
+    {
+        beacon_key_pdu_data key_pdu = {0};
+        fill_marker_in_key_pdu(&key_pdu);
+        if (get_key_fragment_pdu(&key_pdu) != 0)
+        {
+            return -1;
+        }
+        sender_pdu->data_size = get_beacon_key_pdu_data_len(&key_pdu);
+        memcpy(sender_pdu->data, &key_pdu, sender_pdu->data_size);
+    }
+    else
+    {
+        beacon_pdu_data pdu = {0};
+        fill_marker_in_pdu(&pdu);
+        if (encrypt_payload(payload, payload_size, &pdu) != 0)
+        {
+            return -1;
+        }
+        sender_pdu->data_size = get_beacon_pdu_data_len(&pdu);
+        memcpy(sender_pdu->data, &pdu, sender_pdu->data_size);
+    }
+
+    // Odstęp między rozgłoszeniami wynika z ID klucza sesji, jak w sender_app
+    *timestamp_us += (int64_t) get_time_interval_for_current_session_key() * 1000;
+    sender_pdu->timestamp_us = *timestamp_us;
+    return 0;
+}
+
+// Data PDUs handed to the engine, the observer count is taken relative to the start of the feed
+typedef struct {
+    uint32_t fed_data_pdus;
+    uint32_t decrypted_base;
+} bench_engine_feed;
+
+static void bench_init_engine_feed(bench_engine_feed *feed)
+{
+    feed->fed_data_pdus = 0;
+    feed->decrypted_base = atomic_load(&bench_decrypted_payloads);
+}
+
+static uint32_t bench_get_decrypted(const bench_engine_feed *feed)
+{
+    return atomic_load(&bench_decrypted_payloads) - feed->decrypted_base;
+}
+
+// Scanner that never overruns the scan ring: waits while half of the ring is still waiting for authorization,
+// so every PDU reaches the pipeline and drops can only come from the engine itself
+static void bench_feed_engine(bench_engine_feed *feed, bench_sender_pdu *sender_pdu, esp_bd_addr_t mac_address)
+{
+    spsc_ring_stats ring_stats = {0};
+    get_scan_ring_stats(&ring_stats);
+    while (ring_stats.count >= ring_stats.capacity / 2)
+    {
+        taskYIELD();
+        get_scan_ring_stats(&ring_stats);
+    }
+
+    scan_complete_callback(sender_pdu->timestamp_us, sender_pdu->data, sender_pdu->data_size, mac_address);
+    feed->fed_data_pdus += sender_pdu->is_key_pdu ? 0 : 1;
+}
+
+// Waits until every data PDU fed reached the observer or nothing was decrypted for BENCH_ENGINE_STALL_MS,
+// returns the number of decrypted payloads
+static uint32_t bench_drain_engine(const bench_engine_feed *feed)
+{
+    uint32_t stalled_ms = 0;
+    uint32_t decrypted = bench_get_decrypted(feed);
+    while (decrypted < feed->fed_data_pdus && stalled_ms < BENCH_ENGINE_STALL_MS)
+    {
+        vTaskDelay(pdMS_TO_TICKS(1));
+        const uint32_t last_decrypted = decrypted;
+        decrypted = bench_get_decrypted(feed);
+        stalled_ms = decrypted == last_decrypted ? stalled_ms + 1 : 0;
+    }
+    return decrypted;
+}
+
+// Sender stream of the shipped sender replayed from 32 interleaved MAC addresses through scan_complete_callback,
+// authorization and the REPLAY_SHARDS processing shard tasks. Reports PDU/s until every data PDU reached the observer,
+// compare runs with REPLAY_SHARDS=1 and REPLAY_SHARDS=2
+static int bench_processing_shards()
+{
+    static bench_sender_pdu sender_pdus[BENCH_SHARD_PDUS_PER_SENDER];
+    esp_bd_addr_t mac_addresses[BENCH_SHARD_SENDERS];
+    uint16_t senders_per_shard[MAX_SEC_PDU_PROCESSING_SHARDS] = {0};
+
+    if (bench_start_engine() != 0)
+    {
+        return -1;
+    }
+
+    const uint8_t no_shards = bench_get_engine_shards();
+    for (uint16_t sender = 0; sender < BENCH_SHARD_SENDERS; sender++)
+    {
+        fill_sender_mac_address(mac_addresses[sender], BENCH_SHARD_MAC_BASE + sender * 7919u);
+        senders_per_shard[get_sec_processing_shard_for_mac(mac_addresses[sender], no_shards)]++;
+    }
+
+    bench_engine_feed feed;
+    bench_init_engine_feed(&feed);
+    int64_t timestamp_us = 0;
+    uint32_t decrypted = 0;
+    uint64_t elapsed_ns = 0;
+    for (int round = 0; round < BENCH_SHARD_ROUNDS; round++)
+    {
+        // Strumień nadawcy przygotowany poza pomiarem, każdy adres MAC rozgłasza te same PDU
+        for (uint32_t slot = 0; slot < BENCH_SHARD_PDUS_PER_SENDER; slot++)
+        {
+            uint8_t payload[BENCH_SHARD_PAYLOAD_SIZE];
+            fill_pattern(payload, sizeof(payload), (uint8_t) slot);
+            if (bench_take_sender_pdu(payload, sizeof(payload), &timestamp_us, &sender_pdus[slot]) != 0)
+            {
+                ESP_LOGE(BENCH_LOG_GROUP, "Sender PDU encryption failed");
+                return -1;
+            }
+        }
+
+        bench_sample start = bench_now();
+        for (uint32_t slot = 0; slot < BENCH_SHARD_PDUS_PER_SENDER; slot++)
+        {
+            for (uint16_t sender = 0; sender < BENCH_SHARD_SENDERS; sender++)
+            {
+                bench_feed_engine(&feed, &sender_pdus[slot], mac_addresses[sender]);
+            }
+        }
+        decrypted = bench_drain_engine(&feed);
+        bench_sample end = bench_now();
+        elapsed_ns += end.ns - start.ns;
+    }
+
+    const uint32_t no_pdus = BENCH_SHARD_SENDERS * BENCH_SHARD_PDUS_PER_SENDER * BENCH_SHARD_ROUNDS;
+    ESP_LOGI(BENCH_LOG_GROUP, "%u shard(s), senders of shard 0: %u/%u, %u PDUs fed, %u/%u data PDUs decrypted: %.0f PDU/s",
+             (unsigned) no_shards, (unsigned) senders_per_shard[0], (unsigned) BENCH_SHARD_SENDERS, (unsigned) no_pdus,
+             (unsigned) decrypted, (unsigned) feed.fed_data_pdus, (double) no_pdus * 1e9 / (double) elapsed_ns);
+
+    // Każdy PDU danych dociera do obserwatora dokładnie raz
+    if (decrypted != feed.fed_data_pdus)
+    {
+        ESP_LOGE(BENCH_LOG_GROUP, "Decrypted payloads do not match data PDUs fed!");
+        return -1;
+    }
+
+    return 0;
+}
+
+// mbedtls md HMAC with context setup per fragment against the allocation free single block HMAC
+static int bench_fragment_hmac()
+{
+    static uint8_t fragments[BENCH_KEY_FRAGMENTS][KEY_FRAGMENT_SIZE];
+    static uint8_t encrypted_fragments[BENCH_KEY_FRAGMENTS][KEY_FRAGMENT_SIZE];
+    static uint8_t hmacs[BENCH_KEY_FRAGMENTS][HMAC_SHA256_DIGEST_SIZE];
+
+    for (int i = 0; i < BENCH_KEY_FRAGMENTS; i++)
+    {
+        fill_pattern(fragments[i], KEY_FRAGMENT_SIZE, (uint8_t) i);
+        xor_encrypt_key_fragment(fragments[i], encrypted_fragments[i], (uint8_t) (i * 7));
+    }
+
+    bench_sample start = bench_now();
+    for (int round = 0; round < BENCH_HMAC_ROUNDS; round++)
+    {
+        for (int i = 0; i < BENCH_KEY_FRAGMENTS; i++)
+        {
+            calculate_hmac(fragments[i], KEY_FRAGMENT_SIZE, encrypted_fragments[i], KEY_FRAGMENT_SIZE, hmacs[i]);
+        }
+    }
+    bench_sample end = bench_now();
+    bench_report("Fragment HMAC mbedtls md", start, end, BENCH_HMAC_ROUNDS * BENCH_KEY_FRAGMENTS);
+
+    int mismatches = 0;
+    start = bench_now();
+    for (int round = 0; round < BENCH_HMAC_ROUNDS; round++)
+    {
+        for (int i = 0; i < BENCH_KEY_FRAGMENTS; i++)
+        {
+            mismatches += verify_key_fragment_hmac(fragments[i], encrypted_fragments[i], hmacs[i]) != 0;
+        }
+    }
+    end = bench_now();
+    bench_report("Fragment HMAC single block verify", start, end, BENCH_HMAC_ROUNDS * BENCH_KEY_FRAGMENTS);
+
+    if (mismatches != 0)
+    {
+        ESP_LOGE(BENCH_LOG_GROUP, "Single block HMAC differs from mbedtls HMAC for %i fragments!", mismatches);
+        return -1;
+    }
+
+    return 0;
+}
+
+// Data PDU decryption with AES-CTR against AES-CCM tag verification, both on the cached key schedule
+static int bench_aead_payload()
+{
+    static beacon_pdu_data ctr_pdus[BENCH_NO_PDUS];
+    static beacon_pdu_data aead_pdus[BENCH_NO_PDUS];
+    static uint8_t plaintexts[BENCH_NO_PDUS][MAX_AEAD_PDU_PAYLOAD_SIZE];
+    static uint8_t output[BENCH_NO_PDUS][MAX_AEAD_PDU_PAYLOAD_SIZE];
+    const size_t payload_size = MAX_AEAD_PDU_PAYLOAD_SIZE;
+
+    key_128b key;
+    fill_pattern(key.key, sizeof(key.key), 0x3C);
+    aes_key_schedule key_schedule;
+    if (init_aes_key_schedule(&key_schedule, key.key) != 0)
+    {
+        ESP_LOGE(BENCH_LOG_GROUP, "Key schedule init failed");
+        return -1;
+    }
+
+    uint8_t ctr_nonce[NONCE_SIZE];
+    uint8_t aead_nonce[AES_CCM_NONCE_SIZE];
+    for (int i = 0; i < BENCH_NO_PDUS; i++)
+    {
+        fill_pattern(plaintexts[i], payload_size, (uint8_t) i);
+
+        build_beacon_pdu_data(produce_key_session_data(1, 0), plaintexts[i], payload_size, &ctr_pdus[i]);
+        ctr_pdus[i].pdu_no = (uint16_t) i;
+        ctr_pdus[i].xor_seed = (uint8_t) i;
+        ctr_pdus[i].payload_size = payload_size;
+        build_nonce(ctr_nonce, &(ctr_pdus[i].marker), ctr_pdus[i].key_session_data, ctr_pdus[i].xor_seed);
+        aes_ctr_decrypt_payload_with_key_schedule(plaintexts[i], payload_size, &key_schedule, ctr_nonce, ctr_pdus[i].payload);
+
+        memcpy(&aead_pdus[i], &ctr_pdus[i], sizeof(beacon_pdu_data));
+        aead_pdus[i].cmd = AEAD_DATA_CMD;
+        aead_pdus[i].payload_size = payload_size + DATA_PDU_AEAD_TAG_SIZE;
+        build_aead_nonce(aead_nonce, &aead_pdus[i]);
+        aes_ccm_encrypt_and_tag_with_key_schedule(&key_schedule, aead_nonce, plaintexts[i], payload_size, aead_pdus[i].payload,
+                                                  &(aead_pdus[i].payload[payload_size]), DATA_PDU_AEAD_TAG_SIZE);
+    }
+
+    bench_sample start = bench_now();
+    for (int round = 0; round < BENCH_AEAD_ROUNDS; round++)
+    {
+        for (int i = 0; i < BENCH_NO_PDUS; i++)
+        {
+            build_nonce(ctr_nonce, &(ctr_pdus[i].marker), ctr_pdus[i].key_session_data, ctr_pdus[i].xor_seed);
+            aes_ctr_decrypt_payload_with_key_schedule(ctr_pdus[i].payload, payload_size, &key_schedule, ctr_nonce, output[i]);
+        }
+    }
+    bench_sample end = bench_now();
+    bench_report("Data PDU AES-CTR decrypt", start, end, BENCH_AEAD_ROUNDS * BENCH_NO_PDUS);
+
+    int failed = memcmp(output, plaintexts, sizeof(output)) != 0;
+
+    start = bench_now();
+    for (int round = 0; round < BENCH_AEAD_ROUNDS; round++)
+    {
+        for (int i = 0; i < BENCH_NO_PDUS; i++)
+        {
+            build_aead_nonce(aead_nonce, &aead_pdus[i]);
+            failed += aes_ccm_auth_decrypt_with_key_schedule(&key_schedule, aead_nonce, aead_pdus[i].payload, payload_size, output[i],
+                                                             &(aead_pdus[i].payload[payload_size]), DATA_PDU_AEAD_TAG_SIZE) != 0;
+        }
+    }
+    end = bench_now();
+    bench_report("Data PDU AES-CCM verify and decrypt", start, end, BENCH_AEAD_ROUNDS * BENCH_NO_PDUS);
+
+    failed += memcmp(output, plaintexts, sizeof(output)) != 0;
+
+    free_aes_key_schedule(&key_schedule);
+
+    if (failed != 0)
+    {
+        ESP_LOGE(BENCH_LOG_GROUP, "AEAD round trip failed!");
+        return -1;
+    }
+
+    return 0;
+}
+
+// Data PDU of every payload length encrypted, serialized to adv data and parsed back, legacy or extended length limits
+static int bench_pdu_codec()
+{
+    static uint8_t adv_data[MAX_BEACON_PDU_LEN];
+    uint8_t payload[MAX_PDU_PAYLOAD_SIZE];
+    uint8_t decrypted[MAX_PDU_PAYLOAD_SIZE];
+    uint8_t nonce[NONCE_SIZE];
+    beacon_pdu_data pdu;
+    beacon_pdu_data parsed_pdu;
+    int failed = 0;
+
+    key_128b key;
+    fill_pattern(key.key, sizeof(key.key), 0x77);
+    aes_key_schedule key_schedule;
+    if (init_aes_key_schedule(&key_schedule, key.key) != 0)
+    {
+        ESP_LOGE(BENCH_LOG_GROUP, "Key schedule init failed");
+        return -1;
+    }
+
+    ESP_LOGI(BENCH_LOG_GROUP, "Extended advertising: %d, adv data %u B, payload per PDU %u B",
+             BLE_EXTENDED_ADVERTISING, (unsigned) MAX_BEACON_PDU_LEN, (unsigned) MAX_PDU_PAYLOAD_SIZE);
+
+    uint32_t no_pdus = 0;
+    bench_sample start = bench_now();
+    for (int round = 0; round < BENCH_CODEC_ROUNDS; round++)
+    {
+        for (size_t payload_size = 0; payload_size <= MAX_PDU_PAYLOAD_SIZE; payload_size++)
+        {
+            fill_pattern(payload, payload_size, (uint8_t) payload_size);
+            memset(&pdu, 0, sizeof(pdu));
+            build_beacon_pdu_data(produce_key_session_data(0x1234, 0), payload, payload_size, &pdu);
+            pdu.pdu_no = (uint16_t) payload_size;
+            pdu.xor_seed = (uint8_t) round;
+            pdu.payload_size = payload_size;
+            build_nonce(nonce, &(pdu.marker), pdu.key_session_data, pdu.xor_seed);
+            aes_ctr_decrypt_payload_with_key_schedule(payload, payload_size, &key_schedule, nonce, pdu.payload);
+
+            // Bajty rozgłoszenia tak jak wysyła je nadawca
+            const size_t adv_data_len = get_beacon_pdu_data_len(&pdu);
+            memcpy(adv_data, &pdu, adv_data_len);
+
+            failed += adv_data_len > MAX_BEACON_PDU_LEN;
+            failed += get_command_from_pdu(adv_data, adv_data_len) != DATA_CMD;
+            failed += get_beacon_pdu_from_adv_data(&parsed_pdu, adv_data, adv_data_len) == false;
+            failed += parsed_pdu.payload_size != payload_size || parsed_pdu.pdu_no != pdu.pdu_no;
+            failed += get_key_id_from_key_session_data(parsed_pdu.key_session_data) != 0x1234;
+
+            build_nonce(nonce, &(parsed_pdu.marker), parsed_pdu.key_session_data, parsed_pdu.xor_seed);
+            aes_ctr_decrypt_payload_with_key_schedule(parsed_pdu.payload, parsed_pdu.payload_size, &key_schedule, nonce, decrypted);
+            failed += memcmp(decrypted, payload, payload_size) != 0;
+            no_pdus++;
+        }
+    }
+    bench_sample end = bench_now();
+    bench_report("PDU encode, serialize, parse and decrypt", start, end, no_pdus);
+
+    free_aes_key_schedule(&key_schedule);
+
+    if (failed != 0)
+    {
+        ESP_LOGE(BENCH_LOG_GROUP, "PDU codec round trip failed %i checks!", failed);
+        return -1;
+    }
+
+    return 0;
+}
+
+// CTR with a fresh counter block per call, mbedtls advances the counter block passed to it
+static void bench_ctr_crypt(aes_key_schedule *key_schedule, uint8_t *input, size_t length, uint32_t pdu_no, uint8_t *output)
+{
+    uint8_t nonce[NONCE_SIZE] = {0};
+    memcpy(nonce, &pdu_no, sizeof(pdu_no));
+    aes_ctr_decrypt_payload_with_key_schedule(input, length, key_schedule, nonce, output);
+}
+
+// Test payloads sent one per data PDU vs coalesced into record list PDUs: PDUs on air and per message cost
+static int bench_record_aggregation()
+{
+    static const size_t message_sizes[] = {4, 10, 16};
+    static uint8_t list[MAX_PDU_PAYLOAD_SIZE];
+    static uint8_t encrypted[MAX_PDU_PAYLOAD_SIZE];
+    uint8_t message[MAX_PDU_PAYLOAD_SIZE];
+    int failed = 0;
+
+    key_128b key;
+    fill_pattern(key.key, sizeof(key.key), 0x5A);
+    aes_key_schedule key_schedule;
+    if (init_aes_key_schedule(&key_schedule, key.key) != 0)
+    {
+        ESP_LOGE(BENCH_LOG_GROUP, "Key schedule init failed");
+        return -1;
+    }
+
+    for (size_t s = 0; s < sizeof(message_sizes) / sizeof(message_sizes[0]); s++)
+    {
+        const size_t message_size = message_sizes[s];
+        char label[96];
+
+        bench_sample start = bench_now();
+        for (uint32_t i = 0; i < BENCH_AGGREGATION_MESSAGES; i++)
+        {
+            fill_pattern(message, message_size, (uint8_t) i);
+            bench_ctr_crypt(&key_schedule, message, message_size, i, encrypted);
+            bench_ctr_crypt(&key_schedule, encrypted, message_size, i, encrypted);
+            failed += memcmp(encrypted, message, message_size) != 0;
+        }
+        bench_sample end = bench_now();
+        snprintf(label, sizeof(label), "%u B message per PDU (%u PDUs)", (unsigned) message_size, (unsigned) BENCH_AGGREGATION_MESSAGES);
+        bench_report(label, start, end, BENCH_AGGREGATION_MESSAGES);
+
+        uint32_t no_pdus = 0;
+        uint32_t no_delivered = 0;
+        uint32_t next_message = 0;
+        start = bench_now();
+        while (next_message < BENCH_AGGREGATION_MESSAGES)
+        {
+            // Nadawca: rekordy dokładane aż kolejny się nie zmieści
+            size_t list_size = 0;
+            const uint32_t first_message = next_message;
+            while (next_message < BENCH_AGGREGATION_MESSAGES)
+            {
+                fill_pattern(message, message_size, (uint8_t) next_message);
+                if (add_record_to_record_list(list, sizeof(list), &list_size, message, message_size) == false)
+                {
+                    break;
+                }
+                next_message++;
+            }
+
+            bench_ctr_crypt(&key_schedule, list, list_size, no_pdus, encrypted);
+
+            // Odbiorca: deszyfrowanie całego PDU i rozdzielenie rekordów do obserwatorów
+            bench_ctr_crypt(&key_schedule, encrypted, list_size, no_pdus, encrypted);
+            no_pdus++;
+            size_t offset = 0;
+            const uint8_t *record = NULL;
+            size_t record_size = 0;
+            uint32_t message_no = first_message;
+            while (get_next_record_from_record_list(encrypted, list_size, &offset, &record, &record_size))
+            {
+                fill_pattern(message, message_size, (uint8_t) message_no++);
+                failed += record_size != message_size || memcmp(record, message, message_size) != 0;
+                no_delivered++;
+            }
+            failed += offset != list_size;
+        }
+        end = bench_now();
+        snprintf(label, sizeof(label), "%u B messages aggregated (%u PDUs, %.2f messages per PDU)", (unsigned) message_size,
+                 (unsigned) no_pdus, (double) BENCH_AGGREGATION_MESSAGES / no_pdus);
+        bench_report(label, start, end, BENCH_AGGREGATION_MESSAGES);
+
+        failed += no_delivered != BENCH_AGGREGATION_MESSAGES;
+    }
+
+    free_aes_key_schedule(&key_schedule);
+
+    if (failed != 0)
+    {
+        ESP_LOGE(BENCH_LOG_GROUP, "Record aggregation round trip failed %i checks!", failed);
+        return -1;
+    }
+
+    return 0;
+}
+
+// Key PDUs with 1 to MAX_KEY_FRAGMENTS_PER_PDU fragments: key PDUs needed until a receiver holds the whole key
+static int bench_key_fragment_pdu()
+{
+    uint8_t adv_data[MAX_BEACON_PDU_LEN];
+    beacon_key_pdu_data pdu;
+    beacon_key_pdu_data received_pdu;
+    int failed = 0;
+
+    for (uint8_t fragments_per_pdu = 1; fragments_per_pdu <= MAX_KEY_FRAGMENTS_PER_PDU; fragments_per_pdu++)
+    {
+        uint32_t no_key_pdus = 0;
+        uint8_t next_fragment = 0;
+        size_t adv_data_len = 0;
+
+        bench_sample start = bench_now();
+        for (uint32_t key_no = 0; key_no < BENCH_KEY_PDU_KEYS; key_no++)
+        {
+            key_128b key;
+            key_splitted splitted_key;
+            key_splitted received_fragments = {0};
+            uint8_t collected_fragments = 0;
+            const uint16_t key_id = (uint16_t) (key_no & MAX_KEY_ID_VAL);
+
+            fill_pattern(key.key, KEY_SIZE, (uint8_t) key_no);
+            split_128b_key_to_fragment(&key, &splitted_key);
+
+            while (collected_fragments != (1u << NO_KEY_FRAGMENTS) - 1)
+            {
+                // Nadawca: kolejne fragmenty jak w get_key_fragment_pdu(), licznik fragmentów nie wraca do zera przy zmianie klucza
+                memset(&pdu, 0, sizeof(pdu));
+                fill_marker_in_key_pdu(&pdu);
+                pdu.cmd = KEY_FRAGMENT_CMD;
+                pdu.pdu_no = (uint16_t) no_key_pdus;
+                pdu.no_fragments = fragments_per_pdu;
+                for (uint8_t i = 0; i < fragments_per_pdu; i++)
+                {
+                    const uint8_t key_fragment_no = next_fragment;
+                    next_fragment = (next_fragment + 1) % NO_KEY_FRAGMENTS;
+                    pdu.bcd[i].key_session_data = produce_key_session_data(key_id, key_fragment_no);
+                    pdu.bcd[i].xor_seed = (uint8_t) (key_no * 13 + i);
+                    xor_encrypt_key_fragment(splitted_key.fragment[key_fragment_no], pdu.bcd[i].enc_key_fragment, pdu.bcd[i].xor_seed);
+                    calculate_hmac_of_fragment(splitted_key.fragment[key_fragment_no], pdu.bcd[i].enc_key_fragment, pdu.bcd[i].key_fragment_hmac);
+                }
+                adv_data_len = get_beacon_key_pdu_data_len(&pdu);
+                memcpy(adv_data, &pdu, adv_data_len);
+                no_key_pdus++;
+
+                // Odbiorca: liczba fragmentów z długości rozgłoszenia, każdy weryfikowany osobno
+                failed += get_command_from_pdu(adv_data, adv_data_len) != KEY_FRAGMENT_CMD;
+                const uint8_t no_fragments = get_no_key_fragments_from_pdu(adv_data_len);
+                failed += no_fragments != fragments_per_pdu;
+                memcpy(&received_pdu, adv_data, adv_data_len);
+                for (uint8_t i = 0; i < no_fragments; i++)
+                {
+                    beacon_crypto_data *bcd = &(received_pdu.bcd[i]);
+                    uint8_t decrypted_fragment[KEY_FRAGMENT_SIZE];
+                    xor_decrypt_key_fragment(bcd->enc_key_fragment, decrypted_fragment, bcd->xor_seed);
+                    if (verify_key_fragment_hmac(decrypted_fragment, bcd->enc_key_fragment, bcd->key_fragment_hmac) != 0 ||
+                        get_key_id_from_key_session_data(bcd->key_session_data) != key_id)
+                    {
+                        failed++;
+                        continue;
+                    }
+
+                    const uint8_t key_fragment_index = get_key_fragment_index_from_key_session_data(bcd->key_session_data);
+                    add_fragment_to_key_spliited(&received_fragments, decrypted_fragment, key_fragment_index);
+                    collected_fragments |= (uint8_t) (1u << key_fragment_index);
+                }
+            }
+
+            key_128b reconstructed_key;
+            get_128b_key_from_fragments(&reconstructed_key, &received_fragments);
+            failed += memcmp(reconstructed_key.key, key.key, KEY_SIZE) != 0;
+        }
+        bench_sample end = bench_now();
+
+        char label[96];
+        snprintf(label, sizeof(label), "%u fragments per key PDU (%u B adv data, %.2f key PDUs per key)", (unsigned) fragments_per_pdu,
+                 (unsigned) adv_data_len, (double) no_key_pdus / BENCH_KEY_PDU_KEYS);
+        bench_report(label, start, end, BENCH_KEY_PDU_KEYS);
+    }
+
+    if (failed != 0)
+    {
+        ESP_LOGE(BENCH_LOG_GROUP, "Key fragment PDU round trip failed %i checks!", failed);
+        return -1;
+    }
+
+    return 0;
+}
+
+// Data PDUs the processing shards decrypted on arrival (key cache hit) or put into the deferred queue,
+// taken from the PDU latency histograms of all senders
+typedef struct {
+    uint32_t key_cache_hits;
+    uint32_t deferred;
+} bench_key_cache_outcomes;
+
+static void bench_get_key_cache_outcomes(bench_key_cache_outcomes *outcomes)
+{
+    pdu_latency_histogram histogram = {0};
+    get_pdu_latency_histogram(PDU_LATENCY_ALL_SENDERS, PDU_STAGE_KEY_CACHE_HIT, &histogram);
+    outcomes->key_cache_hits = histogram.count;
+    get_pdu_latency_histogram(PDU_LATENCY_ALL_SENDERS, PDU_STAGE_DEFERRED, &histogram);
+    outcomes->deferred = histogram.count;
+}
+
+// Waits until no_data_pdus data PDUs reached the key cache since base, outcomes are relative to base.
+// Returns false when the shards stalled for BENCH_ENGINE_STALL_MS
+static bool bench_wait_for_key_cache_outcomes(const bench_key_cache_outcomes *base, uint32_t no_data_pdus, bench_key_cache_outcomes *outcomes)
+{
+    uint32_t stalled_ms = 0;
+    bench_get_key_cache_outcomes(outcomes);
+    while ((outcomes->key_cache_hits - base->key_cache_hits) + (outcomes->deferred - base->deferred) < no_data_pdus &&
+           stalled_ms < BENCH_ENGINE_STALL_MS)
+    {
+        vTaskDelay(pdMS_TO_TICKS(1));
+        stalled_ms++;
+        bench_get_key_cache_outcomes(outcomes);
+    }
+
+    outcomes->key_cache_hits -= base->key_cache_hits;
+    outcomes->deferred -= base->deferred;
+    return outcomes->key_cache_hits + outcomes->deferred >= no_data_pdus;
+}
+
+// Key fragment cadence the shipped sender starts with (SENDER_KEY_FRAGMENT_CADENCE_TAPERED in config.h)
+static const key_fragment_cadence_policy *bench_get_sender_default_cadence_policy()
+{
+#if SENDER_KEY_FRAGMENT_CADENCE_TAPERED
+    static const tapered_key_fragment_cadence_config cadence = {
+        .burst_slots = SENDER_KEY_CADENCE_BURST_SLOTS,
+        .burst_gap = SENDER_KEY_CADENCE_BURST_GAP,
+        .taper_step_slots = SENDER_KEY_CADENCE_TAPER_STEP_SLOTS,
+        .floor_gap = SENDER_KEY_CADENCE_FLOOR_GAP,
+    };
+    static const key_fragment_cadence_policy policy = {get_tapered_key_fragment_cadence, &cadence};
+#else
+    static const uint16_t cadence = PDU_TO_KEY_FRAGMENT_RATIO;
+    static const key_fragment_cadence_policy policy = {get_fixed_key_fragment_cadence, &cadence};
+#endif
+    return &policy;
+}
+
+// Takes sender PDUs without feeding them until the key changes, first_pdu is the first PDU of the new key session
+static int bench_skip_to_key_rotation(uint8_t *payload, size_t payload_size, int64_t *timestamp_us, bench_sender_pdu *first_pdu)
+{
+    const uint16_t key_id = get_current_key_id();
+    do
+    {
+        fill_pattern(payload, payload_size, 0);
+        if (bench_take_sender_pdu(payload, payload_size, timestamp_us, first_pdu) != 0)
+        {
+            ESP_LOGE(BENCH_LOG_GROUP, "Sender PDU encryption failed");
+            return -1;
+        }
+    } while (get_current_key_id() == key_id);
+
+    return 0;
+}
+
+// Observer joining the sender stream from a new MAC address with first_pdu, fed one PDU at a time until a data PDU
+// hits its key cache. Returns the slots fed before that data PDU, deferred data PDUs are added to no_deferred,
+// BENCH_JOINER_NOT_KEYED when the key is not held after max_slots
+static int bench_join_sender_stream(bench_engine_feed *feed, esp_bd_addr_t mac_address, const bench_sender_pdu *first_pdu,
+                                    uint8_t *payload, size_t payload_size, int64_t *timestamp_us, uint32_t max_slots, uint32_t *no_deferred)
+{
+    bench_key_cache_outcomes base;
+    bench_key_cache_outcomes outcomes = {0};
+    bench_get_key_cache_outcomes(&base);
+    uint32_t no_data_pdus = 0;
+    uint32_t slot = 0;
+    while (outcomes.key_cache_hits == 0 && slot <= max_slots)
+    {
+        bench_sender_pdu sender_pdu = *first_pdu;
+        fill_pattern(payload, payload_size, (uint8_t) slot);
+        if (slot > 0 && bench_take_sender_pdu(payload, payload_size, timestamp_us, &sender_pdu) != 0)
+        {
+            ESP_LOGE(BENCH_LOG_GROUP, "Sender PDU encryption failed");
+            return -1;
+        }
+        bench_feed_engine(feed, &sender_pdu, mac_address);
+        slot++;
+
+        // Autoryzacja przekazuje PDU dopiero po odbiorze kolejnego - czekaj na dane sprzed ostatniego PDU
+        if (slot > 1 && bench_wait_for_key_cache_outcomes(&base, no_data_pdus, &outcomes) == false)
+        {
+            ESP_LOGE(BENCH_LOG_GROUP, "Data PDUs of a joining observer did not reach the key cache");
+            return -1;
+        }
+        no_data_pdus += sender_pdu.is_key_pdu ? 0 : 1;
+    }
+
+    // Klucz wykryty po podaniu PDU następującego po pierwszym trafieniu w pamięć podręczną kluczy
+    const int slots_to_key = outcomes.key_cache_hits > 0 ? (int) slot - 1 : BENCH_JOINER_NOT_KEYED;
+    // Poczekaj na ostatnie PDU, inaczej jego wynik zostałby policzony następnemu obserwatorowi
+    if (slot > 1 && bench_wait_for_key_cache_outcomes(&base, no_data_pdus, &outcomes) == false)
+    {
+        ESP_LOGE(BENCH_LOG_GROUP, "Data PDUs of a joining observer did not reach the key cache");
+        return -1;
+    }
+
+    *no_deferred += outcomes.deferred;
+    return slots_to_key;
+}
+
+// Observers of the shipped sender joining right after a key rotation, each from its own MAC address,
+// with and without a key fragment carried by data PDUs. The sender puts a key PDU every PDU_TO_KEY_FRAGMENT_RATIO + 1 slots,
+// so the burst of the tapered cadence does not hide the fragments carried by data PDUs.
+// Reports slots until the first data PDU hits the key cache and data PDUs deferred meanwhile, as seen by the processing shards
+static int bench_key_piggyback()
+{
+    static const size_t payload_sizes[] = {4, 10, 16};
+    static const uint16_t fixed_cadence_gap = PDU_TO_KEY_FRAGMENT_RATIO;
+    const key_fragment_cadence_policy fixed_cadence = {get_fixed_key_fragment_cadence, &fixed_cadence_gap};
+    uint8_t payload[MAX_PDU_PAYLOAD_SIZE];
+    uint32_t joiner_no = 0;
+    int failed = 0;
+
+#if PDU_LATENCY_HISTOGRAMS == 0
+    ESP_LOGE(BENCH_LOG_GROUP, "Key cache outcomes are counted by the PDU latency histograms, set PDU_LATENCY_HISTOGRAMS");
+    return -1;
+#endif
+    if (bench_start_engine() != 0)
+    {
+        return -1;
+    }
+
+    set_key_fragment_cadence_policy(&fixed_cadence);
+    for (int piggyback = 0; piggyback <= 1; piggyback++)
+    {
+        set_key_fragment_piggybacking(piggyback == 1);
+        for (size_t s = 0; s < sizeof(payload_sizes) / sizeof(payload_sizes[0]); s++)
+        {
+            const size_t payload_size = payload_sizes[s];
+            const bool carry_key_fragment = piggyback == 1 && payload_size <= MAX_DATA_KEY_FRAGMENT_PDU_PAYLOAD_SIZE;
+            uint32_t no_slots = 0;
+            uint32_t no_deferred = 0;
+            uint32_t no_not_keyed = 0;
+            int64_t timestamp_us = 0;
+            bench_engine_feed feed;
+            bench_init_engine_feed(&feed);
+
+            bench_sample start = bench_now();
+            for (uint32_t joiner = 0; joiner < BENCH_PIGGYBACK_JOINERS; joiner++, joiner_no++)
+            {
+                esp_bd_addr_t mac_address;
+                bench_sender_pdu first_pdu;
+                fill_sender_mac_address(mac_address, BENCH_PIGGYBACK_MAC_BASE + joiner_no);
+                if (bench_skip_to_key_rotation(payload, payload_size, &timestamp_us, &first_pdu) != 0)
+                {
+                    return -1;
+                }
+                const int slots_to_key = bench_join_sender_stream(&feed, mac_address, &first_pdu, payload, payload_size, &timestamp_us,
+                                                                  BENCH_PIGGYBACK_MAX_SLOTS, &no_deferred);
+                if (slots_to_key < 0 && slots_to_key != BENCH_JOINER_NOT_KEYED)
+                {
+                    return -1;
+                }
+                no_not_keyed += slots_to_key == BENCH_JOINER_NOT_KEYED;
+                no_slots += slots_to_key == BENCH_JOINER_NOT_KEYED ? BENCH_PIGGYBACK_MAX_SLOTS : (uint32_t) slots_to_key;
+            }
+            const uint32_t decrypted = bench_drain_engine(&feed);
+            bench_sample end = bench_now();
+
+            char label[160];
+            snprintf(label, sizeof(label), "%u B payload, key fragment in data PDUs %s: %.2f slots to key, %.2f deferred data PDUs per observer, %u/%u without key",
+                     (unsigned) payload_size, carry_key_fragment ? "yes" : "no",
+                     (double) no_slots / BENCH_PIGGYBACK_JOINERS, (double) no_deferred / BENCH_PIGGYBACK_JOINERS,
+                     (unsigned) no_not_keyed, (unsigned) BENCH_PIGGYBACK_JOINERS);
+            bench_report(label, start, end, BENCH_PIGGYBACK_JOINERS);
+
+            // Odroczone PDU danych odszyfrowane po złożeniu klucza
+            failed += decrypted != feed.fed_data_pdus;
+            failed += no_not_keyed != 0;
+        }
+    }
+    set_key_fragment_piggybacking(SENDER_PIGGYBACK_KEY_FRAGMENTS);
+    set_key_fragment_cadence_policy(bench_get_sender_default_cadence_policy());
+
+    if (failed != 0)
+    {
+        ESP_LOGE(BENCH_LOG_GROUP, "Key fragment piggyback replay failed %i checks!", failed);
+        return -1;
+    }
+
+    return 0;
+}
+
+static uint32_t bench_xorshift32(uint32_t *state)
+{
+    uint32_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *state = x;
+    return x;
+}
+
+// One key fragment per sender slot, the sender cycles through key fragments and parity_fragments parity fragments.
+// Each slot is lost with the given probability, reports slots until the receiver rebuilds the key
+static int bench_key_loss()
+{
+    static const uint8_t loss_percentages[] = {10, 20, 30};
+    static const uint8_t parity_fragment_counts[] = {0, NO_KEY_PARITY_FRAGMENTS};
+    int failed = 0;
+
+    for (size_t l = 0; l < sizeof(loss_percentages) / sizeof(loss_percentages[0]); l++)
+    {
+        for (size_t p = 0; p < sizeof(parity_fragment_counts) / sizeof(parity_fragment_counts[0]); p++)
+        {
+            const uint8_t parity_fragments = parity_fragment_counts[p];
+            const uint8_t no_coded_fragments = NO_KEY_FRAGMENTS + parity_fragments;
+            // Ten sam ciąg strat dla obu wariantów nadawcy
+            uint32_t loss_state = 0x9E3779B9u + loss_percentages[l];
+            uint32_t no_slots = 0;
+            uint32_t max_slots = 0;
+            uint32_t no_timeouts = 0;
+
+            bench_sample start = bench_now();
+            for (uint32_t key_no = 0; key_no < BENCH_KEY_LOSS_KEYS; key_no++)
+            {
+                key_128b key;
+                key_splitted splitted_key;
+                uint8_t coded_fragments[NO_CODED_KEY_FRAGMENTS][KEY_FRAGMENT_SIZE] = {0};
+                uint8_t received_mask = 0;
+                uint8_t no_received = 0;
+                const uint16_t key_id = (uint16_t) (key_no & MAX_KEY_ID_VAL);
+                // Rotacja klucza w dowolnym miejscu cyklu fragmentów
+                const uint8_t first_coded_fragment = (uint8_t) (key_no % no_coded_fragments);
+
+                fill_pattern(key.key, KEY_SIZE, (uint8_t) (key_no + 1));
+                split_128b_key_to_fragment(&key, &splitted_key);
+
+                uint32_t slot = 0;
+                for (; no_received < NO_KEY_FRAGMENTS && slot < BENCH_KEY_LOSS_MAX_SLOTS; slot++)
+                {
+                    const uint8_t coded_fragment_no = (uint8_t) ((first_coded_fragment + slot) % no_coded_fragments);
+                    if (bench_xorshift32(&loss_state) % 100 < loss_percentages[l])
+                    {
+                        continue;
+                    }
+
+                    // Nadawca: fragment klucza albo fragment parzystości, każdy maskowany i z HMAC
+                    uint8_t fragment[KEY_FRAGMENT_SIZE];
+                    memcpy(fragment, splitted_key.fragment[coded_fragment_no % NO_KEY_FRAGMENTS], KEY_FRAGMENT_SIZE);
+                    if (coded_fragment_no >= NO_KEY_FRAGMENTS)
+                    {
+                        encode_key_parity_fragment(&splitted_key, coded_fragment_no - NO_KEY_FRAGMENTS, fragment);
+                    }
+                    const command cmd = coded_fragment_no >= NO_KEY_FRAGMENTS ? KEY_PARITY_FRAGMENT_CMD : KEY_FRAGMENT_CMD;
+                    beacon_crypto_data bcd;
+                    bcd.key_session_data = produce_key_session_data(key_id, coded_fragment_no % NO_KEY_FRAGMENTS);
+                    bcd.xor_seed = (uint8_t) (key_no + slot);
+                    xor_encrypt_key_fragment(fragment, bcd.enc_key_fragment, bcd.xor_seed);
+                    calculate_hmac_of_fragment(fragment, bcd.enc_key_fragment, bcd.key_fragment_hmac);
+
+                    // Odbiorca: indeks fragmentu z komendy i danych sesji, duplikaty pomijane
+                    uint8_t decrypted_fragment[KEY_FRAGMENT_SIZE];
+                    xor_decrypt_key_fragment(bcd.enc_key_fragment, decrypted_fragment, bcd.xor_seed);
+                    if (verify_key_fragment_hmac(decrypted_fragment, bcd.enc_key_fragment, bcd.key_fragment_hmac) != 0)
+                    {
+                        failed++;
+                        continue;
+                    }
+                    const uint8_t coded_index = get_coded_key_fragment_index(cmd, bcd.key_session_data);
+                    if ((received_mask & (1u << coded_index)) == 0)
+                    {
+                        memcpy(coded_fragments[coded_index], decrypted_fragment, KEY_FRAGMENT_SIZE);
+                        received_mask |= (uint8_t) (1u << coded_index);
+                        no_received++;
+                    }
+                }
+
+                no_slots += slot;
+                max_slots = slot > max_slots ? slot : max_slots;
+                if (no_received < NO_KEY_FRAGMENTS)
+                {
+                    no_timeouts++;
+                    continue;
+                }
+
+                key_splitted received_fragments;
+                key_128b reconstructed_key;
+                failed += decode_key_fragments((const uint8_t (*)[KEY_FRAGMENT_SIZE]) coded_fragments, received_mask, &received_fragments) == false;
+                get_128b_key_from_fragments(&reconstructed_key, &received_fragments);
+                failed += memcmp(reconstructed_key.key, key.key, KEY_SIZE) != 0;
+            }
+            bench_sample end = bench_now();
+
+            char label[128];
+            snprintf(label, sizeof(label), "%u%% loss, %u parity fragments: %.2f slots to key (max %u, %u keys not rebuilt)",
+                     (unsigned) loss_percentages[l], (unsigned) parity_fragments,
+                     (double) no_slots / BENCH_KEY_LOSS_KEYS, (unsigned) max_slots, (unsigned) no_timeouts);
+            bench_report(label, start, end, BENCH_KEY_LOSS_KEYS);
+        }
+    }
+
+    if (failed != 0)
+    {
+        ESP_LOGE(BENCH_LOG_GROUP, "Key fragment erasure coding round trip failed %i checks!", failed);
+        return -1;
+    }
+
+    return 0;
+}
+
+// Sender slots of BENCH_CADENCE_SESSIONS key sessions scheduled by a key fragment cadence policy. An observer joins
+// at every slot of a session and loses BENCH_CADENCE_LOSS_PERCENT of PDUs, reports slots until it decrypts its first
+// data PDU (key rebuilt and a data PDU received) right after rotation and later in the session, and the share of
+// slots left for data. Data PDUs do not carry key fragments here (payloads above MAX_DATA_KEY_FRAGMENT_PDU_PAYLOAD_SIZE)
+static int bench_key_cadence()
+{
+    static uint8_t slot_fragments[(BENCH_CADENCE_SESSIONS + 2) * TEST_NO_PACKETS_TO_KEY_REPLACE];
+    const uint32_t session_slots = TEST_NO_PACKETS_TO_KEY_REPLACE;
+    const uint32_t no_slots = sizeof(slot_fragments) / sizeof(slot_fragments[0]);
+    const uint8_t key_fragments_per_pdu = (SENDER_KEY_FRAGMENTS_PER_PDU < MAX_KEY_FRAGMENTS_PER_PDU) ? SENDER_KEY_FRAGMENTS_PER_PDU : MAX_KEY_FRAGMENTS_PER_PDU;
+    const uint8_t no_coded_fragments = NO_KEY_FRAGMENTS + ((SENDER_KEY_PARITY_FRAGMENTS < NO_KEY_PARITY_FRAGMENTS) ? SENDER_KEY_PARITY_FRAGMENTS : NO_KEY_PARITY_FRAGMENTS);
+    static const uint16_t fixed_gaps[] = {PDU_TO_KEY_FRAGMENT_RATIO, 1};
+    static const tapered_key_fragment_cadence_config tapered_cadence = {
+        .burst_slots = SENDER_KEY_CADENCE_BURST_SLOTS,
+        .burst_gap = SENDER_KEY_CADENCE_BURST_GAP,
+        .taper_step_slots = SENDER_KEY_CADENCE_TAPER_STEP_SLOTS,
+        .floor_gap = SENDER_KEY_CADENCE_FLOOR_GAP,
+    };
+    const key_fragment_cadence_policy policies[] = {
+        {get_fixed_key_fragment_cadence, &fixed_gaps[0]},
+        {get_fixed_key_fragment_cadence, &fixed_gaps[1]},
+        {get_tapered_key_fragment_cadence, &tapered_cadence},
+    };
+    int failed = 0;
+
+    for (size_t p = 0; p < sizeof(policies) / sizeof(policies[0]); p++)
+    {
+        key_fragment_scheduler scheduler;
+        init_key_fragment_scheduler(&scheduler, &policies[p]);
+        uint8_t next_coded_fragment = 0;
+        uint32_t no_data_slots = 0;
+
+        // Nadawca: jak get_key_fragment_pdu(), fragmenty klucza i parzystości nie są mieszane w jednym PDU
+        for (uint32_t slot = 0; slot < no_slots; slot++)
+        {
+            slot_fragments[slot] = 0;
+            if (schedule_key_fragment_pdu(&scheduler, slot % session_slots) == false)
+            {
+                no_data_slots += slot < BENCH_CADENCE_SESSIONS * session_slots;
+                continue;
+            }
+
+            const bool parity = next_coded_fragment >= NO_KEY_FRAGMENTS;
+            uint8_t no_fragments = 0;
+            do
+            {
+                slot_fragments[slot] |= (uint8_t) (1u << next_coded_fragment);
+                next_coded_fragment = (next_coded_fragment + 1) % no_coded_fragments;
+                no_fragments++;
+            } while (no_fragments < key_fragments_per_pdu && (next_coded_fragment >= NO_KEY_FRAGMENTS) == parity);
+        }
+
+        // Stała kadencja musi odtworzyć dawny licznik nadawcy: PDU klucza, potem PDU_TO_KEY_FRAGMENT_RATIO PDU danych
+        if (p == 0)
+        {
+            for (uint32_t slot = 0; slot < no_slots; slot++)
+            {
+                failed += (slot_fragments[slot] != 0) != ((slot % (PDU_TO_KEY_FRAGMENT_RATIO + 1)) == 0);
+            }
+        }
+
+        uint32_t loss_state = 0x9E3779B9u;
+        uint64_t rotation_slots = 0;
+        uint64_t late_join_slots = 0;
+        uint32_t max_late_join_slots = 0;
+
+        bench_sample start = bench_now();
+        for (uint32_t session = 0; session < BENCH_CADENCE_SESSIONS; session++)
+        {
+            for (uint32_t join_slot = 0; join_slot < session_slots; join_slot++)
+            {
+                const uint32_t first_slot = session * session_slots + join_slot;
+                uint32_t key_session = session;
+                uint8_t collected_fragments = 0;
+                bool data_received = false;
+
+                // Odbiorca: PDU danych czekają w kolejce odroczonej, fragmenty starego klucza przepadają przy rotacji
+                uint32_t slot = first_slot;
+                for (; slot < no_slots; slot++)
+                {
+                    if (slot / session_slots != key_session)
+                    {
+                        key_session = slot / session_slots;
+                        collected_fragments = 0;
+                        data_received = false;
+                    }
+                    if (bench_xorshift32(&loss_state) % 100 < BENCH_CADENCE_LOSS_PERCENT)
+                    {
+                        continue;
+                    }
+
+                    if (slot_fragments[slot] == 0)
+                    {
+                        data_received = true;
+                    }
+                    collected_fragments |= slot_fragments[slot];
+                    if (data_received && __builtin_popcount(collected_fragments) >= NO_KEY_FRAGMENTS)
+                    {
+                        break;
+                    }
+                }
+
+                if (slot == no_slots)
+                {
+                    failed++;
+                    continue;
+                }
+
+                const uint32_t slots_to_decrypt = slot - first_slot + 1;
+                if (join_slot == 0)
+                {
+                    rotation_slots += slots_to_decrypt;
+                }
+                else
+                {
+                    late_join_slots += slots_to_decrypt;
+                    max_late_join_slots = slots_to_decrypt > max_late_join_slots ? slots_to_decrypt : max_late_join_slots;
+                }
+            }
+        }
+        bench_sample end = bench_now();
+
+        char label[160];
+        snprintf(label, sizeof(label), "%s cadence (gap %u): first decrypt %.2f slots after rotation, %.2f slots after late join (max %u), %.1f%% data slots",
+                 policies[p].get_data_pdus_between_key_pdus == get_tapered_key_fragment_cadence ? "tapered" : "fixed",
+                 (unsigned) policies[p].get_data_pdus_between_key_pdus(policies[p].context, session_slots - 1),
+                 (double) rotation_slots / BENCH_CADENCE_SESSIONS,
+                 (double) late_join_slots / (BENCH_CADENCE_SESSIONS * (session_slots - 1)),
+                 (unsigned) max_late_join_slots,
+                 100.0 * no_data_slots / (BENCH_CADENCE_SESSIONS * session_slots));
+        bench_report(label, start, end, BENCH_CADENCE_SESSIONS * session_slots);
+    }
+
+    if (failed != 0)
+    {
+        ESP_LOGE(BENCH_LOG_GROUP, "Key fragment cadence simulation failed %i checks!", failed);
+        return -1;
+    }
+
+    return 0;
+}
+
+// Key rotations of the shipped sender seen by an observer that follows it all the time from its own MAC address
+// and loses BENCH_CADENCE_LOSS_PERCENT of PDUs, fed through authorization and the processing shards. The next key is
+// announced during the last SENDER_KEY_HANDOVER_SLOTS PDUs of a session (set_key_handover_slots()) or generated at rotation.
+// Reports data PDUs of the new key deferred per rotation and the share of rotations without a deferred data PDU
+static int bench_key_handover()
+{
+    const bool piggyback_modes[] = {false, SENDER_PIGGYBACK_KEY_FRAGMENTS};
+    static const uint32_t handover_slots[] = {0, SENDER_KEY_HANDOVER_SLOTS};
+    uint8_t payload[TEST_PAYLOAD_BYTES_LEN];
+    int failed = 0;
+
+#if PDU_LATENCY_HISTOGRAMS == 0
+    ESP_LOGE(BENCH_LOG_GROUP, "Key cache outcomes are counted by the PDU latency histograms, set PDU_LATENCY_HISTOGRAMS");
+    return -1;
+#endif
+    if (bench_start_engine() != 0)
+    {
+        return -1;
+    }
+
+    const size_t no_handover_modes = sizeof(handover_slots) / sizeof(handover_slots[0]);
+    for (size_t mode = 0; mode < no_handover_modes * (sizeof(piggyback_modes) / sizeof(piggyback_modes[0])); mode++)
+    {
+        const size_t h = mode % no_handover_modes;
+        const bool piggyback = piggyback_modes[mode / no_handover_modes];
+        set_key_fragment_piggybacking(piggyback);
+        set_key_handover_slots(handover_slots[h]);
+
+        esp_bd_addr_t mac_address;
+        fill_sender_mac_address(mac_address, BENCH_HANDOVER_MAC_BASE + mode);
+        uint32_t loss_state = 0x9E3779B9u;
+        uint32_t no_deferred = 0;
+        uint32_t no_rotations_without_deferred = 0;
+        uint32_t no_slots = 0;
+        int64_t timestamp_us = 0;
+        bench_sender_pdu sender_pdu;
+        bench_engine_feed feed;
+        bench_init_engine_feed(&feed);
+
+        // Obserwator zaczyna od pierwszego PDU sesji, jego pierwsza sesja nie jest liczona jako zmiana klucza
+        if (bench_skip_to_key_rotation(payload, sizeof(payload), &timestamp_us, &sender_pdu) != 0)
+        {
+            return -1;
+        }
+
+        bench_sample start = bench_now();
+        for (uint32_t session = 0; session <= BENCH_HANDOVER_ROTATIONS; session++)
+        {
+            bench_key_cache_outcomes base;
+            bench_key_cache_outcomes outcomes = {0};
+            bench_get_key_cache_outcomes(&base);
+            const uint16_t key_id = get_current_key_id();
+            uint32_t no_data_pdus = 0;
+            uint32_t no_fed = 0;
+            do
+            {
+                if (bench_xorshift32(&loss_state) % 100 >= BENCH_CADENCE_LOSS_PERCENT)
+                {
+                    bench_feed_engine(&feed, &sender_pdu, mac_address);
+                    no_fed++;
+                    // Pierwszy PDU sesji czeka w autoryzacji na kolejny - czekaj na dane sprzed ostatniego PDU
+                    if (no_fed > 1 && bench_wait_for_key_cache_outcomes(&base, no_data_pdus, &outcomes) == false)
+                    {
+                        ESP_LOGE(BENCH_LOG_GROUP, "Data PDUs of the observer did not reach the key cache");
+                        return -1;
+                    }
+                    no_data_pdus += sender_pdu.is_key_pdu ? 0 : 1;
+                }
+
+                no_slots++;
+                fill_pattern(payload, sizeof(payload), (uint8_t) no_fed);
+                if (bench_take_sender_pdu(payload, sizeof(payload), &timestamp_us, &sender_pdu) != 0)
+                {
+                    ESP_LOGE(BENCH_LOG_GROUP, "Sender PDU encryption failed");
+                    return -1;
+                }
+            } while (get_current_key_id() == key_id);
+
+            if (no_fed > 1 && bench_wait_for_key_cache_outcomes(&base, no_data_pdus, &outcomes) == false)
+            {
+                ESP_LOGE(BENCH_LOG_GROUP, "Data PDUs of the observer did not reach the key cache");
+                return -1;
+            }
+
+            if (session > 0)
+            {
+                no_deferred += outcomes.deferred;
+                no_rotations_without_deferred += outcomes.deferred == 0;
+            }
+        }
+        const uint32_t decrypted = bench_drain_engine(&feed);
+        bench_sample end = bench_now();
+
+        char label[160];
+        snprintf(label, sizeof(label), "key handover %u slots, key fragment in data PDUs %s: %.2f deferred data PDUs per rotation, rotations without deferred data %.1f%%",
+                 (unsigned) handover_slots[h], piggyback && TEST_PAYLOAD_BYTES_LEN <= MAX_DATA_KEY_FRAGMENT_PDU_PAYLOAD_SIZE ? "yes" : "no",
+                 (double) no_deferred / BENCH_HANDOVER_ROTATIONS, 100.0 * no_rotations_without_deferred / BENCH_HANDOVER_ROTATIONS);
+        bench_report(label, start, end, no_slots);
+
+        // Odroczone PDU danych odszyfrowane po złożeniu klucza, zapowiedź klucza nie może pogorszyć jego dostępności
+        failed += decrypted != feed.fed_data_pdus;
+        failed += h > 0 && no_rotations_without_deferred == 0;
+    }
+    set_key_fragment_piggybacking(SENDER_PIGGYBACK_KEY_FRAGMENTS);
+    set_key_handover_slots(SENDER_KEY_HANDOVER_SLOTS);
+
+    if (failed != 0)
+    {
+        ESP_LOGE(BENCH_LOG_GROUP, "Key handover replay failed %i checks!", failed);
+        return -1;
+    }
+
+    return 0;
+}
+
+static const replay_benchmark benchmarks[] = {
+    {"aes_key_schedule", bench_aes_key_schedule},
+    {"sender_lookup", bench_sender_lookup},
+    {"adv_interval", bench_adv_interval},
+    {"processing_shards", bench_processing_shards},
+    {"fragment_hmac", bench_fragment_hmac},
+    {"aead_payload", bench_aead_payload},
+    {"pdu_codec", bench_pdu_codec},
+    {"record_aggregation", bench_record_aggregation},
+    {"key_fragment_pdu", bench_key_fragment_pdu},
+    {"key_piggyback", bench_key_piggyback},
+    {"key_loss", bench_key_loss},
+    {"key_cadence", bench_key_cadence},
+    {"key_handover", bench_key_handover},
+};
+
+int run_replay_benchmarks(const char *name)
+{
+    int status = 0;
+    bool found = false;
+    const bool run_all = strcmp(name, "all") == 0;
+
+    for (size_t i = 0; i < sizeof(benchmarks) / sizeof(benchmarks[0]); i++)
+    {
+        if (run_all || strcmp(name, benchmarks[i].name) == 0)
+        {
+            found = true;
+            ESP_LOGI(BENCH_LOG_GROUP, "Running benchmark: %s", benchmarks[i].name);
+            if (benchmarks[i].run() != 0)
+            {
+                ESP_LOGE(BENCH_LOG_GROUP, "Benchmark failed: %s", benchmarks[i].name);
+                status = -1;
+            }
+        }
+    }
+
+    if (found == false)
+    {
+        ESP_LOGE(BENCH_LOG_GROUP, "Unknown benchmark: %s", name);
+        status = -2;
+    }
+
+    return status;
+}
@@ -0,0 +1,12 @@
+#ifndef REPLAY_BENCHMARKS_H
+#define REPLAY_BENCHMARKS_H
+
+// Host micro benchmarks of the receiver pipeline building blocks,
+// selected by name with REPLAY_BENCHMARK env variable ("all" runs every benchmark)
+#define REPLAY_BENCHMARK_ENV "REPLAY_BENCHMARK"
+// Number of processing shards of the replayed pipeline, SEC_PDU_PROCESSING_SHARDS when not set
+#define REPLAY_SHARDS_ENV "REPLAY_SHARDS"
+
+int run_replay_benchmarks(const char *name);
+
+#endif
@@ -0,0 +1,209 @@
+#include "esp_log.h"
+#include "beacon_pdu_data.h"
+#include "sec_pdu_processing.h"
+#include "sec_pdu_processing_scan_callback.h"
+#include "test.h"
+#include "config.h"
+#include "replay_benchmarks.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <time.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+// Capture file: one PDU per line in format "<timestamp_us>,<mac hex>,<adv data hex>",
+// lines logged by the receiver app with RECEIVER_PDU_CAPTURE enabled can be used directly
+#define CAPTURE_FILE_ENV "REPLAY_CAPTURE_FILE"
+#define REPLAY_REALTIME_ENV "REPLAY_REALTIME"
+#define CAPTURE_LINE_MARKER "CAPTURE:"
+#define MAX_CAPTURE_LINE_LEN (128 + (MAX_BEACON_PDU_LEN * 2))
+
+#define DRAIN_POLL_MS 100
+#define DRAIN_IDLE_MS 2000
+
+static const char * REPLAY_LOG_GROUP = "PDU_REPLAY";
+
+typedef struct {
+    int64_t timestamp_us;
+    esp_bd_addr_t mac_address;
+    uint8_t data[MAX_BEACON_PDU_LEN];
+    size_t data_size;
+} captured_pdu;
+
+static atomic_uint_fast32_t decrypted_payloads_counter = 0;
+
+static void replay_payload_decrypted_cb(uint8_t *data, size_t data_len, esp_bd_addr_t mac_address)
+{
+    atomic_fetch_add(&decrypted_payloads_counter, 1);
+}
+
+static uint64_t get_monotonic_time_us()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t) ts.tv_sec * 1000000ULL) + ((uint64_t) ts.tv_nsec / 1000ULL);
+}
+
+static int parse_hex(const char *hex, uint8_t *out, size_t max_len)
+{
+    size_t len = 0;
+    // Hex ends at the first non hex character (end of line, log color codes)
+    while (isxdigit((unsigned char) hex[0]) && isxdigit((unsigned char) hex[1]))
+    {
+        unsigned int byte;
+        if (len >= max_len || sscanf(hex, "%2x", &byte) != 1)
+        {
+            return -1;
+        }
+        out[len++] = (uint8_t) byte;
+        hex += 2;
+    }
+    return (int) len;
+}
+
+static bool parse_capture_line(const char *line, captured_pdu *pdu)
+{
+    const char *record = strstr(line, CAPTURE_LINE_MARKER);
+    record = record != NULL ? record + strlen(CAPTURE_LINE_MARKER) : line;
+
+    long long timestamp_us;
+    char mac_hex[(sizeof(esp_bd_addr_t) * 2) + 1] = {0};
+    int data_offset = 0;
+    if (sscanf(record, "%lld,%12[0-9a-fA-F],%n", &timestamp_us, mac_hex, &data_offset) != 2 || data_offset == 0)
+    {
+        return false;
+    }
+
+    if (parse_hex(mac_hex, pdu->mac_address, sizeof(esp_bd_addr_t)) != sizeof(esp_bd_addr_t))
+    {
+        return false;
+    }
+
+    int data_size = parse_hex(&record[data_offset], pdu->data, MAX_BEACON_PDU_LEN);
+    if (data_size <= 0)
+    {
+        return false;
+    }
+
+    pdu->timestamp_us = (int64_t) timestamp_us;
+    pdu->data_size = (size_t) data_size;
+    return true;
+}
+
+static void wait_for_pipeline_drain()
+{
+    uint32_t idle_ms = 0;
+    uint32_t last_count = atomic_load(&decrypted_payloads_counter);
+    while (idle_ms < DRAIN_IDLE_MS)
+    {
+        vTaskDelay(pdMS_TO_TICKS(DRAIN_POLL_MS));
+        uint32_t count = atomic_load(&decrypted_payloads_counter);
+        idle_ms = count == last_count ? idle_ms + DRAIN_POLL_MS : 0;
+        last_count = count;
+    }
+}
+
+void app_main(void)
+{
+    const char *benchmark_name = getenv(REPLAY_BENCHMARK_ENV);
+    if (benchmark_name != NULL)
+    {
+        exit(run_replay_benchmarks(benchmark_name) == 0 ? 0 : 1);
+    }
+
+    const char *capture_path = getenv(CAPTURE_FILE_ENV);
+    const bool realtime = getenv(REPLAY_REALTIME_ENV) != NULL;
+    const char *shards_env = getenv(REPLAY_SHARDS_ENV);
+    const int no_shards = shards_env != NULL ? atoi(shards_env) : SEC_PDU_PROCESSING_SHARDS;
+
+    if (capture_path == NULL)
+    {
+        ESP_LOGE(REPLAY_LOG_GROUP, "Set %s to the capture file path", CAPTURE_FILE_ENV);
+        exit(1);
+    }
+
+    FILE *capture_file = fopen(capture_path, "r");
+    if (capture_file == NULL)
+    {
+        ESP_LOGE(REPLAY_LOG_GROUP, "Failed to open capture file: %s", capture_path);
+        exit(1);
+    }
+
+    init_test();
+
+    int sec_pdu_status = start_up_sec_processing_with_shards(MAX_BLE_CONSUMERS, (uint8_t) no_shards);
+    if (sec_pdu_status != 0)
+    {
+        ESP_LOGE(REPLAY_LOG_GROUP, "Sec PDU Creation Failed: %i", sec_pdu_status);
+        exit(1);
+    }
+    register_payload_observer_cb(replay_payload_decrypted_cb);
+    register_payload_observer_cb(test_log_packet_received);
+
+    start_test_measurment(TEST_RECEIVER_ROLE);
+
+    char line[MAX_CAPTURE_LINE_LEN];
+    captured_pdu pdu;
+    uint32_t replayed_pdus = 0;
+    int64_t prev_timestamp_us = -1;
+    const uint64_t replay_start_us = get_monotonic_time_us();
+
+    while (fgets(line, sizeof(line), capture_file) != NULL)
+    {
+        if (parse_capture_line(line, &pdu) == false)
+        {
+            continue;
+        }
+
+        // Keep the original spacing between PDUs, otherwise push them as fast as the pipeline accepts
+        if (realtime && prev_timestamp_us >= 0 && pdu.timestamp_us > prev_timestamp_us)
+        {
+            vTaskDelay(pdMS_TO_TICKS((pdu.timestamp_us - prev_timestamp_us) / 1000));
+        }
+        prev_timestamp_us = pdu.timestamp_us;
+
+        scan_complete_callback(pdu.timestamp_us, pdu.data, pdu.data_size, pdu.mac_address);
+        replayed_pdus++;
+    }
+    fclose(capture_file);
+
+    const uint64_t feed_end_us = get_monotonic_time_us();
+    wait_for_pipeline_drain();
+
+    // Idle drain window is not part of the pipeline time
+    const uint64_t elapsed_us = (get_monotonic_time_us() - replay_start_us) - DRAIN_IDLE_MS * 1000ULL;
+    const uint32_t decrypted = atomic_load(&decrypted_payloads_counter);
+
+    end_test_measurment();
+
+    ESP_LOGI(REPLAY_LOG_GROUP, "PROCESSING SHARDS: %i", no_shards);
+    ESP_LOGI(REPLAY_LOG_GROUP, "REPLAYED PDUS: %u", (unsigned) replayed_pdus);
+    ESP_LOGI(REPLAY_LOG_GROUP, "FEED TIME US: %llu", (unsigned long long) (feed_end_us - replay_start_us));
+    ESP_LOGI(REPLAY_LOG_GROUP, "DECRYPTED PAYLOADS: %u", (unsigned) decrypted);
+    ESP_LOGI(REPLAY_LOG_GROUP, "PIPELINE TIME US: %llu", (unsigned long long) elapsed_us);
+    if (elapsed_us > 0)
+    {
+        ESP_LOGI(REPLAY_LOG_GROUP, "THROUGHPUT PDU/S: %.1f", (double) replayed_pdus * 1e6 / (double) elapsed_us);
+        ESP_LOGI(REPLAY_LOG_GROUP, "THROUGHPUT DECRYPTED/S: %.1f", (double) decrypted * 1e6 / (double) elapsed_us);
+    }
+
+    sender_eviction_stats authorization_stats = {0};
+    sender_eviction_stats processing_stats = {0};
+    get_sender_eviction_stats(&authorization_stats, &processing_stats);
+    ESP_LOGI(REPLAY_LOG_GROUP, "AUTHORIZATION SENDERS EVICTED IDLE/LRU/REJECTED: %u/%u/%u", (unsigned) authorization_stats.idle_evictions,
+             (unsigned) authorization_stats.lru_evictions, (unsigned) authorization_stats.rejected_senders);
+    ESP_LOGI(REPLAY_LOG_GROUP, "PROCESSING SENDERS EVICTED IDLE/LRU/REJECTED: %u/%u/%u", (unsigned) processing_stats.idle_evictions,
+             (unsigned) processing_stats.lru_evictions, (unsigned) processing_stats.rejected_senders);
+
+    spsc_ring_stats scan_ring_stats = {0};
+    get_scan_ring_stats(&scan_ring_stats);
+    ESP_LOGI(REPLAY_LOG_GROUP, "SCAN RING PUSHED/DROPPED NEWEST/DROPPED OLDEST: %u/%u/%u", (unsigned) scan_ring_stats.pushed,
+             (unsigned) scan_ring_stats.dropped_newest, (unsigned) scan_ring_stats.dropped_oldest);
+
+    exit(0);
+}
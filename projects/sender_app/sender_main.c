@@ -37,6 +37,12 @@ static SemaphoreHandle_t xStartCmdReceived;
 static atomic_int EndTest = 0;
 static esp_timer_handle_t xPacketSendTimeoutTimer;
 static uint8_t *test_payload_buffer_ptr = NULL;
+#if SENDER_PAYLOAD_AGGREGATION
+// Agregator i flaga terminu używane tylko w wywołaniach esp_timer, wykonywanych kolejno przez jedno zadanie esp_timer
+static payload_aggregator aggregator;
+static esp_timer_handle_t xAggregatorDeadlineTimer;
+static bool is_aggregator_due = false;
+#endif
 
 #define ADV_INT_PLUS_10(x) (int)((x) + (((double)(x)) * (0.1)))
 
@@ -56,23 +62,8 @@ static uint8_t *test_payload_buffer_ptr = NULL;
 #define MAX_BLOCK_TIME_SEMAPHORE_MS 300
 #define MAX_BLOCK_TIME_SEMAPHORE_TICKS pdMS_TO_TICKS(MAX_BLOCK_TIME_SEMAPHORE_MS)
 
-static volatile uint16_t pdu_send_counter = PDU_TO_KEY_FRAGMENT_RATIO;
 static volatile uint32_t prev_key_id = 0;
 
-uint16_t get_and_increment_pdu_send_counter()
-{
-    uint16_t counter_value = pdu_send_counter;
-    if (pdu_send_counter == PDU_TO_KEY_FRAGMENT_RATIO)
-    {
-        pdu_send_counter = 0;   
-    }
-    else
-    {
-        pdu_send_counter++;
-    }
-    return counter_value;
-}
-
 
 static esp_ble_adv_params_t default_ble_adv_params = {
     .adv_int_min        = MS_TO_N_CONVERTION(ADV_INT_MIN_MS),
@@ -105,10 +96,11 @@ void packet_send_timeout_timer(void *arg)
     {
         return;
     }
+    packet_send_counter++;
 
-    // Zinkrementuj licznik i sprawdź, który typ pakietu należy wysłać
+    // Harmonogram fragmentów klucza decyduje, który typ pakietu należy wysłać
     bool result;
-    if (get_and_increment_pdu_send_counter() == PDU_TO_KEY_FRAGMENT_RATIO)
+    if (is_key_fragment_pdu_due())
     {
         result = encrypt_new_key_fragment();
     }
@@ -133,6 +125,21 @@ static esp_timer_create_args_t packetSendTimeoutTimer = {
   .name = "PACKET_SEND_TIMEOUT_TIMER",  
 };
 
+#if SENDER_PAYLOAD_AGGREGATION
+void aggregator_deadline_timer(void *arg)
+{
+    // Najstarsza wiadomość czekała SENDER_AGGREGATION_MAX_DELAY_MS - szyfrowanie dopiero w slocie danych,
+    // tak aby numer PDU i identyfikator klucza odpowiadały kolejności wysyłania
+    is_aggregator_due = true;
+}
+
+static esp_timer_create_args_t aggregatorDeadlineTimer = {
+  .callback = aggregator_deadline_timer,
+  .arg = NULL,
+  .name = "AGGREGATOR_DEADLINE_TIMER",
+};
+#endif
+
 void serial_data_received(uint8_t * data, size_t data_len)
 {
     memcpy(PC_SERIAL_BUFFER, (char *) data, data_len);
@@ -199,6 +206,12 @@ void app_main(void)
     if (esp_timer_create(&packetSendTimeoutTimer, &xPacketSendTimeoutTimer) != ESP_OK)
         return;
 
+#if SENDER_PAYLOAD_AGGREGATION
+    init_payload_aggregator(&aggregator, SENDER_AGGREGATION_MAX_DELAY_MS, SENDER_DATA_PDU_AEAD);
+    if (esp_timer_create(&aggregatorDeadlineTimer, &xAggregatorDeadlineTimer) != ESP_OK)
+        return;
+#endif
+
     if (init_controller == true)
     {
         register_broadcast_new_data_callback(data_set_success_cb);
@@ -314,7 +327,6 @@ void sender_test_end_pdu(int *state)
 
 bool encrypt_new_payload()
 {
-    packet_send_counter++;
     uint32_t PAYLOAD_LEN = TEST_PAYLOAD_BYTES_LEN;
     if (TEST_PAYLOAD_BYTES_LEN == RANDOM_SIZE)
     {
@@ -339,7 +351,36 @@ bool encrypt_new_payload()
     memcpy(payload, test_payload_buffer_ptr, PAYLOAD_LEN);
     beacon_pdu_data pdu = {0};
     fill_marker_in_pdu(&pdu);
+#if SENDER_PAYLOAD_AGGREGATION
+    const uint16_t no_queued_records = aggregator.no_records;
+    int encrypt_status = add_payload_to_aggregator(&aggregator, payload, PAYLOAD_LEN, &pdu);
+    if (encrypt_status >= 0 && (no_queued_records == 0 || encrypt_status == 1))
+    {
+        // Wiadomość jest pierwsza w agregatorze - termin liczony od niej, niezależnie od kolejnych wiadomości
+        esp_timer_stop(xAggregatorDeadlineTimer);
+        is_aggregator_due = false;
+        esp_timer_start_once(xAggregatorDeadlineTimer, (uint64_t) SENDER_AGGREGATION_MAX_DELAY_MS * 1000);
+    }
+
+    if (encrypt_status == 0)
+    {
+        if (is_aggregator_due == false)
+        {
+            // Brak gotowego PDU danych - slot zajmuje fragment klucza zamiast ponownie rozgłaszać poprzednie PDU
+            return encrypt_new_key_fragment();
+        }
+
+        // Termin minął - PDU szyfrowane w slocie, w którym jest wysyłane, razem z bieżącą wiadomością
+        esp_timer_stop(xAggregatorDeadlineTimer);
+        is_aggregator_due = false;
+        encrypt_status = flush_payload_aggregator(&aggregator, &pdu);
+    }
+    encrypt_status = encrypt_status == 1 ? 0 : encrypt_status;
+#elif SENDER_DATA_PDU_AEAD
+    int encrypt_status = encrypt_payload_aead(payload, PAYLOAD_LEN, &pdu);
+#else
     int encrypt_status = encrypt_payload(payload, PAYLOAD_LEN, &pdu);
+#endif
     if (encrypt_status != 0)
     {
         ESP_LOGE(SENDER_APP_LOG_GROUP, "Failed to encrypt payload, error code: %d", encrypt_status);
@@ -362,6 +403,10 @@ bool encrypt_new_payload()
         start_broadcasting(&default_ble_adv_params);
         prev_key_id = get_current_key_id();
     }
+    else
+    {
+        set_broadcasting_payload((uint8_t *)&pdu, get_beacon_pdu_data_len(&pdu));
+    }
 
     test_log_packet_send(pdu.payload, pdu.payload_size, NULL);
     return true;
@@ -369,7 +414,6 @@ bool encrypt_new_payload()
 
 bool encrypt_new_key_fragment()
 {
-    packet_send_counter++;
     beacon_key_pdu_data pdu = {0};
     fill_marker_in_key_pdu(&pdu);
 
@@ -392,10 +436,14 @@ bool encrypt_new_key_fragment()
             vTaskDelay(pdMS_TO_TICKS(10));
         }
 
-        set_broadcasting_payload((uint8_t *)&pdu, get_beacon_key_pdu_data_len());
+        set_broadcasting_payload((uint8_t *)&pdu, get_beacon_key_pdu_data_len(&pdu));
         start_broadcasting(&default_ble_adv_params);
         prev_key_id = get_current_key_id();
     }
+    else
+    {
+        set_broadcasting_payload((uint8_t *)&pdu, get_beacon_key_pdu_data_len(&pdu));
+    }
 
     test_log_key_fragment_send();
     return true;
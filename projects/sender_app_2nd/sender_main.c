@@ -61,25 +61,9 @@ static uint8_t *test_payload_buffer_ptr = NULL;
 #define TEST_NO_PACKETS_TO_KEY_REPLACE 200
 
 #define START_TIME_US 6000000
-#define PDU_TO_KEY_FRAGMENT_RATIO 3
 
-static volatile uint16_t pdu_send_counter = PDU_TO_KEY_FRAGMENT_RATIO;
 static volatile uint32_t prev_key_id = 0;
 
-uint16_t get_and_increment_pdu_send_counter()
-{
-    uint16_t counter_value = pdu_send_counter;
-    if (pdu_send_counter == PDU_TO_KEY_FRAGMENT_RATIO)
-    {
-        pdu_send_counter = 0;   
-    }
-    else
-    {
-        pdu_send_counter++;
-    }
-    return counter_value;
-}
-
 static esp_ble_adv_params_t default_ble_adv_params = {
     .adv_int_min        = MS_TO_N_CONVERTION(ADV_INT_MIN_MS),
     .adv_int_max        = MS_TO_N_CONVERTION(ADV_INT_MAX_MS),
@@ -113,7 +97,7 @@ void packet_send_timeout_timer(void *arg)
     }
 
     bool result;
-    if (get_and_increment_pdu_send_counter() == PDU_TO_KEY_FRAGMENT_RATIO)
+    if (is_key_fragment_pdu_due())
     {
         result = encrypt_new_key_fragment();
     }
@@ -407,13 +391,13 @@ bool encrypt_new_key_fragment()
             vTaskDelay(pdMS_TO_TICKS(10));
         }
 
-        set_broadcasting_payload((uint8_t *)&pdu, get_beacon_key_pdu_data_len());
+        set_broadcasting_payload((uint8_t *)&pdu, get_beacon_key_pdu_data_len(&pdu));
         start_broadcasting(&default_ble_adv_params);
         prev_key_id = get_current_key_id();
     }
     else
     {
-        set_broadcasting_payload((uint8_t *)&pdu, get_beacon_key_pdu_data_len());
+        set_broadcasting_payload((uint8_t *)&pdu, get_beacon_key_pdu_data_len(&pdu));
     }
 
     test_log_key_fragment_send();